@@ -20,6 +20,7 @@
 #include "SETTINGS.h"
 #include "mesh.h"
 #include "field.h"
+#include "mckernels.h"
 
 
 void checkCUDAErrorFn(const char* msg, const char* file = NULL, int line = -1);
@@ -75,22 +76,17 @@ inline void cuda_internalAccumulateNormal(Mesh& mesh, uint a, uint b, uint c)
     mesh.normals[c] += n;
 }
 
-// functions ---------------------------------------------------------------------------------
+// backend ----------------------------------------------------------------------------------
 
-__device__ __device__ void setDefaultArraySizes(
-    uint vertSize,
-    uint normSize,
-    uint triSize);
+// Runs the marching cubes slab kernels (mckernels.h) on the GPU, selected with
+// -DMC_CUDA_BACKEND=1. Slabs are staged through device buffers owned by the
+// calling thread, which grow as needed. Arguments are as in
+// MCKernels::HostBackend.
+struct CudaBackend {
+    static const char* name() { return "cuda"; }
 
-__host__ __device__ VEC3F dev_internalComputeEdge(
-    VEC3I* slab_inds,
-    Mesh& mesh,
-    Grid3D* grid,
-    float va,
-    float vb,
-    int axis,
-    uint x,
-    uint y,
-    uint z,
-    const VEC3I& size
-);
\ No newline at end of file
+    static void classifySlab(const Real* l0, const Real* l1, uint nx, uint ny, uint8_t* configs);
+
+    static void emitSlab(const uint* active, size_t numActive, const uint8_t* configs, const size_t* indexOffsets,
+        const int* slabInds, uint nx, uint ny, uint z, uint* out);
+};
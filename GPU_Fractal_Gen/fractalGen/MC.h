@@ -1,18 +1,35 @@
 #ifndef MC_H
 #define MC_H
 
-#define kernel 0
-
 #include <mutex>
+#include <algorithm>
 #include <vector>
+#include <string>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
 
 #include "SETTINGS.h"
 
 #include "mesh.h"
 #include "field.h"
 
+#include "mckernels.h"
+#include "mctables.h"
+#include "parallel.h"
+#include "samplecache.h"
+
+// Backend of the marching cubes slab kernels: 0 runs them on the host thread
+// pool, 1 on the GPU (CudaMC.cu). Root finding samples the grid, so it always
+// runs on the host.
+#ifndef MC_CUDA_BACKEND
+#define MC_CUDA_BACKEND 0
+#endif
+
+#if MC_CUDA_BACKEND
 #include "CudaMC.h"
+#endif
 
 namespace MC
 {
@@ -41,139 +58,47 @@ namespace MC
     void setDefaultArraySizes(uint vertSize, uint normSize, uint triSize);
 }
 
-
-#endif
-
 namespace MC
 {
     static uint defaultVerticeArraySize  = 100000;
     static uint defaultNormalArraySize   = 100000;
     static uint defaultTriangleArraySize = 400000;
 
-    // Look-up table for triangle configurations
-    static const unsigned long long mc_internalMarching_cube_tris[256] =
-    {
-        0ULL, 33793ULL, 36945ULL, 159668546ULL,
-        18961ULL, 144771090ULL, 5851666ULL, 595283255635ULL,
-        20913ULL, 67640146ULL, 193993474ULL, 655980856339ULL,
-        88782242ULL, 736732689667ULL, 797430812739ULL, 194554754ULL,
-        26657ULL, 104867330ULL, 136709522ULL, 298069416227ULL,
-        109224258ULL, 8877909667ULL, 318136408323ULL, 1567994331701604ULL,
-        189884450ULL, 350847647843ULL, 559958167731ULL, 3256298596865604ULL,
-        447393122899ULL, 651646838401572ULL, 2538311371089956ULL, 737032694307ULL,
-        29329ULL, 43484162ULL, 91358498ULL, 374810899075ULL,
-        158485010ULL, 178117478419ULL, 88675058979ULL, 433581536604804ULL,
-        158486962ULL, 649105605635ULL, 4866906995ULL, 3220959471609924ULL,
-        649165714851ULL, 3184943915608436ULL, 570691368417972ULL, 595804498035ULL,
-        124295042ULL, 431498018963ULL, 508238522371ULL, 91518530ULL,
-        318240155763ULL, 291789778348404ULL, 1830001131721892ULL, 375363605923ULL,
-        777781811075ULL, 1136111028516116ULL, 3097834205243396ULL, 508001629971ULL,
-        2663607373704004ULL, 680242583802939237ULL, 333380770766129845ULL, 179746658ULL,
-        42545ULL, 138437538ULL, 93365810ULL, 713842853011ULL,
-        73602098ULL, 69575510115ULL, 23964357683ULL, 868078761575828ULL,
-        28681778ULL, 713778574611ULL, 250912709379ULL, 2323825233181284ULL,
-        302080811955ULL, 3184439127991172ULL, 1694042660682596ULL, 796909779811ULL,
-        176306722ULL, 150327278147ULL, 619854856867ULL, 1005252473234484ULL,
-        211025400963ULL, 36712706ULL, 360743481544788ULL, 150627258963ULL,
-        117482600995ULL, 1024968212107700ULL, 2535169275963444ULL, 4734473194086550421ULL,
-        628107696687956ULL, 9399128243ULL, 5198438490361643573ULL, 194220594ULL,
-        104474994ULL, 566996932387ULL, 427920028243ULL, 2014821863433780ULL,
-        492093858627ULL, 147361150235284ULL, 2005882975110676ULL, 9671606099636618005ULL,
-        777701008947ULL, 3185463219618820ULL, 482784926917540ULL, 2900953068249785909ULL,
-        1754182023747364ULL, 4274848857537943333ULL, 13198752741767688709ULL, 2015093490989156ULL,
-        591272318771ULL, 2659758091419812ULL, 1531044293118596ULL, 298306479155ULL,
-        408509245114388ULL, 210504348563ULL, 9248164405801223541ULL, 91321106ULL,
-        2660352816454484ULL, 680170263324308757ULL, 8333659837799955077ULL, 482966828984116ULL,
-        4274926723105633605ULL, 3184439197724820ULL, 192104450ULL, 15217ULL,
-        45937ULL, 129205250ULL, 129208402ULL, 529245952323ULL,
-        169097138ULL, 770695537027ULL, 382310500883ULL, 2838550742137652ULL,
-        122763026ULL, 277045793139ULL, 81608128403ULL, 1991870397907988ULL,
-        362778151475ULL, 2059003085103236ULL, 2132572377842852ULL, 655681091891ULL,
-        58419234ULL, 239280858627ULL, 529092143139ULL, 1568257451898804ULL,
-        447235128115ULL, 679678845236084ULL, 2167161349491220ULL, 1554184567314086709ULL,
-        165479003923ULL, 1428768988226596ULL, 977710670185060ULL, 10550024711307499077ULL,
-        1305410032576132ULL, 11779770265620358997ULL, 333446212255967269ULL, 978168444447012ULL,
-        162736434ULL, 35596216627ULL, 138295313843ULL, 891861543990356ULL,
-        692616541075ULL, 3151866750863876ULL, 100103641866564ULL, 6572336607016932133ULL,
-        215036012883ULL, 726936420696196ULL, 52433666ULL, 82160664963ULL,
-        2588613720361524ULL, 5802089162353039525ULL, 214799000387ULL, 144876322ULL,
-        668013605731ULL, 110616894681956ULL, 1601657732871812ULL, 430945547955ULL,
-        3156382366321172ULL, 7644494644932993285ULL, 3928124806469601813ULL, 3155990846772900ULL,
-        339991010498708ULL, 10743689387941597493ULL, 5103845475ULL, 105070898ULL,
-        3928064910068824213ULL, 156265010ULL, 1305138421793636ULL, 27185ULL,
-        195459938ULL, 567044449971ULL, 382447549283ULL, 2175279159592324ULL,
-        443529919251ULL, 195059004769796ULL, 2165424908404116ULL, 1554158691063110021ULL,
-        504228368803ULL, 1436350466655236ULL, 27584723588724ULL, 1900945754488837749ULL,
-        122971970ULL, 443829749251ULL, 302601798803ULL, 108558722ULL,
-        724700725875ULL, 43570095105972ULL, 2295263717447940ULL, 2860446751369014181ULL,
-        2165106202149444ULL, 69275726195ULL, 2860543885641537797ULL, 2165106320445780ULL,
-        2280890014640004ULL, 11820349930268368933ULL, 8721082628082003989ULL, 127050770ULL,
-        503707084675ULL, 122834978ULL, 2538193642857604ULL, 10129ULL,
-        801441490467ULL, 2923200302876740ULL, 1443359556281892ULL, 2901063790822564949ULL,
-        2728339631923524ULL, 7103874718248233397ULL, 12775311047932294245ULL, 95520290ULL,
-        2623783208098404ULL, 1900908618382410757ULL, 137742672547ULL, 2323440239468964ULL,
-        362478212387ULL, 727199575803140ULL, 73425410ULL, 34337ULL,
-        163101314ULL, 668566030659ULL, 801204361987ULL, 73030562ULL,
-        591509145619ULL, 162574594ULL, 100608342969108ULL, 5553ULL,
-        724147968595ULL, 1436604830452292ULL, 176259090ULL, 42001ULL,
-        143955266ULL, 2385ULL, 18433ULL, 0ULL,
-    };
+    // Layers sampled ahead per block, and the most samples a block may hold
+    static const uint   MC_BLOCK_LAYERS  = Parallel::PARALLEL_TILE_SIZE;
+    static const size_t MC_BLOCK_SAMPLES = size_t(1) << 23;
+
+#if MC_CUDA_BACKEND
+    typedef CudaBackend mc_internalBackend;
+#else
+    typedef MCKernels::HostBackend mc_internalBackend;
+#endif
+
+    // The kernels read the slab index layers as 3 ints per grid point
+    static_assert(sizeof(VEC3I) == 3 * sizeof(int), "VEC3I must be three packed ints");
 
     /*!
-      \brief Approximates the vertex position of the mesh from the scalar values along an edge (va, vb).
-      \param slab_inds slab indices global array
-      \param mesh the mesh
-      \param va, vb edges values
+      \brief Bisects the edge leaving grid point (x, y, z) along `axis` for the
+      zero crossing. Grids without non-integer indices can't be refined, and
+      get a zero offset.
+      \param grid the scalar field
+      \param va value at (x, y, z)
       \param axis axis index 0/1/2
-      \param x, y, z current slab index
-      \param size slab indices array size
+      \param x, y, z edge origin
+      \return offset of the crossing from (x, y, z)
       */
-    static void mc_internalComputeEdge(VEC3I* slab_inds, Mesh& mesh, Grid3D* grid, float va, float vb, int axis, uint x, uint y, uint z, const VEC3I& size)
+    static inline VEC3F mc_internalFindEdgeRoot(Grid3D* grid, float va, int axis, uint x, uint y, uint z)
     {
-        if ((va < 0.0) == (vb < 0.0))
-            return;
-
-
         VEC3F offset(0,0,0);
 
         if (grid->supportsNonIntegerIndices) { // Do a root-finding pass if we can
-            double l_bound = (va>0)?0:1;
-            double r_bound = (va>0)?1:0;
-
-            for(int i = 0; i < MC_MAX_ROOTFINDING_ITERATIONS; ++i) {
-                offset[axis] = 0.5 * (l_bound + r_bound);
-                VEC3F samplePoint = VEC3F(x,y,z) + offset;
-                const Real val = grid->getf(samplePoint);
-
-                if (fabs(val) < MC_ROOTFINDING_THRESH) break;
-
-                if(val < 0) {
-                    r_bound = offset[axis];
-                } else {
-                    l_bound = offset[axis];
-                }
-            }
-
+            int iterations;
+            offset[axis] = MCKernels::edgeRoot([grid](Real px, Real py, Real pz) { return grid->getf(VEC3F(px, py, pz)); },
+                va, axis, x, y, z, iterations);
+            PROFILE_HISTOGRAM("mc/root finding iterations", iterations);
         }
 
-
-        VEC3F v = VEC3F(x, y, z) + offset;
-        // v[axis] += va / (va - vb);
-        slab_inds[cuda_internalToIndex1DSlab(x, y, z, size)][axis] = uint(mesh.vertices.size());
-        mesh.vertices.push_back(v);
-        mesh.normals.push_back(VEC3F(0, 0, 0));
-    }
-
-    static void mc_cudaComputeEdge(VEC3I* slab_inds, Mesh& mesh, Grid3D* grid, float va, float vb, int axis, uint x, uint y, uint z, const VEC3I& size)
-    {
-        if ((va < 0.0) == (vb < 0.0))
-            return;
-
-        VEC3F v = dev_internalComputeEdge(slab_inds, mesh, grid, va, vb, axis, x, y, z, size);
-
-        slab_inds[cuda_internalToIndex1DSlab(x, y, z, size)][axis] = uint(mesh.vertices.size());
-        mesh.vertices.push_back(v);
-        mesh.normals.push_back(VEC3F(0, 0, 0));
+        return offset;
     }
 
     /*!
@@ -188,13 +113,260 @@ namespace MC
         VEC3F& vc = mesh.vertices[c];
         VEC3F ab = va - vb;
         VEC3F cb = vc - vb;
-        VEC3F n = cuda_internalCross(cb, ab);
+        VEC3F n = mc_internalCross(cb, ab);
         mesh.normals[a] += n;
         mesh.normals[b] += n;
         mesh.normals[c] += n;
     }
 
 
+    /*!
+      \brief Per-cube flags over a marching cubes grid. A mask may be coarser than
+      the grid it is applied to, each of its cells then covering stride^3 cubes.
+      */
+    struct CellMask {
+        uint xRes = 0, yRes = 0, zRes = 0;
+        uint stride = 1;
+        std::vector<uint8_t> cells;
+
+        CellMask() {}
+        CellMask(uint xRes, uint yRes, uint zRes):
+            xRes(xRes), yRes(yRes), zRes(zRes), cells(size_t(xRes) * yRes * zRes, 0) {}
+
+        size_t index(uint x, uint y, uint z) const {
+            return (size_t(z) * yRes + y) * xRes + x;
+        }
+
+        void set(uint x, uint y, uint z) {
+            cells[index(x, y, z)] = 1;
+        }
+
+        // Looks up cube (x, y, z) of the grid being marched. Cubes past the
+        // extent of a coarser mask were never seen by it, so they stay active.
+        bool active(uint x, uint y, uint z) const {
+            x /= stride; y /= stride; z /= stride;
+            if (x >= xRes || y >= yRes || z >= zRes)
+                return true;
+            return cells[index(x, y, z)];
+        }
+
+        size_t count() const {
+            size_t n = 0;
+            for (uint8_t c : cells) n += c;
+            return n;
+        }
+
+        // Grows the active region by `radius` cells in every direction, so features
+        // that slipped between the samples of a coarse level are still refined
+        CellMask dilated(int radius = 1) const {
+            CellMask out(xRes, yRes, zRes);
+            out.stride = stride;
+            for (uint z = 0; z < zRes; z++)
+            for (uint y = 0; y < yRes; y++)
+            for (uint x = 0; x < xRes; x++) {
+                if (!cells[index(x, y, z)]) continue;
+                for (int dz = -radius; dz <= radius; dz++)
+                for (int dy = -radius; dy <= radius; dy++)
+                for (int dx = -radius; dx <= radius; dx++) {
+                    const int nx = int(x) + dx, ny = int(y) + dy, nz = int(z) + dz;
+                    if (nx < 0 || ny < 0 || nz < 0 || nx >= int(xRes) || ny >= int(yRes) || nz >= int(zRes))
+                        continue;
+                    out.set(nx, ny, nz);
+                }
+            }
+            return out;
+        }
+    };
+
+    /*!
+      \brief Where and how often march_cubes saves its progress. A checkpoint
+      holds everything the march carries from one z-slab to the next: the two
+      slab index layers (slab_inds), the edge visit stamps and the partial mesh
+      with its unnormalized normal sums, so a resumed run continues bit for bit
+      where the checkpoint was taken. The slab state is replaced at `path`
+      each time; the mesh goes to <path>.mesh, which each checkpoint only
+      appends its new vertices and triangles to. Grid caches aren't saved;
+      they only memoize field values (use the --cache sample file to keep those).
+      */
+    struct Checkpoint {
+        std::string path;
+        uint64_t key = 0;       // identifies the job; a checkpoint for another key is ignored
+        uint everySlabs = 0;    // write after every this many slabs, 0 for never
+        bool resume = false;    // continue from the checkpoint at `path`, if there is one
+    };
+
+    static const char MC_CHECKPOINT_MAGIC[8] = {'F', 'M', 'C', 'C', 'K', 'P', 'T', '2'};
+    static const char MC_CHECKPOINT_MESH_MAGIC[8] = {'F', 'M', 'C', 'M', 'E', 'S', 'H', '1'};
+
+    struct mc_internalCheckpointHeader {
+        char     magic[8];
+        uint64_t key;
+        uint32_t nx, ny, nz, nextZ;
+        uint64_t numVertices, numIndices;
+        uint64_t meshBytes;     // length of the valid part of the mesh log
+    };
+
+    struct mc_internalCheckpointMeshHeader {
+        char     magic[8];
+        uint64_t key;
+    };
+
+    // One append to the mesh log: vertices [vertexBegin, vertexEnd) with their
+    // normal sums, replacing any read before, then indices [indexBegin, indexEnd)
+    struct mc_internalCheckpointSegment {
+        uint64_t vertexBegin, vertexEnd;
+        uint64_t indexBegin, indexEnd;
+    };
+
+    // The open mesh log and how much of the mesh it holds
+    struct mc_internalCheckpointLog {
+        FILE*    file = NULL;
+        uint64_t bytes = 0;
+        size_t   vertices = 0, indices = 0;
+
+        // Lowest vertex whose normal sum changed since the last append
+        size_t   firstChanged = SIZE_MAX;
+
+        ~mc_internalCheckpointLog() {
+            if (file) fclose(file);
+        }
+    };
+
+    static std::string mc_internalCheckpointMeshPath(const Checkpoint& checkpoint)
+    {
+        return checkpoint.path + ".mesh";
+    }
+
+    // Appends the mesh added or changed since the last checkpoint to the log,
+    // then replaces the slab state before slab nextZ atomically. A crash in
+    // between leaves an append past the recorded length, which is ignored.
+    static bool mc_internalWriteCheckpoint(const Checkpoint& checkpoint, mc_internalCheckpointLog& log,
+            uint nx, uint ny, uint nz, uint nextZ, const VEC3I* slab_inds, const uint* slab_seen, const Mesh& mesh)
+    {
+        if (log.file == NULL) {
+            log.file = fopen(mc_internalCheckpointMeshPath(checkpoint).c_str(), "wb");
+            if (log.file == NULL) return false;
+            mc_internalCheckpointMeshHeader header;
+            memcpy(header.magic, MC_CHECKPOINT_MESH_MAGIC, 8);
+            header.key = checkpoint.key;
+            if (fwrite(&header, sizeof(header), 1, log.file) != 1) {
+                fclose(log.file);
+                log.file = NULL;
+                return false;
+            }
+            log.bytes = sizeof(header);
+            log.vertices = log.indices = 0;
+        }
+
+        mc_internalCheckpointSegment segment;
+        segment.vertexBegin = std::min(log.vertices, log.firstChanged);
+        segment.vertexEnd = mesh.vertices.size();
+        segment.indexBegin = log.indices;
+        segment.indexEnd = mesh.indices.size();
+        const size_t numVertices = segment.vertexEnd - segment.vertexBegin;
+        const size_t numIndices = segment.indexEnd - segment.indexBegin;
+
+        const bool appended = fwrite(&segment, sizeof(segment), 1, log.file) == 1
+            && fwrite(mesh.vertices.data() + segment.vertexBegin, sizeof(VEC3F), numVertices, log.file) == numVertices
+            && fwrite(mesh.normals.data() + segment.vertexBegin, sizeof(VEC3F), numVertices, log.file) == numVertices
+            && fwrite(mesh.indices.data() + segment.indexBegin, sizeof(uint), numIndices, log.file) == numIndices
+            && fflush(log.file) == 0;
+        if (!appended) {
+            // The log may end in part of a segment now: the next checkpoint starts a new one
+            fclose(log.file);
+            log.file = NULL;
+            return false;
+        }
+
+        const uint64_t segmentBytes = sizeof(segment) + 2 * numVertices * sizeof(VEC3F) + numIndices * sizeof(uint);
+        PROFILE_COUNT("io/bytes written", segmentBytes);
+        log.bytes += segmentBytes;
+        log.vertices = segment.vertexEnd;
+        log.indices = segment.indexEnd;
+        log.firstChanged = SIZE_MAX;
+
+        return SampleCache::writeFileAtomically(checkpoint.path, [&](FILE* file) {
+            mc_internalCheckpointHeader header;
+            memcpy(header.magic, MC_CHECKPOINT_MAGIC, 8);
+            header.key = checkpoint.key;
+            header.nx = nx; header.ny = ny; header.nz = nz;
+            header.nextZ = nextZ;
+            header.numVertices = mesh.vertices.size();
+            header.numIndices = mesh.indices.size();
+            header.meshBytes = log.bytes;
+
+            const size_t slabSize = size_t(nx) * ny * 2;
+            return fwrite(&header, sizeof(header), 1, file) == 1
+                && fwrite(slab_inds, sizeof(VEC3I), slabSize, file) == slabSize
+                && fwrite(slab_seen, sizeof(uint), slabSize * 3, file) == slabSize * 3;
+        });
+    }
+
+    // Restores a checkpoint written by the same job on the same grid and
+    // leaves its mesh log open at the end of the recorded part, where the
+    // next append goes.
+    // Returns the slab to continue from, or 0 to start over
+    static uint mc_internalReadCheckpoint(const Checkpoint& checkpoint, mc_internalCheckpointLog& log,
+            uint nx, uint ny, uint nz, VEC3I* slab_inds, uint* slab_seen, Mesh& mesh)
+    {
+        FILE* file = fopen(checkpoint.path.c_str(), "rb");
+        if (file == NULL) return 0;
+
+        mc_internalCheckpointHeader header;
+        bool ok = fread(&header, sizeof(header), 1, file) == 1
+            && memcmp(header.magic, MC_CHECKPOINT_MAGIC, 8) == 0 && header.key == checkpoint.key
+            && header.nx == nx && header.ny == ny && header.nz == nz && header.nextZ < nz;
+
+        if (ok) {
+            const size_t slabSize = size_t(nx) * ny * 2;
+            ok = fread(slab_inds, sizeof(VEC3I), slabSize, file) == slabSize
+              && fread(slab_seen, sizeof(uint), slabSize * 3, file) == slabSize * 3;
+        }
+        fclose(file);
+
+        // Replay the log's segments up to the length the state recorded
+        FILE* meshFile = ok ? fopen(mc_internalCheckpointMeshPath(checkpoint).c_str(), "r+b") : NULL;
+        mc_internalCheckpointMeshHeader meshHeader;
+        ok = meshFile != NULL && fread(&meshHeader, sizeof(meshHeader), 1, meshFile) == 1
+            && memcmp(meshHeader.magic, MC_CHECKPOINT_MESH_MAGIC, 8) == 0 && meshHeader.key == checkpoint.key;
+        uint64_t bytes = sizeof(meshHeader);
+        while (ok && bytes < header.meshBytes) {
+            mc_internalCheckpointSegment segment;
+            ok = fread(&segment, sizeof(segment), 1, meshFile) == 1
+                && segment.vertexBegin <= mesh.vertices.size() && segment.vertexBegin <= segment.vertexEnd
+                && segment.vertexEnd <= header.numVertices
+                && segment.indexBegin == mesh.indices.size() && segment.indexBegin <= segment.indexEnd
+                && segment.indexEnd <= header.numIndices;
+            if (!ok) break;
+
+            const size_t numVertices = segment.vertexEnd - segment.vertexBegin;
+            const size_t numIndices = segment.indexEnd - segment.indexBegin;
+            mesh.vertices.resize(segment.vertexEnd);
+            mesh.normals.resize(segment.vertexEnd);
+            mesh.indices.resize(segment.indexEnd);
+            ok = fread(mesh.vertices.data() + segment.vertexBegin, sizeof(VEC3F), numVertices, meshFile) == numVertices
+              && fread(mesh.normals.data() + segment.vertexBegin, sizeof(VEC3F), numVertices, meshFile) == numVertices
+              && fread(mesh.indices.data() + segment.indexBegin, sizeof(uint), numIndices, meshFile) == numIndices;
+            bytes += sizeof(segment) + 2 * numVertices * sizeof(VEC3F) + numIndices * sizeof(uint);
+        }
+        ok = ok && bytes == header.meshBytes
+            && mesh.vertices.size() == header.numVertices && mesh.indices.size() == header.numIndices;
+
+        if (!ok) {
+            if (meshFile) fclose(meshFile);
+            printf("Warning: %s is not a checkpoint of this run, starting over\n", checkpoint.path.c_str());
+            mesh = Mesh();
+            return 0;
+        }
+
+        log.file = meshFile;
+        log.bytes = bytes;
+        log.vertices = mesh.vertices.size();
+        log.indices = mesh.indices.size();
+        log.firstChanged = SIZE_MAX;
+        return header.nextZ;
+    }
+
     /*
        \brief Stores the default array sizes for the indexed mesh computed
        by the marching cubes. Useful for speeding-up the marching cubes.
@@ -215,172 +387,460 @@ namespace MC
       \param grid Grid3D scalar field or function of real values
       \param outputMesh indexed mesh returned.
       \param verbose if true, prints progress updates
+      \param mask if given, cubes outside it are treated as empty and never sampled
+      \param activeOut if given, every cube the surface passes through is set in it
+      \param checkpoint if given, progress is saved to and resumed from it. Not
+      with mask or activeOut, whose state isn't saved: the march then runs
+      without it. The checkpoint is removed once the march completes.
       */
-    inline void march_cubes(Grid3D *grid, Mesh& outputMesh, bool verbose = false) {
+    inline void march_cubes(Grid3D *grid, Mesh& outputMesh, bool verbose = false,
+            const CellMask* mask = nullptr, CellMask* activeOut = nullptr, const Checkpoint* checkpoint = nullptr) {
 
+        PROFILE_SCOPE("march_cubes");
+        if (checkpoint && (mask || activeOut)) {
+            printf("Warning: masked marches can't be checkpointed, marching without the checkpoint\n");
+            checkpoint = nullptr;
+        }
         uint nx = grid->xRes, ny = grid->yRes, nz = grid->zRes;
 
         outputMesh.vertices.reserve(defaultVerticeArraySize);
         outputMesh.normals.reserve(defaultNormalArraySize);
         outputMesh.indices.reserve(defaultTriangleArraySize);
 
-        PB_START("Marching cubes with res %dx%dx%d", nx, ny, nz);
-        PB_PROGRESS(0);
-
         VEC3I* slab_inds = new VEC3I[nx * ny * 2]{};
+        // z + 1 of the slab each (edge, axis) was last visited in (masked marches)
+        uint* slab_seen = new uint[nx * ny * 2 * 3]{};
+
+        uint firstZ = 0;
+        mc_internalCheckpointLog checkpointLog;
+        if (checkpoint && checkpoint->resume) {
+            firstZ = mc_internalReadCheckpoint(*checkpoint, checkpointLog, nx, ny, nz, slab_inds, slab_seen, outputMesh);
+            if (verbose && firstZ > 0) {
+                printf("Resuming from slab %u of %u\n", firstZ, nz - 1);
+            }
+        }
 
-        for (uint z = 0; z < nz - 1; z++)
+        PB_DECL();
+        if (verbose) {
+            PB_STARTD("Marching cubes with res %dx%dx%d", nx, ny, nz);
+        }
+
+        // Grids that can be read concurrently are sampled a block of layers
+        // ahead, in tiles spread over all cores (Parallel::parallelTiles), and
+        // the march reads the block. Masked marches only sample active cubes,
+        // so they read the grid directly.
+        const bool blocked = grid->supportsConcurrentReads() && !mask;
+        const uint blockDepth = uint(std::max<size_t>(1, std::min<size_t>(MC_BLOCK_LAYERS, MC_BLOCK_SAMPLES / (size_t(nx) * ny))));
+        std::vector<Real> block;
+        uint blockZ0 = 0, blockZ1 = 0;   // layers [blockZ0, blockZ1) are in block
+        Parallel::SchedulerStats samplingStats;
+
+        // Samples layers z0 to z0 + blockDepth, keeping the last layer of the
+        // previous block if it is the first of this one
+        auto fillBlock = [&](uint z0) {
+            PROFILE_SCOPE("mc sample block");
+            const uint z1 = std::min(z0 + blockDepth + 1, nz);
+            const size_t layer = size_t(nx) * ny;
+
+            // Move the carried layer to the front before resizing: the last
+            // block is shorter, and shrinking first would cut it off
+            uint first = z0;
+            if (blockZ1 > blockZ0 && blockZ1 - 1 == z0) {
+                std::copy(block.begin() + (z0 - blockZ0) * layer, block.begin() + (z0 - blockZ0 + 1) * layer, block.begin());
+                first = z0 + 1;
+            }
+            block.resize(layer * (z1 - z0));
+
+            samplingStats.add(Parallel::parallelTiles(nx, ny, z1 - first, [&](const Parallel::Tile& tile) {
+                for (uint z = tile.z0; z < tile.z1; z++)
+                for (uint y = tile.y0; y < tile.y1; y++)
+                for (uint x = tile.x0; x < tile.x1; x++)
+                    block[(size_t(z + first - z0) * ny + y) * nx + x] = grid->get(x, y, z + first);
+            }));
+            blockZ0 = z0;
+            blockZ1 = z1;
+        };
+
+        // Each slab is marched in phases over dense per-slab arrays: its two
+        // layers of samples are gathered, every cube is classified into a
+        // config byte, the cubes the surface crosses are compacted into a list
+        // by a prefix sum, and their vertices and triangles are then written
+        // into slots sized up front. Vertices are numbered and normals summed
+        // in the same order as a cube-at-a-time march, so the mesh is the same.
+        const uint cx = nx - 1, cy = ny - 1;
+        const size_t layerSize = size_t(nx) * ny;
+        const size_t numCubes = size_t(cx) * cy;
+
+        // Unblocked marches gather the two layers here, flagging the points
+        // sampled so far; the top layer of a slab is the bottom of the next
+        std::vector<Real> lo, hi;
+        std::vector<uint8_t> loHave, hiHave, need, inMask;
+        uint hiZ = nz;
+        if (!blocked) {
+            lo.assign(layerSize, 0);
+            hi.assign(layerSize, 0);
+            loHave.assign(layerSize, 0);
+            hiHave.assign(layerSize, 0);
+        }
+        if (mask) {
+            need.assign(layerSize, 0);
+            inMask.assign(numCubes, 0);
+        }
+
+        auto sampleLayer = [&](std::vector<Real>& values, std::vector<uint8_t>& have, uint z) {
+            for (uint y = 0; y < ny; y++)
+            for (uint x = 0; x < nx; x++) {
+                const size_t i = size_t(y) * nx + x;
+                if (have[i] || (mask && !need[i])) continue;
+                values[i] = grid->get(x, y, z);
+                have[i] = 1;
+            }
+        };
+
+        std::vector<uint8_t> configs(numCubes);
+        std::vector<uint> slots(numCubes);      // exclusive prefix sum of the crossed flags
+        std::vector<uint> active;               // crossed cubes of the slab, y-major
+        std::vector<size_t> indexOffsets;       // first index of each crossed cube's triangles
+        std::vector<uint> vertexOffsets;        // first vertex each crossed cube makes
+        std::vector<uint16_t> made;             // edges each crossed cube makes the vertex on
+        const MCTables::Tables& tables = MCTables::TABLES;
+
+        for (uint z = firstZ; z < nz - 1; z++)
         {
-            const VEC3I size(nx, ny, nz);
+            PROFILE_SCOPE("mc slab");
+
+            if (mask) {
+                std::fill(need.begin(), need.end(), 0);
+                for (uint y = 0; y < cy; y++)
+                for (uint x = 0; x < cx; x++) {
+                    const bool in = mask->active(x, y, z);
+                    inMask[size_t(y) * cx + x] = in;
+                    if (!in) continue;
+                    const size_t i = size_t(y) * nx + x;
+                    need[i] = need[i + 1] = need[i + nx] = need[i + nx + 1] = 1;
+                }
+            }
 
-            Real vs[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-            uint edge_indices[12];
+            const Real* l0;
+            const Real* l1;
+            if (blocked) {
+                if (z + 1 >= blockZ1) fillBlock(z);
+                l0 = block.data() + size_t(z - blockZ0) * layerSize;
+                l1 = l0 + layerSize;
+            } else {
+                if (hiZ == z) {
+                    std::swap(lo, hi);
+                    std::swap(loHave, hiHave);
+                } else {
+                    std::fill(loHave.begin(), loHave.end(), 0);
+                }
+                std::fill(hiHave.begin(), hiHave.end(), 0);
+                sampleLayer(lo, loHave, z);
+                sampleLayer(hi, hiHave, z + 1);
+                hiZ = z + 1;
+                l0 = lo.data();
+                l1 = hi.data();
+            }
 
-            for (uint y = 0; y < ny - 1; y++)
+            // Classify every cube of the slab; cubes outside the mask get
+            // config 0. Points a masked march didn't sample only feed cubes
+            // that are masked out.
             {
-                for (uint x = 0; x < nx - 1; x++)
-                {
-
-                    vs[0] = grid->get(x, y, z);
-                    vs[1] = grid->get(x + 1, y, z);
-                    vs[2] = grid->get(x, y + 1, z);
-                    vs[3] = grid->get(x + 1, y + 1, z);
-                    vs[4] = grid->get(x, y, z + 1);
-                    vs[5] = grid->get(x + 1, y, z + 1);
-                    vs[6] = grid->get(x, y + 1, z + 1);
-                    vs[7] = grid->get(x + 1, y + 1, z + 1);
-
-                    const int config_n =
-                        ((vs[0] < 0) << 0) |
-                        ((vs[1] < 0) << 1) |
-                        ((vs[2] < 0) << 2) |
-                        ((vs[3] < 0) << 3) |
-                        ((vs[4] < 0) << 4) |
-                        ((vs[5] < 0) << 5) |
-                        ((vs[6] < 0) << 6) |
-                        ((vs[7] < 0) << 7);
-                    if (config_n == 0 || config_n == 255)
-                        continue;
+                PROFILE_SCOPE("mc classify");
+                mc_internalBackend::classifySlab(l0, l1, nx, ny, configs.data());
+                if (mask) {
+                    for (size_t i = 0; i < numCubes; i++)
+                        configs[i] &= uint8_t(-int(inMask[i]));
+                }
+            }
 
-                    if (y == 0 && z == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[1], 0, x, y, z, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[1], 0, x, y, z, size);
-#endif
-                    if (z == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[2], vs[3], 0, x, y + 1, z, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[2], vs[3], 0, x, y + 1, z, size);
-#endif
-                    if (y == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[4], vs[5], 0, x, y, z + 1, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[4], vs[5], 0, x, y, z + 1, size);
-#endif
-#if kernel 
-                    mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[6], vs[7], 0, x, y + 1, z + 1, size);
-#else
-                    mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[6], vs[7], 0, x, y + 1, z + 1, size);
-#endif
-                    if (x == 0 && z == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[2], 1, x, y, z, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[2], 1, x, y, z, size);
-#endif
-                    if (z == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[1], vs[3], 1, x + 1, y, z, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[1], vs[3], 1,x + 1, y, z, size);
-#endif
-                    if (x == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[4], vs[6], 1, x, y, z + 1, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[4], vs[6], 1, x, y, z + 1, size);
-#endif
-#if kernel 
-                    mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[5], vs[7], 1, x + 1, y, z + 1, size);
-#else
-                    mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[5], vs[7], 1, x + 1, y, z + 1, size);
-#endif
-                    if (x == 0 && y == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[4], 2, x, y, z, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[4], 2, x, y, z, size);
-#endif
-                    if (y == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[1], vs[5], 2, x + 1, y, z, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[1], vs[5], 2, x + 1, y, z, size);
-#endif
-                    if (x == 0)
-#if kernel 
-                        mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[2], vs[6], 2, x, y + 1, z, size);
-#else
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[2], vs[6], 2, x, y + 1, z, size);
-#endif
-#if kernel 
-                    mc_cudaComputeEdge(slab_inds, outputMesh, grid, vs[3], vs[7], 2, x + 1, y + 1, z, size);
-#else
-                    mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[3], vs[7], 2, x + 1, y + 1, z, size);
-#endif
+            // Compact the crossed cubes (neither all inside nor all outside),
+            // then size each one's triangles from the table
+            size_t numActive = 0;
+            for (size_t i = 0; i < numCubes; i++) {
+                slots[i] = uint(numActive);
+                numActive += (configs[i] != 0) & (configs[i] != 255);
+            }
+            active.resize(numActive);
+            for (size_t i = 0; i < numCubes; i++) {
+                if (configs[i] != 0 && configs[i] != 255)
+                    active[slots[i]] = uint(i);
+            }
 
-                    edge_indices[0] = slab_inds[cuda_internalToIndex1DSlab(x, y, z, size)].x();
-                    edge_indices[1] = slab_inds[cuda_internalToIndex1DSlab(x, y + 1, z, size)].x();
-                    edge_indices[2] = slab_inds[cuda_internalToIndex1DSlab(x, y, z + 1, size)].x();
-                    edge_indices[3] = slab_inds[cuda_internalToIndex1DSlab(x, y + 1, z + 1, size)].x();
-                    edge_indices[4] = slab_inds[cuda_internalToIndex1DSlab(x, y, z, size)].y();
-                    edge_indices[5] = slab_inds[cuda_internalToIndex1DSlab(x + 1, y, z, size)].y();
-                    edge_indices[6] = slab_inds[cuda_internalToIndex1DSlab(x, y, z + 1, size)].y();
-                    edge_indices[7] = slab_inds[cuda_internalToIndex1DSlab(x + 1, y, z + 1, size)].y();
-                    edge_indices[8] = slab_inds[cuda_internalToIndex1DSlab(x, y, z, size)].z();
-                    edge_indices[9] = slab_inds[cuda_internalToIndex1DSlab(x + 1, y, z, size)].z();
-                    edge_indices[10] = slab_inds[cuda_internalToIndex1DSlab(x, y + 1, z, size)].z();
-                    edge_indices[11] = slab_inds[cuda_internalToIndex1DSlab(x + 1, y + 1, z, size)].z();
-
-                    const uint64_t& config = mc_internalMarching_cube_tris[config_n];
-                    const size_t n_triangles = config & 0xF;
-                    const size_t n_indices = n_triangles * 3;
-                    const size_t& indexBase = outputMesh.indices.size();
-                    int offset = 4;
-                    for (size_t i = 0; i < n_indices; i++)
-                    {
-                        const int edge = (config >> offset) & 0xF;
-                        outputMesh.indices.push_back(edge_indices[edge]);
-                        offset += 4;
-                    }
-                    for (size_t i = 0; i < n_triangles; i++)
-                    {
-                        mc_internalAccumulateNormal(outputMesh,
-                            outputMesh.indices[indexBase + i * 3 + 0],
-                            outputMesh.indices[indexBase + i * 3 + 1],
-                            outputMesh.indices[indexBase + i * 3 + 2]);
+            indexOffsets.resize(numActive + 1);
+            size_t numIndices = 0;
+            for (size_t a = 0; a < numActive; a++) {
+                indexOffsets[a] = numIndices;
+                numIndices += tables.indexCount[configs[active[a]]];
+            }
+            indexOffsets[numActive] = numIndices;
+            PROFILE_COUNT("mc/crossed cubes", numActive);
+
+            if (activeOut) {
+                for (uint i : active)
+                    activeOut->set(i % cx, i / cx, z);
+            }
+
+            // Decide which crossed edges each cube makes the vertex on, and
+            // number those vertices. An edge shared with a cube visited
+            // earlier already has one. Unmasked, the earlier cubes are the
+            // neighbours before it along x, y and z whenever those exist, and
+            // the tables give the edges it owns outright; masked, some of them
+            // may have been skipped, so edges are stamped with the slab that
+            // last visited them instead.
+            made.resize(numActive);
+            vertexOffsets.resize(numActive);
+            size_t numVertices = 0;
+            if (!mask) {
+                for (size_t a = 0; a < numActive; a++) {
+                    const uint i = active[a];
+                    const uint x = i % cx, y = i / cx;
+                    const int before = (x > 0) | ((y > 0) << 1) | ((z > 0) << 2);
+                    made[a] = tables.ownedMask[before][configs[i]];
+                    vertexOffsets[a] = uint(numVertices);
+                    numVertices += tables.ownedCount[before][configs[i]];
+                }
+            } else {
+                for (size_t a = 0; a < numActive; a++) {
+                    const uint i = active[a];
+                    const uint x = i % cx, y = i / cx;
+                    const uint8_t config = configs[i];
+                    uint16_t edges = 0;
+                    vertexOffsets[a] = uint(numVertices);
+                    for (int j = 0; j < tables.crossedCount[config]; j++) {
+                        const int e = tables.crossedEdges[config][j];
+                        const uint ez = z + MCTables::EDGE_ORIGIN[e][2];
+                        uint& seen = slab_seen[MCKernels::slabIndex(x + MCTables::EDGE_ORIGIN[e][0],
+                            y + MCTables::EDGE_ORIGIN[e][1], ez, nx, ny) * 3 + MCTables::EDGE_AXIS[e]];
+                        if (seen == ez + 1)
+                            continue;
+                        seen = ez + 1;
+                        edges |= uint16_t(1 << e);
+                        numVertices++;
                     }
+                    made[a] = edges;
+                }
+            }
 
+            // Place the vertices. Each root is found on its own, so grids that
+            // can be read concurrently do them in parallel.
+            const uint vertexBase = uint(outputMesh.vertices.size());
+            outputMesh.vertices.resize(vertexBase + numVertices);
+            outputMesh.normals.resize(vertexBase + numVertices, VEC3F(0, 0, 0));
+            auto placeVertices = [&](size_t a) {
+                const uint i = active[a];
+                const uint x = i % cx, y = i / cx;
+                const size_t p = size_t(y) * nx + x;
+                const Real vs[8] = { l0[p], l0[p + 1], l0[p + nx], l0[p + nx + 1],
+                                     l1[p], l1[p + 1], l1[p + nx], l1[p + nx + 1] };
+                const uint8_t config = configs[i];
+                uint v = vertexBase + vertexOffsets[a];
+                for (int j = 0; j < tables.crossedCount[config]; j++) {
+                    const int e = tables.crossedEdges[config][j];
+                    if (!((made[a] >> e) & 1))
+                        continue;
+                    const int axis = MCTables::EDGE_AXIS[e];
+                    const uint ex = x + MCTables::EDGE_ORIGIN[e][0];
+                    const uint ey = y + MCTables::EDGE_ORIGIN[e][1];
+                    const uint ez = z + MCTables::EDGE_ORIGIN[e][2];
+                    const float va = vs[MCTables::EDGE_CORNERS[e][0]];
+                    slab_inds[MCKernels::slabIndex(ex, ey, ez, nx, ny)][axis] = v;
+                    outputMesh.vertices[v] = VEC3F(ex, ey, ez) + mc_internalFindEdgeRoot(grid, va, axis, ex, ey, ez);
+                    v++;
                 }
+            };
+            if (grid->supportsConcurrentReads()) {
+                Parallel::parallelFor(0, numActive, placeVertices, 16);
+            } else {
+                for (size_t a = 0; a < numActive; a++) placeVertices(a);
+            }
+
+            // Emit the triangles, each cube into its own range
+            const size_t indexBase = outputMesh.indices.size();
+            outputMesh.indices.resize(indexBase + numIndices);
+            mc_internalBackend::emitSlab(active.data(), numActive, configs.data(), indexOffsets.data(),
+                slab_inds[0].data(), nx, ny, z, outputMesh.indices.data() + indexBase);
+
+            // Normal sums depend on the order they are added in, so they are
+            // accumulated serially, triangle by triangle
+            for (size_t t = indexBase; t < outputMesh.indices.size(); t += 3) {
+                mc_internalAccumulateNormal(outputMesh,
+                    outputMesh.indices[t + 0],
+                    outputMesh.indices[t + 1],
+                    outputMesh.indices[t + 2]);
+            }
+            if (checkpoint) {
+                for (size_t t = indexBase; t < outputMesh.indices.size(); t++)
+                    checkpointLog.firstChanged = std::min<size_t>(checkpointLog.firstChanged, outputMesh.indices[t]);
             }
 
-            PB_PROGRESS((float) z / nz);
+            if (verbose) {
+                PB_PROGRESS((float) z / nz);
+            }
 
-            fflush(stdout);
+            if (checkpoint && checkpoint->everySlabs > 0 && (z + 1) % checkpoint->everySlabs == 0 && z + 1 < nz - 1) {
+                PROFILE_SCOPE("mc checkpoint");
+                if (!mc_internalWriteCheckpoint(*checkpoint, checkpointLog, nx, ny, nz, z + 1, slab_inds, slab_seen, outputMesh))
+                    printf("Warning: could not write checkpoint %s\n", checkpoint->path.c_str());
+            }
         }
 
         delete[] slab_inds;
+        delete[] slab_seen;
 
-        PB_END();
+        if (checkpoint) {
+            if (checkpointLog.file) {
+                fclose(checkpointLog.file);
+                checkpointLog.file = NULL;
+            }
+            remove(checkpoint->path.c_str());
+            remove(mc_internalCheckpointMeshPath(*checkpoint).c_str());
+        }
 
-        if (verbose) printf("\n");
+        if (verbose) {
+            PB_END();
+            printf("\n");
+            if (blocked) samplingStats.print("Marching cubes sampling");
+        }
 
         for (size_t i = 0; i < outputMesh.normals.size(); i++)
             outputMesh.normals[i] = mc_internalNormalize(outputMesh.normals[i]);
 
     }
 
+    /*!
+      \brief Cube-at-a-time marching cubes straight off the packed triangle
+      table, serial and without any of the phases of march_cubes. It is the
+      reference validateBackend checks the backends against.
+      \param grid Grid3D scalar field or function of real values
+      \param outputMesh indexed mesh returned
+      \param mask if given, cubes outside it are treated as empty
+      */
+    inline void march_cubes_reference(Grid3D* grid, Mesh& outputMesh, const CellMask* mask = nullptr) {
+        const uint nx = grid->xRes, ny = grid->yRes, nz = grid->zRes;
+        std::vector<VEC3I> slab_inds(size_t(nx) * ny * 2, VEC3I(0, 0, 0));
+        std::vector<uint> slab_seen(size_t(nx) * ny * 2 * 3, 0);
+
+        for (uint z = 0; z < nz - 1; z++)
+        for (uint y = 0; y < ny - 1; y++)
+        for (uint x = 0; x < nx - 1; x++) {
+            if (mask && !mask->active(x, y, z))
+                continue;
+
+            Real vs[8];
+            int config_n = 0;
+            for (int c = 0; c < 8; c++) {
+                vs[c] = grid->get(x + (c & 1), y + ((c >> 1) & 1), z + (c >> 2));
+                config_n |= (vs[c] < 0) << c;
+            }
+            if (config_n == 0 || config_n == 255)
+                continue;
+
+            uint edge_indices[12];
+            for (int e = 0; e < 12; e++) {
+                const int axis = MCTables::EDGE_AXIS[e];
+                const uint ex = x + MCTables::EDGE_ORIGIN[e][0];
+                const uint ey = y + MCTables::EDGE_ORIGIN[e][1];
+                const uint ez = z + MCTables::EDGE_ORIGIN[e][2];
+                const size_t p = MCKernels::slabIndex(ex, ey, ez, nx, ny);
+                const Real va = vs[MCTables::EDGE_CORNERS[e][0]];
+                const Real vb = vs[MCTables::EDGE_CORNERS[e][1]];
+
+                if (slab_seen[p * 3 + axis] != ez + 1) {
+                    slab_seen[p * 3 + axis] = ez + 1;
+                    if ((va < 0) != (vb < 0)) {
+                        slab_inds[p][axis] = int(outputMesh.vertices.size());
+                        outputMesh.vertices.push_back(VEC3F(ex, ey, ez) + mc_internalFindEdgeRoot(grid, va, axis, ex, ey, ez));
+                        outputMesh.normals.push_back(VEC3F(0, 0, 0));
+                    }
+                }
+                edge_indices[e] = slab_inds[p][axis];
+            }
+
+            const unsigned long long config = MCTables::PACKED_TRIANGLES[config_n];
+            const size_t indexBase = outputMesh.indices.size();
+            for (size_t i = 0; i < 3 * (config & 0xF); i++)
+                outputMesh.indices.push_back(edge_indices[(config >> (4 + 4 * i)) & 0xF]);
+            for (size_t t = indexBase; t < outputMesh.indices.size(); t += 3)
+                mc_internalAccumulateNormal(outputMesh, outputMesh.indices[t], outputMesh.indices[t + 1], outputMesh.indices[t + 2]);
+        }
+
+        for (size_t i = 0; i < outputMesh.normals.size(); i++)
+            outputMesh.normals[i] = mc_internalNormalize(outputMesh.normals[i]);
+    }
+
+    template <class T>
+    static bool mc_internalSameBits(const std::vector<T>& a, const std::vector<T>& b)
+    {
+        return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+    }
+
+    /*!
+      \brief Marches `grid` with the configured backend (MC_CUDA_BACKEND) and
+      with march_cubes_reference, once unmasked and once under a coarse
+      checkerboard mask, and checks the meshes are bit for bit the same. This
+      validates a backend on any machine it builds on.
+      \return true if every mesh matches
+      */
+    inline bool validateBackend(Grid3D* grid, bool verbose = true) {
+        PROFILE_SCOPE("validate mc backend");
+        CellMask checkerboard((grid->xRes + 3) / 4, (grid->yRes + 3) / 4, (grid->zRes + 3) / 4);
+        checkerboard.stride = 4;
+        for (uint z = 0; z < checkerboard.zRes; z++)
+        for (uint y = 0; y < checkerboard.yRes; y++)
+        for (uint x = 0; x < checkerboard.xRes; x++)
+            if ((x + y + z) % 2 == 0) checkerboard.set(x, y, z);
+
+        bool ok = true;
+        for (int pass = 0; pass < 2; pass++) {
+            const CellMask* mask = pass ? &checkerboard : nullptr;
+            Mesh m, reference;
+            march_cubes(grid, m, false, mask);
+            march_cubes_reference(grid, reference, mask);
+
+            const bool same = mc_internalSameBits(m.vertices, reference.vertices)
+                && mc_internalSameBits(m.normals, reference.normals)
+                && mc_internalSameBits(m.indices, reference.indices);
+            if (verbose || !same) {
+                printf("Marching cubes backend %s %s the reference%s: %zu vertices, %zu triangles (reference %zu, %zu)\n",
+                    mc_internalBackend::name(), same ? "matches" : "DIFFERS from", pass ? " under a mask" : "",
+                    m.vertices.size(), m.indices.size() / 3, reference.vertices.size(), reference.indices.size() / 3);
+            }
+            ok = ok && same;
+        }
+        return ok;
+    }
+
+    /*!
+      \brief Replaces the face-accumulated normals of an extracted mesh with the
+      normalized field gradient at each vertex. Fields with analytic derivatives
+      (see getValueAndGradient) deliver it in about one evaluation per vertex.
+      Vertices are spread over the cores if the field supports concurrent reads.
+      \param mesh mesh with vertices already in field coordinates
+      \param field the scalar field the mesh was extracted from
+      */
+    inline void computeFieldNormals(Mesh& mesh, const FieldFunction3D& field)
+    {
+        PROFILE_SCOPE("field normals");
+        mesh.normals.resize(mesh.vertices.size());
+
+        auto vertexNormal = [&](size_t i) {
+            VEC3F gradient;
+            field.getValueAndGradient(mesh.vertices[i], gradient);
+
+            // Keep the face normal where the gradient vanishes or blows up
+            const Real length = gradient.norm();
+            if (length > 0 && std::isfinite(length))
+                mesh.normals[i] = gradient / length;
+        };
+
+        if (field.supportsConcurrentReads()) {
+            Parallel::parallelFor(0, mesh.vertices.size(), vertexNormal, 64);
+        } else {
+            for (size_t i = 0; i < mesh.vertices.size(); i++) vertexNormal(i);
+        }
+    }
+
 }
+
+#endif
@@ -0,0 +1,562 @@
+#ifndef CHUNKS_H
+#define CHUNKS_H
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+#include "SETTINGS.h"
+#include "mesh.h"
+#include "field.h"
+#include "dualcontour.h"
+#include "parallel.h"
+
+using namespace std;
+
+// Tiled extraction of a world region into cubic chunks for streaming. Every
+// chunk is a uniform grid at its own level of detail, and all of them sit on
+// one global lattice (the finest level), so a sample or an edge crossing on a
+// chunk boundary is computed from exactly the same point whichever chunk
+// asks for it. Chunks are contoured with a dual method: each sign changing
+// edge of the finest lattice around it becomes a polygon joining the cubes on
+// either side, whatever their size, as in octree dual contouring. A chunk
+// emits the polygons of the edges it owns and pulls in copies of the
+// neighbouring cubes' vertices, so seams close exactly, also between chunks
+// one level of detail apart.
+namespace Chunks
+{
+    // Shards of the shared boundary sample cache, so chunks rarely contend
+    static const int CHUNK_CACHE_SHARDS = 64;
+
+    // Boundary crossings of a cube: 12 edges, halved along seams, plus the
+    // midlines of up to 6 faces next to a finer chunk
+    static const int CHUNK_MAX_CROSSINGS = 48;
+
+    struct ChunkInfo {
+        VEC3I  coords;
+        int    level = 0;
+        int    res = 0;
+        size_t vertices = 0;
+        size_t triangles = 0;
+        string filename;
+    };
+
+    /*!
+      \brief The chunk grid over a region and the level of detail of each
+      chunk. Lattice point I of the finest level is at regionMin + I * cellSize.
+      */
+    struct Layout {
+        VEC3F regionMin;
+        Real  chunkSize = 1;
+        Real  cellSize = 1;
+        int   res = 1;            // finest cells per chunk edge
+        VEC3I dims;               // chunks per axis
+        vector<uint8_t> levels;   // per chunk, x fastest
+
+        /*!
+          \brief Covers `region` with whole chunks. Chunks in ring r around the
+          chunk containing `focus` get level min(r, numLevels - 1), so any two
+          chunks that touch, even at a corner, are at most one level apart.
+          */
+        Layout(const AABB& region, Real chunkSize, int res, int numLevels, const VEC3F& focus):
+            regionMin(region.min()), chunkSize(chunkSize), cellSize(chunkSize / res), res(res)
+        {
+            dims = (region.span() / chunkSize).array().ceil().cast<int>().max(1).matrix();
+            levels.resize(size_t(dims[0]) * dims[1] * dims[2]);
+
+            const VEC3I center = ((focus - regionMin) / chunkSize).array().floor().cast<int>().matrix();
+            for (int z = 0; z < dims[2]; z++)
+            for (int y = 0; y < dims[1]; y++)
+            for (int x = 0; x < dims[0]; x++) {
+                const int ring = (VEC3I(x, y, z) - center).cwiseAbs().maxCoeff();
+                levels[index(VEC3I(x, y, z))] = uint8_t(std::min(ring, numLevels - 1));
+            }
+        }
+
+        size_t numChunks() const { return levels.size(); }
+
+        size_t index(const VEC3I& c) const {
+            return (size_t(c[2]) * dims[1] + c[1]) * dims[0] + c[0];
+        }
+
+        VEC3I coords(size_t i) const {
+            return VEC3I(int(i % dims[0]), int(i / dims[0] % dims[1]), int(i / (size_t(dims[0]) * dims[1])));
+        }
+
+        bool contains(const VEC3I& c) const {
+            return (c.array() >= 0).all() && (c.array() < dims.array()).all();
+        }
+
+        int step(const VEC3I& c) const {
+            return 1 << levels[index(c)];
+        }
+
+        // Every chunk computes the position of a lattice point the same way
+        VEC3F point(const VEC3I& I) const {
+            return regionMin + I.cast<Real>() * cellSize;
+        }
+
+        VEC3F point(const VEC3I& I, int axis, Real t) const {
+            VEC3F p = point(I);
+            p[axis] = regionMin[axis] + (I[axis] + t) * cellSize;
+            return p;
+        }
+
+        // Chunk coordinate along one axis of a lattice coordinate; `side` picks
+        // the chunk below (-1) or above (+1) when it lies on a chunk boundary
+        int chunkCoord(int I, int side) const {
+            if (I % res == 0) return I / res + (side < 0 ? -1 : 0);
+            return I / res;
+        }
+    };
+
+    // Samples that more than one chunk reads: chunk faces and the halo of
+    // neighbouring cubes around them. Each is evaluated once.
+    class SharedSamples {
+    public:
+        SharedSamples(const FieldFunction3D& field, const Layout& layout): field(field), layout(layout) {}
+
+        Real get(const VEC3I& I) {
+            const uint64_t key = (uint64_t(uint32_t(I[0]) & 0x1FFFFF) << 42) |
+                                 (uint64_t(uint32_t(I[1]) & 0x1FFFFF) << 21) |
+                                  uint64_t(uint32_t(I[2]) & 0x1FFFFF);
+            Shard& shard = shards[(key * 0x9E3779B97F4A7C15ULL) >> 58];
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto it = shard.values.find(key);
+                if (it != shard.values.end()) return it->second;
+            }
+
+            const Real value = field.getFieldValue(layout.point(I));
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.values.emplace(key, value);
+            return value;
+        }
+
+        // The shards lock themselves, so this is up to the field
+        bool supportsConcurrentReads() const {
+            return field.supportsConcurrentReads();
+        }
+
+    private:
+        struct Shard {
+            std::mutex mutex;
+            std::unordered_map<uint64_t, Real> values;
+        };
+
+        const FieldFunction3D& field;
+        const Layout& layout;
+        Shard shards[CHUNK_CACHE_SHARDS];
+    };
+
+    // One chunk's samples on its own lattice; everything else goes to the
+    // shared cache
+    struct chunk_internalSamples {
+        VEC3I origin;   // lattice coordinates of the chunk's min corner
+        int   step = 1;
+        int   n = 0;    // cells per edge
+        vector<Real> values;
+        SharedSamples* shared = nullptr;
+
+        Real get(const VEC3I& I) const {
+            const VEC3I local = I - origin;
+            if ((local.array() >= 0).all() && (local.array() <= n * step).all() &&
+                local[0] % step == 0 && local[1] % step == 0 && local[2] % step == 0) {
+                const VEC3I q = local / step;
+                return values[(size_t(q[2]) * (n + 1) + q[1]) * (n + 1) + q[0]];
+            }
+            return shared->get(I);
+        }
+    };
+
+    static inline bool chunk_internalCrosses(Real va, Real vb) {
+        return (va < 0.0) != (vb < 0.0);
+    }
+
+    // log2 of a power-of-two cube step
+    static inline int chunk_internalLog2(int step) {
+        int log = 0;
+        while (step > 1) {
+            step >>= 1;
+            log++;
+        }
+        return log;
+    }
+
+    // Finest step among the chunks sharing the lattice edge from I along `axis`
+    static int chunk_internalEdgeStep(const Layout& layout, const VEC3I& I, int axis, int length)
+    {
+        const int b = (axis + 1) % 3, c = (axis + 2) % 3;
+        int step = length;
+        for (int sb = -1; sb <= 1; sb += 2)
+        for (int sc = -1; sc <= 1; sc += 2) {
+            VEC3I chunk;
+            chunk[axis] = layout.chunkCoord(I[axis], 1);
+            chunk[b] = layout.chunkCoord(I[b], sb);
+            chunk[c] = layout.chunkCoord(I[c], sc);
+            if (layout.contains(chunk)) step = std::min(step, layout.step(chunk));
+        }
+        return step;
+    }
+
+    /*!
+      \brief Places the vertex of the cube at lattice point I with edge `step`,
+      from the crossings on every finest-lattice edge of its boundary. The
+      result only depends on the cube and the layout, so chunks computing a
+      neighbour's vertex get the same bits.
+      */
+    static VEC3F chunk_internalCubeVertex(const Layout& layout, const FieldFunction3D& field,
+            const chunk_internalSamples& samples, const VEC3I& I, int step, DC::Method method)
+    {
+        VEC3F crossings[CHUNK_MAX_CROSSINGS];
+        int n = 0;
+
+        auto addEdge = [&](const VEC3I& e0, int axis, int length) {
+            VEC3I e1 = e0;
+            e1[axis] += length;
+            const Real va = samples.get(e0), vb = samples.get(e1);
+            if (!chunk_internalCrosses(va, vb)) return;
+            crossings[n++] = layout.point(e0, axis, length * (va / (va - vb)));
+        };
+
+        // Cube edges, halved where a finer chunk shares them
+        for (int axis = 0; axis < 3; axis++) {
+            const int b = (axis + 1) % 3, c = (axis + 2) % 3;
+            for (int ob = 0; ob <= step; ob += step)
+            for (int oc = 0; oc <= step; oc += step) {
+                VEC3I e0 = I;
+                e0[b] += ob;
+                e0[c] += oc;
+                const int edgeStep = chunk_internalEdgeStep(layout, e0, axis, step);
+                for (int o = 0; o < step; o += edgeStep) {
+                    VEC3I e = e0;
+                    e[axis] += o;
+                    addEdge(e, axis, edgeStep);
+                }
+            }
+        }
+
+        // Midlines of faces against a finer chunk
+        const VEC3I chunk = I / layout.res;
+        for (int normal = 0; normal < 3; normal++) {
+            for (int side = 0; side <= 1; side++) {
+                VEC3I f = I;
+                f[normal] += side * step;
+                if (f[normal] % layout.res != 0) continue;
+
+                VEC3I across = chunk;
+                across[normal] += side ? 1 : -1;
+                if (!layout.contains(across) || layout.step(across) >= step) continue;
+
+                const int half = layout.step(across);
+                const int t1 = (normal + 1) % 3, t2 = (normal + 2) % 3;
+                for (int o = 0; o < step; o += half) {
+                    VEC3I e = f;
+                    e[t2] += half;
+                    e[t1] += o;
+                    addEdge(e, t1, half);
+
+                    e = f;
+                    e[t1] += half;
+                    e[t2] += o;
+                    addEdge(e, t2, half);
+                }
+            }
+        }
+
+        // Only cubes next to a sign change are ever asked for
+        if (n == 0) return layout.point(I);
+
+        VEC3F massPoint(0, 0, 0);
+        for (int i = 0; i < n; i++) massPoint += crossings[i];
+        massPoint /= n;
+
+        if (method == DC::SURFACE_NETS)
+            return massPoint;
+
+        VEC3F normals[CHUNK_MAX_CROSSINGS];
+        for (int i = 0; i < n; i++)
+            field.getValueAndGradient(crossings[i], normals[i]);
+        const VEC3F v = DC::solveQEF(crossings, normals, n, massPoint);
+
+        VEC3I hi = I;
+        hi.array() += step;
+        return v.cwiseMax(layout.point(I)).cwiseMin(layout.point(hi));
+    }
+
+    /*!
+      \brief Contours one chunk.
+      \param layout chunk grid
+      \param field the scalar field
+      \param shared boundary sample cache shared by all chunks
+      \param chunk chunk coordinates
+      \param method surface nets or dual contouring
+      \param mesh output, in field coordinates
+      */
+    inline void extractChunk(const Layout& layout, const FieldFunction3D& field, SharedSamples& shared,
+            const VEC3I& chunk, DC::Method method, Mesh& mesh)
+    {
+        chunk_internalSamples samples;
+        samples.origin = chunk * layout.res;
+        samples.step = layout.step(chunk);
+        samples.n = layout.res / samples.step;
+        samples.shared = &shared;
+
+        // Interior samples are this chunk's alone; faces go through the cache
+        const int n = samples.n, step = samples.step;
+        samples.values.resize(size_t(n + 1) * (n + 1) * (n + 1));
+        for (int z = 0; z <= n; z++)
+        for (int y = 0; y <= n; y++)
+        for (int x = 0; x <= n; x++) {
+            const VEC3I I = samples.origin + VEC3I(x, y, z) * step;
+            const bool face = x == 0 || y == 0 || z == 0 || x == n || y == n || z == n;
+            samples.values[(size_t(z) * (n + 1) + y) * (n + 1) + x] =
+                face ? shared.get(I) : field.getFieldValue(layout.point(I));
+        }
+
+        std::unordered_map<uint64_t, uint> vertexOf;
+        auto cubeVertex = [&](const VEC3I& I, int cubeStep) {
+            const uint64_t key = (uint64_t(uint32_t(I[0]) & 0xFFFFF) << 44) |
+                                 (uint64_t(uint32_t(I[1]) & 0xFFFFF) << 24) |
+                                 (uint64_t(uint32_t(I[2]) & 0xFFFFF) << 4) |
+                                  uint64_t(chunk_internalLog2(cubeStep));
+            auto it = vertexOf.find(key);
+            if (it != vertexOf.end()) return it->second;
+
+            const VEC3F v = chunk_internalCubeVertex(layout, field, samples, I, cubeStep, method);
+            const uint index = uint(mesh.vertices.size());
+            mesh.vertices.push_back(v);
+            mesh.normals.push_back(VEC3F(0, 0, 0));
+            vertexOf.emplace(key, index);
+            return index;
+        };
+
+        // Cube of chunk `c` just to the (sb, sc) side of the edge from I along `axis`
+        auto cubeBeside = [&](const VEC3I& I, int axis, int sb, int sc, VEC3I& cubeMin, int& cubeStep) {
+            const int b = (axis + 1) % 3, c = (axis + 2) % 3;
+            VEC3I owner;
+            owner[axis] = layout.chunkCoord(I[axis], 1);
+            owner[b] = layout.chunkCoord(I[b], sb);
+            owner[c] = layout.chunkCoord(I[c], sc);
+            if (!layout.contains(owner)) return false;
+
+            cubeStep = layout.step(owner);
+            const VEC3I local = I - owner * layout.res;
+            cubeMin[axis] = local[axis] / cubeStep * cubeStep;
+            cubeMin[b] = (sb > 0 ? local[b] : local[b] - 1) / cubeStep * cubeStep;
+            cubeMin[c] = (sc > 0 ? local[c] : local[c] - 1) / cubeStep * cubeStep;
+            cubeMin += owner * layout.res;
+            return true;
+        };
+
+        const size_t self = layout.index(chunk);
+        for (int axis = 0; axis < 3; axis++) {
+            const int b = (axis + 1) % 3, c = (axis + 2) % 3;
+            VEC3I extent(n, n, n);
+            extent[axis] = n - 1;
+
+            for (int z = 0; z <= extent[2]; z++)
+            for (int y = 0; y <= extent[1]; y++)
+            for (int x = 0; x <= extent[0]; x++) {
+                const VEC3I I = samples.origin + VEC3I(x, y, z) * step;
+                VEC3I I1 = I;
+                I1[axis] += step;
+                const Real va = samples.get(I), vb = samples.get(I1);
+                if (!chunk_internalCrosses(va, vb)) continue;
+
+                // Edges on a chunk face or edge belong to the finest chunk
+                // sharing them, ties to the one with the largest index
+                const bool onBoundary = I[b] % layout.res == 0 || I[c] % layout.res == 0;
+                if (onBoundary) {
+                    size_t owner = self;
+                    int ownerStep = step;
+                    for (int sb = -1; sb <= 1; sb += 2)
+                    for (int sc = -1; sc <= 1; sc += 2) {
+                        VEC3I other;
+                        other[axis] = chunk[axis];
+                        other[b] = layout.chunkCoord(I[b], sb);
+                        other[c] = layout.chunkCoord(I[c], sc);
+                        if (!layout.contains(other)) continue;
+                        const int otherStep = layout.step(other);
+                        const size_t otherIndex = layout.index(other);
+                        if (otherStep < ownerStep || (otherStep == ownerStep && otherIndex > owner)) {
+                            owner = otherIndex;
+                            ownerStep = otherStep;
+                        }
+                    }
+                    if (owner != self) continue;
+                }
+
+                // The cubes around the edge, counter-clockwise about +axis
+                const int quadrants[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+                uint polygon[4];
+                int corners = 0;
+                bool complete = true;
+                for (int q = 0; q < 4 && complete; q++) {
+                    VEC3I cubeMin;
+                    int cubeStep;
+                    if (!cubeBeside(I, axis, quadrants[q][0], quadrants[q][1], cubeMin, cubeStep)) {
+                        complete = false;
+                        break;
+                    }
+                    const uint v = cubeVertex(cubeMin, cubeStep);
+                    if (corners == 0 || polygon[corners - 1] != v) polygon[corners++] = v;
+                }
+                if (!complete) continue;
+                if (corners > 1 && polygon[corners - 1] == polygon[0]) corners--;
+                if (corners < 3) continue;
+
+                // Normals point to the positive side, like MC::march_cubes
+                if (va >= 0) std::reverse(polygon, polygon + corners);
+                if (corners == 3) {
+                    mesh.indices.insert(mesh.indices.end(), { polygon[0], polygon[1], polygon[2] });
+                } else {
+                    const Real d02 = (mesh.vertices[polygon[0]] - mesh.vertices[polygon[2]]).squaredNorm();
+                    const Real d13 = (mesh.vertices[polygon[1]] - mesh.vertices[polygon[3]]).squaredNorm();
+                    if (d02 <= d13) {
+                        mesh.indices.insert(mesh.indices.end(), { polygon[0], polygon[1], polygon[2], polygon[0], polygon[2], polygon[3] });
+                    } else {
+                        mesh.indices.insert(mesh.indices.end(), { polygon[0], polygon[1], polygon[3], polygon[1], polygon[2], polygon[3] });
+                    }
+                }
+            }
+        }
+
+        // Field normals, so copies of a seam vertex in neighbouring chunks
+        // shade alike. Chunks already run in parallel, so this one is serial.
+        for (size_t i = 0; i < mesh.vertices.size(); i++) {
+            VEC3F gradient;
+            field.getValueAndGradient(mesh.vertices[i], gradient);
+            const Real length = gradient.norm();
+            mesh.normals[i] = (length > 0 && std::isfinite(length)) ? VEC3F(gradient / length) : VEC3F(0, 0, 1);
+        }
+    }
+
+    // "reef.obj" -> "reef"
+    inline string chunk_internalStem(const string& outputFilename) {
+        const size_t dot = outputFilename.rfind('.');
+        const size_t slash = outputFilename.find_last_of("/\\");
+        if (dot != string::npos && (slash == string::npos || dot > slash)) return outputFilename.substr(0, dot);
+        return outputFilename;
+    }
+
+    /*!
+      \brief Writes the chunk index the streaming client loads: region, chunk
+      size and, per non-empty chunk, its coordinates, level of detail, bounds,
+      mesh file and size.
+      */
+    inline void writeManifest(const string& filename, const Layout& layout, const vector<ChunkInfo>& chunks)
+    {
+        ofstream out(filename);
+        if (!out.is_open()) {
+            printf("Could not open chunk manifest %s for writing.\n", filename.c_str());
+            exit(1);
+        }
+
+        out << "{\n";
+        out << "  \"regionMin\": [" << layout.regionMin[0] << ", " << layout.regionMin[1] << ", " << layout.regionMin[2] << "],\n";
+        out << "  \"chunkSize\": " << layout.chunkSize << ",\n";
+        out << "  \"dims\": [" << layout.dims[0] << ", " << layout.dims[1] << ", " << layout.dims[2] << "],\n";
+        out << "  \"res\": " << layout.res << ",\n";
+        out << "  \"chunks\": [";
+        bool first = true;
+        for (const ChunkInfo& info : chunks) {
+            if (info.triangles == 0) continue;
+            const VEC3F lo = layout.point(info.coords * layout.res);
+            const VEC3F hi = layout.point((info.coords + VEC3I(1, 1, 1)) * layout.res);
+            const size_t slash = info.filename.find_last_of("/\\");
+            out << (first ? "\n" : ",\n");
+            out << "    { \"coords\": [" << info.coords[0] << ", " << info.coords[1] << ", " << info.coords[2] << "]"
+                << ", \"lod\": " << info.level << ", \"res\": " << info.res
+                << ", \"min\": [" << lo[0] << ", " << lo[1] << ", " << lo[2] << "]"
+                << ", \"max\": [" << hi[0] << ", " << hi[1] << ", " << hi[2] << "]"
+                << ", \"file\": \"" << (slash == string::npos ? info.filename : info.filename.substr(slash + 1)) << "\""
+                << ", \"vertices\": " << info.vertices << ", \"triangles\": " << info.triangles << " }";
+            first = false;
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    /*!
+      \brief Extracts every chunk of `layout`, in parallel if the field supports
+      concurrent reads, writing one OBJ per non-empty chunk
+      (<stem>.chunk_<x>_<y>_<z>.obj) and the manifest (<stem>.chunks.json).
+      \param layout chunk grid
+      \param field the scalar field
+      \param method surface nets or dual contouring
+      \param outputFilename base name of the outputs
+      \param verbose print progress and a summary
+      \return per-chunk stats, in chunk index order
+      */
+    inline vector<ChunkInfo> generate(const Layout& layout, const FieldFunction3D& field, DC::Method method,
+            const string& outputFilename, bool verbose = true)
+    {
+        const string stem = chunk_internalStem(outputFilename);
+        SharedSamples shared(field, layout);
+        vector<ChunkInfo> chunks(layout.numChunks());
+
+        PB_DECL();
+        if (verbose) {
+            PB_STARTD("Extracting %dx%dx%d chunks (%s)", layout.dims[0], layout.dims[1], layout.dims[2], DC::methodName(method));
+        }
+        std::mutex progressMutex;
+        size_t done = 0;
+
+        auto extract = [&](size_t i) {
+            ChunkInfo& info = chunks[i];
+            info.coords = layout.coords(i);
+            info.level = layout.levels[i];
+            info.res = layout.res >> info.level;
+
+            PROFILE_SCOPE("chunk");
+            Mesh mesh;
+            extractChunk(layout, field, shared, info.coords, method, mesh);
+            info.vertices = mesh.vertices.size();
+            info.triangles = mesh.indices.size() / 3;
+
+            if (info.triangles > 0) {
+                info.filename = stem + ".chunk_" + to_string(info.coords[0]) + "_" + to_string(info.coords[1]) + "_" + to_string(info.coords[2]) + ".obj";
+
+                std::lock_guard<std::mutex> lock(progressMutex);
+                mesh.writeOBJ(info.filename);
+            }
+
+            if (verbose) {
+                std::lock_guard<std::mutex> lock(progressMutex);
+                done++;
+                PB_PROGRESS((float) done / layout.numChunks());
+            }
+        };
+
+        if (shared.supportsConcurrentReads()) {
+            Parallel::parallelFor(0, layout.numChunks(), extract);
+        } else {
+            for (size_t i = 0; i < layout.numChunks(); i++) extract(i);
+        }
+
+        if (verbose) {
+            PB_END();
+            printf("\n");
+        }
+
+        writeManifest(stem + ".chunks.json", layout, chunks);
+
+        if (verbose) {
+            size_t nonEmpty = 0, triangles = 0;
+            for (const ChunkInfo& info : chunks) {
+                if (info.triangles) nonEmpty++;
+                triangles += info.triangles;
+            }
+            printf("Wrote %zu non-empty chunks (%zu triangles) and manifest %s.chunks.json\n", nonEmpty, triangles, stem.c_str());
+        }
+
+        return chunks;
+    }
+}
+
+#endif
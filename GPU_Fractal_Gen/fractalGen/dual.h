@@ -0,0 +1,181 @@
+#ifndef DUAL_H
+#define DUAL_H
+
+#include <cmath>
+#include <cstdint>
+
+#include "SETTINGS.h"
+#include "PerlinNoise.h"
+
+// Forward-mode dual number: a value together with its gradient with respect
+// to the three coordinates of a sample position. Arithmetic on Dual3 applies
+// the chain rule, so code written against it yields value and gradient from
+// a single evaluation.
+struct Dual3 {
+    Real  v;
+    VEC3F d;
+
+    Dual3(Real v = 0): v(v), d(0, 0, 0) {}
+    Dual3(Real v, const VEC3F& d): v(v), d(d) {}
+
+    Dual3& operator+=(const Dual3& o) { v += o.v; d += o.d; return *this; }
+    Dual3& operator-=(const Dual3& o) { v -= o.v; d -= o.d; return *this; }
+    Dual3& operator*=(const Dual3& o) { d = d * o.v + o.d * v; v *= o.v; return *this; }
+    Dual3& operator*=(Real s) { v *= s; d *= s; return *this; }
+};
+
+inline Dual3 operator+(const Dual3& a, const Dual3& b) { return Dual3(a.v + b.v, a.d + b.d); }
+inline Dual3 operator-(const Dual3& a, const Dual3& b) { return Dual3(a.v - b.v, a.d - b.d); }
+inline Dual3 operator-(const Dual3& a) { return Dual3(-a.v, -a.d); }
+inline Dual3 operator*(const Dual3& a, const Dual3& b) { return Dual3(a.v * b.v, a.d * b.v + b.d * a.v); }
+inline Dual3 operator/(const Dual3& a, const Dual3& b) { return Dual3(a.v / b.v, (a.d * b.v - b.d * a.v) / (b.v * b.v)); }
+
+inline Dual3 operator+(const Dual3& a, Real s) { return Dual3(a.v + s, a.d); }
+inline Dual3 operator+(Real s, const Dual3& a) { return Dual3(s + a.v, a.d); }
+inline Dual3 operator-(const Dual3& a, Real s) { return Dual3(a.v - s, a.d); }
+inline Dual3 operator-(Real s, const Dual3& a) { return Dual3(s - a.v, -a.d); }
+inline Dual3 operator*(const Dual3& a, Real s) { return Dual3(a.v * s, a.d * s); }
+inline Dual3 operator*(Real s, const Dual3& a) { return Dual3(s * a.v, s * a.d); }
+inline Dual3 operator/(const Dual3& a, Real s) { return Dual3(a.v / s, a.d / s); }
+
+inline Dual3 exp(const Dual3& a) { const Real e = std::exp(a.v); return Dual3(e, a.d * e); }
+inline Dual3 log(const Dual3& a) { return Dual3(std::log(a.v), a.d / a.v); }
+inline Dual3 sqrt(const Dual3& a) { const Real s = std::sqrt(a.v); return Dual3(s, a.d / (2 * s)); }
+
+namespace DualMath
+{
+    // Value and Jacobian (rows: components, columns: d/dx, d/dy, d/dz) of a
+    // vector of duals
+    inline VEC3F value(const Dual3& x, const Dual3& y, const Dual3& z) {
+        return VEC3F(x.v, y.v, z.v);
+    }
+
+    inline MATRIX3 jacobian(const Dual3& x, const Dual3& y, const Dual3& z) {
+        MATRIX3 J;
+        J.row(0) = x.d.transpose();
+        J.row(1) = y.d.transpose();
+        J.row(2) = z.d.transpose();
+        return J;
+    }
+
+    // Gradient vectors that perlin_detail::Grad dots with the corner offset,
+    // indexed by the low four bits of the hash
+    static const Real DUAL_PERLIN_GRADIENTS[16][3] = {
+        { 1, 1, 0}, {-1, 1, 0}, { 1,-1, 0}, {-1,-1, 0},
+        { 1, 0, 1}, {-1, 0, 1}, { 1, 0,-1}, {-1, 0,-1},
+        { 0, 1, 1}, { 0,-1, 1}, { 0, 1,-1}, { 0,-1,-1},
+        { 1, 1, 0}, { 0,-1, 1}, {-1, 1, 0}, { 0,-1,-1} };
+
+    inline Real fadeSlope(const Real t) {
+        return 30 * t * t * (t - 1) * (t - 1);
+    }
+
+    /*!
+      \brief siv::PerlinNoise::noise3D together with its gradient. The value is
+      computed step for step like siv's (so it matches exactly); the gradient is
+      the closed form: the interpolated corner gradients plus the fade slopes
+      times the differences across each axis.
+      */
+    inline Real noise3D(const siv::PerlinNoise& noise, const Real x, const Real y, const Real z, VEC3F& gradient) {
+        using namespace siv::perlin_detail;
+        const siv::PerlinNoise::state_type& perm = noise.serialize();
+
+        const Real _x = std::floor(x);
+        const Real _y = std::floor(y);
+        const Real _z = std::floor(z);
+
+        const std::int32_t ix = static_cast<std::int32_t>(_x) & 255;
+        const std::int32_t iy = static_cast<std::int32_t>(_y) & 255;
+        const std::int32_t iz = static_cast<std::int32_t>(_z) & 255;
+
+        const Real fx = (x - _x);
+        const Real fy = (y - _y);
+        const Real fz = (z - _z);
+
+        const Real u = Fade(fx);
+        const Real v = Fade(fy);
+        const Real w = Fade(fz);
+
+        const std::uint8_t A = (perm[ix & 255] + iy) & 255;
+        const std::uint8_t B = (perm[(ix + 1) & 255] + iy) & 255;
+
+        const std::uint8_t AA = (perm[A] + iz) & 255;
+        const std::uint8_t AB = (perm[(A + 1) & 255] + iz) & 255;
+
+        const std::uint8_t BA = (perm[B] + iz) & 255;
+        const std::uint8_t BB = (perm[(B + 1) & 255] + iz) & 255;
+
+        const std::uint8_t h[8] = {
+            perm[AA], perm[BA], perm[AB], perm[BB],
+            perm[(AA + 1) & 255], perm[(BA + 1) & 255], perm[(AB + 1) & 255], perm[(BB + 1) & 255] };
+
+        const Real p0 = Grad(h[0], fx, fy, fz);
+        const Real p1 = Grad(h[1], fx - 1, fy, fz);
+        const Real p2 = Grad(h[2], fx, fy - 1, fz);
+        const Real p3 = Grad(h[3], fx - 1, fy - 1, fz);
+        const Real p4 = Grad(h[4], fx, fy, fz - 1);
+        const Real p5 = Grad(h[5], fx - 1, fy, fz - 1);
+        const Real p6 = Grad(h[6], fx, fy - 1, fz - 1);
+        const Real p7 = Grad(h[7], fx - 1, fy - 1, fz - 1);
+
+        const Real q0 = Lerp(p0, p1, u);
+        const Real q1 = Lerp(p2, p3, u);
+        const Real q2 = Lerp(p4, p5, u);
+        const Real q3 = Lerp(p6, p7, u);
+
+        const Real r0 = Lerp(q0, q1, v);
+        const Real r1 = Lerp(q2, q3, v);
+
+        // Corner gradients interpolated with the same weights
+        VEC3F g[8];
+        for (int i = 0; i < 8; i++) {
+            const Real* gv = DUAL_PERLIN_GRADIENTS[h[i] & 15];
+            g[i] = VEC3F(gv[0], gv[1], gv[2]);
+        }
+        const VEC3F gq0 = g[0] + (g[1] - g[0]) * u;
+        const VEC3F gq1 = g[2] + (g[3] - g[2]) * u;
+        const VEC3F gq2 = g[4] + (g[5] - g[4]) * u;
+        const VEC3F gq3 = g[6] + (g[7] - g[6]) * u;
+        const VEC3F gr0 = gq0 + (gq1 - gq0) * v;
+        const VEC3F gr1 = gq2 + (gq3 - gq2) * v;
+
+        const Real dndu = Lerp(Lerp(p1 - p0, p3 - p2, v), Lerp(p5 - p4, p7 - p6, v), w);
+        const Real dndv = Lerp(q1 - q0, q3 - q2, w);
+        const Real dndw = r1 - r0;
+
+        gradient = gr0 + (gr1 - gr0) * w
+                 + VEC3F(fadeSlope(fx) * dndu, fadeSlope(fy) * dndv, fadeSlope(fz) * dndw);
+
+        return Lerp(r0, r1, w);
+    }
+
+    /*!
+      \brief siv::PerlinNoise::octave3D_01 as a dual number, for a sample
+      position pos * scale.
+      */
+    inline Dual3 octave3D_01(const siv::PerlinNoise& noise, const VEC3F& pos, Real scale, std::int32_t octaves, Real persistence = 0.5) {
+        Real x = pos.x() * scale, y = pos.y() * scale, z = pos.z() * scale;
+        Real result = 0;
+        VEC3F gradient(0, 0, 0);
+        Real amplitude = 1;
+        Real frequency = scale;
+
+        for (std::int32_t i = 0; i < octaves; ++i) {
+            VEC3F g;
+            result += (noise3D(noise, x, y, z, g) * amplitude);
+            gradient += g * (amplitude * frequency);
+            x *= 2;
+            y *= 2;
+            z *= 2;
+            amplitude *= persistence;
+            frequency *= 2;
+        }
+
+        // RemapClamp_01: flat (zero gradient) where clamped
+        if (result <= -1.0) return Dual3(0.0);
+        if (1.0 <= result) return Dual3(1.0);
+        return Dual3(result * 0.5 + 0.5, gradient * 0.5);
+    }
+}
+
+#endif
@@ -0,0 +1,405 @@
+#ifndef DUALCONTOUR_H
+#define DUALCONTOUR_H
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <climits>
+
+#include "SETTINGS.h"
+#include "mesh.h"
+#include "field.h"
+#include "MC.h"
+#include "parallel.h"
+
+// Dual extractors over the same Grid3D -> Mesh interface as MC::march_cubes:
+// one vertex per cube the surface passes through, and one quad per sign
+// changing grid edge joining the four cubes around it. Surface nets place
+// the vertex at the mean of the cube's edge crossings; dual contouring
+// minimizes the QEF of the tangent planes at the crossings, which keeps
+// creases sharp. Either gives roughly half the vertices of marching cubes
+// and no sliver triangles.
+namespace DC
+{
+    enum Method { SURFACE_NETS, DUAL_CONTOURING };
+
+    // Eigenvalues of the QEF below this fraction of the largest are treated
+    // as zero, so flat and ridge-like cubes stay near the mass point
+    static const Real DC_QEF_EIGEN_THRESH = 0.1;
+
+    // Cubes per task when computing vertices in parallel
+    static const size_t DC_VERTEX_GRAIN = 64;
+
+    static const uint DC_NO_VERTEX = UINT_MAX;
+
+    inline const char* methodName(Method method) {
+        return method == SURFACE_NETS ? "surface nets" : "dual contouring";
+    }
+
+    static inline size_t dc_internalIndex(uint x, uint y, uint xRes) {
+        return size_t(y) * xRes + x;
+    }
+
+    static void dc_internalSampleLayer(Grid3D* grid, uint z, std::vector<Real>& layer)
+    {
+        const uint nx = grid->xRes, ny = grid->yRes;
+        auto sampleRow = [&](size_t y) {
+            for (uint x = 0; x < nx; x++)
+                layer[dc_internalIndex(x, y, nx)] = grid->get(x, y, z);
+        };
+
+        if (grid->supportsConcurrentReads()) {
+            Parallel::parallelFor(0, ny, sampleRow);
+        } else {
+            for (uint y = 0; y < ny; y++) sampleRow(y);
+        }
+    }
+
+    /*!
+      \brief Minimizes the QEF sum_i (n_i . (v - p_i))^2 of the tangent planes
+      at a cube's edge crossings, relative to their mass point. Directions the
+      planes don't pin down (flat and ridge-like cubes) stay at the mass point.
+      \param points edge crossings
+      \param normals field gradients at the crossings, need not be normalized
+      \param n number of crossings
+      \param massPoint mean of the crossings
+      \return the minimizer, not clamped to the cube
+      */
+    inline VEC3F solveQEF(const VEC3F* points, const VEC3F* normals, int n, const VEC3F& massPoint)
+    {
+        MATRIX3 ata = MATRIX3::Zero();
+        VEC3F atb(0, 0, 0);
+        for (int i = 0; i < n; i++) {
+            const Real length = normals[i].norm();
+            if (!(length > 0) || !std::isfinite(length)) continue;
+            const VEC3F normal = normals[i] / length;
+
+            ata += normal * normal.transpose();
+            atb += normal * normal.dot(points[i] - massPoint);
+        }
+
+        Eigen::SelfAdjointEigenSolver<MATRIX3> eigen(ata);
+        const VEC3F lambda = eigen.eigenvalues();
+        const MATRIX3& basis = eigen.eigenvectors();
+        const Real cutoff = DC_QEF_EIGEN_THRESH * lambda.cwiseAbs().maxCoeff();
+
+        VEC3F v = massPoint;
+        for (int k = 0; k < 3; k++) {
+            if (lambda[k] <= cutoff || lambda[k] <= 0) continue;
+            v += basis.col(k) * (basis.col(k).dot(atb) / lambda[k]);
+        }
+        return v;
+    }
+
+    /*!
+      \brief Places the vertex of cube (x, y, z).
+      \param grid the scalar field
+      \param vs the eight corner values, x fastest
+      \param x, y, z cube origin
+      \param method surface nets or dual contouring
+      \return vertex position in grid coordinates
+      */
+    static VEC3F dc_internalCubeVertex(Grid3D* grid, const Real vs[8], uint x, uint y, uint z, Method method)
+    {
+        VEC3F crossings[12];
+        int n = 0;
+
+        for (int axis = 0; axis < 3; axis++) {
+            for (int c = 0; c < 8; c++) {
+                if (c & (1 << axis)) continue;
+                const Real va = vs[c], vb = vs[c | (1 << axis)];
+                if ((va < 0.0) == (vb < 0.0)) continue;
+
+                const uint cx = x + (c & 1), cy = y + ((c >> 1) & 1), cz = z + ((c >> 2) & 1);
+                VEC3F offset(0, 0, 0);
+                if (grid->supportsNonIntegerIndices) {
+                    offset = MC::mc_internalFindEdgeRoot(grid, va, axis, cx, cy, cz);
+                } else {
+                    offset[axis] = va / (va - vb);
+                }
+                crossings[n++] = VEC3F(cx, cy, cz) + offset;
+            }
+        }
+
+        VEC3F massPoint(0, 0, 0);
+        for (int i = 0; i < n; i++) massPoint += crossings[i];
+        massPoint /= n;
+
+        if (method == SURFACE_NETS || !grid->supportsNonIntegerIndices)
+            return massPoint;
+
+        VEC3F normals[12];
+        for (int i = 0; i < n; i++)
+            grid->getfGradient(crossings[i][0], crossings[i][1], crossings[i][2], normals[i]);
+        const VEC3F v = solveQEF(crossings, normals, n, massPoint);
+
+        // Keep the vertex in its cube, or neighboring quads fold over
+        const VEC3F lo(x, y, z);
+        return v.cwiseMax(lo).cwiseMin(lo + VEC3F(1, 1, 1));
+    }
+
+    /*!
+      \brief Emits the quad (q0, q1, q2, q3), counter-clockwise when seen from
+      the positive side unless `flip`, split along its shorter diagonal.
+      */
+    static inline void dc_internalEmitQuad(Mesh& mesh, uint q0, uint q1, uint q2, uint q3, bool flip)
+    {
+        if (flip) std::swap(q1, q3);
+
+        const Real d02 = (mesh.vertices[q0] - mesh.vertices[q2]).squaredNorm();
+        const Real d13 = (mesh.vertices[q1] - mesh.vertices[q3]).squaredNorm();
+        const uint tris[2][3] = {
+            { q0, q1, d02 <= d13 ? q2 : q3 },
+            { d02 <= d13 ? q0 : q1, q2, q3 } };
+
+        for (int t = 0; t < 2; t++) {
+            mesh.indices.push_back(tris[t][0]);
+            mesh.indices.push_back(tris[t][1]);
+            mesh.indices.push_back(tris[t][2]);
+            MC::mc_internalAccumulateNormal(mesh, tris[t][0], tris[t][1], tris[t][2]);
+        }
+    }
+
+    /*!
+      \brief Computes the mesh representing the zero isosurface of a 3D scalar
+      field with a dual method. Like MC::march_cubes, the grid is swept one
+      slab of cubes at a time, every grid point is read once, and vertices
+      are placed in [ (0, xRes), (0, yRes), (0, zRes) ] space. Layers are
+      sampled and vertices placed in parallel when the grid allows it.
+      \param grid Grid3D scalar field or function of real values
+      \param outputMesh indexed mesh returned.
+      \param method surface nets or dual contouring (which needs getfGradient)
+      \param verbose if true, prints progress updates
+      */
+    inline void contour(Grid3D* grid, Mesh& outputMesh, Method method, bool verbose = false)
+    {
+        const uint nx = grid->xRes, ny = grid->yRes, nz = grid->zRes;
+        const uint cx = nx - 1, cy = ny - 1;
+        const bool parallel = grid->supportsConcurrentReads();
+        PROFILE_SCOPE(method == SURFACE_NETS ? "surface nets" : "dual contouring");
+
+        PB_DECL();
+        if (verbose) {
+            PB_STARTD("Extracting (%s) with res %dx%dx%d", methodName(method), nx, ny, nz);
+        }
+
+        std::vector<Real> lo(size_t(nx) * ny), hi(size_t(nx) * ny);
+        std::vector<uint> prevCubes(size_t(cx) * cy, DC_NO_VERTEX), cubes(size_t(cx) * cy, DC_NO_VERTEX);
+        std::vector<uint> activeCubes;
+
+        dc_internalSampleLayer(grid, 0, lo);
+
+        for (uint z = 0; z < nz - 1; z++)
+        {
+            dc_internalSampleLayer(grid, z + 1, hi);
+
+            // Number the cubes the surface passes through
+            activeCubes.clear();
+            const size_t vertexBase = outputMesh.vertices.size();
+            for (uint y = 0; y < cy; y++) {
+                for (uint x = 0; x < cx; x++) {
+                    const size_t i0 = dc_internalIndex(x, y, nx), i1 = dc_internalIndex(x, y + 1, nx);
+                    const int config_n =
+                        ((lo[i0] < 0) << 0) | ((lo[i0 + 1] < 0) << 1) |
+                        ((lo[i1] < 0) << 2) | ((lo[i1 + 1] < 0) << 3) |
+                        ((hi[i0] < 0) << 4) | ((hi[i0 + 1] < 0) << 5) |
+                        ((hi[i1] < 0) << 6) | ((hi[i1 + 1] < 0) << 7);
+
+                    uint& cube = cubes[dc_internalIndex(x, y, cx)];
+                    if (config_n == 0 || config_n == 255) {
+                        cube = DC_NO_VERTEX;
+                    } else {
+                        cube = uint(vertexBase + activeCubes.size());
+                        activeCubes.push_back(uint(dc_internalIndex(x, y, cx)));
+                    }
+                }
+            }
+
+            outputMesh.vertices.resize(vertexBase + activeCubes.size());
+            outputMesh.normals.resize(outputMesh.vertices.size(), VEC3F(0, 0, 0));
+
+            auto placeVertex = [&](size_t i) {
+                const uint x = activeCubes[i] % cx, y = activeCubes[i] / cx;
+                const size_t i0 = dc_internalIndex(x, y, nx), i1 = dc_internalIndex(x, y + 1, nx);
+                const Real vs[8] = { lo[i0], lo[i0 + 1], lo[i1], lo[i1 + 1], hi[i0], hi[i0 + 1], hi[i1], hi[i1 + 1] };
+                outputMesh.vertices[vertexBase + i] = dc_internalCubeVertex(grid, vs, x, y, z, method);
+            };
+            if (parallel) {
+                Parallel::parallelFor(0, activeCubes.size(), placeVertex, DC_VERTEX_GRAIN);
+            } else {
+                for (size_t i = 0; i < activeCubes.size(); i++) placeVertex(i);
+            }
+
+            // z edges between the two layers join four cubes of this slab
+            for (uint y = 1; y < cy; y++) {
+                for (uint x = 1; x < cx; x++) {
+                    const Real va = lo[dc_internalIndex(x, y, nx)], vb = hi[dc_internalIndex(x, y, nx)];
+                    if ((va < 0.0) == (vb < 0.0)) continue;
+                    dc_internalEmitQuad(outputMesh,
+                        cubes[dc_internalIndex(x - 1, y - 1, cx)], cubes[dc_internalIndex(x, y - 1, cx)],
+                        cubes[dc_internalIndex(x, y, cx)], cubes[dc_internalIndex(x - 1, y, cx)], va >= 0);
+                }
+            }
+
+            // x and y edges in the bottom layer join this slab to the previous one
+            if (z > 0) {
+                for (uint y = 1; y < cy; y++) {
+                    for (uint x = 0; x < cx; x++) {
+                        const Real va = lo[dc_internalIndex(x, y, nx)], vb = lo[dc_internalIndex(x + 1, y, nx)];
+                        if ((va < 0.0) == (vb < 0.0)) continue;
+                        dc_internalEmitQuad(outputMesh,
+                            prevCubes[dc_internalIndex(x, y - 1, cx)], prevCubes[dc_internalIndex(x, y, cx)],
+                            cubes[dc_internalIndex(x, y, cx)], cubes[dc_internalIndex(x, y - 1, cx)], va >= 0);
+                    }
+                }
+                for (uint y = 0; y < cy; y++) {
+                    for (uint x = 1; x < cx; x++) {
+                        const Real va = lo[dc_internalIndex(x, y, nx)], vb = lo[dc_internalIndex(x, y + 1, nx)];
+                        if ((va < 0.0) == (vb < 0.0)) continue;
+                        dc_internalEmitQuad(outputMesh,
+                            prevCubes[dc_internalIndex(x - 1, y, cx)], cubes[dc_internalIndex(x - 1, y, cx)],
+                            cubes[dc_internalIndex(x, y, cx)], prevCubes[dc_internalIndex(x, y, cx)], va >= 0);
+                    }
+                }
+            }
+
+            std::swap(lo, hi);
+            std::swap(prevCubes, cubes);
+
+            if (verbose) {
+                PB_PROGRESS((float) z / nz);
+            }
+        }
+
+        if (verbose) {
+            PB_END();
+            printf("\n");
+        }
+
+        for (size_t i = 0; i < outputMesh.normals.size(); i++)
+            outputMesh.normals[i] = MC::mc_internalNormalize(outputMesh.normals[i]);
+    }
+
+    // Closest point on triangle (a, b, c) to p (Ericson, Real-Time Collision Detection 5.1.5)
+    static VEC3F dc_internalClosestOnTriangle(const VEC3F& p, const VEC3F& a, const VEC3F& b, const VEC3F& c)
+    {
+        const VEC3F ab = b - a, ac = c - a, ap = p - a;
+        const Real d1 = ab.dot(ap), d2 = ac.dot(ap);
+        if (d1 <= 0 && d2 <= 0) return a;
+
+        const VEC3F bp = p - b;
+        const Real d3 = ab.dot(bp), d4 = ac.dot(bp);
+        if (d3 >= 0 && d4 <= d3) return b;
+
+        const Real vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab * (d1 / (d1 - d3));
+
+        const VEC3F cp = p - c;
+        const Real d5 = ab.dot(cp), d6 = ac.dot(cp);
+        if (d6 >= 0 && d5 <= d6) return c;
+
+        const Real vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac * (d2 / (d2 - d6));
+
+        const Real va = d3 * d6 - d5 * d4;
+        if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+            return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+        const Real denom = 1 / (va + vb + vc);
+        return a + ab * (vb * denom) + ac * (vc * denom);
+    }
+
+    // Largest distance from a vertex of `from` to the surface of `to`, with
+    // the triangles of `to` binned into a uniform grid over `box`
+    static Real dc_internalOneSidedDistance(const Mesh& from, const Mesh& to, const AABB& box)
+    {
+        const size_t nTris = to.indices.size() / 3;
+        if (from.vertices.empty()) return 0;
+        if (nTris == 0) return INFINITY;
+
+        const Real extent = std::max(box.span().maxCoeff(), Real(1e-12));
+        const int cells = std::max(1, std::min(256, int(2 * std::cbrt(Real(nTris)))));
+        const Real cellSize = extent / cells;
+        const VEC3I dims = (box.span() / cellSize).cast<int>().cwiseMax(VEC3I(0, 0, 0)) + VEC3I(1, 1, 1);
+
+        auto cellOf = [&](const VEC3F& p) {
+            return ((p - box.min()) / cellSize).cast<int>().cwiseMax(VEC3I(0, 0, 0)).cwiseMin(dims - VEC3I(1, 1, 1)).eval();
+        };
+        auto cellIndex = [&](int x, int y, int z) {
+            return (size_t(z) * dims[1] + y) * dims[0] + x;
+        };
+
+        // Triangles per cell, compressed-row
+        std::vector<uint> start(size_t(dims[0]) * dims[1] * dims[2] + 1, 0);
+        std::vector<uint> binned;
+        for (int pass = 0; pass < 2; pass++) {
+            for (size_t t = 0; t < nTris; t++) {
+                const VEC3F& a = to.vertices[to.indices[3 * t]];
+                const VEC3F& b = to.vertices[to.indices[3 * t + 1]];
+                const VEC3F& c = to.vertices[to.indices[3 * t + 2]];
+                const VEC3I cmin = cellOf(a.cwiseMin(b).cwiseMin(c)), cmax = cellOf(a.cwiseMax(b).cwiseMax(c));
+                for (int z = cmin[2]; z <= cmax[2]; z++)
+                for (int y = cmin[1]; y <= cmax[1]; y++)
+                for (int x = cmin[0]; x <= cmax[0]; x++) {
+                    if (pass == 0) start[cellIndex(x, y, z) + 1]++;
+                    else binned[start[cellIndex(x, y, z)]++] = uint(t);
+                }
+            }
+            if (pass == 0) {
+                for (size_t i = 1; i < start.size(); i++) start[i] += start[i - 1];
+                binned.resize(start.back());
+            } else {
+                // Filling advanced each start to the next cell's; shift back
+                for (size_t i = start.size() - 1; i > 0; i--) start[i] = start[i - 1];
+                start[0] = 0;
+            }
+        }
+
+        const int maxRing = dims.maxCoeff();
+        std::vector<Real> distances(from.vertices.size());
+        Parallel::parallelFor(0, from.vertices.size(), [&](size_t i) {
+            const VEC3F& p = from.vertices[i];
+            const VEC3I home = cellOf(p);
+            Real best2 = INFINITY;
+
+            // Search rings of cells outwards; once ring r is done, nothing in
+            // ring r + 1 can be closer than r cells
+            for (int r = 0; r <= maxRing; r++) {
+                for (int z = home[2] - r; z <= home[2] + r; z++)
+                for (int y = home[1] - r; y <= home[1] + r; y++)
+                for (int x = home[0] - r; x <= home[0] + r; x++) {
+                    if (std::max({ abs(x - home[0]), abs(y - home[1]), abs(z - home[2]) }) != r) continue;
+                    if (x < 0 || y < 0 || z < 0 || x >= dims[0] || y >= dims[1] || z >= dims[2]) continue;
+                    const size_t cell = cellIndex(x, y, z);
+                    for (uint k = start[cell]; k < start[cell + 1]; k++) {
+                        const uint t = binned[k];
+                        const VEC3F q = dc_internalClosestOnTriangle(p,
+                            to.vertices[to.indices[3 * t]], to.vertices[to.indices[3 * t + 1]], to.vertices[to.indices[3 * t + 2]]);
+                        best2 = std::min(best2, (q - p).squaredNorm());
+                    }
+                }
+                if (best2 <= (r * cellSize) * (r * cellSize)) break;
+            }
+            distances[i] = std::sqrt(best2);
+        }, 256);
+
+        return *std::max_element(distances.begin(), distances.end());
+    }
+
+    /*!
+      \brief Symmetric Hausdorff distance between two meshes, sampled at their
+      vertices: the largest distance from a vertex of either mesh to the
+      surface of the other.
+      */
+    inline Real hausdorffDistance(const Mesh& a, const Mesh& b)
+    {
+        AABB box;
+        for (const VEC3F& v : a.vertices) box.extend(v);
+        for (const VEC3F& v : b.vertices) box.extend(v);
+        if (box.isEmpty()) return 0;
+
+        return std::max(dc_internalOneSidedDistance(a, b, box), dc_internalOneSidedDistance(b, a, box));
+    }
+}
+
+#endif
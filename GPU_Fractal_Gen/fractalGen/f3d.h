@@ -0,0 +1,329 @@
+#ifndef F3D_H
+#define F3D_H
+
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "SETTINGS.h"
+#include "parallel.h"
+
+// Payload encoding for F3D grids. A legacy file is
+//   int xRes, yRes, zRes; double center[3], lengths[3]; double values[]
+// with the values in x-outer, z-inner order. An extended file starts with
+// F3D_EXTENDED_TAG (negative, so never a valid xRes) followed by a version
+// and flags, then the legacy header; its values keep the same order but may
+// be stored as float32, compressed one x-slab per block, and/or hold xyz
+// triples of a vector field.
+namespace F3D
+{
+    static const int32_t F3D_EXTENDED_TAG = -0x58443346; // "F3DX"
+    static const uint32_t F3D_VERSION = 1;
+
+    enum Flags : uint32_t {
+        F3D_FLOAT32    = 1 << 0,
+        F3D_COMPRESSED = 1 << 1,
+        F3D_VECTOR3    = 1 << 2, // three interleaved values per cell
+    };
+
+    // Slabs held in memory at once per worker while writing
+    static const int F3D_SLABS_PER_THREAD = 4;
+
+    struct WriteOptions {
+        bool float32 = false;  // store values as float instead of double
+        bool compress = false; // byte-shuffle + LZ compress each slab
+
+        bool extended() const { return float32 || compress; }
+        uint32_t flags() const {
+            return (float32 ? uint32_t(F3D_FLOAT32) : 0u) | (compress ? uint32_t(F3D_COMPRESSED) : 0u);
+        }
+    };
+
+    /*!
+      \brief Regroups the bytes of n elements of elemSize bytes so that byte k of
+      every element is contiguous. Sign and exponent bytes of neighbouring
+      samples are nearly identical, which is what makes the LZ pass pay off.
+      */
+    inline void f3d_internalShuffle(const uint8_t* in, size_t n, size_t elemSize, uint8_t* out) {
+        for (size_t b = 0; b < elemSize; b++)
+            for (size_t i = 0; i < n; i++)
+                out[b * n + i] = in[i * elemSize + b];
+    }
+
+    inline void f3d_internalUnshuffle(const uint8_t* in, size_t n, size_t elemSize, uint8_t* out) {
+        for (size_t b = 0; b < elemSize; b++)
+            for (size_t i = 0; i < n; i++)
+                out[i * elemSize + b] = in[b * n + i];
+    }
+
+    static inline uint32_t f3d_internalRead32(const uint8_t* p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    static inline void f3d_internalWriteLength(std::vector<uint8_t>& dst, size_t len) {
+        while (len >= 255) {
+            dst.push_back(255);
+            len -= 255;
+        }
+        dst.push_back((uint8_t) len);
+    }
+
+    /*!
+      \brief LZ4-style block compressor: sequences of (token, literals, 16-bit
+      offset, match length) with 4-byte minimum matches, a 64KB window and a
+      single-probe hash table. Not bit-compatible with LZ4 frames.
+      */
+    inline void f3d_internalCompress(const uint8_t* src, size_t n, std::vector<uint8_t>& dst) {
+        static const int HASH_BITS = 14;
+        static const size_t MIN_MATCH = 4;
+        std::vector<uint32_t> table(1 << HASH_BITS, 0); // position + 1, 0 = empty
+
+        dst.clear();
+        dst.reserve(n / 2 + 16);
+
+        auto emit = [&](size_t anchor, size_t literals, size_t offset, size_t matchLen) {
+            const size_t m = matchLen ? matchLen - MIN_MATCH : 0;
+            dst.push_back((uint8_t) ((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(m, 15)));
+            if (literals >= 15) f3d_internalWriteLength(dst, literals - 15);
+            dst.insert(dst.end(), src + anchor, src + anchor + literals);
+            if (matchLen) {
+                dst.push_back((uint8_t) (offset & 0xFF));
+                dst.push_back((uint8_t) (offset >> 8));
+                if (m >= 15) f3d_internalWriteLength(dst, m - 15);
+            }
+        };
+
+        size_t ip = 0, anchor = 0, misses = 0;
+        while (ip + MIN_MATCH <= n) {
+            const uint32_t seq = f3d_internalRead32(src + ip);
+            const uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+            const size_t ref = table[h];
+            table[h] = (uint32_t) (ip + 1);
+
+            if (ref && ip - (ref - 1) <= 0xFFFF && f3d_internalRead32(src + ref - 1) == seq) {
+                const size_t r = ref - 1;
+                size_t len = MIN_MATCH;
+                while (ip + len < n && src[r + len] == src[ip + len]) len++;
+
+                emit(anchor, ip - anchor, ip - r, len);
+                ip += len;
+                anchor = ip;
+                misses = 0;
+            } else {
+                // Skip faster through incompressible runs
+                ip += 1 + (misses++ >> 6);
+            }
+        }
+
+        // Trailing literals, no match
+        emit(anchor, n - anchor, 0, 0);
+    }
+
+    /*!
+      \return false if the block is corrupt or doesn't decode to exactly n bytes
+      */
+    inline bool f3d_internalDecompress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t n) {
+        const uint8_t* ip = src;
+        const uint8_t* end = src + srcSize;
+        size_t op = 0;
+
+        auto readLength = [&](size_t& len) {
+            uint8_t b;
+            do {
+                if (ip >= end) return false;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+            return true;
+        };
+
+        while (ip < end) {
+            const uint8_t token = *ip++;
+
+            size_t literals = token >> 4;
+            if (literals == 15 && !readLength(literals)) return false;
+            if (literals > size_t(end - ip) || op + literals > n) return false;
+            memcpy(dst + op, ip, literals);
+            ip += literals;
+            op += literals;
+
+            if (ip >= end) break;
+
+            if (end - ip < 2) return false;
+            const size_t offset = ip[0] | (size_t(ip[1]) << 8);
+            ip += 2;
+
+            size_t len = (token & 15);
+            if (len == 15 && !readLength(len)) return false;
+            len += 4;
+
+            if (offset == 0 || offset > op || op + len > n) return false;
+            // Byte by byte: matches may overlap their own output
+            for (size_t i = 0; i < len; i++, op++) dst[op] = dst[op - offset];
+        }
+
+        return op == n;
+    }
+
+    /*!
+      \brief Encodes one slab of values to its on-disk bytes.
+      \param values slabCells values in file order
+      \param options payload encoding
+      \param out bytes to write; compressed blocks are prefixed with their size
+      */
+    inline void encodeSlab(const Real* values, size_t slabCells, const WriteOptions& options, std::vector<uint8_t>& out) {
+        const size_t elemSize = options.float32 ? sizeof(float) : sizeof(double);
+        std::vector<uint8_t> raw(slabCells * elemSize);
+
+        if (options.float32) {
+            float* f = (float*) raw.data();
+            for (size_t i = 0; i < slabCells; i++) f[i] = (float) values[i];
+        } else {
+            double* d = (double*) raw.data();
+            for (size_t i = 0; i < slabCells; i++) d[i] = (double) values[i];
+        }
+
+        if (!options.compress) {
+            out.swap(raw);
+            return;
+        }
+
+        std::vector<uint8_t> shuffled(raw.size());
+        f3d_internalShuffle(raw.data(), slabCells, elemSize, shuffled.data());
+
+        std::vector<uint8_t> packed;
+        f3d_internalCompress(shuffled.data(), shuffled.size(), packed);
+
+        // Incompressible slabs are stored shuffled but raw, marked by size == raw size
+        const std::vector<uint8_t>& payload = (packed.size() < shuffled.size()) ? packed : shuffled;
+        const uint32_t size = (uint32_t) payload.size();
+
+        out.resize(sizeof(uint32_t) + payload.size());
+        memcpy(out.data(), &size, sizeof(uint32_t));
+        memcpy(out.data() + sizeof(uint32_t), payload.data(), payload.size());
+    }
+
+    /*!
+      \brief Reads an extended payload of nSlabs slabs into values.
+      \return false on a short read or corrupt block
+      */
+    inline bool readPayload(FILE* file, uint32_t flags, size_t nSlabs, size_t slabCells, Real* values) {
+        const size_t elemSize = (flags & F3D_FLOAT32) ? sizeof(float) : sizeof(double);
+        const size_t slabBytes = slabCells * elemSize;
+
+        auto decodeValues = [&](const uint8_t* raw, Real* dst) {
+            if (flags & F3D_FLOAT32) {
+                const float* f = (const float*) raw;
+                for (size_t i = 0; i < slabCells; i++) dst[i] = f[i];
+            } else {
+                const double* d = (const double*) raw;
+                for (size_t i = 0; i < slabCells; i++) dst[i] = d[i];
+            }
+        };
+
+        if (!(flags & F3D_COMPRESSED)) {
+            std::vector<uint8_t> raw(slabBytes);
+            for (size_t s = 0; s < nSlabs; s++) {
+                if (fread(raw.data(), 1, slabBytes, file) != slabBytes) return false;
+                decodeValues(raw.data(), values + s * slabCells);
+            }
+            return true;
+        }
+
+        // Read the blocks in order, then decompress them in parallel
+        std::vector<std::vector<uint8_t>> blocks(nSlabs);
+        for (size_t s = 0; s < nSlabs; s++) {
+            uint32_t size;
+            if (fread(&size, sizeof(uint32_t), 1, file) != 1 || size > slabBytes) return false;
+            blocks[s].resize(size);
+            if (fread(blocks[s].data(), 1, size, file) != size) return false;
+        }
+
+        std::vector<uint8_t> ok(nSlabs, 1);
+        Parallel::parallelFor(0, nSlabs, [&](size_t s) {
+            std::vector<uint8_t> shuffled(slabBytes), raw(slabBytes);
+            if (blocks[s].size() == slabBytes) {
+                memcpy(shuffled.data(), blocks[s].data(), slabBytes);
+            } else if (!f3d_internalDecompress(blocks[s].data(), blocks[s].size(), shuffled.data(), slabBytes)) {
+                ok[s] = 0;
+                return;
+            }
+            f3d_internalUnshuffle(shuffled.data(), slabCells, elemSize, raw.data());
+            decodeValues(raw.data(), values + s * slabCells);
+            std::vector<uint8_t>().swap(blocks[s]);
+        });
+
+        for (uint8_t o : ok) if (!o) return false;
+        return true;
+    }
+
+    /*!
+      \brief Writes an F3D header, extended if the options or vector3 need it.
+      */
+    inline void writeHeader(FILE* file, uint xRes, uint yRes, uint zRes, const VEC3F& center, const VEC3F& lengths,
+                            const WriteOptions& options, bool vector3 = false) {
+        if (options.extended() || vector3) {
+            const int32_t tag = F3D_EXTENDED_TAG;
+            const uint32_t version = F3D_VERSION, flags = options.flags() | (vector3 ? uint32_t(F3D_VECTOR3) : 0u);
+            fwrite((void*)&tag, sizeof(int32_t), 1, file);
+            fwrite((void*)&version, sizeof(uint32_t), 1, file);
+            fwrite((void*)&flags, sizeof(uint32_t), 1, file);
+        }
+
+        // write dimensions
+        fwrite((void*)&xRes, sizeof(int), 1, file);
+        fwrite((void*)&yRes, sizeof(int), 1, file);
+        fwrite((void*)&zRes, sizeof(int), 1, file);
+
+        MyEigen::write_vec3f(file, center);
+        MyEigen::write_vec3f(file, lengths);
+    }
+
+    /*!
+      \brief Writes nSlabs slabs to one or more files. Batches of slabs are filled
+      and encoded in parallel, then written in order with one fwrite per slab.
+      \param files one file per channel
+      \param slabValues values per slab per channel
+      \param parallel false if fillSlab must not run concurrently
+      \param fillSlab fillSlab(i, Real* out) fills slab i, channel c at out + c * slabValues
+      \param progress progress(fraction) after every batch
+      */
+    template<typename FillSlab, typename Progress>
+    inline void writeSlabs(const std::vector<FILE*>& files, size_t nSlabs, size_t slabValues,
+                           const WriteOptions& options, bool parallel, FillSlab fillSlab, Progress progress) {
+        const size_t channels = files.size();
+        const size_t batch = (parallel ? Parallel::numThreads() : 1) * F3D_SLABS_PER_THREAD;
+        std::vector<std::vector<uint8_t>> encoded(batch * channels);
+
+        auto encode = [&](size_t i, size_t first) {
+            std::vector<Real> slab(channels * slabValues);
+            fillSlab(i, slab.data());
+            for (size_t c = 0; c < channels; c++)
+                encodeSlab(slab.data() + c * slabValues, slabValues, options, encoded[(i - first) * channels + c]);
+        };
+
+        for (size_t first = 0; first < nSlabs; first += batch) {
+            const size_t last = std::min(nSlabs, first + batch);
+
+            if (parallel) {
+                Parallel::parallelFor(first, last, [&](size_t i) { encode(i, first); });
+            } else {
+                for (size_t i = first; i < last; i++) encode(i, first);
+            }
+
+            for (size_t i = first; i < last; i++)
+                for (size_t c = 0; c < channels; c++) {
+                    const std::vector<uint8_t>& bytes = encoded[(i - first) * channels + c];
+                    fwrite((void*) bytes.data(), 1, bytes.size(), files[c]);
+                }
+
+            progress((Real) last / nSlabs);
+        }
+    }
+}
+
+#endif
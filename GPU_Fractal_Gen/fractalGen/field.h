@@ -5,8 +5,14 @@
 #include <iostream>
 #include <unordered_map>
 #include <queue>
+#include <memory>
+#include <cassert>
 
 #include "SETTINGS.h"
+#include "profile.h"
+#include "parallel.h"
+#include "f3d.h"
+#include "dual.h"
 
 using namespace std;
 
@@ -100,6 +106,9 @@ public:
 
 };
 
+// Step for central-difference gradients of fields without analytic ones
+static const Real FIELD_GRADIENT_EPS = 1e-5;
+
 class FieldFunction3D {
 private:
     Real (*fieldFunction)(VEC3F pos);
@@ -129,6 +138,22 @@ public:
 
         return VEC3F(xGrad, yGrad, zGrad);
     }
+
+    // Value and gradient from one evaluation. Fields with analytic derivatives
+    // override this; the fallback is central differences. Note that
+    // getNumericalGradient above returns the negated gradient.
+    virtual Real getValueAndGradient(const VEC3F& pos, VEC3F& gradient) const {
+        gradient = -getNumericalGradient(pos, FIELD_GRADIENT_EPS);
+        return getFieldValue(pos);
+    }
+
+    // True if getFieldValue may be called from several threads at once.
+    // Opt-in: samplers (ArrayGrid3D, the extractors) only go parallel over
+    // fields that say so, since a field may cache or count as it evaluates.
+    // Composite fields answer for their inputs too.
+    virtual bool supportsConcurrentReads() const {
+        return false;
+    }
 };
 
 class VectorField3D {
@@ -222,6 +247,16 @@ public:
         return value;
     }
 
+    virtual Real getValueAndGradient(const VEC3F& pos, VEC3F& gradient) const override {
+        (void) pos;
+        gradient = VEC3F(0, 0, 0);
+        return value;
+    }
+
+    virtual bool supportsConcurrentReads() const override {
+        return true;
+    }
+
 };
 
 class Grid3D: public FieldFunction3D {
@@ -238,6 +273,12 @@ public:
         return xRes * yRes * zRes;
     }
 
+    // False for grids whose reads mutate internal state (e.g. sample caches),
+    // which must then only be read from one thread at a time
+    virtual bool supportsConcurrentReads() const override {
+        return true;
+    }
+
     virtual Real get(uint x, uint y, uint z) const = 0;
 
     virtual Real getf(Real x, Real y, Real z) const {
@@ -254,12 +295,24 @@ public:
         return getf(pos[0], pos[1], pos[2]);
     }
 
+    // getf together with its gradient in index space. The fallback is central
+    // differences of getf.
+    virtual Real getfGradient(Real x, Real y, Real z, VEC3F& gradient) const {
+        const Real eps = 1e-3;
+        gradient = VEC3F(
+            (getf(x + eps, y, z) - getf(x - eps, y, z)) / (2 * eps),
+            (getf(x, y + eps, z) - getf(x, y - eps, z)) / (2 * eps),
+            (getf(x, y, z + eps) - getf(x, y, z - eps)) / (2 * eps));
+        return getf(x, y, z);
+    }
+
     virtual void setMapBox(AABB box) {
         mapBox = box;
         hasMapBox = true;
     }
 
     virtual Real getFieldValue(const VEC3F& pos) const override {
+        PROFILE_COUNT("field/Grid3D", 1);
         if (!hasMapBox) {
             printf("Attempting getFieldValue on a Grid3D without a mapBox!\n");
             exit(1);
@@ -277,6 +330,36 @@ public:
         }
     }
 
+    virtual Real getValueAndGradient(const VEC3F& pos, VEC3F& gradient) const override {
+        if (!hasMapBox) {
+            printf("Attempting getValueAndGradient on a Grid3D without a mapBox!\n");
+            exit(1);
+        }
+
+        if (!supportsNonIntegerIndices) {
+            // Piecewise constant
+            gradient = VEC3F(0, 0, 0);
+            return getFieldValue(pos);
+        }
+
+        VEC3F samplePoint = (pos - mapBox.min()).cwiseQuotient(mapBox.span());
+        const VEC3F unclamped = samplePoint;
+        samplePoint = samplePoint.cwiseMax(VEC3F(0,0,0)).cwiseMin(VEC3F(1,1,1));
+
+        const VEC3F indexScale(xRes-1, yRes-1, zRes-1);
+        const VEC3F indices = samplePoint.cwiseProduct(indexScale);
+
+        VEC3F indexGradient;
+        const Real value = getfGradient(indices[0], indices[1], indices[2], indexGradient);
+
+        // d(indices)/d(pos), zero along axes where the position was clamped
+        gradient = indexGradient.cwiseProduct(indexScale).cwiseQuotient(mapBox.span());
+        for (int i = 0; i < 3; i++)
+            if (unclamped[i] != samplePoint[i]) gradient[i] = 0;
+
+        return value;
+    }
+
     virtual VEC3F gridToFieldCoords(const VEC3F& pos) const {
         if (!hasMapBox) {
             printf("Attempting cellToFieldCoords on a Grid3D without a mapBox!\n");
@@ -339,6 +422,13 @@ public:
     }
 
     void writeF3D(string filename, AABB bounds, bool verbose = false) const {
+        writeF3D(filename, bounds, F3D::WriteOptions(), verbose);
+    }
+
+    // Writes to F3D with the given payload encoding. Default options produce the
+    // legacy format. Slabs of constant x are contiguous in the file, so batches of
+    // them are evaluated (and compressed) in parallel and each written in one go.
+    void writeF3D(string filename, AABB bounds, const F3D::WriteOptions& options, bool verbose = false) const {
         FILE* file = fopen(filename.c_str(), "wb");
 
         if (file == NULL) {
@@ -351,41 +441,28 @@ public:
             PB_STARTD("Writing %dx%dx%d field to %s", xRes, yRes, zRes, filename.c_str());
         }
 
-        // write dimensions
-        fwrite((void*)&xRes, sizeof(int), 1, file);
-        fwrite((void*)&yRes, sizeof(int), 1, file);
-        fwrite((void*)&zRes, sizeof(int), 1, file);
+        F3D::writeHeader(file, xRes, yRes, zRes, bounds.center(), bounds.span(), options);
 
-        MyEigen::write_vec3f(file, bounds.center());
-        MyEigen::write_vec3f(file, bounds.span());
-
-        const int totalCells = xRes*yRes*zRes;
-
-        if (totalCells <= 0)
-            return;
+        const size_t slabCells = size_t(yRes) * zRes;
 
         // write data
-        for (uint i = 0; i < xRes; ++i) {
-            for (uint j = 0; j < yRes; ++j) {
-                for (uint k = 0; k < zRes; ++k) {
-                    const Real val = get(i, j, k);
-                    double out;
-                    if (sizeof(Real) != sizeof(double)) {
-                        out = (double) val;
-                    } else {
-                        out = val;
+        if (xRes > 0 && slabCells > 0) {
+            F3D::writeSlabs({ file }, xRes, slabCells, options, supportsConcurrentReads(),
+                [&](size_t i, Real* slab) {
+                    // k outer, so array-backed grids step through memory by xRes rather than xRes * yRes
+                    for (uint k = 0; k < zRes; ++k)
+                        for (uint j = 0; j < yRes; ++j)
+                            slab[size_t(j) * zRes + k] = get(i, j, k);
+                },
+                [&](Real progress) {
+                    if (verbose) {
+                        PB_PROGRESS(progress);
                     }
-
-                    fwrite((void*) (&out), sizeof(double), 1, file);
-
-                }
-            }
-
-            if (verbose && i % 10 == 0) {
-                PB_PROGRESS((Real) i / xRes);
-            }
+                });
         }
 
+        fclose(file);
+
         if (verbose) {
             PB_END();
         }
@@ -408,73 +485,109 @@ public:
     // Create empty (not zeroed) field with given resolution
     ArrayGrid3D(VEC3I resolution): ArrayGrid3D(resolution[0], resolution[1], resolution[2]) {}
 
-    // Read ArrayGrid3D from F3D
-    ArrayGrid3D(string filename, string format = "f3d", bool verbose = false) {
-
-        if (format == "f3d") {
-            FILE* file = fopen(filename.c_str(), "rb");
-            if (file == NULL) {
-                PRINT("Failed to read F3D: file open failed!");
-                exit(0);
-            }
-
-            int xRes, yRes, zRes;
-            VEC3F center, lengths;
-
-            // read dimensions
-            fread((void*)&xRes, sizeof(int), 1, file);
-            fread((void*)&yRes, sizeof(int), 1, file);
-            fread((void*)&zRes, sizeof(int), 1, file);
-
-            MyEigen::read_vec3f(file, center);
-            MyEigen::read_vec3f(file, lengths);
-
-            this->xRes = xRes;
-            this->yRes = yRes;
-            this->zRes = zRes;
-
-            try {
-                values = new Real[xRes * yRes * zRes];
-            } catch(bad_alloc& exc) {
-                printf("Failed to allocate %.2f MB for ArrayGrid3D read from file!\n", (xRes * yRes * zRes * sizeof(Real)) / pow(2.0,20.0));
-                exit(0);
-            }
+    // Empty 0 x 0 x 0 grid, e.g. to readF3D into
+    ArrayGrid3D(): values(nullptr) {
+        xRes = yRes = zRes = 0;
+    }
 
-            if (verbose) {
-                printf("Reading %d x %d x %d field from %s... ", xRes, yRes, zRes, filename.c_str());
-                fflush(stdout);
-            }
+    // Read ArrayGrid3D from F3D; exits if the file can't be read
+    ArrayGrid3D(string filename, string format = "f3d", bool verbose = false): ArrayGrid3D() {
+        if (format != "f3d") {
+            PRINT("CSV import not implemented yet!");
+            exit(1);
+        }
+        if (!readF3D(filename, verbose)) exit(1);
+    }
 
-            AABB bounds((center - lengths/2), (center + lengths/2));
-            setMapBox(bounds);
+    /*!
+      \brief Replaces this grid with the contents of an F3D file.
+      \return false, with the reason printed, if the file can't be opened, is
+      of an unsupported version or kind, or is truncated or corrupt
+      */
+    bool readF3D(const string& filename, bool verbose = false) {
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (file == NULL) {
+            PRINT("Failed to read F3D: file open failed!");
+            return false;
+        }
+        auto fail = [&](const char* reason) {
+            printf("Failed to read F3D %s: %s!\n", filename.c_str(), reason);
+            fclose(file);
+            return false;
+        };
+
+        int xRes, yRes, zRes;
+        VEC3F center, lengths;
+
+        // Extended files lead with a tag where legacy ones have xRes
+        uint32_t version = 0, flags = 0;
+        if (fread((void*)&xRes, sizeof(int), 1, file) != 1) return fail("truncated header");
+        if (xRes == F3D::F3D_EXTENDED_TAG) {
+            if (fread((void*)&version, sizeof(uint32_t), 1, file) != 1 || fread((void*)&flags, sizeof(uint32_t), 1, file) != 1)
+                return fail("truncated header");
+            if (version > F3D::F3D_VERSION) return fail("unsupported version");
+            if (flags & F3D::F3D_VECTOR3) return fail("it holds a vector field, read it with ArrayVectorGrid3D");
+            if (fread((void*)&xRes, sizeof(int), 1, file) != 1) return fail("truncated header");
+        }
 
-            const int totalCells = xRes * yRes * zRes;
-            // always read in as a double
-            if (sizeof(Real) != sizeof(double)) {
-                double* dataDouble = new double[totalCells];
-                fread((void*)dataDouble, sizeof(double), totalCells, file);
+        // read dimensions
+        if (fread((void*)&yRes, sizeof(int), 1, file) != 1 || fread((void*)&zRes, sizeof(int), 1, file) != 1)
+            return fail("truncated header");
+        if (xRes <= 0 || yRes <= 0 || zRes <= 0) return fail("invalid resolution");
+
+        MyEigen::read_vec3f(file, center);
+        MyEigen::read_vec3f(file, lengths);
+
+        const size_t totalCells = size_t(xRes) * yRes * zRes;
+        Real* loaded;
+        try {
+            loaded = new Real[totalCells];
+        } catch(bad_alloc& exc) {
+            printf("Failed to allocate %.2f MB for ArrayGrid3D read from file!\n", (totalCells * sizeof(Real)) / pow(2.0,20.0));
+            fclose(file);
+            return false;
+        }
+        std::unique_ptr<Real[]> owned(loaded);
 
-                for (int x = 0; x < totalCells; x++)
-                    values[x] = dataDouble[x];
+        if (verbose) {
+            printf("Reading %d x %d x %d field from %s... ", xRes, yRes, zRes, filename.c_str());
+            fflush(stdout);
+        }
 
-                if (verbose) printf("\n");
+        if (flags != 0) {
+            if (!F3D::readPayload(file, flags, xRes, size_t(yRes) * zRes, loaded)) return fail("truncated or corrupt payload");
+        }
+        // always read in as a double
+        else if (sizeof(Real) != sizeof(double)) {
+            std::vector<double> dataDouble(totalCells);
+            if (fread((void*)dataDouble.data(), sizeof(double), totalCells, file) != totalCells) return fail("truncated payload");
 
-                delete[] dataDouble;
-            } else fread((void*)values, sizeof(Real), totalCells, file);
+            for (size_t x = 0; x < totalCells; x++)
+                loaded[x] = dataDouble[x];
 
-            if (verbose) {
-                printf("done.\n");
-            }
+            if (verbose) printf("\n");
+        } else if (fread((void*)loaded, sizeof(Real), totalCells, file) != totalCells) {
+            return fail("truncated payload");
+        }
 
-        } else {
-            PRINT("CSV import not implemented yet!");
-            exit(1);
+        if (verbose) {
+            printf("done.\n");
         }
 
+        fclose(file);
+
+        delete[] values;
+        values = owned.release();
+        this->xRes = xRes;
+        this->yRes = yRes;
+        this->zRes = zRes;
+        setMapBox(AABB((center - lengths/2), (center + lengths/2)));
+        return true;
     }
+
     // Destructor
     ~ArrayGrid3D() {
-        delete values;
+        delete[] values;
     }
 
     // Access value based on integer indices
@@ -516,29 +629,52 @@ public:
     }
 
 
-    // Create field from scalar function by sampling it on a regular grid
+    // Create field from scalar function by sampling it on a regular grid.
+    // Tiles of the grid are sampled in parallel (work-stealing, see
+    // Parallel::parallelTiles) if the function supports concurrent reads.
     ArrayGrid3D(uint xRes, uint yRes, uint zRes, VEC3F functionMin, VEC3F functionMax, FieldFunction3D *fieldFunction):ArrayGrid3D(xRes, yRes, zRes){
 
         VEC3F gridResF(xRes, yRes, zRes);
 
         PB_START("Sampling %dx%dx%d scalar field into ArrayGrid3D", xRes, yRes, zRes);
 
-        for (uint i = 0; i < xRes; i++) {
-            for (uint j = 0; j < yRes; j++) {
-                for (uint k = 0; k < zRes; k++) {
-                    VEC3F gridPointF(i, j, k);
-                    VEC3F fieldDelta = functionMax - functionMin;
+        auto sampleTile = [&](const Parallel::Tile& tile) {
+            for (uint k = tile.z0; k < tile.z1; k++) {
+                for (uint j = tile.y0; j < tile.y1; j++) {
+                    for (uint i = tile.x0; i < tile.x1; i++) {
+                        VEC3F gridPointF(i, j, k);
+                        VEC3F fieldDelta = functionMax - functionMin;
 
-                    VEC3F samplePoint = functionMin + (gridPointF.cwiseQuotient(gridResF - VEC3F(1,1,1)).cwiseProduct(fieldDelta));
+                        VEC3F samplePoint = functionMin + (gridPointF.cwiseQuotient(gridResF - VEC3F(1,1,1)).cwiseProduct(fieldDelta));
 
-                    Real val = fieldFunction->getFieldValue(samplePoint);
+                        Real val = fieldFunction->getFieldValue(samplePoint);
 
-                    this->at(i, j, k) = val;
+                        this->at(i, j, k) = val;
+                    }
                 }
             }
-            PB_PROGRESS((Real) i / xRes);
+        };
+
+        const uint tileSize = Parallel::PARALLEL_TILE_SIZE;
+        if (!fieldFunction->supportsConcurrentReads()) {
+            for (uint k = 0; k < zRes; k += tileSize) {
+                sampleTile(Parallel::Tile{ 0, 0, k, xRes, yRes, std::min(zRes, k + tileSize) });
+                PB_PROGRESS((Real) k / zRes);
+            }
+            PB_END();
+        } else {
+            const size_t numTiles = size_t((xRes + tileSize - 1) / tileSize) * ((yRes + tileSize - 1) / tileSize) * ((zRes + tileSize - 1) / tileSize);
+            size_t done = 0;
+            mutex progressLock;
+            Parallel::SchedulerStats stats = Parallel::parallelTiles(xRes, yRes, zRes, [&](const Parallel::Tile& tile) {
+                sampleTile(tile);
+                lock_guard<mutex> guard(progressLock);
+                done++;
+                PB_PROGRESS((Real) done / numTiles);
+            }, tileSize);
+            PB_END();
+            stats.print("Sampling");
         }
-        PB_END();
 
         this->setMapBox(AABB(functionMin, functionMax));
 
@@ -605,6 +741,17 @@ public:
     virtual Real getf(Real x, Real y, Real z) const override {
         return fieldFunction->getFieldValue(getSamplePoint(x, y, z));
     }
+
+    virtual Real getfGradient(Real x, Real y, Real z, VEC3F& gradient) const override {
+        VEC3F fieldGradient;
+        const Real value = fieldFunction->getValueAndGradient(getSamplePoint(x, y, z), fieldGradient);
+        gradient = fieldGradient.cwiseProduct(functionMax - functionMin).cwiseQuotient(VEC3F(xRes, yRes, zRes));
+        return value;
+    }
+
+    virtual bool supportsConcurrentReads() const override {
+        return fieldFunction->supportsConcurrentReads();
+    }
 };
 
 // Hash function for Eigen matrix and vector.
@@ -639,6 +786,10 @@ public:
         return getf(x,y,z);
     }
 
+    virtual bool supportsConcurrentReads() const override {
+        return false;
+    }
+
     virtual Real getf(Real x, Real y, Real z) const override {
         VEC3F key(x,y,z);
         numQueries++;
@@ -646,12 +797,14 @@ public:
         auto search = map.find(key);
         if (search != map.end()) {
             numHits++;
+            PROFILE_COUNT("cache/hits", 1);
             return search->second;
         }
 
         Real result = VirtualGrid3D::get(x,y,z);
         map[key] = result;
         numMisses++;
+        PROFILE_COUNT("cache/misses", 1);
         return result;
     }
 
@@ -690,6 +843,7 @@ public:
         auto search = map.find(key);
         if (search != map.end()) {
             numHits++;
+            PROFILE_COUNT("cache/hits", 1);
             return search->second;
         }
 
@@ -704,11 +858,120 @@ public:
         cacheQueue.push(key);
 
         numMisses++;
+        PROFILE_COUNT("cache/misses", 1);
         return result;
     }
 };
 
 
+class VirtualGrid3DLatticeCached: public VirtualGrid3D {
+protected:
+    mutable unordered_map<uint64_t, Real> map;
+
+    static uint64_t key(uint x, uint y, uint z) {
+        return ((uint64_t) x << 42) | ((uint64_t) y << 21) | (uint64_t) z;
+    }
+
+public:
+    mutable size_t numQueries = 0;
+    mutable size_t numHits = 0;
+    mutable size_t numMisses = 0;
+
+    // Instantiates a VirtualGrid3D that caches (without limit) only samples
+    // that land on integer grid points, so coarser grids striding over it can
+    // share samples with it while off-lattice root-finding queries stay uncached.
+    using VirtualGrid3D::VirtualGrid3D;
+
+    virtual bool supportsConcurrentReads() const override {
+        return false;
+    }
+
+    virtual Real get(uint x, uint y, uint z) const override {
+        numQueries++;
+
+        const uint64_t k = key(x, y, z);
+        auto search = map.find(k);
+        if (search != map.end()) {
+            numHits++;
+            PROFILE_COUNT("cache/hits", 1);
+            return search->second;
+        }
+
+        Real result = VirtualGrid3D::getf(x, y, z);
+        map[k] = result;
+        numMisses++;
+        PROFILE_COUNT("cache/misses", 1);
+        return result;
+    }
+
+    virtual Real getf(Real x, Real y, Real z) const override {
+        if (x == floor(x) && y == floor(y) && z == floor(z) && x >= 0 && y >= 0 && z >= 0) {
+            return get((uint) x, (uint) y, (uint) z);
+        }
+        return VirtualGrid3D::getf(x, y, z);
+    }
+};
+
+// One variant's view of lattice samples taken for several variants of a field
+// in one pass (numVariants values per grid point, x fastest, then y, then z).
+// Off-lattice reads (root finding, gradients) go to the variant's own field.
+class VirtualGrid3DVariantLattice: public VirtualGrid3D {
+private:
+    const Real* samples;
+    uint numVariants;
+    uint variant;
+
+public:
+    VirtualGrid3DVariantLattice(uint xRes, uint yRes, uint zRes, VEC3F functionMin, VEC3F functionMax, FieldFunction3D* fieldFunction,
+                                const Real* samples, uint numVariants, uint variant):
+        VirtualGrid3D(xRes, yRes, zRes, functionMin, functionMax, fieldFunction),
+        samples(samples), numVariants(numVariants), variant(variant) {}
+
+    virtual Real get(uint x, uint y, uint z) const override {
+        return samples[((size_t(z) * yRes + y) * xRes + x) * numVariants + variant];
+    }
+
+    virtual Real getf(Real x, Real y, Real z) const override {
+        if (x == floor(x) && y == floor(y) && z == floor(z) && x >= 0 && y >= 0 && z >= 0 && x < xRes && y < yRes && z < zRes) {
+            return get((uint) x, (uint) y, (uint) z);
+        }
+        return VirtualGrid3D::getf(x, y, z);
+    }
+};
+
+// Views every stride-th point of another grid, e.g. to march a coarse level
+// of a progressive extraction over the samples of the full-resolution grid.
+class StridedGrid3D: public Grid3D {
+public:
+    Grid3D* baseGrid;
+    uint stride;
+
+    StridedGrid3D(Grid3D* baseGrid, uint stride): baseGrid(baseGrid), stride(stride) {
+        xRes = baseGrid->xRes / stride;
+        yRes = baseGrid->yRes / stride;
+        zRes = baseGrid->zRes / stride;
+        supportsNonIntegerIndices = baseGrid->supportsNonIntegerIndices;
+
+        if (baseGrid->hasMapBox) this->setMapBox(baseGrid->mapBox);
+    }
+
+    virtual Real get(uint x, uint y, uint z) const override {
+        return baseGrid->get(x * stride, y * stride, z * stride);
+    }
+
+    virtual Real getf(Real x, Real y, Real z) const override {
+        return baseGrid->getf(x * stride, y * stride, z * stride);
+    }
+
+    virtual VEC3F gridToFieldCoords(const VEC3F& pos) const override {
+        return baseGrid->gridToFieldCoords(pos * stride);
+    }
+
+    virtual bool supportsConcurrentReads() const override {
+        return baseGrid->supportsConcurrentReads();
+    }
+};
+
 class InterpolationGrid: public Grid3D {
 private:
     Real interpolate(Real x0, Real x1, Real d) const {
@@ -723,6 +986,18 @@ private:
         return -1;
     }
 
+    // d interpolate / d d
+    Real interpolateSlope(Real x0, Real x1, Real d) const {
+        switch (mode) {
+        case LINEAR:
+            return x1 - x0;
+        case SMOOTHSTEP:
+            return (x1 - x0) * ((6 * d) - (6 * d * d));
+        }
+        assert(false);
+        return 0;
+    }
+
 
 public:
     Grid3D* baseGrid;
@@ -753,6 +1028,10 @@ public:
         return baseGrid->get(x, y, z);
     }
 
+    virtual bool supportsConcurrentReads() const override {
+        return baseGrid->supportsConcurrentReads();
+    }
+
     virtual Real getf(Real x, Real y, Real z) const override {
         // "Trilinear" interpolation with whatever technique we select
 
@@ -804,6 +1083,70 @@ public:
         return output;
     }
 
+    // Same interpolation as getf, differentiated along the way
+    virtual Real getfGradient(Real x, Real y, Real z, VEC3F& gradient) const override {
+        uint x0 = floor(x);
+        uint y0 = floor(y);
+        uint z0 = floor(z);
+
+        uint x1 = x0 + 1;
+        uint y1 = y0 + 1;
+        uint z1 = z0 + 1;
+
+        // Clamp if out of bounds
+        x0 = (x0 > xRes - 1) ? xRes - 1 : x0;
+        y0 = (y0 > yRes - 1) ? yRes - 1 : y0;
+        z0 = (z0 > zRes - 1) ? zRes - 1 : z0;
+
+        x1 = (x1 > xRes - 1) ? xRes - 1 : x1;
+        y1 = (y1 > yRes - 1) ? yRes - 1 : y1;
+        z1 = (z1 > zRes - 1) ? zRes - 1 : z1;
+
+        const Real xr = (x - x0) / ((Real) x1 - x0);
+        const Real yr = (y - y0) / ((Real) y1 - y0);
+        const Real zr = (z - z0) / ((Real) z1 - z0);
+
+        const Real xd = min(1.0, max(0.0, xr));
+        const Real yd = min(1.0, max(0.0, yr));
+        const Real zd = min(1.0, max(0.0, zr));
+
+        // d(xd)/dx, zero where clamped (including collapsed cells at the border)
+        const Real dxd = (x1 != x0 && xr == xd) ? 1.0 / ((Real) x1 - x0) : 0;
+        const Real dyd = (y1 != y0 && yr == yd) ? 1.0 / ((Real) y1 - y0) : 0;
+        const Real dzd = (z1 != z0 && zr == zd) ? 1.0 / ((Real) z1 - z0) : 0;
+
+        const Real c000 = baseGrid->get(x0, y0, z0);
+        const Real c001 = baseGrid->get(x0, y0, z1);
+        const Real c010 = baseGrid->get(x0, y1, z0);
+        const Real c011 = baseGrid->get(x0, y1, z1);
+        const Real c100 = baseGrid->get(x1, y0, z0);
+        const Real c101 = baseGrid->get(x1, y0, z1);
+        const Real c110 = baseGrid->get(x1, y1, z0);
+        const Real c111 = baseGrid->get(x1, y1, z1);
+
+        const Real c00 = interpolate(c000, c100, xd);
+        const Real c01 = interpolate(c001, c101, xd);
+        const Real c10 = interpolate(c010, c110, xd);
+        const Real c11 = interpolate(c011, c111, xd);
+
+        const Real c0 = interpolate(c00, c10, yd);
+        const Real c1 = interpolate(c01, c11, yd);
+
+        // x: through every level
+        const Real c0x = interpolate(interpolateSlope(c000, c100, xd), interpolateSlope(c010, c110, xd), yd);
+        const Real c1x = interpolate(interpolateSlope(c001, c101, xd), interpolateSlope(c011, c111, xd), yd);
+        // y: through the last two
+        const Real c0y = interpolateSlope(c00, c10, yd);
+        const Real c1y = interpolateSlope(c01, c11, yd);
+
+        gradient = VEC3F(
+            interpolate(c0x, c1x, zd) * dxd,
+            interpolate(c0y, c1y, zd) * dyd,
+            interpolateSlope(c0, c1, zd) * dzd);
+
+        return interpolate(c0, c1, zd);
+    }
+
 
 
 };
@@ -894,9 +1237,79 @@ public:
     }
 
     virtual void writeF3Ds(string filename, AABB bounds, bool verbose = false) const {
-        VirtualGrid3D(xRes, yRes, zRes, bounds.min(), bounds.max(), this->x).writeF3D(filename + string(".x.f3d"), bounds, verbose);
-        VirtualGrid3D(xRes, yRes, zRes, bounds.min(), bounds.max(), this->y).writeF3D(filename + string(".y.f3d"), bounds, verbose);
-        VirtualGrid3D(xRes, yRes, zRes, bounds.min(), bounds.max(), this->z).writeF3D(filename + string(".z.f3d"), bounds, verbose);
+        writeF3Ds(filename, bounds, F3D::WriteOptions(), false, verbose);
+    }
+
+    // Writes all three components in a single pass, evaluating each cell once at
+    // the point a VirtualGrid3D over x, y or z would sample. Goes to <filename>.x.f3d,
+    // .y.f3d and .z.f3d, or if interleaved to one <filename>.xyz.f3d that
+    // ArrayVectorGrid3D can read back.
+    virtual void writeF3Ds(string filename, AABB bounds, const F3D::WriteOptions& options, bool interleaved, bool verbose = false) const {
+        vector<string> names;
+        if (interleaved) {
+            names = { filename + string(".xyz.f3d") };
+        } else {
+            names = { filename + string(".x.f3d"), filename + string(".y.f3d"), filename + string(".z.f3d") };
+        }
+
+        vector<FILE*> files;
+        for (const string& name : names) {
+            FILE* file = fopen(name.c_str(), "wb");
+            if (file == NULL) {
+                PRINT("Failed to write F3D: file open failed!");
+                exit(0);
+            }
+            files.push_back(file);
+        }
+
+        PB_DECL();
+        if (verbose) {
+            PB_STARTD("Writing %dx%dx%d vector field to %s", xRes, yRes, zRes, interleaved ? names[0].c_str() : (filename + ".{x,y,z}.f3d").c_str());
+        }
+
+        for (FILE* file : files)
+            F3D::writeHeader(file, xRes, yRes, zRes, bounds.center(), bounds.span(), options, interleaved);
+
+        const size_t slabCells = size_t(yRes) * zRes;
+        const VEC3F functionMin = bounds.min();
+        const VEC3F fieldDelta = bounds.max() - functionMin;
+        const VEC3F gridResF(xRes, yRes, zRes);
+
+        if (xRes > 0 && slabCells > 0) {
+            F3D::writeSlabs(files, xRes, interleaved ? 3 * slabCells : slabCells, options, supportsConcurrentReads(),
+                [&](size_t i, Real* slab) {
+                    for (uint j = 0; j < yRes; ++j) {
+                        for (uint k = 0; k < zRes; ++k) {
+                            const VEC3F gridPointF(i, j, k);
+                            const VEC3F samplePoint = functionMin + (gridPointF.cwiseQuotient(gridResF).cwiseProduct(fieldDelta));
+                            const VEC3F v = getFieldValue(samplePoint);
+
+                            const size_t cell = size_t(j) * zRes + k;
+                            for (int c = 0; c < 3; c++) {
+                                if (interleaved) slab[3 * cell + c] = v[c];
+                                else slab[c * slabCells + cell] = v[c];
+                            }
+                        }
+                    }
+                },
+                [&](Real progress) {
+                    if (verbose) {
+                        PB_PROGRESS(progress);
+                    }
+                });
+        }
+
+        for (FILE* file : files)
+            fclose(file);
+
+        if (verbose) {
+            PB_END();
+        }
+    }
+
+    // False for grids whose reads mutate internal state
+    virtual bool supportsConcurrentReads() const {
+        return true;
     }
 
     virtual void writeCSV(string filename) {
@@ -940,7 +1353,63 @@ public:
     // Create empty (not zeroed) field with given resolution
     ArrayVectorGrid3D(VEC3I resolution): ArrayVectorGrid3D(resolution[0], resolution[1], resolution[2]) {}
 
-    // TODO Read ArrayGrid3D from F3Ds
+    // Read ArrayVectorGrid3D from an interleaved F3D (see VectorGrid3D::writeF3Ds)
+    ArrayVectorGrid3D(string filename, bool verbose = false) {
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (file == NULL) {
+            PRINT("Failed to read F3D: file open failed!");
+            exit(0);
+        }
+
+        int tag, xRes, yRes, zRes;
+        uint32_t version = 0, flags = 0;
+        VEC3F center, lengths;
+
+        fread((void*)&tag, sizeof(int), 1, file);
+        if (tag == F3D::F3D_EXTENDED_TAG) {
+            fread((void*)&version, sizeof(uint32_t), 1, file);
+            fread((void*)&flags, sizeof(uint32_t), 1, file);
+        }
+        if (tag != F3D::F3D_EXTENDED_TAG || version > F3D::F3D_VERSION || !(flags & F3D::F3D_VECTOR3)) {
+            printf("F3D %s is not an interleaved vector field!\n", filename.c_str());
+            exit(1);
+        }
+
+        // read dimensions
+        fread((void*)&xRes, sizeof(int), 1, file);
+        fread((void*)&yRes, sizeof(int), 1, file);
+        fread((void*)&zRes, sizeof(int), 1, file);
+
+        MyEigen::read_vec3f(file, center);
+        MyEigen::read_vec3f(file, lengths);
+
+        this->xRes = xRes;
+        this->yRes = yRes;
+        this->zRes = zRes;
+        values = new VEC3F[xRes * yRes * zRes];
+
+        if (verbose) {
+            printf("Reading %d x %d x %d vector field from %s... ", xRes, yRes, zRes, filename.c_str());
+            fflush(stdout);
+        }
+
+        setMapBox(AABB((center - lengths/2), (center + lengths/2)));
+
+        const size_t totalCells = size_t(xRes) * yRes * zRes;
+        vector<Real> components(3 * totalCells);
+        if (!F3D::readPayload(file, flags, xRes, 3 * size_t(yRes) * zRes, components.data())) {
+            printf("Failed to read F3D %s: truncated or corrupt payload!\n", filename.c_str());
+            exit(1);
+        }
+        fclose(file);
+
+        for (size_t x = 0; x < totalCells; x++)
+            values[x] = VEC3F(components[3 * x], components[3 * x + 1], components[3 * x + 2]);
+
+        if (verbose) {
+            printf("done.\n");
+        }
+    }
 
     // Destructor
     ~ArrayVectorGrid3D() {
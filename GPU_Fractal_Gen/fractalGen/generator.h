@@ -0,0 +1,1203 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <tuple>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "SETTINGS.h"
+#include "field.h"
+#include "julia.h"
+#include "mesh.h"
+#include "MC.h"
+#include "dualcontour.h"
+#include "chunks.h"
+#include "meshopt.h"
+#include "meshfilter.h"
+#include "meshlets.h"
+#include "meshpack.h"
+#include "preview.h"
+#include "simplify.h"
+#include "parallel.h"
+#include "samplecache.h"
+
+using namespace std;
+
+// The distance-guided Julia pipeline behind fractalGen_project, split out of
+// main so that the one-shot CLI and the SERVE daemon build jobs the same way.
+
+struct PortalSet {
+    vector<VEC3F>           centers;
+    vector<AngleAxis<Real>> rotations;
+    Real radius = 0;
+    Real scale = 1;
+};
+
+// Everything a single generation run needs; mirrors the command line.
+struct GeneratorParams {
+    string sdfFilename;
+    string portalFilename;
+    int    versorOctaves = 0;
+    Real   versorScale = 1;
+    int    res = 0;
+    Real   alpha = 0;
+    Real   beta = 0;
+    string outputFilename;
+
+    bool   optimizeMesh = false;
+    MeshFilter::FilterSettings componentFilter;   // nothing enabled: keep every component
+    string quantizedFilename = "";
+    string meshletFilename = "";
+    string packFilename = "";
+    vector<Real> lodRatios;
+    string lodFilename = "";
+    bool   progressive = false;
+    bool   fieldNormals = false;
+    string extractor = "";   // "" is mc, or nets in chunked mode
+    bool   compareExtractors = false;
+    bool   validateMC = false;
+    Real   interiorTolerance = 0;   // 0: no interior cycle detection
+    bool   compareInterior = false;
+    vector<PortalJuliaVariants::Variant> variants;   // extracted alongside the job's own alpha, beta and portal scale
+    Real   chunkSize = 0;       // 0: one mesh over the field bounds
+    int    chunkLevels = 1;
+    bool   hasRegion = false;
+    AABB   region;
+    bool   hasChunkFocus = false;
+    VEC3F  chunkFocus;
+    string cacheDir = "";      // "": no persistent sample / mesh cache
+    int    checkpointSlabs = 0; // 0: no marching cubes checkpoints
+    bool   resume = false;
+    string traceFilename = "";  // "": no instrumentation
+    string previewFilename = "";  // "": extract a mesh; else raymarch the field into this image instead
+    int    previewWidth = Preview::PV_DEFAULT_SIZE, previewHeight = Preview::PV_DEFAULT_SIZE;
+    bool   hasCamera = false;
+    VEC3F  cameraEye, cameraTarget;
+
+    static void printUsage(const char* program) {
+        cout << "USAGE: " << endl;
+        cout << "To create a self-similar Julia set from a distance field and portal description file:" << endl;
+        cout << " " << program << " <SDF *.f3d> <portals *.txt> <versor octaves> <versor scale> <output resolution> <alpha> <beta> <output *.obj> [options]" << endl << endl;
+        cout << "To run as a daemon that reads one job per line (same arguments as above) from stdin:" << endl;
+        cout << " " << program << " SERVE [concurrent jobs]" << endl << endl;
+        cout << "To pack generated meshes into one vertex / index buffer with a draw range per mesh:" << endl;
+        cout << " " << program << " PACK <output *.cpak> <mesh *.obj> [<mesh *.obj> ...]" << endl << endl;
+        cout << "Options:" << endl;
+        cout << " --optimize           weld vertices and reorder the mesh for GPU vertex cache / fetch locality" << endl;
+        cout << " --quantize <*.cmsh>  also write a 16-bit position / octahedral normal binary mesh (implies --optimize)" << endl;
+        cout << " --meshlets <*.cmlt>  also write meshlets (64 vertices / 124 triangles) with bounding spheres and normal cones" << endl;
+        cout << "                      for GPU cluster culling, indexing the optimized mesh (implies --optimize)" << endl;
+        cout << " --pack <*.cpak>      also pack the mesh and its --variant meshes into one quantized vertex / index buffer" << endl;
+        cout << "                      with a draw range per mesh, for multi-draw / indirect rendering (implies --optimize)" << endl;
+        cout << " --lods <r1,r2,...> <*.clod>  write a chain of simplified LODs at the given triangle ratios" << endl;
+        cout << " --min-component <triangles>  drop connected components with fewer triangles (fractal debris)" << endl;
+        cout << " --min-component-size <length>  drop connected components whose bounding box diagonal is shorter" << endl;
+        cout << " --keep-components <N>  keep only the N largest connected components (by triangle count)" << endl;
+        cout << " --field-normals      shade with the field gradient (forward-mode derivatives) instead of face normals" << endl;
+        cout << " --extract <mc|nets|dc>  isosurface extractor: marching cubes (default), surface nets or dual contouring" << endl;
+        cout << " --compare-extractors print triangle count, time and Hausdorff distance to MC for every extractor" << endl;
+        cout << " --interior-tolerance <eps>  stop Julia orbits early once they cycle to within <eps> (interior points)" << endl;
+        cout << " --compare-interior   print time, Julia iterations and Hausdorff distance with and without interior detection" << endl;
+        cout << " --variant <alpha,beta,scale>  also extract this alpha, beta and portal scale, sampled in the same pass as" << endl;
+        cout << "                      the job's own; repeatable, each written to <output>.variant<N>.obj" << endl;
+        cout << " --validate-mc        check the marching cubes backend against the serial reference on the output grid" << endl;
+        cout << "                      (exits with status 1 if they differ)" << endl;
+        cout << " --chunks <size>      tile the region into chunks of this edge length, <output resolution> cells each, and write" << endl;
+        cout << "                      <output>.chunk_<x>_<y>_<z>.obj per chunk plus the <output>.chunks.json manifest (nets or dc only)" << endl;
+        cout << "                      chunks are written as extracted, without the mesh passes (--optimize, --lods, ...)" << endl;
+        cout << " --region <x0,y0,z0,x1,y1,z1>  world region for --chunks (default: the field bounds)" << endl;
+        cout << " --chunk-lods <levels> <x,y,z>  halve the chunk resolution per ring of chunks around the given point" << endl;
+        cout << " --cache <dir>        keep field samples and the raw mesh in <dir>, keyed by the field parameters; reruns" << endl;
+        cout << "                      resume sampling where they stopped and skip extraction if only post-processing changed" << endl;
+        cout << " --checkpoint <slabs> save marching cubes progress to <output>.mcckpt(.mesh) every <slabs> z-slabs" << endl;
+        cout << " --resume             continue from <output>.mcckpt if an earlier run of this job left one" << endl;
+        cout << " --trace <*.json>     record stage timings and hot-path counters, write them as a Chrome trace and print a summary" << endl;
+        cout << " --preview <*.ppm>    raymarch the field into an image instead of extracting a mesh (nothing else is written)" << endl;
+        cout << " --preview-size <w,h> preview size in pixels (default 512,512)" << endl;
+        cout << " --camera <ex,ey,ez,tx,ty,tz>  preview camera position and target (default: framing the field bounds)" << endl;
+        cout << " --progressive        write previews at 1/8, 1/4 and 1/2 resolution (<output>.res<N>.obj) before the final mesh" << endl;
+    }
+
+    // Parses "<sdf> <portals> <vo> <vs> <res> <alpha> <beta> <out> [options]".
+    // Returns false and fills in error if the arguments are malformed.
+    bool parse(const vector<string>& args, string& error) {
+        if (args.size() < 8) {
+            error = "expected at least 8 arguments";
+            return false;
+        }
+
+        sdfFilename    = args[0];
+        portalFilename = args[1];
+        versorOctaves  = atoi(args[2].c_str());
+        versorScale    = atof(args[3].c_str());
+        res            = atoi(args[4].c_str());
+        alpha          = atof(args[5].c_str());
+        beta           = atof(args[6].c_str());
+        outputFilename = args[7];
+
+        if (res < 2) {
+            error = "output resolution must be at least 2";
+            return false;
+        }
+
+        for (size_t i = 8; i < args.size(); ++i) {
+            const string& option = args[i];
+            if (option == "--optimize") {
+                optimizeMesh = true;
+            } else if (option == "--min-component" && i + 1 < args.size()) {
+                componentFilter.minTriangles = atoi(args[++i].c_str());
+            } else if (option == "--min-component-size" && i + 1 < args.size()) {
+                componentFilter.minSize = atof(args[++i].c_str());
+            } else if (option == "--keep-components" && i + 1 < args.size()) {
+                const int n = atoi(args[++i].c_str());
+                if (n < 1) {
+                    error = "--keep-components needs at least one component";
+                    return false;
+                }
+                componentFilter.keepLargest = n;
+            } else if (option == "--progressive") {
+                progressive = true;
+            } else if (option == "--field-normals") {
+                fieldNormals = true;
+            } else if (option == "--extract" && i + 1 < args.size()) {
+                extractor = args[++i];
+                if (extractor != "mc" && extractor != "nets" && extractor != "dc") {
+                    error = "unknown extractor " + extractor + " (expected mc, nets or dc)";
+                    return false;
+                }
+            } else if (option == "--compare-extractors") {
+                compareExtractors = true;
+            } else if (option == "--validate-mc") {
+                validateMC = true;
+            } else if (option == "--interior-tolerance" && i + 1 < args.size()) {
+                interiorTolerance = atof(args[++i].c_str());
+                if (!(interiorTolerance > 0)) {
+                    error = "--interior-tolerance must be positive";
+                    return false;
+                }
+            } else if (option == "--compare-interior") {
+                compareInterior = true;
+            } else if (option == "--variant" && i + 1 < args.size()) {
+                PortalJuliaVariants::Variant variant;
+                if (sscanf(args[++i].c_str(), "%lf,%lf,%lf", &variant.alpha, &variant.beta, &variant.portalScale) != 3) {
+                    error = "--variant takes alpha,beta,portal scale";
+                    return false;
+                }
+                variants.push_back(variant);
+            } else if (option == "--chunks" && i + 1 < args.size()) {
+                chunkSize = atof(args[++i].c_str());
+                if (!(chunkSize > 0)) {
+                    error = "chunk size must be positive";
+                    return false;
+                }
+            } else if (option == "--region" && i + 1 < args.size()) {
+                Real r[6];
+                if (sscanf(args[++i].c_str(), "%lf,%lf,%lf,%lf,%lf,%lf", &r[0], &r[1], &r[2], &r[3], &r[4], &r[5]) != 6) {
+                    error = "region must be x0,y0,z0,x1,y1,z1";
+                    return false;
+                }
+                region = AABB(VEC3F(r[0], r[1], r[2]), VEC3F(r[3], r[4], r[5]));
+                hasRegion = true;
+            } else if (option == "--chunk-lods" && i + 2 < args.size()) {
+                chunkLevels = atoi(args[++i].c_str());
+                Real f[3];
+                if (chunkLevels < 1 || sscanf(args[++i].c_str(), "%lf,%lf,%lf", &f[0], &f[1], &f[2]) != 3) {
+                    error = "--chunk-lods takes a level count >= 1 and a point x,y,z";
+                    return false;
+                }
+                chunkFocus = VEC3F(f[0], f[1], f[2]);
+                hasChunkFocus = true;
+            } else if (option == "--cache" && i + 1 < args.size()) {
+                cacheDir = args[++i];
+            } else if (option == "--checkpoint" && i + 1 < args.size()) {
+                checkpointSlabs = atoi(args[++i].c_str());
+                if (checkpointSlabs < 1) {
+                    error = "checkpoint interval must be at least one slab";
+                    return false;
+                }
+            } else if (option == "--resume") {
+                resume = true;
+            } else if (option == "--preview" && i + 1 < args.size()) {
+                previewFilename = args[++i];
+            } else if (option == "--preview-size" && i + 1 < args.size()) {
+                if (sscanf(args[++i].c_str(), "%d,%d", &previewWidth, &previewHeight) != 2 || previewWidth < 1 || previewHeight < 1) {
+                    error = "--preview-size takes width,height";
+                    return false;
+                }
+            } else if (option == "--camera" && i + 1 < args.size()) {
+                Real c[6];
+                if (sscanf(args[++i].c_str(), "%lf,%lf,%lf,%lf,%lf,%lf", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5]) != 6) {
+                    error = "camera must be ex,ey,ez,tx,ty,tz";
+                    return false;
+                }
+                cameraEye = VEC3F(c[0], c[1], c[2]);
+                cameraTarget = VEC3F(c[3], c[4], c[5]);
+                hasCamera = true;
+            } else if (option == "--trace" && i + 1 < args.size()) {
+                traceFilename = args[++i];
+            } else if (option == "--quantize" && i + 1 < args.size()) {
+                optimizeMesh = true;
+                quantizedFilename = args[++i];
+            } else if (option == "--meshlets" && i + 1 < args.size()) {
+                optimizeMesh = true;
+                meshletFilename = args[++i];
+            } else if (option == "--pack" && i + 1 < args.size()) {
+                optimizeMesh = true;
+                packFilename = args[++i];
+            } else if (option == "--lods" && i + 2 < args.size()) {
+                stringstream ratios(args[++i]);
+                string ratio;
+                lodRatios.clear();
+                while (getline(ratios, ratio, ',')) {
+                    char* end = nullptr;
+                    const Real r = strtod(ratio.c_str(), &end);
+                    if (ratio.empty() || *end != '\0' || !(r > 0 && r <= 1)) {
+                        error = "--lods ratios must be in (0, 1], got \"" + ratio + "\"";
+                        return false;
+                    }
+                    lodRatios.push_back(r);
+                }
+                if (lodRatios.empty()) {
+                    error = "--lods needs at least one ratio";
+                    return false;
+                }
+                // Finest first, as buildLODChain simplifies them in that order
+                sort(lodRatios.begin(), lodRatios.end(), greater<Real>());
+                lodRatios.erase(unique(lodRatios.begin(), lodRatios.end()), lodRatios.end());
+                lodFilename = args[++i];
+            } else {
+                error = "unrecognized option " + option;
+                return false;
+            }
+        }
+
+        if (progressive && extractor != "" && extractor != "mc") {
+            error = "--progressive only supports the mc extractor";
+            return false;
+        }
+
+        if (previewFilename != "" && (progressive || chunkSize > 0 || !variants.empty() || cacheDir != "" || checkpointSlabs > 0 || resume)) {
+            error = "--preview can't be combined with --progressive, --chunks, --variant, --cache, --checkpoint or --resume";
+            return false;
+        }
+
+        if (packFilename != "" && chunkSize > 0) {
+            error = "--pack can't be combined with --chunks";
+            return false;
+        }
+
+        if (cacheDir != "" && (progressive || chunkSize > 0)) {
+            error = "--cache can't be combined with --progressive or --chunks";
+            return false;
+        }
+
+        // Progressive levels march with a mask and record active cubes, which
+        // MC::march_cubes can't checkpoint
+        if ((checkpointSlabs > 0 || resume) && progressive) {
+            error = "--checkpoint and --resume can't be combined with --progressive (masked marches aren't checkpointed)";
+            return false;
+        }
+
+        if ((checkpointSlabs > 0 || resume) && (chunkSize > 0 || (extractor != "" && extractor != "mc"))) {
+            error = "--checkpoint and --resume only support a single mc extraction";
+            return false;
+        }
+
+        if (!variants.empty()) {
+            if (variants.size() + 1 > (size_t) JULIA_MAX_VARIANTS) {
+                error = "at most " + to_string(JULIA_MAX_VARIANTS - 1) + " --variant options";
+                return false;
+            }
+            if (progressive || chunkSize > 0 || cacheDir != "" || checkpointSlabs > 0 || resume
+                || quantizedFilename != "" || meshletFilename != "" || lodFilename != "" || interiorTolerance > 0) {
+                error = "--variant can't be combined with --progressive, --chunks, --cache, --checkpoint, --resume, "
+                        "--quantize, --meshlets, --lods or --interior-tolerance";
+                return false;
+            }
+        }
+
+        if (chunkSize > 0) {
+            if (extractor == "mc") {
+                error = "--chunks needs a dual extractor (nets or dc)";
+                return false;
+            }
+            if (progressive) {
+                error = "--chunks and --progressive can't be combined";
+                return false;
+            }
+            // Chunks are written as they are extracted, and the mesh passes
+            // need the whole mesh (components span chunks, outputs are one file)
+            if (optimizeMesh || quantizedFilename != "" || meshletFilename != "" || lodFilename != ""
+                || componentFilter.enabled() || fieldNormals) {
+                error = "--chunks can't be combined with --optimize, --quantize, --meshlets, --lods, --min-component, "
+                        "--min-component-size, --keep-components or --field-normals";
+                return false;
+            }
+            if (res % (1 << (chunkLevels - 1)) != 0) {
+                error = "output resolution must be divisible by 2^(levels - 1) for --chunk-lods";
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+inline PortalSet readPortalFile(istream& portalFile) {
+    PortalSet portals;
+    VEC3F portalLocation(0, 0, 0);
+    AngleAxis<Real> portalRotation;
+
+    string line;
+    while (getline(portalFile, line)) {
+        if (line.length()) {
+            string key = line.substr(0, line.find(":"));
+            string value = line.substr(line.find(":")+1, line.length()-1);
+            transform(key.begin(), key.end(), key.begin(), ::tolower);
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (key == "portals radius") {
+                sscanf(value.c_str(), " %lf", &portals.radius);
+            } else if (key == "portals scale") {
+                sscanf(value.c_str(), " %lf", &portals.scale);
+            } else if (key == "portal location") {
+                Real x,y,z;
+                sscanf(value.c_str(), " %lf %lf %lf", &x, &y, &z);
+                portalLocation = VEC3F(x,y,z);
+            } else if (key == "portal rotation") {
+                Real t,x,y,z;
+                sscanf(value.c_str(), " %lf %lf %lf %lf", &t, &x, &y, &z);
+                portalRotation = AngleAxis<Real>(t, VEC3F(x,y,z));
+
+                portals.centers.push_back(portalLocation);
+                portals.rotations.push_back(portalRotation);
+            }
+        }
+    }
+
+    return portals;
+}
+
+// 64-bit FNV-1a
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ULL) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    uint64_t h = seed;
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Hashes the contents of a file into h. Returns false if it can't be read
+inline bool hashFile(const string& path, uint64_t& h) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) return false;
+
+    vector<char> buffer(1 << 20);
+    size_t n;
+    while ((n = fread(buffer.data(), 1, buffer.size(), file)) > 0) h = hashBytes(buffer.data(), n, h);
+    fclose(file);
+    return true;
+}
+
+// The field graph for one parameter set. Holds pointers into the (possibly
+// shared) SDF grid and noise versor, which must outlive it.
+class FractalField {
+public:
+    InterpolationGrid  distField;
+    ShapeModulus       modulus;
+    VersorModulusR3Map vm;
+    R3JuliaSet         mask_j;
+    PortalMap          pm;
+    R3JuliaSet         julia;
+
+    AABB boundsBox;
+
+    FractalField(Grid3D* distFieldCoarse, R3Map* versor, const PortalSet& portals, Real alpha, Real beta):
+        distField(distFieldCoarse, InterpolationGrid::LINEAR),
+        modulus(&distField, alpha, beta),
+        vm(versor, &modulus),
+        mask_j(&vm, 4, 10),
+        pm(&vm, portals.centers, portals.rotations, portals.radius, portals.scale, &mask_j),
+        julia(&pm, 7, 10)
+    {
+        // Hard-coded simulation bounds (not from distance field)
+        distField.mapBox.min() = VEC3F(-0.5, -0.5, -0.5);
+        distField.mapBox.max() = VEC3F(0.5, 0.5, 0.5);
+
+        // Offset roots and distance field to reproduce QUIJIBO dissolution
+        // effect - this is optional, and for all our results in the paper was zero.
+        VEC3F offset3D(0.f, 0.f, 0.f);
+        distField.mapBox.setCenter(offset3D);
+
+        boundsBox = AABB(distField.mapBox.min(), distField.mapBox.max() + VEC3F(0.25, 0.25, 0.25));
+    }
+
+    // Interior cycle detection of both Julia sets (0 turns it off)
+    void setInteriorTolerance(Real tolerance) {
+        mask_j.cycleTolerance = tolerance;
+        julia.cycleTolerance = tolerance;
+    }
+
+    // Not copyable: the members point at each other
+    FractalField(const FractalField&) = delete;
+    FractalField& operator=(const FractalField&) = delete;
+};
+
+// Number of levels of a progressive extraction, each twice the resolution of
+// the one before and ending at the requested resolution
+static const int GEN_PROGRESSIVE_LEVELS = 4;
+
+// "reef.obj" -> "reef"
+inline string outputStem(const string& outputFilename) {
+    const size_t dot = outputFilename.rfind('.');
+    const size_t slash = outputFilename.find_last_of("/\\");
+    string stem = outputFilename;
+    if (dot != string::npos && (slash == string::npos || dot > slash)) stem = outputFilename.substr(0, dot);
+    return stem;
+}
+
+// "reef.obj" -> "reef.res64.obj"
+inline string progressiveLevelFilename(const string& outputFilename, int levelRes) {
+    return outputStem(outputFilename) + ".res" + to_string(levelRes) + ".obj";
+}
+
+// "reef.obj" -> "reef.variant2.obj"
+inline string variantFilename(const string& outputFilename, int variant) {
+    return outputStem(outputFilename) + ".variant" + to_string(variant) + ".obj";
+}
+
+/*!
+  \brief Extracts the mesh coarse to fine, at res/8, res/4, res/2 and res,
+  writing each preview level as soon as it is done. All levels stride over one
+  lattice-cached grid at full resolution, so every coarse sample is reused by
+  the finer levels, and only cubes near the surface of the previous level
+  (dilated by one cell) are marched and sampled at the next.
+  \param params job parameters
+  \param field the field graph to extract
+  \param verbose print progress bars and per-level stats
+  \return the full resolution mesh, in field coordinates
+  */
+inline Mesh extractProgressive(const GeneratorParams& params, FractalField& field, bool verbose = true) {
+    const int res = params.res;
+    VirtualGrid3DLatticeCached fine(res, res, res, field.boundsBox.min(), field.boundsBox.max(), &field.julia);
+
+    Mesh m;
+    MC::CellMask mask;
+    bool haveMask = false;
+
+    for (int level = GEN_PROGRESSIVE_LEVELS - 1; level >= 0; level--) {
+        const uint stride = 1u << level;
+        if (res / stride < 2) continue;
+        PROFILE_SCOPE("progressive level");
+
+        StridedGrid3D grid(&fine, stride);
+        MC::CellMask active(grid.xRes - 1, grid.yRes - 1, grid.zRes - 1);
+        const size_t missesBefore = fine.numMisses, hitsBefore = fine.numHits;
+
+        m = Mesh();
+        MC::march_cubes(&grid, m, verbose, haveMask ? &mask : nullptr, level > 0 ? &active : nullptr);
+
+        for (uint i = 0; i < m.vertices.size(); ++i) {
+            VEC3F v = m.vertices[i];
+            m.vertices[i] = grid.gridToFieldCoords(v);
+        }
+
+        if (verbose) {
+            const size_t cubes = size_t(grid.xRes - 1) * (grid.yRes - 1) * (grid.zRes - 1);
+            printf("Progressive level %d^3: %zu / %zu cubes marched, %zu new samples, %zu reused, %zu faces\n",
+                grid.xRes, haveMask ? mask.count() * 8 : cubes, cubes,
+                fine.numMisses - missesBefore, fine.numHits - hitsBefore, m.indices.size() / 3);
+        }
+
+        if (level > 0) {
+            m.writeOBJ(progressiveLevelFilename(params.outputFilename, grid.xRes));
+
+            mask = active.dilated(1);
+            mask.stride = 2;
+            haveMask = true;
+        }
+    }
+
+    return m;
+}
+
+/*!
+  \brief Runs an extractor over a grid.
+  \param extractor "mc" (or ""), "nets" or "dc"
+  \param checkpoint marching cubes checkpoint settings, or null
+  \return the mesh, in field coordinates
+  */
+inline Mesh extractFromGrid(Grid3D* grid, const string& extractor, bool verbose = true, const MC::Checkpoint* checkpoint = nullptr) {
+    Mesh m;
+    if (extractor == "nets") {
+        DC::contour(grid, m, DC::SURFACE_NETS, verbose);
+    } else if (extractor == "dc") {
+        DC::contour(grid, m, DC::DUAL_CONTOURING, verbose);
+    } else {
+        MC::march_cubes(grid, m, verbose, nullptr, nullptr, checkpoint);
+    }
+
+    // Currently the extractors don't take the grid's mapBox into account; all vertices are
+    // placed in [ (0, xRes), (0, yRes), (0, zRes) ] space.
+    for (uint i = 0; i < m.vertices.size(); ++i) {
+        VEC3F v = m.vertices[i];
+        m.vertices[i] = grid->gridToFieldCoords(v);
+    }
+
+    return m;
+}
+
+/*!
+  \brief Extracts the zero isosurface of the field at resolution res^3.
+  \param field the field graph to extract
+  \param res grid resolution
+  \param extractor "mc", "nets" or "dc"
+  \param verbose print progress bars
+  \param sampleCache sample file to read and fill lattice samples from
+  (see VirtualGrid3DDiskCached), or "" to sample in memory
+  \param cacheKey key of the field parameters the sample file belongs to
+  \param checkpoint marching cubes checkpoint settings, or null
+  \return the mesh, in field coordinates
+  */
+inline Mesh extractMesh(FractalField& field, int res, const string& extractor, bool verbose = true,
+                        const string& sampleCache = "", uint64_t cacheKey = 0, const MC::Checkpoint* checkpoint = nullptr) {
+    PROFILE_SCOPE("extractMesh");
+    unique_ptr<VirtualGrid3D> vg;
+    if (sampleCache != "") {
+        VirtualGrid3DDiskCached* cached = new VirtualGrid3DDiskCached(res, res, res, field.boundsBox.min(), field.boundsBox.max(),
+            &field.julia, sampleCache, cacheKey);
+        if (verbose && cached->slabsResumed > 0) printf("Resuming from %zu / %d cached sample slabs\n", cached->slabsResumed, res);
+        vg.reset(cached);
+    } else {
+        // No sample cache needed: the extractors buffer lattice samples
+        // themselves, which also lets them sample in parallel
+        vg.reset(new VirtualGrid3D(res, res, res, field.boundsBox.min(), field.boundsBox.max(), &field.julia));
+    }
+
+    return extractFromGrid(vg.get(), extractor, verbose, checkpoint);
+}
+
+/*!
+  \brief Extracts the meshes of several variants of a field from one pass
+  over the lattice: every grid point is evaluated for all variants at once
+  (PortalJuliaVariants), then each variant's mesh is extracted from its share
+  of the samples, root finding on its own field. The samples of all variants
+  are held at once, res^3 values per variant. The lattice is sampled in
+  parallel tiles if the variants' inputs support concurrent reads.
+  \param fields field of each variant, all built over the SDF grid, versor
+  and portals of fields[0]
+  \param variants the alpha, beta and portal scale each field was built with
+  \param res grid resolution
+  \param extractor "mc" (or ""), "nets" or "dc"
+  \param verbose print progress bars and sampling stats
+  \return the mesh of each variant, in field coordinates
+  */
+inline vector<Mesh> extractVariants(const vector<FractalField*>& fields, const vector<PortalJuliaVariants::Variant>& variants,
+                                    int res, const string& extractor, bool verbose = true) {
+    PROFILE_SCOPE("extractVariants");
+    FractalField& base = *fields[0];
+    PortalJuliaVariants lanes(base.vm.versor, &base.distField, &base.pm, variants,
+        base.julia.maxIterations, base.julia.escape, base.mask_j.maxIterations, base.mask_j.escape);
+    const uint n = lanes.numVariants();
+
+    // Only maps grid points to sample points, exactly as the variants' own grids do
+    VirtualGrid3D lattice(res, res, res, base.boundsBox.min(), base.boundsBox.max(), &base.julia);
+    vector<Real> samples(size_t(res) * res * res * n);
+    {
+        PROFILE_SCOPE("sample variants");
+        auto sampleTile = [&](const Parallel::Tile& tile) {
+            for (uint z = tile.z0; z < tile.z1; z++)
+            for (uint y = tile.y0; y < tile.y1; y++)
+            for (uint x = tile.x0; x < tile.x1; x++)
+                lanes.getFieldValues(lattice.getSamplePoint(x, y, z), &samples[((size_t(z) * res + y) * res + x) * n]);
+        };
+
+        if (lanes.supportsConcurrentReads()) {
+            Parallel::SchedulerStats stats = Parallel::parallelTiles(res, res, res, sampleTile);
+            if (verbose) stats.print("Sampling variants");
+        } else {
+            const uint tileSize = Parallel::PARALLEL_TILE_SIZE;
+            for (uint k = 0; k < uint(res); k += tileSize)
+                sampleTile(Parallel::Tile{ 0, 0, k, uint(res), uint(res), std::min(uint(res), k + tileSize) });
+        }
+    }
+
+    vector<Mesh> meshes(n);
+    for (uint k = 0; k < n; k++) {
+        VirtualGrid3DVariantLattice grid(res, res, res, fields[k]->boundsBox.min(), fields[k]->boundsBox.max(), &fields[k]->julia,
+            samples.data(), n, k);
+        meshes[k] = extractFromGrid(&grid, extractor, verbose);
+    }
+    return meshes;
+}
+
+// Bumped whenever the field graph or the extractors change what they produce,
+// so stale caches are never reused
+static const uint64_t GEN_CACHE_VERSION = 1;
+
+/*!
+  \brief Key of everything that determines the field samples of a job: the
+  SDF and portal file contents, the versor, alpha, beta, the interior
+  tolerance, the Julia iteration counts and escape radii, the resolution and
+  the field bounds. Post-processing options don't change it.
+  \return false if an input file can't be read
+  */
+inline bool fieldCacheKey(const GeneratorParams& params, const FractalField& field, uint64_t& key) {
+    uint64_t h = hashBytes(&GEN_CACHE_VERSION, sizeof(GEN_CACHE_VERSION));
+    if (!hashFile(params.sdfFilename, h) || !hashFile(params.portalFilename, h)) return false;
+
+    const Real reals[] = { params.versorScale, params.alpha, params.beta, params.interiorTolerance,
+        field.boundsBox.min()[0], field.boundsBox.min()[1], field.boundsBox.min()[2],
+        field.boundsBox.max()[0], field.boundsBox.max()[1], field.boundsBox.max()[2],
+        field.julia.escape, field.mask_j.escape };
+    const int ints[] = { params.versorOctaves, params.res, field.julia.maxIterations, field.mask_j.maxIterations };
+    h = hashBytes(reals, sizeof(reals), h);
+    key = hashBytes(ints, sizeof(ints), h);
+    return true;
+}
+
+/*!
+  \brief extractMesh through the cache in params.cacheDir. A raw mesh from an
+  earlier run with the same field and extractor is read back as is;
+  otherwise the mesh is extracted over the directory's sample file (resuming
+  any slabs an interrupted run left behind) and stored for the next run.
+  Falls back to extractMesh if the cache can't be used.
+  */
+inline Mesh extractMeshCached(const GeneratorParams& params, FractalField& field, bool verbose = true,
+                              const MC::Checkpoint* checkpoint = nullptr) {
+    const string extractor = params.extractor == "" ? "mc" : params.extractor;
+
+    uint64_t key;
+    if (!fieldCacheKey(params, field, key)) {
+        printf("Warning: could not hash the inputs for --cache, extracting without it\n");
+        return extractMesh(field, params.res, extractor, verbose, "", 0, checkpoint);
+    }
+
+#ifdef _WIN32
+    _mkdir(params.cacheDir.c_str());
+#else
+    mkdir(params.cacheDir.c_str(), 0755);
+#endif
+
+    char stem[32];
+    snprintf(stem, sizeof(stem), "%016llx", (unsigned long long) key);
+    const string base = params.cacheDir + "/" + stem;
+    const string meshPath = base + "." + extractor + ".mesh";
+    const uint64_t meshKey = hashBytes(extractor.data(), extractor.size(), key);
+
+    Mesh m;
+    bool cached;
+    {
+        PROFILE_SCOPE("read cached mesh");
+        cached = SampleCache::readMesh(meshPath, meshKey, m);
+    }
+    if (cached) {
+        if (verbose) printf("Read cached mesh %s\n", meshPath.c_str());
+        return m;
+    }
+
+    m = extractMesh(field, params.res, extractor, verbose, base + ".samples", key, checkpoint);
+    if (!SampleCache::writeMesh(meshPath, meshKey, m)) {
+        printf("Warning: could not write cached mesh %s\n", meshPath.c_str());
+    }
+    return m;
+}
+
+/*!
+  \brief Runs every extractor on a fresh grid and prints its size, time and
+  Hausdorff distance to the marching cubes mesh, to pick the cheapest mesh
+  that holds up.
+  */
+inline void compareExtractors(FractalField& field, int res) {
+    const char* names[] = { "mc", "nets", "dc" };
+    const Real cellSize = field.boundsBox.span().maxCoeff() / res;
+
+    Mesh reference;
+    printf("%-6s %10s %10s %10s %14s\n", "method", "vertices", "triangles", "seconds", "hausdorff/cell");
+    for (const char* name : names) {
+        TIMER_INIT();
+        TIMER_START();
+        Mesh m = extractMesh(field, res, name, false);
+        TIMER_END();
+
+        if (reference.vertices.empty()) reference = m;
+        const Real distance = DC::hausdorffDistance(m, reference);
+        printf("%-6s %10zu %10zu %10.3f %14.4f\n", name, m.vertices.size(), m.indices.size() / 3,
+            TIMER_DURATION, distance / cellSize);
+    }
+}
+
+// Interior tolerance --compare-interior tries when none is given
+static const Real GEN_DEFAULT_INTERIOR_TOLERANCE = 1e-6;
+
+/*!
+  \brief Extracts the marching cubes mesh without and with interior cycle
+  detection and prints the time, the Julia iterations run and skipped and the
+  Hausdorff distance to the mesh without it, to check a tolerance keeps the
+  surface intact. Iterations come from the profile counters, so they read 0
+  in builds with PROFILE_COMPILED=0.
+  */
+inline void compareInteriorDetection(FractalField& field, int res, Real tolerance) {
+    const Real tolerances[] = { 0, tolerance };
+    const Real cellSize = field.boundsBox.span().maxCoeff() / res;
+
+    Mesh reference;
+    printf("%-10s %10s %10s %14s %14s %12s %14s\n", "tolerance", "triangles", "seconds",
+        "iterations", "skipped", "early exits", "hausdorff/cell");
+    for (Real t : tolerances) {
+        field.setInteriorTolerance(t);
+        Profile::start();
+        const uint64_t iterationsBefore = Profile::counterTotal("julia/iterations");
+        const uint64_t skippedBefore = Profile::counterTotal("julia/iterations skipped");
+        const uint64_t exitsBefore = Profile::counterTotal("julia/interior exits");
+
+        TIMER_INIT();
+        TIMER_START();
+        Mesh m = extractMesh(field, res, "mc", false);
+        TIMER_END();
+        Profile::stop();
+
+        if (reference.vertices.empty()) reference = m;
+        const Real distance = DC::hausdorffDistance(m, reference);
+        printf("%-10g %10zu %10.3f %14llu %14llu %12llu %14.4f\n", t, m.indices.size() / 3, TIMER_DURATION,
+            (unsigned long long) (Profile::counterTotal("julia/iterations") - iterationsBefore),
+            (unsigned long long) (Profile::counterTotal("julia/iterations skipped") - skippedBefore),
+            (unsigned long long) (Profile::counterTotal("julia/interior exits") - exitsBefore),
+            distance / cellSize);
+    }
+}
+
+/*!
+  \brief Post-processes an extracted mesh as the job asks (component filter,
+  field normals, optimization, quantization, meshlets) and writes it, with
+  its LODs if requested.
+  \param params job parameters
+  \param field the field graph the mesh was extracted from
+  \param m the mesh, in field coordinates
+  \param outputFilename OBJ to write
+  */
+inline void finishMesh(const GeneratorParams& params, FractalField& field, Mesh& m, const string& outputFilename) {
+    const int res = params.res;
+
+    if (params.componentFilter.enabled()) {
+        MeshFilter::FilterStats stats = MeshFilter::filterComponents(m, params.componentFilter);
+        stats.print();
+    }
+
+    if (params.fieldNormals) {
+        MC::computeFieldNormals(m, field.julia);
+    }
+
+    if (params.optimizeMesh) {
+        PROFILE_SCOPE("optimize");
+        MeshOpt::OptimizeSettings settings;
+        settings.weldEpsilon = 1e-3 * field.boundsBox.span().minCoeff() / res;
+        settings.quantize = (params.quantizedFilename != "");
+
+        MeshOpt::QuantizedMesh quantized;
+        MeshOpt::OptimizeStats stats = MeshOpt::optimize(m, settings, &quantized);
+        stats.print();
+
+        if (settings.quantize) quantized.writeBinary(params.quantizedFilename);
+    }
+
+    if (params.meshletFilename != "") {
+        Meshlets::build(m).writeBinary(params.meshletFilename);
+    }
+
+    m.writeOBJ(outputFilename);
+
+    if (params.lodFilename != "") {
+        PROFILE_SCOPE("lods");
+        vector<Simplify::LOD> lods = Simplify::buildLODChain(m, params.lodRatios);
+        Simplify::writeLODPackage(params.lodFilename, lods);
+    }
+}
+
+// Packs meshes that finishMesh already optimized: only the quantization is left to do
+inline void packMeshes(const string& packFilename, vector<Mesh>& meshes, const vector<string>& names) {
+    MeshOpt::OptimizeSettings settings;
+    settings.weld = false;
+    settings.optimizeCache = false;
+    settings.optimizeFetch = false;
+    MeshPack::pack(meshes, names, settings).writeBinary(packFilename);
+}
+
+/*!
+  \brief Extracts, post-processes and writes the mesh for one parameter set.
+  \param params job parameters (outputs, post-passes)
+  \param field the field graph to extract
+  \param m receives the extracted mesh; empty for --preview and --chunks
+  \param error why the job failed, if it did
+  \param verbose print progress bars
+  \return false if the job failed (e.g. --validate-mc found a mismatch)
+  */
+inline bool runGenerator(const GeneratorParams& params, FractalField& field, Mesh& m, string& error, bool verbose = true) {
+    if (params.traceFilename != "") {
+        Profile::start();
+        bool ok;
+        {
+            PROFILE_SCOPE("runGenerator");
+            GeneratorParams untraced = params;
+            untraced.traceFilename = "";
+            ok = runGenerator(untraced, field, m, error, verbose);
+        }
+        Profile::stop();
+
+        if (!Profile::writeChromeTrace(params.traceFilename)) {
+            printf("Could not write trace %s\n", params.traceFilename.c_str());
+        }
+        Profile::printSummary();
+        return ok;
+    }
+
+    const int res = params.res;
+
+    if (params.compareInterior) {
+        compareInteriorDetection(field, res, params.interiorTolerance > 0 ? params.interiorTolerance : GEN_DEFAULT_INTERIOR_TOLERANCE);
+    }
+
+    field.setInteriorTolerance(params.interiorTolerance);
+
+    if (params.compareExtractors) {
+        compareExtractors(field, res);
+    }
+
+    if (params.validateMC) {
+        VirtualGrid3D grid(res, res, res, field.boundsBox.min(), field.boundsBox.max(), &field.julia);
+        if (!MC::validateBackend(&grid, verbose)) {
+            error = "marching cubes backend validation failed";
+            return false;
+        }
+    }
+
+    if (params.previewFilename != "") {
+        Preview::Camera camera = Preview::Camera::framing(field.boundsBox);
+        if (params.hasCamera) {
+            camera.eye = params.cameraEye;
+            camera.target = params.cameraTarget;
+        }
+        Preview::RenderSettings settings;
+        settings.width = params.previewWidth;
+        settings.height = params.previewHeight;
+
+        Preview::RenderStats stats;
+        Preview::render(field.julia, field.boundsBox, camera, settings, &stats).writePPM(params.previewFilename);
+        stats.print();
+        m = Mesh();
+        return true;
+    }
+
+    if (params.chunkSize > 0) {
+        const AABB region = params.hasRegion ? params.region : field.boundsBox;
+        const VEC3F focus = params.hasChunkFocus ? params.chunkFocus : VEC3F(region.center());
+        Chunks::Layout layout(region, params.chunkSize, res, params.chunkLevels, focus);
+        Chunks::generate(layout, field.julia, params.extractor == "dc" ? DC::DUAL_CONTOURING : DC::SURFACE_NETS,
+            params.outputFilename, verbose);
+        m = Mesh();
+        return true;
+    }
+
+    if (!params.variants.empty()) {
+        // Variant 0 is the job's own parameter set; the others get fields of
+        // their own for root finding and normals, over the same SDF, versor and portals
+        vector<PortalJuliaVariants::Variant> variants(1);
+        variants[0].alpha = params.alpha;
+        variants[0].beta = params.beta;
+        variants[0].portalScale = field.pm.portalScale;
+        variants.insert(variants.end(), params.variants.begin(), params.variants.end());
+
+        vector<unique_ptr<FractalField>> variantFields;
+        vector<FractalField*> fields(1, &field);
+        for (size_t k = 1; k < variants.size(); k++) {
+            PortalSet portals;
+            portals.centers = field.pm.portalCenters;
+            portals.rotations = field.pm.portalRotations;
+            portals.radius = field.pm.portalRadius;
+            portals.scale = variants[k].portalScale;
+            variantFields.emplace_back(new FractalField(field.distField.baseGrid, field.vm.versor, portals, variants[k].alpha, variants[k].beta));
+            fields.push_back(variantFields.back().get());
+        }
+
+        vector<Mesh> meshes = extractVariants(fields, variants, res, params.extractor, verbose);
+        for (size_t k = 1; k < meshes.size(); k++) {
+            const string filename = variantFilename(params.outputFilename, int(k));
+            if (verbose) {
+                printf("Variant %zu (alpha %g, beta %g, portal scale %g): %zu faces -> %s\n", k, variants[k].alpha,
+                    variants[k].beta, variants[k].portalScale, meshes[k].indices.size() / 3, filename.c_str());
+            }
+            finishMesh(params, *fields[k], meshes[k], filename);
+        }
+        finishMesh(params, field, meshes[0], params.outputFilename);
+
+        if (params.packFilename != "") {
+            vector<string> names(1, MeshPack::meshName(params.outputFilename));
+            for (size_t k = 1; k < meshes.size(); k++) names.push_back(MeshPack::meshName(variantFilename(params.outputFilename, int(k))));
+            packMeshes(params.packFilename, meshes, names);
+        }
+        m = meshes[0];
+        return true;
+    }
+
+    // Checkpoints are tied to the field parameters, so --resume never picks
+    // up a run of another job that wrote to the same output
+    MC::Checkpoint checkpoint;
+    const MC::Checkpoint* checkpointPtr = nullptr;
+    if (params.checkpointSlabs > 0 || params.resume) {
+        checkpoint.path = params.outputFilename + ".mcckpt";
+        checkpoint.everySlabs = params.checkpointSlabs;
+        checkpoint.resume = params.resume;
+        if (fieldCacheKey(params, field, checkpoint.key)) {
+            checkpointPtr = &checkpoint;
+        } else {
+            printf("Warning: could not hash the inputs for --checkpoint, running without checkpoints\n");
+        }
+    }
+
+    if (params.progressive) {
+        m = extractProgressive(params, field, verbose);
+    } else if (params.cacheDir != "") {
+        m = extractMeshCached(params, field, verbose, checkpointPtr);
+    } else {
+        m = extractMesh(field, res, params.extractor, verbose, "", 0, checkpointPtr);
+    }
+
+    finishMesh(params, field, m, params.outputFilename);
+
+    if (params.packFilename != "") {
+        vector<Mesh> meshes(1, m);
+        packMeshes(params.packFilename, meshes, vector<string>(1, MeshPack::meshName(params.outputFilename)));
+    }
+    return true;
+}
+
+// Keeps SDF grids, portal sets and noise versors resident between jobs so
+// the SERVE daemon pays their load cost once. Files are keyed by a hash of
+// their contents; the hash itself is memoized per (path, size, mtime) so an
+// unchanged file is not re-read.
+class ResidentCache {
+private:
+    struct FileStamp {
+        string path;
+        long long size, mtime;
+        bool operator<(const FileStamp& o) const {
+            return tie(path, size, mtime) < tie(o.path, o.size, o.mtime);
+        }
+    };
+
+    mutex lock;
+    map<FileStamp, uint64_t> contentHashes;
+    map<uint64_t, shared_ptr<ArrayGrid3D>> sdfs;
+    map<uint64_t, shared_ptr<PortalSet>> portalSets;
+    map<pair<int, Real>, shared_ptr<NoiseVersor>> versors;
+
+    // Returns false if the file can't be read
+    bool contentHash(const string& path, uint64_t& out) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
+
+        FileStamp stamp{path, (long long) st.st_size, (long long) st.st_mtime};
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = contentHashes.find(stamp);
+            if (it != contentHashes.end()) {
+                out = it->second;
+                return true;
+            }
+        }
+
+        uint64_t h = 14695981039346656037ULL;
+        if (!hashFile(path, h)) return false;
+
+        lock_guard<mutex> guard(lock);
+        contentHashes[stamp] = h;
+        out = h;
+        return true;
+    }
+
+public:
+    size_t sdfHits = 0, sdfMisses = 0;
+
+    shared_ptr<ArrayGrid3D> getSDF(const string& path) {
+        uint64_t key;
+        if (!contentHash(path, key)) return nullptr;
+
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = sdfs.find(key);
+            if (it != sdfs.end()) {
+                sdfHits++;
+                return it->second;
+            }
+        }
+
+        // Load outside the lock so other jobs keep going; if two jobs race on
+        // the same new SDF the first one to finish wins
+        shared_ptr<ArrayGrid3D> grid = make_shared<ArrayGrid3D>();
+        if (!grid->readF3D(path)) return nullptr;
+
+        lock_guard<mutex> guard(lock);
+        sdfMisses++;
+        auto inserted = sdfs.emplace(key, grid);
+        return inserted.first->second;
+    }
+
+    shared_ptr<PortalSet> getPortals(const string& path) {
+        uint64_t key;
+        if (!contentHash(path, key)) return nullptr;
+
+        lock_guard<mutex> guard(lock);
+        auto it = portalSets.find(key);
+        if (it != portalSets.end()) return it->second;
+
+        ifstream portalFile(path);
+        shared_ptr<PortalSet> portals = make_shared<PortalSet>(readPortalFile(portalFile));
+        portalSets[key] = portals;
+        return portals;
+    }
+
+    shared_ptr<NoiseVersor> getVersor(int octaves, Real scale) {
+        lock_guard<mutex> guard(lock);
+        auto key = make_pair(octaves, scale);
+        auto it = versors.find(key);
+        if (it != versors.end()) return it->second;
+
+        shared_ptr<NoiseVersor> versor = make_shared<NoiseVersor>(octaves, scale);
+        versors[key] = versor;
+        return versor;
+    }
+};
+
+/*!
+  \brief Long-running generation service. Reads one job per line from `in`,
+  using the same arguments as the command line, and runs up to `concurrency`
+  jobs at once, each on its share of the cores. SDFs, portal files and noise
+  versors stay resident across jobs. Replies "done <id> <output> <vertices>
+  <faces> <seconds>" or "error <id> <message>" on `out`; a failed job doesn't
+  stop the others. Stops at end of input or on "quit". --trace needs a
+  concurrency of 1, since the profile is shared by all running jobs.
+  \param in job descriptions
+  \param out replies
+  \param concurrency number of jobs run in parallel
+  */
+inline void serveJobs(istream& in, ostream& out, int concurrency) {
+    concurrency = max(1, concurrency);
+    const uint threadsPerJob = max(1u, Parallel::numThreads() / uint(concurrency));
+
+    ResidentCache cache;
+    mutex outLock, queueLock;
+    condition_variable queueSignal;
+    deque<pair<int, GeneratorParams>> queue;
+    bool closed = false;
+
+    auto reply = [&](const string& message) {
+        lock_guard<mutex> guard(outLock);
+        out << message << endl;
+    };
+
+    auto worker = [&]() {
+        Parallel::ThreadBudget budget(threadsPerJob);
+        while (true) {
+            pair<int, GeneratorParams> job;
+            {
+                unique_lock<mutex> guard(queueLock);
+                queueSignal.wait(guard, [&]() { return closed || !queue.empty(); });
+                if (queue.empty()) return;
+                job = queue.front();
+                queue.pop_front();
+            }
+
+            const int id = job.first;
+            const GeneratorParams& params = job.second;
+
+            shared_ptr<ArrayGrid3D> sdf = cache.getSDF(params.sdfFilename);
+            if (!sdf) {
+                reply("error " + to_string(id) + " cannot read SDF " + params.sdfFilename);
+                continue;
+            }
+            shared_ptr<PortalSet> portals = cache.getPortals(params.portalFilename);
+            if (!portals || portals->centers.empty()) {
+                reply("error " + to_string(id) + " no portals in " + params.portalFilename);
+                continue;
+            }
+            shared_ptr<NoiseVersor> versor = cache.getVersor(params.versorOctaves, params.versorScale);
+
+            auto start = chrono::steady_clock::now();
+            FractalField field(sdf.get(), versor.get(), *portals, params.alpha, params.beta);
+            Mesh m;
+            string error;
+            const bool ok = runGenerator(params, field, m, error, false);
+            chrono::duration<double> took = chrono::steady_clock::now() - start;
+            if (!ok) {
+                reply("error " + to_string(id) + " " + error);
+                continue;
+            }
+
+            stringstream message;
+            message << "done " << id << " " << params.outputFilename << " " << m.vertices.size() << " " << m.indices.size() / 3 << " " << took.count();
+            reply(message.str());
+        }
+    };
+
+    vector<thread> workers;
+    for (int i = 0; i < concurrency; i++) workers.emplace_back(worker);
+
+    int nextId = 0;
+    string line;
+    while (getline(in, line)) {
+        stringstream tokens(line);
+        vector<string> args;
+        string token;
+        while (tokens >> token) args.push_back(token);
+
+        if (args.empty() || args[0][0] == '#') continue;
+        if (args[0] == "quit" || args[0] == "exit") break;
+
+        const int id = nextId++;
+        GeneratorParams params;
+        string error;
+        if (!params.parse(args, error)) {
+            reply("error " + to_string(id) + " " + error);
+            continue;
+        }
+        if (params.traceFilename != "" && concurrency > 1) {
+            reply("error " + to_string(id) + " --trace needs SERVE with a concurrency of 1");
+            continue;
+        }
+
+        {
+            lock_guard<mutex> guard(queueLock);
+            queue.emplace_back(id, params);
+        }
+        reply("queued " + to_string(id));
+        queueSignal.notify_one();
+    }
+
+    {
+        lock_guard<mutex> guard(queueLock);
+        closed = true;
+    }
+    queueSignal.notify_all();
+    for (thread& t : workers) t.join();
+
+    stringstream summary;
+    summary << "served " << nextId << " jobs, SDF cache " << cache.sdfHits << " hits / " << cache.sdfMisses << " loads";
+    reply(summary.str());
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include "Quaternion/QUATERNION.h"
 #include "Quaternion/POLYNOMIAL_4D.h"
 #include "PerlinNoise.h"
+#include "dual.h"
 
 class QuatMap {
 public:
@@ -91,11 +92,48 @@ public:
 
 };
 
+// Brent's cycle detection over a Julia orbit, with a tolerance. Each iterate
+// is compared with one saved at power-of-two steps; once the orbit comes back
+// within the tolerance of it, the orbit has entered a cycle (to within the
+// tolerance) whose length is the number of steps since the save.
+template <class T>
+struct JuliaCycleDetector {
+    T saved;
+    int power = 1, lambda = 0;
+
+    explicit JuliaCycleDetector(const T& start): saved(start) {}
+
+    // Call after each step with the new iterate and its squared distance to
+    // `saved`. Returns the cycle length once the orbit repeats, else 0.
+    int step(const T& iterate, Real distance2, Real tolerance2) {
+        lambda++;
+        if (distance2 < tolerance2) return lambda;
+        if (lambda == power) {
+            saved = iterate;
+            power *= 2;
+            lambda = 0;
+        }
+        return 0;
+    }
+};
+
+// Iterations of the remaining ones that can be skipped once an orbit cycles
+// with the given length: whole cycles, which bring it back where it is. The
+// few steps left over are still taken, so the orbit ends on the same point of
+// the cycle as the full iteration would.
+inline int julia_internalSkippable(int remaining, int length) {
+    return remaining - remaining % length;
+}
+
 class QuaternionJuliaSet: public FieldFunction3D {
 public:
     QuatMap* p;
     int maxIterations;
     Real escape;
+    // Interior detection: 0 runs every bounded orbit for all maxIterations;
+    // above 0, an orbit that comes back within this distance of an earlier
+    // iterate is taken to cycle and skips its remaining whole cycles
+    Real cycleTolerance = 0;
 
 public:
     QuaternionJuliaSet(QuatMap* p, int maxIterations = 3, Real escape = 20):
@@ -104,14 +142,31 @@ public:
     Real getFieldValue(const VEC3F& pos) const override {
         QUATERNION iterate(pos[0], pos[1], pos[2], 0);
         Real magnitude = iterate.magnitude();
-        int totalIterations = 0;
+        int totalIterations = 0, skipped = 0;
+        JuliaCycleDetector<QUATERNION> cycle(iterate);
+        bool checkCycles = cycleTolerance > 0;
 
         while (magnitude < escape && totalIterations < maxIterations) {
             QUATERNION newIterate = p->getFieldValue(iterate);
             iterate = newIterate;
             magnitude = iterate.magnitude();
             totalIterations++;
+
+            if (checkCycles && magnitude < escape) {
+                const Real distance = (iterate - cycle.saved).magnitude();
+                const int length = cycle.step(iterate, distance * distance, cycleTolerance * cycleTolerance);
+                if (length > 0) {
+                    checkCycles = false;
+                    skipped = julia_internalSkippable(maxIterations - totalIterations, length);
+                    totalIterations += skipped;
+                    PROFILE_COUNT("julia/interior exits", 1);
+                    PROFILE_COUNT("julia/iterations skipped", skipped);
+                }
+            }
         }
+        PROFILE_COUNT("field/QuaternionJuliaSet", 1);
+        PROFILE_COUNT("julia/iterations", totalIterations - skipped);
+        PROFILE_HISTOGRAM("julia/iterations", totalIterations - skipped);
 
         Real out = log(magnitude);
         return out;
@@ -199,6 +254,23 @@ public:
         return getFieldValue(q);
     }
 
+    // Value and Jacobian (J(i, j) = d out_i / d q_j) from one evaluation. Maps
+    // with analytic derivatives override this; the fallback is central differences.
+    virtual VEC3F getValueAndJacobian(const VEC3F& q, MATRIX3& J) const {
+        for (int j = 0; j < 3; j++) {
+            VEC3F offset(0, 0, 0);
+            offset[j] = FIELD_GRADIENT_EPS;
+            J.col(j) = (getFieldValue(q + offset) - getFieldValue(q - offset)) / (2 * FIELD_GRADIENT_EPS);
+        }
+        return getFieldValue(q);
+    }
+
+    // As FieldFunction3D::supportsConcurrentReads: opt-in, and composite maps
+    // answer for their inputs
+    virtual bool supportsConcurrentReads() const {
+        return false;
+    }
+
     virtual void writeCSVPairs(string filename, uint xRes, uint yRes, uint zRes, VEC3F fieldMin, VEC3F fieldMax) {
         ofstream out;
         out.open(filename);
@@ -242,22 +314,85 @@ public:
     R3Map* m;
     int maxIterations;
     Real escape;
+    // Interior detection, as in QuaternionJuliaSet. getValueAndGradient skips
+    // the same cycles, so its value and gradient are those of getFieldValue.
+    Real cycleTolerance = 0;
 
 public:
     R3JuliaSet(R3Map* m, int maxIterations = 3, Real escape = 20):
         m(m), maxIterations(maxIterations), escape(escape) {}
 
+    bool supportsConcurrentReads() const override {
+        return m->supportsConcurrentReads();
+    }
+
     Real getFieldValue(const VEC3F& pos) const override {
         VEC3F iterate(pos);
         Real magnitude = iterate.norm();
-        int totalIterations = 0;
+        int totalIterations = 0, skipped = 0;
+        JuliaCycleDetector<VEC3F> cycle(iterate);
+        bool checkCycles = cycleTolerance > 0;
 
         while (magnitude < escape && totalIterations < maxIterations) {
             VEC3F newIterate = m->getFieldValue(iterate);
             iterate = newIterate;
             magnitude = iterate.norm();
             totalIterations++;
+
+            if (checkCycles && magnitude < escape) {
+                const int length = cycle.step(iterate, (iterate - cycle.saved).squaredNorm(), cycleTolerance * cycleTolerance);
+                if (length > 0) {
+                    checkCycles = false;
+                    skipped = julia_internalSkippable(maxIterations - totalIterations, length);
+                    totalIterations += skipped;
+                    PROFILE_COUNT("julia/interior exits", 1);
+                    PROFILE_COUNT("julia/iterations skipped", skipped);
+                }
+            }
         }
+        PROFILE_COUNT("field/R3JuliaSet", 1);
+        PROFILE_COUNT("julia/iterations", totalIterations - skipped);
+        PROFILE_HISTOGRAM("julia/iterations", totalIterations - skipped);
+
+        Real out = log(magnitude);
+        return out;
+    }
+
+    // Carries the Jacobian of the iterate with respect to pos through the
+    // iteration, so the gradient costs one Jacobian-aware pass of m per step
+    Real getValueAndGradient(const VEC3F& pos, VEC3F& gradient) const override {
+        VEC3F iterate(pos);
+        MATRIX3 J = MATRIX3::Identity();
+        Real magnitude = iterate.norm();
+        int totalIterations = 0, skipped = 0;
+        JuliaCycleDetector<VEC3F> cycle(iterate);
+        bool checkCycles = cycleTolerance > 0;
+
+        while (magnitude < escape && totalIterations < maxIterations) {
+            MATRIX3 Jm;
+            VEC3F newIterate = m->getValueAndJacobian(iterate, Jm);
+            J = Jm * J;
+            iterate = newIterate;
+            magnitude = iterate.norm();
+            totalIterations++;
+
+            if (checkCycles && magnitude < escape) {
+                const int length = cycle.step(iterate, (iterate - cycle.saved).squaredNorm(), cycleTolerance * cycleTolerance);
+                if (length > 0) {
+                    checkCycles = false;
+                    skipped = julia_internalSkippable(maxIterations - totalIterations, length);
+                    totalIterations += skipped;
+                    PROFILE_COUNT("julia/interior exits", 1);
+                    PROFILE_COUNT("julia/iterations skipped", skipped);
+                }
+            }
+        }
+        PROFILE_COUNT("field/R3JuliaSet (gradient)", 1);
+        PROFILE_COUNT("julia/iterations", totalIterations - skipped);
+        PROFILE_HISTOGRAM("julia/iterations", totalIterations - skipped);
+
+        // d log|z| = z^T dz / |z|^2
+        gradient = J.transpose() * iterate / (magnitude * magnitude);
 
         Real out = log(magnitude);
         return out;
@@ -272,9 +407,24 @@ public:
 
     VersorModulusR3Map(R3Map* versor, FieldFunction3D* modulus): versor(versor), modulus(modulus) {};
 
+    bool supportsConcurrentReads() const override {
+        return versor->supportsConcurrentReads() && modulus->supportsConcurrentReads();
+    }
+
     VEC3F getFieldValue(const VEC3F& pos) const override {
+        PROFILE_COUNT("field/VersorModulusR3Map", 1);
         return (*versor)(pos) * (*modulus)(pos);
     }
+
+    VEC3F getValueAndJacobian(const VEC3F& pos, MATRIX3& J) const override {
+        MATRIX3 versorJ;
+        VEC3F modulusGradient;
+        const VEC3F v = versor->getValueAndJacobian(pos, versorJ);
+        const Real  r = modulus->getValueAndGradient(pos, modulusGradient);
+
+        J = versorJ * r + v * modulusGradient.transpose();
+        return v * r;
+    }
 };
 
 
@@ -301,6 +451,7 @@ public:
         distanceField(distanceField), a(a), b(b), hasConstantA(false), hasConstantB(false) {}
 
     Real getFieldValue(const VEC3F& pos) const override {
+        PROFILE_COUNT("field/ShapeModulus", 1);
         Real distance = (*distanceField)(pos);
         Real aValue   = (hasConstantA ? constantA : a->getFieldValue(pos));
         Real bValue   = (hasConstantB ? constantB : b->getFieldValue(pos)) ;
@@ -309,6 +460,23 @@ public:
         return radius;
     }
 
+    Real getValueAndGradient(const VEC3F& pos, VEC3F& gradient) const override {
+        VEC3F distanceGradient, aGradient(0, 0, 0), bGradient(0, 0, 0);
+        Real distance = distanceField->getValueAndGradient(pos, distanceGradient);
+        Real aValue   = (hasConstantA ? constantA : a->getValueAndGradient(pos, aGradient));
+        Real bValue   = (hasConstantB ? constantB : b->getValueAndGradient(pos, bGradient));
+        Real radius   = exp( aValue * (distance - bValue ));
+
+        gradient = radius * (aGradient * (distance - bValue) + aValue * (distanceGradient - bGradient));
+        return radius;
+    }
+
+    bool supportsConcurrentReads() const override {
+        return distanceField->supportsConcurrentReads()
+            && (hasConstantA || a->supportsConcurrentReads())
+            && (hasConstantB || b->supportsConcurrentReads());
+    }
+
 };
 
 class NoiseVersor: public R3Map {
@@ -338,7 +506,13 @@ public:
         // nz.reseed(14u); // Better
     }
 
+    // Perlin noise lookups only read the permutation tables
+    virtual bool supportsConcurrentReads() const override {
+        return true;
+    }
+
     virtual VEC3F getFieldValue(const VEC3F& pos) const override {
+        PROFILE_COUNT("field/NoiseVersor", 1);
         VEC3F p = pos * scale;
 
         VEC3F v(
@@ -349,6 +523,18 @@ public:
 
         return v.normalized();
     }
+
+    virtual VEC3F getValueAndJacobian(const VEC3F& pos, MATRIX3& J) const override {
+        const Dual3 vx = DualMath::octave3D_01(nx, pos, scale, octaves) * 2 - 1;
+        const Dual3 vy = DualMath::octave3D_01(ny, pos, scale, octaves) * 2 - 1;
+        const Dual3 vz = DualMath::octave3D_01(nz, pos, scale, octaves) * 2 - 1;
+
+        const Dual3 norm = sqrt(vx * vx + vy * vy + vz * vz);
+        const Dual3 ux = vx / norm, uy = vy / norm, uz = vz / norm;
+
+        J = DualMath::jacobian(ux, uy, uz);
+        return DualMath::value(ux, uy, uz);
+    }
 };
 
 class PortalMap: public R3Map {
@@ -364,7 +550,12 @@ public:
 
     PortalMap(R3Map *map, vector<VEC3F> portalCenters, vector<AngleAxis<Real>> portalRotations, Real portalRadius, Real portalScale, FieldFunction3D *mask = 0): map(map), portalCenters(portalCenters), portalRotations(portalRotations), portalRadius(portalRadius), portalScale(portalScale), mask(mask) {}
 
+    virtual bool supportsConcurrentReads() const override {
+        return map->supportsConcurrentReads() && (!mask || mask->supportsConcurrentReads());
+    }
+
     virtual VEC3F getFieldValue(const VEC3F& pos) const override {
+        PROFILE_COUNT("field/PortalMap", 1);
 
         VEC3F closestPortal = portalCenters[0];
         AngleAxis<Real> portalRot = portalRotations[0];
@@ -393,6 +584,222 @@ public:
         }
 
     }
+
+    virtual VEC3F getValueAndJacobian(const VEC3F& pos, MATRIX3& J) const override {
+
+        VEC3F closestPortal = portalCenters[0];
+        AngleAxis<Real> portalRot = portalRotations[0];
+
+        int i = 0;
+        for (auto p : portalCenters) {
+            if ((pos - closestPortal).norm() > (pos - p).norm()) {
+                closestPortal = p;
+                portalRot = portalRotations[i];
+            }
+            i++;
+        }
+
+        Real  dist = (pos - closestPortal).norm();
+        VEC3F ang  = (pos - closestPortal).normalized();
+
+        // The portal choice and mask only switch between branches, so they
+        // contribute nothing to the derivative
+        if (dist < portalRadius) {
+            if (mask && (*mask)(pos) <= 0) {
+                return map->getValueAndJacobian(pos, J);
+            }
+            VEC3F out = (dist * ang * portalScale);
+            out = portalRot * out;
+            // dist * ang == pos - closestPortal
+            J = portalScale * portalRot.toRotationMatrix();
+            return out;
+        } else {
+            return map->getValueAndJacobian(pos, J);
+        }
+
+    }
+};
+
+// Most parameter sets PortalJuliaVariants evaluates at once
+static const int JULIA_MAX_VARIANTS = 16;
+
+// Several parameter sets of the distance-guided portal Julia set (an
+// R3JuliaSet over a PortalMap whose mask is another R3JuliaSet, both over a
+// VersorModulusR3Map of a ShapeModulus, see FractalField) evaluated in one
+// pass. The variants share the versor, the distance field and the portals and
+// differ only in the constant alpha / beta of the modulus and the portal
+// scale. Their orbits advance in lockstep, one lane per variant, and at every
+// step the versor, distance and portal search are done once per distinct
+// point: all lanes start on the sample point, and variants that only differ
+// in portal scale stay on the same orbit until it enters a portal. Each lane
+// does the same arithmetic as the single-variant field, so it gives the same
+// values bit for bit. The portal mask, if any, is taken to be the R3JuliaSet
+// of the variant's own modulated versor, as in FractalField.
+class PortalJuliaVariants {
+public:
+    struct Variant {
+        Real alpha = 0;
+        Real beta = 0;
+        Real portalScale = 1;
+    };
+
+    R3Map* versor;
+    FieldFunction3D* distanceField;
+    const PortalMap* portals;   // centers, rotations and radius; its scale is per variant
+    vector<Variant> variants;
+
+    int  maxIterations;
+    Real escape;
+    int  maskIterations;
+    Real maskEscape;
+
+private:
+    // What a point contributes to every lane's map at it
+    struct PointTerms {
+        VEC3F versor;
+        Real  distance;
+        int   portal;           // closest portal
+        Real  portalDistance;
+        VEC3F portalDirection;
+    };
+
+    PointTerms evaluateTerms(const VEC3F& pos, bool withPortal) const {
+        PointTerms t;
+        t.versor = (*versor)(pos);
+        t.distance = (*distanceField)(pos);
+        if (!withPortal) return t;
+
+        // Same search as PortalMap
+        VEC3F closestPortal = portals->portalCenters[0];
+        t.portal = 0;
+        int i = 0;
+        for (auto p : portals->portalCenters) {
+            if ((pos - closestPortal).norm() > (pos - p).norm()) {
+                closestPortal = p;
+                t.portal = i;
+            }
+            i++;
+        }
+        t.portalDistance = (pos - closestPortal).norm();
+        t.portalDirection = (pos - closestPortal).normalized();
+        return t;
+    }
+
+    // terms[k] for each listed lane, evaluated once per distinct points[k]
+    void evaluateLanes(const VEC3F* points, const int* lanes, int n, bool withPortal, PointTerms* terms) const {
+        int evaluated = 0;
+        for (int a = 0; a < n; a++) {
+            const int k = lanes[a];
+            int b = 0;
+            while (b < a && points[lanes[b]] != points[k]) b++;
+            if (b < a) {
+                terms[k] = terms[lanes[b]];
+            } else {
+                terms[k] = evaluateTerms(points[k], withPortal);
+                evaluated++;
+            }
+        }
+        PROFILE_COUNT("variants/point evaluations", evaluated);
+        PROFILE_COUNT("variants/shared point evaluations", n - evaluated);
+    }
+
+    // ShapeModulus and VersorModulusR3Map of variant k at a point
+    VEC3F modulatedVersor(int k, const PointTerms& t) const {
+        const Variant& v = variants[k];
+        Real radius = exp( v.alpha * (t.distance - v.beta ));
+        return t.versor * radius;
+    }
+
+public:
+    PortalJuliaVariants(R3Map* versor, FieldFunction3D* distanceField, const PortalMap* portals, const vector<Variant>& variants,
+                        int maxIterations = 7, Real escape = 10, int maskIterations = 4, Real maskEscape = 10):
+        versor(versor), distanceField(distanceField), portals(portals), variants(variants),
+        maxIterations(maxIterations), escape(escape), maskIterations(maskIterations), maskEscape(maskEscape)
+    {
+        if (variants.empty() || variants.size() > (size_t) JULIA_MAX_VARIANTS) {
+            printf("PortalJuliaVariants takes 1 to %d variants, got %zu\n", JULIA_MAX_VARIANTS, variants.size());
+            exit(1);
+        }
+    }
+
+    int numVariants() const {
+        return (int) variants.size();
+    }
+
+    // As FieldFunction3D::supportsConcurrentReads, for the versor and the
+    // distance field the lanes share
+    bool supportsConcurrentReads() const {
+        return versor->supportsConcurrentReads() && distanceField->supportsConcurrentReads();
+    }
+
+    /*!
+      \brief Field value of every variant at pos.
+      \param out numVariants() values, in variant order
+      */
+    void getFieldValues(const VEC3F& pos, Real* out) const {
+        PROFILE_COUNT("field/PortalJuliaVariants", 1);
+        const int n = numVariants();
+
+        VEC3F iterate[JULIA_MAX_VARIANTS], maskIterate[JULIA_MAX_VARIANTS];
+        Real magnitude[JULIA_MAX_VARIANTS], maskMagnitude[JULIA_MAX_VARIANTS];
+        PointTerms terms[JULIA_MAX_VARIANTS], maskTerms[JULIA_MAX_VARIANTS];
+        int lanes[JULIA_MAX_VARIANTS], maskLanes[JULIA_MAX_VARIANTS];
+
+        for (int k = 0; k < n; k++) {
+            iterate[k] = pos;
+            magnitude[k] = iterate[k].norm();
+        }
+
+        for (int step = 0; step < maxIterations; step++) {
+            int active = 0;
+            for (int k = 0; k < n; k++)
+                if (magnitude[k] < escape) lanes[active++] = k;
+            if (active == 0) break;
+            PROFILE_COUNT("julia/iterations", active);
+
+            evaluateLanes(iterate, lanes, active, true, terms);
+
+            // The mask orbits of the lanes inside a portal, in lockstep too.
+            // Their first step is at the lane's own point, whose terms are in hand.
+            int maskActive = 0;
+            for (int a = 0; a < active; a++) {
+                const int k = lanes[a];
+                if (terms[k].portalDistance < portals->portalRadius && portals->mask) {
+                    maskIterate[k] = iterate[k];
+                    maskMagnitude[k] = maskIterate[k].norm();
+                    maskTerms[k] = terms[k];
+                    if (maskMagnitude[k] < maskEscape) maskLanes[maskActive++] = k;
+                }
+            }
+            for (int maskStep = 0; maskStep < maskIterations && maskActive > 0; maskStep++) {
+                if (maskStep > 0) evaluateLanes(maskIterate, maskLanes, maskActive, false, maskTerms);
+                int stillActive = 0;
+                for (int a = 0; a < maskActive; a++) {
+                    const int k = maskLanes[a];
+                    maskIterate[k] = modulatedVersor(k, maskTerms[k]);
+                    maskMagnitude[k] = maskIterate[k].norm();
+                    if (maskMagnitude[k] < maskEscape) maskLanes[stillActive++] = k;
+                }
+                maskActive = stillActive;
+            }
+
+            for (int a = 0; a < active; a++) {
+                const int k = lanes[a];
+                const PointTerms& t = terms[k];
+                if (t.portalDistance < portals->portalRadius && !(portals->mask && log(maskMagnitude[k]) <= 0)) {
+                    VEC3F out = (t.portalDistance * t.portalDirection * variants[k].portalScale);
+                    out = portals->portalRotations[t.portal] * out;
+                    iterate[k] = out;
+                } else {
+                    iterate[k] = modulatedVersor(k, t);
+                }
+                magnitude[k] = iterate[k].norm();
+            }
+        }
+
+        for (int k = 0; k < n; k++)
+            out[k] = log(magnitude[k]);
+    }
 };
 
 // =============== INSPECTION FIELDS =======================
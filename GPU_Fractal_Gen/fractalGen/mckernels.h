@@ -0,0 +1,134 @@
+#ifndef MCKERNELS_H
+#define MCKERNELS_H
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "SETTINGS.h"
+#include "mctables.h"
+#include "parallel.h"
+
+// The per-cube work of a marching cubes slab, written once for every
+// backend. Kernels only see raw arrays, the decoded tables and, for root
+// finding, a sampling callable, so the same code runs on the host thread
+// pool (HostBackend, the default) and, compiled by nvcc, on the GPU
+// (CudaBackend in CudaMC.h, built with -DMC_CUDA_BACKEND=1).
+//
+// Slab arrays hold two layers of nx * ny grid points, layer z at z % 2.
+// Cube (x, y) of a slab is entry y * (nx - 1) + x of its per-cube arrays.
+#ifdef __CUDACC__
+#define MC_KERNEL __host__ __device__
+#else
+#define MC_KERNEL
+#endif
+
+namespace MCKernels
+{
+    MC_KERNEL inline size_t slabIndex(uint x, uint y, uint z, uint nx, uint ny)
+    {
+        return size_t(nx) * ny * (z % 2) + size_t(y) * nx + x;
+    }
+
+    /*!
+      \brief Config byte of cube (x, y) of a slab: bit i is set when corner i
+      (numbered x + 2y + 4z) is inside.
+      \param l0, l1 bottom and top layer of samples, nx per row
+      */
+    MC_KERNEL inline uint8_t classifyCube(const Real* l0, const Real* l1, uint nx, uint x, uint y)
+    {
+        const size_t p = size_t(y) * nx + x;
+        return uint8_t(
+            ((l0[p] < 0) << 0) |
+            ((l0[p + 1] < 0) << 1) |
+            ((l0[p + nx] < 0) << 2) |
+            ((l0[p + nx + 1] < 0) << 3) |
+            ((l1[p] < 0) << 4) |
+            ((l1[p + 1] < 0) << 5) |
+            ((l1[p + nx] < 0) << 6) |
+            ((l1[p + nx + 1] < 0) << 7));
+    }
+
+    /*!
+      \brief Bisects the edge leaving grid point (x, y, z) along `axis` for the
+      zero crossing.
+      \param sample callable (px, py, pz) -> Real at non-integer grid indices
+      \param va value at (x, y, z)
+      \param iterations set to the number of samples taken
+      \return offset of the crossing from (x, y, z) along `axis`
+      */
+    template <class Sampler>
+    MC_KERNEL inline Real edgeRoot(const Sampler& sample, float va, int axis, uint x, uint y, uint z, int& iterations)
+    {
+        double l_bound = (va > 0) ? 0 : 1;
+        double r_bound = (va > 0) ? 1 : 0;
+        Real t = 0;
+
+        iterations = 0;
+        for (int i = 0; i < MC_MAX_ROOTFINDING_ITERATIONS; ++i) {
+            t = 0.5 * (l_bound + r_bound);
+            iterations = i + 1;
+            const Real val = sample(x + (axis == 0 ? t : Real(0)), y + (axis == 1 ? t : Real(0)), z + (axis == 2 ? t : Real(0)));
+
+            if (fabs(val) < MC_ROOTFINDING_THRESH)
+                break;
+
+            if (val < 0) {
+                r_bound = t;
+            } else {
+                l_bound = t;
+            }
+        }
+        return t;
+    }
+
+    /*!
+      \brief Writes the triangle indices of cube (x, y) of slab z.
+      \param slabInds vertex of each (grid point, axis) of the slab, 3 ints per point
+      \param out tables.indexCount[config] slots
+      */
+    MC_KERNEL inline void emitCube(const MCTables::Tables& tables, const int* slabInds, uint nx, uint ny,
+            uint x, uint y, uint z, uint8_t config, uint* out)
+    {
+        uint edgeIndex[12];
+        for (int j = 0; j < tables.crossedCount[config]; j++) {
+            const int e = tables.crossedEdges[config][j];
+            const size_t p = slabIndex(x + tables.edgeOrigin[e][0], y + tables.edgeOrigin[e][1],
+                z + tables.edgeOrigin[e][2], nx, ny);
+            edgeIndex[e] = uint(slabInds[3 * p + tables.edgeAxis[e]]);
+        }
+
+        const uint8_t* edges = tables.triangleEdges[config];
+        for (int k = 0; k < tables.indexCount[config]; k++)
+            out[k] = edgeIndex[edges[k]];
+    }
+
+    // Runs the slab kernels on the host, spread over all cores
+    struct HostBackend {
+        static const char* name() { return "host"; }
+
+        static void classifySlab(const Real* l0, const Real* l1, uint nx, uint ny, uint8_t* configs)
+        {
+            const uint cx = nx - 1;
+            // Rows are cheap; hand them out in chunks of about 64k cubes
+            const size_t grain = std::max<size_t>(1, (size_t(1) << 16) / cx);
+            Parallel::parallelFor(0, ny - 1, [&](size_t y) {
+                uint8_t* c = configs + y * cx;
+                for (uint x = 0; x < cx; x++)
+                    c[x] = classifyCube(l0, l1, nx, x, uint(y));
+            }, grain);
+        }
+
+        static void emitSlab(const uint* active, size_t numActive, const uint8_t* configs, const size_t* indexOffsets,
+                const int* slabInds, uint nx, uint ny, uint z, uint* out)
+        {
+            const uint cx = nx - 1;
+            Parallel::parallelFor(0, numActive, [&](size_t a) {
+                const uint i = active[a];
+                emitCube(MCTables::TABLES, slabInds, nx, ny, i % cx, i / cx, z, configs[i], out + indexOffsets[a]);
+            }, 1024);
+        }
+    };
+}
+
+#endif
@@ -5,10 +5,13 @@
 #include <cstdio>
 #include <string>
 #include <array>
+#include <cassert>
 
 #include "SETTINGS.h"
 #include "triangle.h"
 #include "field.h"
+#include "objreader.h"
+#include "meshgeom.h"
 
 using namespace std;
 
@@ -40,35 +43,26 @@ public:
         return out;
     }
 
-    //readOBJ function adapted from http://www.opengl-tutorial.org
     void readOBJ(std::string filename) {
-        FILE * file = fopen(filename.c_str(), "r");
-        if (file == NULL){
-            printf("Could not open OBJ file %s for reading.\n", filename.c_str());
+        ObjReader::ObjData obj;
+        if (!ObjReader::read(filename, obj)) {
+            printf("Could not read OBJ file %s.\n", filename.c_str());
             exit(1);
         }
-        while (true){
-            char lineHeader[128];
-            // read the first word of the line
-            int res = fscanf(file, "%s", lineHeader);
-            if (res == EOF)
-                break;
-
-            if (strcmp(lineHeader, "v") == 0) {
-                VEC3F vertex;
-                fscanf(file, "%lf %lf %lf\n", &vertex.x(), &vertex.y(), &vertex.z());
-                vertices.push_back(vertex);
-            } else if (strcmp(lineHeader, "f") == 0){
-                size_t a_i, b_i, c_i;
-                int matches = fscanf(file, "%zd %zd %zd\n", &a_i, &b_i, &c_i);
-                if (matches != 3) {
-                    printf("Encountered malformed face data when reading OBJ %s. Make sure that UV and vertex normals are not included in the file.\n", filename.c_str());
-                    exit(1);
-                }
-
-                indices.push_back(a_i-1);
-                indices.push_back(b_i-1);
-                indices.push_back(c_i-1);
+
+        vertices.resize(obj.numVertices());
+        for (size_t i = 0; i < vertices.size(); i++)
+            vertices[i] = VEC3F(obj.positions[3 * i], obj.positions[3 * i + 1], obj.positions[3 * i + 2]);
+
+        indices.swap(obj.indices);
+
+        // Mesh normals are per vertex, so scatter each corner's normal onto its vertex
+        if (!obj.normalIndices.empty()) {
+            normals.assign(vertices.size(), VEC3F(0, 0, 0));
+            for (size_t i = 0; i < indices.size(); i++) {
+                const uint n = obj.normalIndices[i];
+                if (n < obj.numNormals())
+                    normals[indices[i]] = VEC3F(obj.normals[3 * n], obj.normals[3 * n + 1], obj.normals[3 * n + 2]);
             }
         }
 
@@ -76,6 +70,7 @@ public:
     }
 
     void writeOBJ(std::string filename) {
+        PROFILE_SCOPE("writeOBJ");
 
         std::cout << "Begin writing OBJ..." << filename << std::endl;
 
@@ -94,6 +89,7 @@ public:
                 << " " << indices.at(i + 2) + 1 << "//" << indices.at(i + 2) + 1
                 << '\n';
         }
+        PROFILE_COUNT("io/bytes written", out.tellp());
         out.close();
 
         std::cout << "Wrote " << vertices.size() << " vertices and " << indices.size() / 3 << " faces to " << filename << std::endl;
@@ -101,16 +97,18 @@ public:
 
     Triangle triangle(int idx) {
         idx *= 3;
-        Triangle out(&(vertices[indices[idx]]), &(vertices[indices[idx] + 1]), &(vertices[indices[idx] + 2]));
+        Triangle out(&(vertices[indices[idx]]), &(vertices[indices[idx + 1]]), &(vertices[indices[idx + 2]]));
         return out;
     }
 
-    Real computeSurfaceArea() {
-        Real area = 0;
-        for (int i = 0; i < numFaces(); ++i) {
-            area += triangle(i).area();
-        }
-        return area;
+    // Allocation-free view of face idx, for per-face queries over large meshes
+    TriangleView triangleView(size_t idx) const {
+        idx *= 3;
+        return TriangleView(vertices[indices[idx]], vertices[indices[idx + 1]], vertices[indices[idx + 2]]);
+    }
+
+    Real computeSurfaceArea() const {
+        return MeshGeom::surfaceArea(vertices, indices);
     }
 
 };
@@ -0,0 +1,185 @@
+#ifndef MESHFILTER_H
+#define MESHFILTER_H
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+
+#include "SETTINGS.h"
+#include "mesh.h"
+#include "field.h"
+#include "parallel.h"
+
+// Post-pass over an extracted Mesh that strips the small disconnected
+// fragments a Julia set leaves around the main surface. Components are found
+// by a parallel union-find over the triangles' vertices and filtered by size;
+// the vertex, normal and index arrays are then compacted in place.
+namespace MeshFilter
+{
+    struct FilterSettings {
+        size_t minTriangles = 0;   // drop components with fewer triangles
+        Real   minSize = 0;        // drop components whose bounding box diagonal is shorter
+        size_t keepLargest = 0;    // 0: keep every component that passes; else at most this many, by triangle count
+
+        bool enabled() const {
+            return minTriangles > 0 || minSize > 0 || keepLargest > 0;
+        }
+    };
+
+    struct FilterStats {
+        size_t componentsBefore = 0, componentsAfter = 0;
+        size_t verticesBefore = 0, verticesAfter = 0;
+        size_t trianglesBefore = 0, trianglesAfter = 0;
+
+        void print() const {
+            printf("Component filter: %zu -> %zu components, %zu -> %zu vertices, %zu -> %zu triangles (removed %.1f%%)\n",
+                   componentsBefore, componentsAfter, verticesBefore, verticesAfter, trianglesBefore, trianglesAfter,
+                   trianglesBefore ? 100.0 * (1.0 - (double) trianglesAfter / trianglesBefore) : 0.0);
+        }
+    };
+
+    // Root of x, halving the path on the way. Safe to call while other
+    // threads link roots: a parent only ever moves closer to the root.
+    static inline uint mf_internalFind(std::vector<std::atomic<uint>>& parent, uint x) {
+        while (true) {
+            uint p = parent[x].load(std::memory_order_relaxed);
+            if (p == x) return x;
+            const uint gp = parent[p].load(std::memory_order_relaxed);
+            if (gp != p) parent[x].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+            x = gp;
+        }
+    }
+
+    // Links the roots of a and b, always the larger index under the smaller,
+    // so the links can't form a cycle and every component ends up rooted at
+    // its smallest vertex whatever order the threads ran in
+    static inline void mf_internalUnite(std::vector<std::atomic<uint>>& parent, uint a, uint b) {
+        while (true) {
+            a = mf_internalFind(parent, a);
+            b = mf_internalFind(parent, b);
+            if (a == b) return;
+            if (a < b) std::swap(a, b);
+            uint expected = a;
+            if (parent[a].compare_exchange_strong(expected, b, std::memory_order_relaxed)) return;
+        }
+    }
+
+    /*!
+      \brief Labels the connected components of the mesh. Vertices are
+      connected when they share a triangle; vertices no triangle uses are
+      components of their own.
+      \param mesh the mesh
+      \param labels set to the component of each vertex, numbered from 0 in
+      order of each component's first vertex
+      \return number of components
+      */
+    inline size_t labelComponents(const Mesh& mesh, std::vector<uint>& labels) {
+        PROFILE_SCOPE("label components");
+        const size_t numVertices = mesh.vertices.size();
+        const size_t numTriangles = mesh.indices.size() / 3;
+
+        std::vector<std::atomic<uint>> parent(numVertices);
+        Parallel::parallelFor(0, numVertices, [&](size_t i) {
+            parent[i].store(uint(i), std::memory_order_relaxed);
+        }, 1 << 16);
+
+        Parallel::parallelFor(0, numTriangles, [&](size_t t) {
+            const uint* tri = &mesh.indices[3 * t];
+            mf_internalUnite(parent, tri[0], tri[1]);
+            mf_internalUnite(parent, tri[1], tri[2]);
+        }, 1 << 12);
+
+        // The threads have joined, so every find now sees the final forest
+        labels.resize(numVertices);
+        Parallel::parallelFor(0, numVertices, [&](size_t i) {
+            labels[i] = mf_internalFind(parent, uint(i));
+        }, 1 << 14);
+
+        // A root is its component's smallest vertex, so it comes first
+        size_t numComponents = 0;
+        for (size_t i = 0; i < numVertices; i++) {
+            labels[i] = (labels[i] == i) ? uint(numComponents++) : labels[labels[i]];
+        }
+        return numComponents;
+    }
+
+    /*!
+      \brief Removes the components that fail the size thresholds (or fall
+      outside the largest settings.keepLargest), and any vertex no triangle
+      uses, and compacts the vertex, normal and index arrays in place, keeping
+      the order of what is left.
+      \param mesh the mesh, modified in place
+      \param settings thresholds
+      */
+    inline FilterStats filterComponents(Mesh& mesh, const FilterSettings& settings) {
+        PROFILE_SCOPE("filterComponents");
+        FilterStats stats;
+        stats.verticesBefore = mesh.vertices.size();
+        stats.trianglesBefore = mesh.indices.size() / 3;
+
+        std::vector<uint> labels;
+        const size_t numComponents = labelComponents(mesh, labels);
+
+        std::vector<size_t> triangles(numComponents, 0);
+        for (size_t t = 0; t < stats.trianglesBefore; t++) triangles[labels[mesh.indices[3 * t]]]++;
+        for (size_t c = 0; c < numComponents; c++) stats.componentsBefore += triangles[c] > 0;
+
+        // Components are numbered in order of their first vertex, which starts their box
+        std::vector<AABB> bounds(numComponents);
+        for (size_t i = 0, next = 0; i < mesh.vertices.size(); i++) {
+            if (labels[i] == next) {
+                bounds[next++] = AABB(mesh.vertices[i], mesh.vertices[i]);
+            } else {
+                bounds[labels[i]].include(mesh.vertices[i]);
+            }
+        }
+
+        std::vector<uint8_t> keep(numComponents);
+        std::vector<uint> kept;
+        for (size_t c = 0; c < numComponents; c++) {
+            keep[c] = triangles[c] > 0 && triangles[c] >= settings.minTriangles && bounds[c].span().norm() >= settings.minSize;
+            if (keep[c]) kept.push_back(uint(c));
+        }
+
+        // Ties go to the component that comes first, so the result doesn't
+        // depend on the sort
+        if (settings.keepLargest > 0 && kept.size() > settings.keepLargest) {
+            std::stable_sort(kept.begin(), kept.end(), [&](uint a, uint b) { return triangles[a] > triangles[b]; });
+            for (size_t i = settings.keepLargest; i < kept.size(); i++) keep[kept[i]] = 0;
+            kept.resize(settings.keepLargest);
+        }
+        stats.componentsAfter = kept.size();
+
+        // Every kept vertex moves down to its new index, which is never past
+        // its old one, so the arrays compact onto themselves front to back
+        const bool hasNormals = mesh.normals.size() == mesh.vertices.size();
+        std::vector<uint> remap(mesh.vertices.size());
+        size_t numVertices = 0;
+        for (size_t i = 0; i < mesh.vertices.size(); i++) {
+            if (!keep[labels[i]]) continue;
+            remap[i] = uint(numVertices);
+            mesh.vertices[numVertices] = mesh.vertices[i];
+            if (hasNormals) mesh.normals[numVertices] = mesh.normals[i];
+            numVertices++;
+        }
+
+        size_t numIndices = 0;
+        for (size_t t = 0; t < stats.trianglesBefore; t++) {
+            if (!keep[labels[mesh.indices[3 * t]]]) continue;
+            for (int j = 0; j < 3; j++) mesh.indices[numIndices + j] = remap[mesh.indices[3 * t + j]];
+            numIndices += 3;
+        }
+
+        mesh.vertices.resize(numVertices);
+        if (hasNormals) mesh.normals.resize(numVertices);
+        mesh.indices.resize(numIndices);
+
+        stats.verticesAfter = numVertices;
+        stats.trianglesAfter = numIndices / 3;
+        PROFILE_COUNT("filter/triangles removed", stats.trianglesBefore - stats.trianglesAfter);
+        return stats;
+    }
+}
+
+#endif
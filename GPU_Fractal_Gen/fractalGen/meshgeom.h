@@ -0,0 +1,236 @@
+#ifndef MESHGEOM_H
+#define MESHGEOM_H
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "SETTINGS.h"
+#include "parallel.h"
+
+// Batch geometry over the faces of an indexed mesh. Faces are gathered into
+// structure-of-arrays form (one array per corner and coordinate) so the
+// kernels below are straight loops over contiguous Reals that the compiler
+// can vectorize. Whole-mesh queries gather and process fixed-size blocks of
+// faces in parallel and never touch more than a block's worth of scratch per
+// thread.
+namespace MeshGeom
+{
+    // Faces per block of the whole-mesh queries
+    static const size_t MESHGEOM_BLOCK = 1024;
+
+    struct TriangleSoA {
+        std::vector<Real> v0[3];
+        std::vector<Real> v1[3];
+        std::vector<Real> v2[3];
+
+        size_t size() const { return v0[0].size(); }
+
+        void resize(size_t n) {
+            for (int a = 0; a < 3; a++) {
+                v0[a].resize(n);
+                v1[a].resize(n);
+                v2[a].resize(n);
+            }
+        }
+
+        // Gathers faces [first, first + count) of the mesh into slots [at, at + count)
+        void gather(const std::vector<VEC3F>& vertices, const std::vector<uint>& indices, size_t first, size_t count, size_t at = 0) {
+            for (size_t i = 0; i < count; i++) {
+                const size_t f = 3 * (first + i);
+                const VEC3F& a0 = vertices[indices[f]];
+                const VEC3F& a1 = vertices[indices[f + 1]];
+                const VEC3F& a2 = vertices[indices[f + 2]];
+                for (int a = 0; a < 3; a++) {
+                    v0[a][at + i] = a0[a];
+                    v1[a][at + i] = a1[a];
+                    v2[a][at + i] = a2[a];
+                }
+            }
+        }
+
+        // All faces of a mesh, gathered in parallel
+        static TriangleSoA fromMesh(const std::vector<VEC3F>& vertices, const std::vector<uint>& indices) {
+            TriangleSoA soa;
+            const size_t n = indices.size() / 3;
+            soa.resize(n);
+            Parallel::parallelFor(0, (n + MESHGEOM_BLOCK - 1) / MESHGEOM_BLOCK, [&](size_t b) {
+                const size_t first = b * MESHGEOM_BLOCK;
+                const size_t count = std::min(MESHGEOM_BLOCK, n - first);
+                soa.gather(vertices, indices, first, count, first);
+            });
+            return soa;
+        }
+    };
+
+    struct BoxSoA {
+        std::vector<Real> mins[3];
+        std::vector<Real> maxs[3];
+
+        void resize(size_t n) {
+            for (int a = 0; a < 3; a++) {
+                mins[a].resize(n);
+                maxs[a].resize(n);
+            }
+        }
+    };
+
+    /*!
+      \brief Face areas of faces [begin, end).
+      \param out area of face i at out[i - begin]
+      */
+    inline void areas(const TriangleSoA& t, size_t begin, size_t end, Real* out) {
+        const Real *x0 = t.v0[0].data(), *y0 = t.v0[1].data(), *z0 = t.v0[2].data();
+        const Real *x1 = t.v1[0].data(), *y1 = t.v1[1].data(), *z1 = t.v1[2].data();
+        const Real *x2 = t.v2[0].data(), *y2 = t.v2[1].data(), *z2 = t.v2[2].data();
+        for (size_t i = begin; i < end; i++) {
+            const Real ax = x1[i] - x0[i], ay = y1[i] - y0[i], az = z1[i] - z0[i];
+            const Real bx = x2[i] - x0[i], by = y2[i] - y0[i], bz = z2[i] - z0[i];
+            const Real cx = ay * bz - az * by;
+            const Real cy = az * bx - ax * bz;
+            const Real cz = ax * by - ay * bx;
+            out[i - begin] = 0.5 * std::sqrt(cx * cx + cy * cy + cz * cz);
+        }
+    }
+
+    /*!
+      \brief Unit face normals (counter-clockwise winding) of faces [begin,
+      end). Degenerate faces get a zero normal.
+      \param nx, ny, nz normal of face i at index i - begin
+      */
+    inline void normals(const TriangleSoA& t, size_t begin, size_t end, Real* nx, Real* ny, Real* nz) {
+        const Real *x0 = t.v0[0].data(), *y0 = t.v0[1].data(), *z0 = t.v0[2].data();
+        const Real *x1 = t.v1[0].data(), *y1 = t.v1[1].data(), *z1 = t.v1[2].data();
+        const Real *x2 = t.v2[0].data(), *y2 = t.v2[1].data(), *z2 = t.v2[2].data();
+        for (size_t i = begin; i < end; i++) {
+            const Real ax = x1[i] - x0[i], ay = y1[i] - y0[i], az = z1[i] - z0[i];
+            const Real bx = x2[i] - x0[i], by = y2[i] - y0[i], bz = z2[i] - z0[i];
+            const Real cx = ay * bz - az * by;
+            const Real cy = az * bx - ax * bz;
+            const Real cz = ax * by - ay * bx;
+            const Real length = std::sqrt(cx * cx + cy * cy + cz * cz);
+            const Real inv = length > 0 ? 1.0 / length : 0.0;
+            nx[i - begin] = cx * inv;
+            ny[i - begin] = cy * inv;
+            nz[i - begin] = cz * inv;
+        }
+    }
+
+    /*!
+      \brief Axis-aligned bounds of faces [begin, end), written to slots
+      [begin, end) of `out` (which must be at least that large).
+      */
+    inline void boundingBoxes(const TriangleSoA& t, size_t begin, size_t end, BoxSoA& out) {
+        for (int a = 0; a < 3; a++) {
+            const Real *p0 = t.v0[a].data(), *p1 = t.v1[a].data(), *p2 = t.v2[a].data();
+            Real *lo = out.mins[a].data(), *hi = out.maxs[a].data();
+            for (size_t i = begin; i < end; i++) {
+                lo[i] = std::min(p0[i], std::min(p1[i], p2[i]));
+                hi[i] = std::max(p0[i], std::max(p1[i], p2[i]));
+            }
+        }
+    }
+
+    /*!
+      \brief Segment test (Moller-Trumbore) of faces [begin, end) against the
+      segment from `start` to `end`, matching TriangleView::intersects.
+      \param hits 1 at index i - begin if face i is crossed, else 0
+      */
+    inline void intersects(const TriangleSoA& t, size_t begin, size_t end,
+            const VEC3F& segStart, const VEC3F& segEnd, uint8_t* hits) {
+        const Real dx = segEnd[0] - segStart[0], dy = segEnd[1] - segStart[1], dz = segEnd[2] - segStart[2];
+        const Real *x0 = t.v0[0].data(), *y0 = t.v0[1].data(), *z0 = t.v0[2].data();
+        const Real *x1 = t.v1[0].data(), *y1 = t.v1[1].data(), *z1 = t.v1[2].data();
+        const Real *x2 = t.v2[0].data(), *y2 = t.v2[1].data(), *z2 = t.v2[2].data();
+
+        for (size_t i = begin; i < end; i++) {
+            const Real ax = x1[i] - x0[i], ay = y1[i] - y0[i], az = z1[i] - z0[i];
+            const Real bx = x2[i] - x0[i], by = y2[i] - y0[i], bz = z2[i] - z0[i];
+
+            // q = dir x e2, det = e1 . q
+            const Real qx = dy * bz - dz * by;
+            const Real qy = dz * bx - dx * bz;
+            const Real qz = dx * by - dy * bx;
+            const Real det = ax * qx + ay * qy + az * qz;
+
+            const Real sx = segStart[0] - x0[i], sy = segStart[1] - y0[i], sz = segStart[2] - z0[i];
+            const Real inv = 1.0 / det;
+            const Real u = (sx * qx + sy * qy + sz * qz) * inv;
+
+            // r = s x e1
+            const Real rx = sy * az - sz * ay;
+            const Real ry = sz * ax - sx * az;
+            const Real rz = sx * ay - sy * ax;
+            const Real v = (dx * rx + dy * ry + dz * rz) * inv;
+            const Real s = (bx * rx + by * ry + bz * rz) * inv;
+
+            hits[i - begin] = uint8_t((std::fabs(det) >= 1e-20) & (u >= 0) & (u <= 1) & (v >= 0) & (u + v <= 1) & (s >= 0) & (s <= 1));
+        }
+    }
+
+    /*!
+      \brief Total surface area of an indexed mesh, as a parallel reduction
+      over blocks of faces. Blocks are summed in order, so the result doesn't
+      depend on the thread count.
+      */
+    inline Real surfaceArea(const std::vector<VEC3F>& vertices, const std::vector<uint>& indices) {
+        const size_t n = indices.size() / 3;
+        const size_t blocks = (n + MESHGEOM_BLOCK - 1) / MESHGEOM_BLOCK;
+        std::vector<Real> partial(blocks, 0);
+
+        Parallel::parallelFor(0, blocks, [&](size_t b) {
+            thread_local TriangleSoA block;
+            Real blockAreas[MESHGEOM_BLOCK];
+
+            const size_t first = b * MESHGEOM_BLOCK;
+            const size_t count = std::min(MESHGEOM_BLOCK, n - first);
+            block.resize(MESHGEOM_BLOCK);
+            block.gather(vertices, indices, first, count);
+            areas(block, 0, count, blockAreas);
+
+            Real sum = 0;
+            for (size_t i = 0; i < count; i++) sum += blockAreas[i];
+            partial[b] = sum;
+        });
+
+        Real area = 0;
+        for (Real p : partial) area += p;
+        return area;
+    }
+
+    /*!
+      \brief Bounds of all faces of an indexed mesh, computed in parallel.
+      */
+    inline BoxSoA boundingBoxes(const std::vector<VEC3F>& vertices, const std::vector<uint>& indices) {
+        const TriangleSoA t = TriangleSoA::fromMesh(vertices, indices);
+        BoxSoA out;
+        out.resize(t.size());
+        Parallel::parallelFor(0, (t.size() + MESHGEOM_BLOCK - 1) / MESHGEOM_BLOCK, [&](size_t b) {
+            boundingBoxes(t, b * MESHGEOM_BLOCK, std::min(t.size(), (b + 1) * MESHGEOM_BLOCK), out);
+        });
+        return out;
+    }
+
+    /*!
+      \brief Faces of an indexed mesh crossed by the segment from `start` to
+      `end`, tested in parallel.
+      \return indices of the crossed faces, ascending
+      */
+    inline std::vector<uint> intersectingFaces(const std::vector<VEC3F>& vertices, const std::vector<uint>& indices,
+            const VEC3F& start, const VEC3F& end) {
+        const TriangleSoA t = TriangleSoA::fromMesh(vertices, indices);
+        std::vector<uint8_t> hits(t.size());
+        Parallel::parallelFor(0, (t.size() + MESHGEOM_BLOCK - 1) / MESHGEOM_BLOCK, [&](size_t b) {
+            const size_t first = b * MESHGEOM_BLOCK;
+            intersects(t, first, std::min(t.size(), first + MESHGEOM_BLOCK), start, end, hits.data() + first);
+        });
+
+        std::vector<uint> out;
+        for (size_t i = 0; i < hits.size(); i++)
+            if (hits[i]) out.push_back(uint(i));
+        return out;
+    }
+}
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef MESHLETS_H
+#define MESHLETS_H
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+
+#include "SETTINGS.h"
+#include "mesh.h"
+#include "field.h"
+
+using namespace std;
+
+// Splits a Mesh into meshlets, small clusters of nearby triangles, each with
+// a bounding sphere and a normal cone, so a GPU pass can frustum, occlusion
+// and backface cull at cluster granularity before any vertex work. Meshlets
+// index the mesh's vertices as they are written, so they go with the OBJ and
+// the quantized CMSH of the same (optimized) mesh.
+namespace Meshlets
+{
+    // Limits that fit one meshlet in a 64-wide task / workgroup: 124
+    // triangles keep the local index triplets within 372 bytes
+    static const uint ML_MAX_VERTICES = 64;
+    static const uint ML_MAX_TRIANGLES = 124;
+
+    // Below this minimum normal-to-axis dot product a cone is too wide to
+    // ever cull anything, and is stored as one that never does
+    static const Real ML_MIN_CONE_SPREAD = 0.1;
+
+    struct Meshlet {
+        uint vertexOffset;     // into MeshletSet::vertices
+        uint triangleOffset;   // into MeshletSet::triangles, in bytes
+        uint vertexCount;
+        uint triangleCount;
+    };
+
+    // Triangle normals follow the winding (counter-clockwise is the front).
+    // Cull a meshlet when the camera sees all of it from behind:
+    //   dot(normalize(coneApex - cameraPosition), coneAxis) >= coneCutoff
+    // and when its sphere is outside the frustum or occluded.
+    struct Bounds {
+        VEC3F center;
+        Real  radius;
+        VEC3F coneApex;
+        VEC3F coneAxis;
+        Real  coneCutoff;      // sin of the cone's half angle; 1 never culls
+    };
+
+    struct MeshletSet {
+        std::vector<Meshlet>  meshlets;
+        std::vector<Bounds>   bounds;
+        std::vector<uint>     vertices;    // mesh vertex index of every meshlet vertex
+        std::vector<uint8_t>  triangles;   // three meshlet-local vertex indices per triangle
+
+        /*!
+          \brief Writes the meshlets in a binary file next to the mesh they index.
+          Layout: "CMLT", version, meshlet count, vertex count, triangle byte
+          count (all uint32), then per meshlet vertexOffset, triangleOffset,
+          vertexCount, triangleCount (uint32) and center, radius, cone apex,
+          cone axis, cone cutoff (float), then the vertex indices (uint32)
+          and the local triangles (uint8, padded to 4 bytes).
+          */
+        void writeBinary(string filename) const {
+            FILE* file = fopen(filename.c_str(), "wb");
+            if (file == NULL) {
+                printf("Could not open %s for writing.\n", filename.c_str());
+                return;
+            }
+
+            const char magic[4] = {'C', 'M', 'L', 'T'};
+            const uint32_t header[4] = {1, (uint32_t) meshlets.size(), (uint32_t) vertices.size(), (uint32_t) triangles.size()};
+            fwrite(magic, 1, 4, file);
+            fwrite(header, sizeof(uint32_t), 4, file);
+
+            for (size_t i = 0; i < meshlets.size(); i++) {
+                const Meshlet& m = meshlets[i];
+                const Bounds& b = bounds[i];
+                const uint32_t ranges[4] = {m.vertexOffset, m.triangleOffset, m.vertexCount, m.triangleCount};
+                const float cull[11] = {
+                    (float) b.center.x(), (float) b.center.y(), (float) b.center.z(), (float) b.radius,
+                    (float) b.coneApex.x(), (float) b.coneApex.y(), (float) b.coneApex.z(),
+                    (float) b.coneAxis.x(), (float) b.coneAxis.y(), (float) b.coneAxis.z(), (float) b.coneCutoff};
+                fwrite(ranges, sizeof(uint32_t), 4, file);
+                fwrite(cull, sizeof(float), 11, file);
+            }
+
+            fwrite(vertices.data(), sizeof(uint32_t), vertices.size(), file);
+            std::vector<uint8_t> padded(triangles);
+            padded.resize((triangles.size() + 3) & ~size_t(3), 0);
+            fwrite(padded.data(), 1, padded.size(), file);
+
+            PROFILE_COUNT("io/bytes written", ftell(file));
+            fclose(file);
+
+            printf("Wrote %zu meshlets (%.1f vertices, %.1f triangles each) to %s\n", meshlets.size(),
+                   meshlets.empty() ? 0.0 : (double) vertices.size() / meshlets.size(),
+                   meshlets.empty() ? 0.0 : (double) triangles.size() / 3 / meshlets.size(), filename.c_str());
+        }
+    };
+
+    // Ritter's bounding sphere: start from the farthest apart of the extreme
+    // points along x, y and z, then grow to take in every point
+    static inline void ml_internalBoundingSphere(const std::vector<VEC3F>& points, VEC3F& center, Real& radius) {
+        size_t lo[3] = {0, 0, 0}, hi[3] = {0, 0, 0};
+        for (size_t i = 1; i < points.size(); i++) {
+            for (int k = 0; k < 3; k++) {
+                if (points[i][k] < points[lo[k]][k]) lo[k] = i;
+                if (points[i][k] > points[hi[k]][k]) hi[k] = i;
+            }
+        }
+
+        int axis = 0;
+        for (int k = 1; k < 3; k++)
+            if ((points[hi[k]] - points[lo[k]]).squaredNorm() > (points[hi[axis]] - points[lo[axis]]).squaredNorm()) axis = k;
+
+        center = (points[lo[axis]] + points[hi[axis]]) / 2;
+        radius = (points[hi[axis]] - points[lo[axis]]).norm() / 2;
+
+        for (const VEC3F& p : points) {
+            const Real d = (p - center).norm();
+            if (d > radius) {
+                const Real grown = (radius + d) / 2;
+                center += (p - center) * ((grown - radius) / d);
+                radius = grown;
+            }
+        }
+    }
+
+    /*!
+      \brief Bounding sphere and normal cone of one meshlet, as described at
+      Bounds. Degenerate triangles don't count towards the cone.
+      */
+    inline Bounds computeBounds(const Mesh& mesh, const MeshletSet& set, const Meshlet& meshlet) {
+        Bounds b;
+        std::vector<VEC3F> points(meshlet.vertexCount);
+        for (uint i = 0; i < meshlet.vertexCount; i++) points[i] = mesh.vertices[set.vertices[meshlet.vertexOffset + i]];
+        ml_internalBoundingSphere(points, b.center, b.radius);
+
+        std::vector<VEC3F> normals, corners;
+        const uint8_t* local = &set.triangles[meshlet.triangleOffset];
+        VEC3F sum(0, 0, 0);
+        for (uint t = 0; t < meshlet.triangleCount; t++) {
+            const VEC3F& p0 = points[local[3 * t]];
+            VEC3F n = (points[local[3 * t + 1]] - p0).cross(points[local[3 * t + 2]] - p0);
+            const Real length = n.norm();
+            if (length <= 0) continue;
+            n /= length;
+            normals.push_back(n);
+            corners.push_back(p0);
+            sum += n;
+        }
+
+        b.coneApex = b.center;
+        b.coneAxis = VEC3F(0, 0, 0);
+        b.coneCutoff = 1;
+        if (normals.empty() || sum.norm() <= 0) return b;
+        b.coneAxis = sum.normalized();
+
+        Real minDot = 1;
+        for (const VEC3F& n : normals) minDot = std::min(minDot, n.dot(b.coneAxis));
+        if (minDot <= ML_MIN_CONE_SPREAD) return b;
+
+        // Move the apex back along the axis until every triangle's plane is
+        // in front of it, so the test holds for perspective views too
+        Real maxT = 0;
+        for (size_t t = 0; t < normals.size(); t++)
+            maxT = std::max(maxT, (b.center - corners[t]).dot(normals[t]) / b.coneAxis.dot(normals[t]));
+        b.coneApex = b.center - b.coneAxis * maxT;
+        b.coneCutoff = sqrt(1 - minDot * minDot);
+        return b;
+    }
+
+    /*!
+      \brief Greedily partitions the triangles into meshlets of at most
+      maxVertices vertices and maxTriangles triangles. Each meshlet grows by
+      the triangle adjacent to it that adds the fewest new vertices, and only
+      jumps to the next unused triangle in index order when nothing is
+      adjacent, so meshlets stay compact; run after optimizeVertexCache for
+      the best locality on that fallback.
+      \param mesh the mesh
+      \param maxVertices at most 255, local indices are bytes
+      \return the meshlets, with bounds
+      */
+    inline MeshletSet build(const Mesh& mesh, uint maxVertices = ML_MAX_VERTICES, uint maxTriangles = ML_MAX_TRIANGLES) {
+        PROFILE_SCOPE("build meshlets");
+        MeshletSet set;
+        maxVertices = std::max(3u, std::min(maxVertices, 255u));
+        maxTriangles = std::max(1u, maxTriangles);
+        const size_t nVerts = mesh.vertices.size();
+        const size_t nTris = mesh.indices.size() / 3;
+        if (nTris == 0) return set;
+
+        // Vertex -> triangle adjacency in CSR form
+        std::vector<uint> adjOffset(nVerts + 1, 0);
+        for (uint idx : mesh.indices) adjOffset[idx + 1]++;
+        for (size_t v = 0; v < nVerts; v++) adjOffset[v + 1] += adjOffset[v];
+        std::vector<uint> adjacency(mesh.indices.size());
+        {
+            std::vector<uint> fill(adjOffset.begin(), adjOffset.end() - 1);
+            for (size_t t = 0; t < nTris; t++)
+                for (int k = 0; k < 3; k++)
+                    adjacency[fill[mesh.indices[3 * t + k]]++] = t;
+        }
+
+        const uint8_t unassigned = 0xff;
+        std::vector<uint8_t> localIndex(nVerts, unassigned);   // in the current meshlet
+        std::vector<bool> used(nTris, false);
+        std::vector<uint> candidates;
+        size_t scanCursor = 0;
+
+        Meshlet current{0, 0, 0, 0};
+        auto finish = [&]() {
+            if (current.triangleCount == 0) return;
+            for (uint i = 0; i < current.vertexCount; i++) localIndex[set.vertices[current.vertexOffset + i]] = unassigned;
+            set.meshlets.push_back(current);
+            current = Meshlet{uint(set.vertices.size()), uint(set.triangles.size()), 0, 0};
+            candidates.clear();
+        };
+
+        auto newVertices = [&](size_t t) {
+            int n = 0;
+            for (int k = 0; k < 3; k++) n += localIndex[mesh.indices[3 * t + k]] == unassigned;
+            return n;
+        };
+
+        for (size_t emitted = 0; emitted < nTris; emitted++) {
+            // Best adjacent triangle; used ones are dropped from the list as we go
+            size_t best = nTris;
+            int bestNew = 4;
+            for (size_t i = 0; i < candidates.size();) {
+                const uint t = candidates[i];
+                if (used[t]) {
+                    candidates[i] = candidates.back();
+                    candidates.pop_back();
+                    continue;
+                }
+                const int n = newVertices(t);
+                if (n < bestNew || (n == bestNew && t < best)) {
+                    bestNew = n;
+                    best = t;
+                }
+                i++;
+            }
+            if (best == nTris) {
+                while (used[scanCursor]) scanCursor++;
+                best = scanCursor;
+                bestNew = newVertices(best);
+            }
+
+            if (current.vertexCount + bestNew > maxVertices || current.triangleCount + 1 > maxTriangles) finish();
+
+            used[best] = true;
+            for (int k = 0; k < 3; k++) {
+                const uint v = mesh.indices[3 * best + k];
+                if (localIndex[v] == unassigned) {
+                    localIndex[v] = uint8_t(current.vertexCount++);
+                    set.vertices.push_back(v);
+                    for (uint j = adjOffset[v]; j < adjOffset[v + 1]; j++)
+                        if (!used[adjacency[j]]) candidates.push_back(adjacency[j]);
+                }
+                set.triangles.push_back(localIndex[v]);
+            }
+            current.triangleCount++;
+        }
+        finish();
+
+        set.bounds.resize(set.meshlets.size());
+        for (size_t i = 0; i < set.meshlets.size(); i++) set.bounds[i] = computeBounds(mesh, set, set.meshlets[i]);
+        return set;
+    }
+}
+
+#endif
@@ -0,0 +1,476 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+
+#include "SETTINGS.h"
+#include "mesh.h"
+#include "field.h"
+
+using namespace std;
+
+// Post-pass over an extracted Mesh that prepares it for the GPU: welds
+// near-duplicate vertices, reorders triangles for the post-transform cache
+// (Forsyth), reorders vertices for fetch locality and optionally quantizes
+// positions to 16 bits and normals to octahedral snorm16.
+namespace MeshOpt
+{
+    // Size of the LRU cache modelled by the Forsyth scoring function
+    static const int MO_FORSYTH_CACHE_SIZE = 32;
+
+    // Size of the FIFO cache used to report ACMR, matching common hardware
+    static const int MO_ACMR_CACHE_SIZE = 16;
+
+    // Float32 interleaved position + normal, which is what the renderer uploads
+    static const size_t MO_FLOAT_VERTEX_BYTES = 6 * sizeof(float);
+
+    // Bits per axis of the weld grid cell keys, so three fit in a uint64
+    static const int MO_WELD_CELL_BITS = 21;
+
+    // uint16 xyz (+ pad) position and 2 x snorm16 octahedral normal
+    static const size_t MO_QUANTIZED_VERTEX_BYTES = 4 * sizeof(uint16_t) + 2 * sizeof(int16_t);
+
+    struct OptimizeSettings {
+        bool weld = true;
+        Real weldEpsilon = 1e-7;
+        bool optimizeCache = true;
+        bool optimizeFetch = true;
+        bool quantize = false;
+    };
+
+    struct OptimizeStats {
+        size_t verticesBefore = 0, verticesAfter = 0;
+        size_t trianglesBefore = 0, trianglesAfter = 0;
+        size_t degenerateTriangles = 0;
+        double acmrBefore = 0, acmrAfter = 0;
+        size_t bytesBefore = 0, bytesAfter = 0;
+
+        void print() const {
+            printf("Mesh optimization: %zu -> %zu vertices, %zu -> %zu triangles (%zu degenerate removed)\n",
+                   verticesBefore, verticesAfter, trianglesBefore, trianglesAfter, degenerateTriangles);
+            printf("  ACMR (FIFO %d): %.3f -> %.3f\n", MO_ACMR_CACHE_SIZE, acmrBefore, acmrAfter);
+            printf("  GPU buffer size: %.2f MB -> %.2f MB (saved %.1f%%)\n",
+                   bytesBefore / pow(2.0, 20.0), bytesAfter / pow(2.0, 20.0),
+                   bytesBefore ? 100.0 * (1.0 - (double) bytesAfter / bytesBefore) : 0.0);
+        }
+    };
+
+    // Positions quantized to the mesh bounds and normals octahedral-encoded,
+    // ready to be uploaded as-is.
+    struct QuantizedMesh {
+        AABB bounds;
+        std::vector<uint16_t> positions; // 4 per vertex, w is padding
+        std::vector<int16_t>  normals;   // 2 per vertex
+        std::vector<uint>     indices;
+        bool shortIndices = false;
+
+        size_t numVertices() const { return positions.size() / 4; }
+
+        size_t byteSize() const {
+            return numVertices() * MO_QUANTIZED_VERTEX_BYTES + indices.size() * (shortIndices ? sizeof(uint16_t) : sizeof(uint32_t));
+        }
+
+        VEC3F decodePosition(size_t i) const {
+            VEC3F q(positions[4 * i], positions[4 * i + 1], positions[4 * i + 2]);
+            return bounds.min() + (q / 65535.0).cwiseProduct(bounds.span());
+        }
+
+        // Binary layout: "CMSH", version, vertex count, index count, index
+        // size in bytes, bounds min/max as float, positions, normals, indices.
+        void writeBinary(string filename) const {
+            FILE* file = fopen(filename.c_str(), "wb");
+            if (file == NULL) {
+                printf("Could not open %s for writing.\n", filename.c_str());
+                return;
+            }
+
+            const char magic[4] = {'C', 'M', 'S', 'H'};
+            const uint32_t header[4] = {1, (uint32_t) numVertices(), (uint32_t) indices.size(), shortIndices ? 2u : 4u};
+            const float box[6] = {(float) bounds.min().x(), (float) bounds.min().y(), (float) bounds.min().z(),
+                                  (float) bounds.max().x(), (float) bounds.max().y(), (float) bounds.max().z()};
+
+            fwrite(magic, 1, 4, file);
+            fwrite(header, sizeof(uint32_t), 4, file);
+            fwrite(box, sizeof(float), 6, file);
+            fwrite(positions.data(), sizeof(uint16_t), positions.size(), file);
+            fwrite(normals.data(), sizeof(int16_t), normals.size(), file);
+
+            if (shortIndices) {
+                std::vector<uint16_t> shorts(indices.begin(), indices.end());
+                fwrite(shorts.data(), sizeof(uint16_t), shorts.size(), file);
+            } else {
+                fwrite(indices.data(), sizeof(uint32_t), indices.size(), file);
+            }
+
+            PROFILE_COUNT("io/bytes written", ftell(file));
+            fclose(file);
+
+            printf("Wrote %zu quantized vertices and %zu faces to %s\n", numVertices(), indices.size() / 3, filename.c_str());
+        }
+    };
+
+    static inline AABB mo_internalBounds(const Mesh& mesh) {
+        if (mesh.vertices.empty()) return AABB();
+
+        AABB box(mesh.vertices[0], mesh.vertices[0]);
+        for (const VEC3F& v : mesh.vertices) box.include(v);
+        return box;
+    }
+
+    /*!
+      \brief Average cache miss ratio (transformed vertices per triangle) of the
+      index buffer, simulated with a FIFO post-transform cache.
+      \param mesh the mesh
+      \param cacheSize number of FIFO entries
+      */
+    inline double computeACMR(const Mesh& mesh, int cacheSize = MO_ACMR_CACHE_SIZE) {
+        const size_t nTris = mesh.indices.size() / 3;
+        if (nTris == 0) return 0;
+
+        // A vertex is in the cache if it was inserted fewer than cacheSize misses ago
+        std::vector<size_t> insertedAt(mesh.vertices.size(), 0);
+        size_t misses = 0;
+
+        for (uint idx : mesh.indices) {
+            if (insertedAt[idx] == 0 || misses + 1 - insertedAt[idx] > (size_t) cacheSize) {
+                misses++;
+                insertedAt[idx] = misses;
+            }
+        }
+
+        return (double) misses / nTris;
+    }
+
+    /*!
+      \brief Merges vertices closer than epsilon and removes the triangles that
+      become degenerate. Normals of merged vertices are averaged. Candidates
+      are looked up in a grid over the mesh bounds whose cells are at least
+      epsilon wide, coarsened so every cell index fits in MO_WELD_CELL_BITS.
+      \param mesh the mesh, modified in place
+      \param epsilon merge distance
+      \return number of degenerate triangles removed
+      */
+    inline size_t weldVertices(Mesh& mesh, Real epsilon) {
+        const bool hasNormals = mesh.normals.size() == mesh.vertices.size();
+
+        const int64_t maxCell = (int64_t(1) << MO_WELD_CELL_BITS) - 1;
+        const AABB bounds = mo_internalBounds(mesh);
+        const Real cellSize = max(epsilon, bounds.span().maxCoeff() / Real(maxCell - 2));
+        auto cellKey = [&](int64_t x, int64_t y, int64_t z) {
+            return uint64_t(x) | uint64_t(y) << MO_WELD_CELL_BITS | uint64_t(z) << (2 * MO_WELD_CELL_BITS);
+        };
+
+        unordered_map<uint64_t, std::vector<uint>> buckets;
+        buckets.reserve(mesh.vertices.size());
+
+        std::vector<uint> remap(mesh.vertices.size());
+        std::vector<VEC3F> vertices, normals;
+        vertices.reserve(mesh.vertices.size());
+        normals.reserve(mesh.normals.size());
+
+        const Real eps2 = epsilon * epsilon;
+
+        for (size_t i = 0; i < mesh.vertices.size(); i++) {
+            const VEC3F& v = mesh.vertices[i];
+            // Clamped before the cast (NaNs land in the first cell) and offset by one
+            // so the neighbour cells below stay in range
+            int64_t cell[3];
+            for (int a = 0; a < 3; a++) {
+                const Real c = floor((v[a] - bounds.min()[a]) / cellSize);
+                cell[a] = 1 + (c >= 0 ? (int64_t) min<Real>(c, Real(maxCell - 2)) : 0);
+            }
+
+            int found = -1;
+            for (int dz = -1; dz <= 1 && found < 0; dz++)
+                for (int dy = -1; dy <= 1 && found < 0; dy++)
+                    for (int dx = -1; dx <= 1 && found < 0; dx++) {
+                        auto search = buckets.find(cellKey(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+                        if (search == buckets.end()) continue;
+                        for (uint candidate : search->second) {
+                            if ((vertices[candidate] - v).squaredNorm() <= eps2) {
+                                found = candidate;
+                                break;
+                            }
+                        }
+                    }
+
+            if (found >= 0) {
+                remap[i] = found;
+                if (hasNormals) normals[found] += mesh.normals[i];
+            } else {
+                remap[i] = vertices.size();
+                buckets[cellKey(cell[0], cell[1], cell[2])].push_back(vertices.size());
+                vertices.push_back(v);
+                if (hasNormals) normals.push_back(mesh.normals[i]);
+            }
+        }
+
+        size_t degenerate = 0;
+        std::vector<uint> indices;
+        indices.reserve(mesh.indices.size());
+        for (size_t t = 0; t + 2 < mesh.indices.size(); t += 3) {
+            uint a = remap[mesh.indices[t]], b = remap[mesh.indices[t + 1]], c = remap[mesh.indices[t + 2]];
+            if (a == b || b == c || a == c) {
+                degenerate++;
+                continue;
+            }
+            indices.push_back(a);
+            indices.push_back(b);
+            indices.push_back(c);
+        }
+
+        for (VEC3F& n : normals) {
+            Real len = n.norm();
+            if (len > 0) n /= len;
+        }
+
+        mesh.vertices.swap(vertices);
+        mesh.indices.swap(indices);
+        if (hasNormals) mesh.normals.swap(normals);
+
+        return degenerate;
+    }
+
+    static inline float mo_internalForsythScore(int cachePosition, uint remainingValence) {
+        if (remainingValence == 0) return -1.0f;
+
+        float score = 0;
+        if (cachePosition >= 0) {
+            if (cachePosition < 3) {
+                // The last triangle's vertices get a fixed score so we don't
+                // favour re-using them over the rest of the cache
+                score = 0.75f;
+            } else {
+                const float scaler = 1.0f / (MO_FORSYTH_CACHE_SIZE - 3);
+                score = powf(1.0f - (cachePosition - 3) * scaler, 1.5f);
+            }
+        }
+
+        // Bonus for vertices with few triangles left, so we finish off
+        // fans instead of leaving lone triangles behind
+        score += 2.0f * powf((float) remainingValence, -0.5f);
+        return score;
+    }
+
+    /*!
+      \brief Reorders triangles to improve post-transform vertex cache hit rate,
+      using Tom Forsyth's "Linear-Speed Vertex Cache Optimisation".
+      \param mesh the mesh, indices are reordered in place
+      */
+    inline void optimizeVertexCache(Mesh& mesh) {
+        const size_t nVerts = mesh.vertices.size();
+        const size_t nTris = mesh.indices.size() / 3;
+        if (nTris == 0) return;
+
+        // Vertex -> triangle adjacency in CSR form; the per-vertex list is
+        // shrunk as triangles get emitted
+        std::vector<uint> valence(nVerts, 0);
+        for (uint idx : mesh.indices) valence[idx]++;
+
+        std::vector<uint> adjOffset(nVerts + 1, 0);
+        for (size_t v = 0; v < nVerts; v++) adjOffset[v + 1] = adjOffset[v] + valence[v];
+
+        std::vector<uint> adjacency(mesh.indices.size());
+        {
+            std::vector<uint> fill(adjOffset.begin(), adjOffset.end() - 1);
+            for (size_t t = 0; t < nTris; t++)
+                for (int k = 0; k < 3; k++)
+                    adjacency[fill[mesh.indices[3 * t + k]]++] = t;
+        }
+
+        std::vector<int> cachePos(nVerts, -1);
+        std::vector<float> vertexScore(nVerts);
+        for (size_t v = 0; v < nVerts; v++) vertexScore[v] = mo_internalForsythScore(-1, valence[v]);
+
+        std::vector<float> triScore(nTris);
+        for (size_t t = 0; t < nTris; t++)
+            triScore[t] = vertexScore[mesh.indices[3 * t]] + vertexScore[mesh.indices[3 * t + 1]] + vertexScore[mesh.indices[3 * t + 2]];
+
+        std::vector<bool> emitted(nTris, false);
+        std::vector<uint> out;
+        out.reserve(mesh.indices.size());
+
+        std::vector<uint> cache, newCache;
+        cache.reserve(MO_FORSYTH_CACHE_SIZE + 3);
+        newCache.reserve(MO_FORSYTH_CACHE_SIZE + 3);
+
+        size_t scanCursor = 0;
+        int best = -1;
+
+        for (size_t emittedCount = 0; emittedCount < nTris; emittedCount++) {
+            if (best < 0) {
+                // Nothing adjacent to the cache, start over at the next unemitted triangle
+                while (emitted[scanCursor]) scanCursor++;
+                best = scanCursor;
+            }
+
+            emitted[best] = true;
+            const uint* tri = &mesh.indices[3 * best];
+
+            for (int k = 0; k < 3; k++) {
+                const uint v = tri[k];
+                out.push_back(v);
+
+                // Remove this triangle from the vertex's remaining list
+                uint* begin = &adjacency[adjOffset[v]];
+                uint* end = begin + valence[v];
+                uint* it = std::find(begin, end, (uint) best);
+                *it = *(end - 1);
+                valence[v]--;
+            }
+
+            // Move the triangle's vertices to the front of the LRU cache
+            newCache.clear();
+            for (int k = 0; k < 3; k++) newCache.push_back(tri[k]);
+            for (uint v : cache)
+                if (v != tri[0] && v != tri[1] && v != tri[2]) newCache.push_back(v);
+
+            for (size_t i = 0; i < newCache.size(); i++) {
+                const uint v = newCache[i];
+                const int position = (i < (size_t) MO_FORSYTH_CACHE_SIZE) ? (int) i : -1;
+                cachePos[v] = position;
+
+                const float newScore = mo_internalForsythScore(position, valence[v]);
+                const float delta = newScore - vertexScore[v];
+                vertexScore[v] = newScore;
+
+                for (uint j = 0; j < valence[v]; j++) triScore[adjacency[adjOffset[v] + j]] += delta;
+            }
+
+            if (newCache.size() > (size_t) MO_FORSYTH_CACHE_SIZE) newCache.resize(MO_FORSYTH_CACHE_SIZE);
+            cache.swap(newCache);
+
+            // Next triangle is the best one touching the cache
+            best = -1;
+            float bestScore = -1;
+            for (uint v : cache) {
+                for (uint j = 0; j < valence[v]; j++) {
+                    const uint t = adjacency[adjOffset[v] + j];
+                    if (triScore[t] > bestScore) {
+                        bestScore = triScore[t];
+                        best = t;
+                    }
+                }
+            }
+        }
+
+        mesh.indices.swap(out);
+    }
+
+    /*!
+      \brief Renumbers vertices in order of first use by the index buffer, so
+      vertex fetches walk memory linearly. Unreferenced vertices are dropped.
+      \param mesh the mesh, vertices/normals/indices rewritten in place
+      */
+    inline void optimizeVertexFetch(Mesh& mesh) {
+        const bool hasNormals = mesh.normals.size() == mesh.vertices.size();
+        const uint unassigned = (uint) -1;
+
+        std::vector<uint> remap(mesh.vertices.size(), unassigned);
+        std::vector<VEC3F> vertices, normals;
+        vertices.reserve(mesh.vertices.size());
+        if (hasNormals) normals.reserve(mesh.normals.size());
+
+        for (uint& idx : mesh.indices) {
+            if (remap[idx] == unassigned) {
+                remap[idx] = vertices.size();
+                vertices.push_back(mesh.vertices[idx]);
+                if (hasNormals) normals.push_back(mesh.normals[idx]);
+            }
+            idx = remap[idx];
+        }
+
+        mesh.vertices.swap(vertices);
+        if (hasNormals) mesh.normals.swap(normals);
+    }
+
+    static inline int16_t mo_internalSnorm16(Real v) {
+        v = std::max(-1.0, std::min(1.0, (double) v));
+        return (int16_t) std::lround(v * 32767.0);
+    }
+
+    // Octahedral normal encoding (Meyer et al. 2010)
+    static inline void mo_internalOctEncode(VEC3F n, int16_t& u, int16_t& v) {
+        n /= (fabs(n.x()) + fabs(n.y()) + fabs(n.z()));
+        Real x = n.x(), y = n.y();
+        if (n.z() < 0) {
+            x = (1.0 - fabs(n.y())) * (n.x() >= 0 ? 1.0 : -1.0);
+            y = (1.0 - fabs(n.x())) * (n.y() >= 0 ? 1.0 : -1.0);
+        }
+        u = mo_internalSnorm16(x);
+        v = mo_internalSnorm16(y);
+    }
+
+    /*!
+      \brief Quantizes positions to 16-bit unorm over the mesh bounds and
+      normals to octahedral snorm16. Indices are narrowed to 16 bits when the
+      vertex count allows it.
+      \param mesh the mesh
+      */
+    inline QuantizedMesh quantize(const Mesh& mesh) {
+        QuantizedMesh out;
+        out.bounds = mo_internalBounds(mesh);
+        out.indices = mesh.indices;
+        out.shortIndices = mesh.vertices.size() <= 65536;
+
+        VEC3F span = out.bounds.span();
+        for (int i = 0; i < 3; i++) if (span[i] <= 0) span[i] = 1;
+
+        out.positions.resize(4 * mesh.vertices.size());
+        out.normals.resize(2 * mesh.vertices.size(), 0);
+
+        for (size_t i = 0; i < mesh.vertices.size(); i++) {
+            VEC3F p = (mesh.vertices[i] - out.bounds.min()).cwiseQuotient(span);
+            for (int k = 0; k < 3; k++)
+                out.positions[4 * i + k] = (uint16_t) std::lround(std::max(0.0, std::min(1.0, (double) p[k])) * 65535.0);
+            out.positions[4 * i + 3] = 0;
+
+            if (i < mesh.normals.size() && mesh.normals[i].squaredNorm() > 0)
+                mo_internalOctEncode(mesh.normals[i], out.normals[2 * i], out.normals[2 * i + 1]);
+        }
+
+        return out;
+    }
+
+    inline size_t floatByteSize(const Mesh& mesh) {
+        return mesh.vertices.size() * MO_FLOAT_VERTEX_BYTES + mesh.indices.size() * sizeof(uint32_t);
+    }
+
+    /*!
+      \brief Runs the enabled optimization passes over the mesh and reports
+      the ACMR and GPU byte size before and after.
+      \param mesh the mesh, modified in place
+      \param settings which passes to run
+      \param quantized filled in when settings.quantize is set
+      */
+    inline OptimizeStats optimize(Mesh& mesh, const OptimizeSettings& settings = OptimizeSettings(), QuantizedMesh* quantized = nullptr) {
+        OptimizeStats stats;
+        stats.verticesBefore = mesh.vertices.size();
+        stats.trianglesBefore = mesh.indices.size() / 3;
+        stats.acmrBefore = computeACMR(mesh);
+        stats.bytesBefore = floatByteSize(mesh);
+
+        if (settings.weld)          stats.degenerateTriangles = weldVertices(mesh, settings.weldEpsilon);
+        if (settings.optimizeCache) optimizeVertexCache(mesh);
+        if (settings.optimizeFetch) optimizeVertexFetch(mesh);
+
+        stats.verticesAfter = mesh.vertices.size();
+        stats.trianglesAfter = mesh.indices.size() / 3;
+        stats.acmrAfter = computeACMR(mesh);
+        stats.bytesAfter = floatByteSize(mesh);
+
+        if (settings.quantize && quantized) {
+            *quantized = quantize(mesh);
+            stats.bytesAfter = quantized->byteSize();
+        }
+
+        return stats;
+    }
+}
+
+#endif
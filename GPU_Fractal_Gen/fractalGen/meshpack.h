@@ -0,0 +1,153 @@
+#ifndef MESHPACK_H
+#define MESHPACK_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include "SETTINGS.h"
+#include "mesh.h"
+#include "field.h"
+#include "meshopt.h"
+
+using namespace std;
+
+// Packs a library of meshes (e.g. the variants of a reef) into one quantized
+// vertex buffer and one index buffer, with a table of draw ranges, so a
+// client fetches and uploads the whole library once and draws each mesh with
+// drawIndexed(indexCount, instances, firstIndex, baseVertex) or the matching
+// indirect arguments.
+namespace MeshPack
+{
+    // Names in the draw table are null-padded to this many bytes
+    static const size_t MP_NAME_BYTES = 32;
+
+    struct DrawRange {
+        string name;
+        uint firstIndex, indexCount;
+        uint baseVertex, vertexCount;
+        AABB bounds;    // positions of this range are quantized over it
+    };
+
+    struct PackedLibrary {
+        std::vector<uint16_t>  positions;   // 4 per vertex, w is padding
+        std::vector<int16_t>   normals;     // 2 per vertex, octahedral
+        std::vector<uint>      indices;     // relative to the range's baseVertex
+        bool shortIndices = true;
+        std::vector<DrawRange> ranges;
+
+        size_t numVertices() const { return positions.size() / 4; }
+
+        size_t byteSize() const {
+            return numVertices() * MeshOpt::MO_QUANTIZED_VERTEX_BYTES + indices.size() * (shortIndices ? sizeof(uint16_t) : sizeof(uint32_t));
+        }
+
+        /*!
+          \brief Writes the library as one binary file. Layout: "CPAK",
+          version, mesh count, vertex count, index count, index size in bytes
+          (all uint32); per mesh its name (MP_NAME_BYTES), firstIndex,
+          indexCount, baseVertex, vertexCount (uint32) and bounds min / max
+          (float); then all positions, all normals and all indices (padded to
+          4 bytes). Every section starts 4-byte aligned, so each can be
+          uploaded straight from the fetched buffer.
+          */
+        void writeBinary(string filename) const {
+            FILE* file = fopen(filename.c_str(), "wb");
+            if (file == NULL) {
+                printf("Could not open %s for writing.\n", filename.c_str());
+                return;
+            }
+
+            const char magic[4] = {'C', 'P', 'A', 'K'};
+            const uint32_t header[5] = {1, (uint32_t) ranges.size(), (uint32_t) numVertices(), (uint32_t) indices.size(), shortIndices ? 2u : 4u};
+            fwrite(magic, 1, 4, file);
+            fwrite(header, sizeof(uint32_t), 5, file);
+
+            for (const DrawRange& r : ranges) {
+                char name[MP_NAME_BYTES] = {0};
+                strncpy(name, r.name.c_str(), MP_NAME_BYTES - 1);
+                const uint32_t range[4] = {r.firstIndex, r.indexCount, r.baseVertex, r.vertexCount};
+                const float box[6] = {(float) r.bounds.min().x(), (float) r.bounds.min().y(), (float) r.bounds.min().z(),
+                                      (float) r.bounds.max().x(), (float) r.bounds.max().y(), (float) r.bounds.max().z()};
+                fwrite(name, 1, MP_NAME_BYTES, file);
+                fwrite(range, sizeof(uint32_t), 4, file);
+                fwrite(box, sizeof(float), 6, file);
+            }
+
+            fwrite(positions.data(), sizeof(uint16_t), positions.size(), file);
+            fwrite(normals.data(), sizeof(int16_t), normals.size(), file);
+
+            if (shortIndices) {
+                std::vector<uint16_t> shorts(indices.begin(), indices.end());
+                shorts.resize((shorts.size() + 1) & ~size_t(1), 0);
+                fwrite(shorts.data(), sizeof(uint16_t), shorts.size(), file);
+            } else {
+                fwrite(indices.data(), sizeof(uint32_t), indices.size(), file);
+            }
+
+            PROFILE_COUNT("io/bytes written", ftell(file));
+            fclose(file);
+
+            printf("Wrote %zu meshes, %zu quantized vertices and %zu faces to %s\n", ranges.size(), numVertices(),
+                   indices.size() / 3, filename.c_str());
+        }
+    };
+
+    // "out/reef.variant2.obj" -> "reef.variant2", the name of its draw range
+    inline string meshName(const string& filename) {
+        const size_t slash = filename.find_last_of("/\\");
+        string name = (slash == string::npos) ? filename : filename.substr(slash + 1);
+        const size_t dot = name.rfind('.');
+        if (dot != string::npos && dot > 0) name = name.substr(0, dot);
+        return name;
+    }
+
+    /*!
+      \brief Optimizes and quantizes every mesh and packs them into one
+      library, in order. Each mesh keeps its own quantization bounds, stored
+      with its draw range. Indices are narrowed to 16 bits when every mesh
+      has at most 65536 vertices.
+      \param meshes the meshes, optimized in place
+      \param names name of each mesh in the draw table
+      \param settings optimization passes to run on each mesh; quantization
+      is always on
+      */
+    inline PackedLibrary pack(std::vector<Mesh>& meshes, const std::vector<string>& names,
+                              MeshOpt::OptimizeSettings settings = MeshOpt::OptimizeSettings()) {
+        PROFILE_SCOPE("pack meshes");
+        settings.quantize = true;
+
+        PackedLibrary library;
+        size_t floatBytes = 0;
+        for (size_t i = 0; i < meshes.size(); i++) {
+            floatBytes += MeshOpt::floatByteSize(meshes[i]);
+
+            MeshOpt::QuantizedMesh quantized;
+            MeshOpt::optimize(meshes[i], settings, &quantized);
+
+            DrawRange range;
+            range.name = i < names.size() ? names[i] : to_string(i);
+            range.firstIndex = library.indices.size();
+            range.indexCount = quantized.indices.size();
+            range.baseVertex = library.numVertices();
+            range.vertexCount = quantized.numVertices();
+            range.bounds = quantized.bounds;
+            library.ranges.push_back(range);
+
+            library.positions.insert(library.positions.end(), quantized.positions.begin(), quantized.positions.end());
+            library.normals.insert(library.normals.end(), quantized.normals.begin(), quantized.normals.end());
+            library.indices.insert(library.indices.end(), quantized.indices.begin(), quantized.indices.end());
+            library.shortIndices = library.shortIndices && quantized.shortIndices;
+        }
+
+        printf("Packed %zu meshes into %zu vertices and %zu triangles: %.2f MB -> %.2f MB in one vertex and one index buffer\n",
+               meshes.size(), library.numVertices(), library.indices.size() / 3,
+               floatBytes / pow(2.0, 20.0), library.byteSize() / pow(2.0, 20.0));
+        return library;
+    }
+}
+
+#endif
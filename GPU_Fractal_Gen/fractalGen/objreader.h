@@ -0,0 +1,309 @@
+#ifndef OBJREADER_H
+#define OBJREADER_H
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "SETTINGS.h"
+#include "parallel.h"
+
+// OBJ loader shared by fractalGen and sdfGen. The file is memory-mapped and
+// split into line-aligned chunks that are parsed in parallel with
+// std::from_chars, then stitched together in file order. Understands "v",
+// "vn" and faces of the form "f a", "f a/b", "f a//c" and "f a/b/c";
+// polygons are fan-triangulated and everything else is skipped.
+namespace ObjReader
+{
+    // Chunks per thread, so a chunk of long face lines doesn't hold everyone up
+    static const int OBJ_CHUNKS_PER_THREAD = 4;
+
+    // Files smaller than this are parsed on one thread
+    static const size_t OBJ_MIN_PARALLEL_BYTES = 1 << 20;
+
+    struct ObjData {
+        std::vector<Real> positions;     // xyz per "v"
+        std::vector<Real> normals;       // xyz per "vn"
+        std::vector<uint> indices;       // 0-based, 3 per triangle
+        std::vector<uint> normalIndices; // 0-based per corner, empty unless every face had normals
+        size_t totalLines = 0;
+        size_t ignoredLines = 0;
+
+        size_t numVertices() const { return positions.size() / 3; }
+        size_t numNormals() const { return normals.size() / 3; }
+        size_t numFaces() const { return indices.size() / 3; }
+    };
+
+    class obj_internalMappedFile {
+    public:
+        const char* data = nullptr;
+        size_t size = 0;
+
+        bool open(const std::string& filename) {
+#ifdef _WIN32
+            // No mmap here, read it in one go instead
+            FILE* file = fopen(filename.c_str(), "rb");
+            if (file == NULL) return false;
+            fseek(file, 0, SEEK_END);
+            size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+            buffer.resize(size);
+            size = fread(buffer.data(), 1, size, file);
+            fclose(file);
+            data = buffer.data();
+            return true;
+#else
+            fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) return false;
+            size = st.st_size;
+            if (size == 0) return true;
+
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) return false;
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            data = (const char*) mapped;
+            return true;
+#endif
+        }
+
+        ~obj_internalMappedFile() {
+#ifndef _WIN32
+            if (data) munmap((void*) data, size);
+            if (fd >= 0) ::close(fd);
+#endif
+        }
+
+    private:
+#ifdef _WIN32
+        std::vector<char> buffer;
+#else
+        int fd = -1;
+#endif
+    };
+
+    struct obj_internalChunk {
+        std::vector<Real> positions, normals;
+        std::vector<uint> indices, normalIndices;
+        size_t faces = 0, facesWithNormals = 0;
+        size_t totalLines = 0, ignoredLines = 0;
+        bool negativeIndex = false;
+    };
+
+    static inline const char* obj_internalSkipSpaces(const char* p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        return p;
+    }
+
+    static inline const char* obj_internalParseReal(const char* p, const char* end, Real& out) {
+        p = obj_internalSkipSpaces(p, end);
+        if (p < end && *p == '+') p++;
+        auto res = std::from_chars(p, end, out);
+        if (res.ec != std::errc()) out = 0;
+        return res.ptr;
+    }
+
+    static inline const char* obj_internalParseInt(const char* p, const char* end, long& out, bool& found) {
+        auto res = std::from_chars(p, end, out);
+        found = (res.ec == std::errc());
+        return res.ptr;
+    }
+
+    // Parses one "a", "a/b", "a//c" or "a/b/c" corner. Returns false at end of line.
+    static inline bool obj_internalParseCorner(const char*& p, const char* end, long& v, long& vn, bool& hasNormal) {
+        p = obj_internalSkipSpaces(p, end);
+        bool found;
+        p = obj_internalParseInt(p, end, v, found);
+        if (!found) return false;
+
+        hasNormal = false;
+        if (p < end && *p == '/') {
+            p++;
+            long vt;
+            p = obj_internalParseInt(p, end, vt, found);
+            if (p < end && *p == '/') {
+                p++;
+                p = obj_internalParseInt(p, end, vn, hasNormal);
+            }
+        }
+        // Skip anything else glued to this corner
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+        return true;
+    }
+
+    static void obj_internalParseChunk(const char* p, const char* end, obj_internalChunk& chunk, bool verticesOnly) {
+        long corners[3], cornerNormals[3];
+
+        while (p < end) {
+            const char* lineEnd = (const char*) memchr(p, '\n', end - p);
+            if (!lineEnd) lineEnd = end;
+            chunk.totalLines++;
+
+            const char* q = obj_internalSkipSpaces(p, lineEnd);
+
+            if (q + 1 < lineEnd && q[0] == 'v' && (q[1] == ' ' || q[1] == '\t')) {
+                Real x, y, z;
+                q = obj_internalParseReal(q + 1, lineEnd, x);
+                q = obj_internalParseReal(q, lineEnd, y);
+                q = obj_internalParseReal(q, lineEnd, z);
+                chunk.positions.push_back(x);
+                chunk.positions.push_back(y);
+                chunk.positions.push_back(z);
+            } else if (q + 2 < lineEnd && q[0] == 'v' && q[1] == 'n' && (q[2] == ' ' || q[2] == '\t')) {
+                if (!verticesOnly) {
+                    Real x, y, z;
+                    q = obj_internalParseReal(q + 2, lineEnd, x);
+                    q = obj_internalParseReal(q, lineEnd, y);
+                    q = obj_internalParseReal(q, lineEnd, z);
+                    chunk.normals.push_back(x);
+                    chunk.normals.push_back(y);
+                    chunk.normals.push_back(z);
+                }
+            } else if (q + 1 < lineEnd && q[0] == 'f' && (q[1] == ' ' || q[1] == '\t')) {
+                if (!verticesOnly) {
+                    q++;
+                    int n = 0;
+                    bool allNormals = true;
+                    long v, vn = 0;
+                    bool hasNormal;
+                    while (obj_internalParseCorner(q, lineEnd, v, vn, hasNormal)) {
+                        if (v < 0 || (hasNormal && vn < 0)) chunk.negativeIndex = true;
+                        allNormals = allNormals && hasNormal;
+
+                        // Fan triangulation: (0, n-1, n)
+                        if (n < 3) {
+                            corners[n] = v;
+                            cornerNormals[n] = vn;
+                        } else {
+                            corners[1] = corners[2];
+                            cornerNormals[1] = cornerNormals[2];
+                            corners[2] = v;
+                            cornerNormals[2] = vn;
+                        }
+                        n++;
+
+                        if (n >= 3) {
+                            for (int k = 0; k < 3; k++) {
+                                chunk.indices.push_back((uint) (corners[k] - 1));
+                                chunk.normalIndices.push_back((uint) (cornerNormals[k] - 1));
+                            }
+                            chunk.faces++;
+                            if (allNormals) chunk.facesWithNormals++;
+                        }
+                    }
+                }
+            } else {
+                chunk.ignoredLines++;
+            }
+
+            p = lineEnd + 1;
+        }
+    }
+
+    /*!
+      \brief Reads an OBJ file.
+      \param filename path to the OBJ
+      \param out parsed data
+      \param verticesOnly skip normals and faces (e.g. when only bounds are needed)
+      \return false if the file couldn't be opened or a face uses a relative
+      or out-of-range vertex or normal index (the reason is printed)
+      */
+    inline bool read(const std::string& filename, ObjData& out, bool verticesOnly = false) {
+        obj_internalMappedFile file;
+        if (!file.open(filename)) return false;
+
+        const char* begin = file.data;
+        const char* end = file.data + file.size;
+
+        size_t nChunks = 1;
+        if (file.size >= OBJ_MIN_PARALLEL_BYTES) nChunks = Parallel::numThreads() * OBJ_CHUNKS_PER_THREAD;
+
+        // Chunk boundaries snapped forward to the start of the next line
+        std::vector<const char*> bounds(nChunks + 1);
+        bounds[0] = begin;
+        bounds[nChunks] = end;
+        for (size_t c = 1; c < nChunks; c++) {
+            const char* p = begin + file.size * c / nChunks;
+            if (p < bounds[c - 1]) p = bounds[c - 1];
+            const char* nl = (p < end) ? (const char*) memchr(p, '\n', end - p) : nullptr;
+            bounds[c] = nl ? nl + 1 : end;
+        }
+
+        std::vector<obj_internalChunk> chunks(nChunks);
+        Parallel::parallelFor(0, nChunks, [&](size_t c) {
+            obj_internalParseChunk(bounds[c], bounds[c + 1], chunks[c], verticesOnly);
+        });
+
+        size_t nPositions = 0, nNormals = 0, nIndices = 0, faces = 0, facesWithNormals = 0;
+        for (const obj_internalChunk& chunk : chunks) {
+            if (chunk.negativeIndex) {
+                printf("Relative (negative) face indices are not supported when reading OBJ %s.\n", filename.c_str());
+                return false;
+            }
+            nPositions += chunk.positions.size();
+            nNormals += chunk.normals.size();
+            nIndices += chunk.indices.size();
+            faces += chunk.faces;
+            facesWithNormals += chunk.facesWithNormals;
+            out.totalLines += chunk.totalLines;
+            out.ignoredLines += chunk.ignoredLines;
+        }
+
+        const bool keepNormalIndices = faces > 0 && faces == facesWithNormals;
+
+        out.positions.resize(nPositions);
+        out.normals.resize(nNormals);
+        out.indices.resize(nIndices);
+        out.normalIndices.resize(keepNormalIndices ? nIndices : 0);
+
+        // Stitch the chunks back together in file order
+        std::vector<size_t> positionBase(nChunks), normalBase(nChunks), indexBase(nChunks);
+        for (size_t c = 0, pb = 0, nb = 0, ib = 0; c < nChunks; c++) {
+            positionBase[c] = pb; pb += chunks[c].positions.size();
+            normalBase[c] = nb;   nb += chunks[c].normals.size();
+            indexBase[c] = ib;    ib += chunks[c].indices.size();
+        }
+
+        Parallel::parallelFor(0, nChunks, [&](size_t c) {
+            const obj_internalChunk& chunk = chunks[c];
+            std::copy(chunk.positions.begin(), chunk.positions.end(), out.positions.begin() + positionBase[c]);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), out.normals.begin() + normalBase[c]);
+            std::copy(chunk.indices.begin(), chunk.indices.end(), out.indices.begin() + indexBase[c]);
+            if (keepNormalIndices)
+                std::copy(chunk.normalIndices.begin(), chunk.normalIndices.end(), out.normalIndices.begin() + indexBase[c]);
+        });
+
+        // Catch out-of-range faces here rather than as a crash later on
+        const size_t nVertices = out.numVertices();
+        for (uint idx : out.indices) {
+            if (idx >= nVertices) {
+                printf("Face index %u out of range (%zu vertices) in OBJ %s.\n", idx + 1, nVertices, filename.c_str());
+                return false;
+            }
+        }
+        const size_t numNormals = out.numNormals();
+        for (uint idx : out.normalIndices) {
+            if (idx >= numNormals) {
+                printf("Face normal index %u out of range (%zu normals) in OBJ %s.\n", idx + 1, numNormals, filename.c_str());
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+#include "SETTINGS.h"
+
+namespace Parallel
+{
+    // Threads the parallel calls made on this thread may use, 0 for every
+    // core. Worker threads inherit it from the thread that starts them.
+    inline thread_local uint parallelThreadLimit = 0;
+
+    inline uint numThreads() {
+        uint n = std::thread::hardware_concurrency();
+        n = n ? n : 1;
+        return parallelThreadLimit ? std::min(n, parallelThreadLimit) : n;
+    }
+
+    // Limits the parallel calls made on this thread, and on the workers they
+    // start, to the given number of threads while in scope (e.g. one job of
+    // several running side by side)
+    class ThreadBudget {
+    private:
+        uint previous;
+
+    public:
+        explicit ThreadBudget(uint threads): previous(parallelThreadLimit) {
+            parallelThreadLimit = std::max(1u, threads);
+        }
+
+        ~ThreadBudget() {
+            parallelThreadLimit = previous;
+        }
+
+        ThreadBudget(const ThreadBudget&) = delete;
+        ThreadBudget& operator=(const ThreadBudget&) = delete;
+    };
+
+    /*!
+      \brief Calls fn(i) for every i in [begin, end) across all cores. Work is
+      handed out in chunks of `grain` from a shared counter, so uneven
+      iterations balance out.
+      \param begin, end index range
+      \param fn callable taking a size_t
+      \param grain number of consecutive indices a thread claims at once
+      */
+    template<typename F>
+    inline void parallelFor(size_t begin, size_t end, F fn, size_t grain = 1) {
+        if (end <= begin) return;
+
+        const size_t count = end - begin;
+        const uint threads = std::min<size_t>(numThreads(), (count + grain - 1) / grain);
+
+        if (threads <= 1) {
+            for (size_t i = begin; i < end; i++) fn(i);
+            return;
+        }
+
+        std::atomic<size_t> next(begin);
+        const uint limit = parallelThreadLimit;
+        auto worker = [&]() {
+            parallelThreadLimit = limit;
+            while (true) {
+                const size_t start = next.fetch_add(grain);
+                if (start >= end) break;
+                const size_t stop = std::min(end, start + grain);
+                for (size_t i = start; i < stop; i++) fn(i);
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (uint t = 1; t < threads; t++) pool.emplace_back(worker);
+        worker();
+        for (std::thread& t : pool) t.join();
+    }
+
+    // Default edge length of the tiles handed out by parallelTiles
+    static const uint PARALLEL_TILE_SIZE = 16;
+
+    // Half-open box of grid points [x0, x1) x [y0, y1) x [z0, z1)
+    struct Tile {
+        uint x0, y0, z0;
+        uint x1, y1, z1;
+    };
+
+    /*!
+      \brief What a parallelTiles call did per thread: busy time is the time
+      spent inside tiles, so busy / wall is the thread's utilization.
+      */
+    struct SchedulerStats {
+        double wallSeconds = 0;
+        std::vector<double> busySeconds;
+        std::vector<size_t> tilesRun, tilesStolen;
+
+        size_t totalTiles() const {
+            size_t n = 0;
+            for (size_t t : tilesRun) n += t;
+            return n;
+        }
+
+        // Accumulates the stats of another call over the same threads
+        void add(const SchedulerStats& other) {
+            wallSeconds += other.wallSeconds;
+            if (busySeconds.size() < other.busySeconds.size()) {
+                busySeconds.resize(other.busySeconds.size(), 0);
+                tilesRun.resize(other.busySeconds.size(), 0);
+                tilesStolen.resize(other.busySeconds.size(), 0);
+            }
+            for (size_t t = 0; t < other.busySeconds.size(); t++) {
+                busySeconds[t] += other.busySeconds[t];
+                tilesRun[t] += other.tilesRun[t];
+                tilesStolen[t] += other.tilesStolen[t];
+            }
+        }
+
+        void print(const char* label) const {
+            size_t stolen = 0;
+            for (size_t t : tilesStolen) stolen += t;
+            printf("%s: %zu tiles on %zu threads in %.3fs, %zu stolen, utilization", label, totalTiles(),
+                busySeconds.size(), wallSeconds, stolen);
+            for (double busy : busySeconds)
+                printf(" %.0f%%", wallSeconds > 0 ? 100.0 * busy / wallSeconds : 100.0);
+            printf("\n");
+        }
+    };
+
+    /*!
+      \brief Calls fn(tile) for every tileSize^3 tile of an nx x ny x nz grid
+      across all cores. Each thread starts with a contiguous run of tiles in
+      its own deque and works through it front to back; a thread that runs
+      dry steals from the back of another thread's deque, so a few expensive
+      tiles (e.g. deep Julia iterations inside a portal) don't leave the other
+      cores idle. Tiles are independent; fn must only write inside its tile.
+      \param nx, ny, nz grid size in points
+      \param fn callable taking a const Tile&
+      \param tileSize tile edge length
+      \return per-thread utilization
+      */
+    template<typename F>
+    inline SchedulerStats parallelTiles(uint nx, uint ny, uint nz, F fn, uint tileSize = PARALLEL_TILE_SIZE) {
+        typedef std::chrono::steady_clock Clock;
+        SchedulerStats stats;
+        if (nx == 0 || ny == 0 || nz == 0) return stats;
+
+        const uint tx = (nx + tileSize - 1) / tileSize, ty = (ny + tileSize - 1) / tileSize, tz = (nz + tileSize - 1) / tileSize;
+        const size_t numTiles = size_t(tx) * ty * tz;
+        const uint threads = uint(std::min<size_t>(numThreads(), numTiles));
+
+        auto tileAt = [&](size_t i) {
+            const uint x = uint(i % tx), y = uint((i / tx) % ty), z = uint(i / (size_t(tx) * ty));
+            return Tile{ x * tileSize, y * tileSize, z * tileSize,
+                std::min(nx, (x + 1) * tileSize), std::min(ny, (y + 1) * tileSize), std::min(nz, (z + 1) * tileSize) };
+        };
+
+        struct Queue {
+            std::mutex lock;
+            std::deque<size_t> tiles;
+        };
+        std::vector<Queue> queues(threads);
+        for (uint t = 0; t < threads; t++)
+            for (size_t i = numTiles * t / threads; i < numTiles * (t + 1) / threads; i++)
+                queues[t].tiles.push_back(i);
+
+        stats.busySeconds.assign(threads, 0);
+        stats.tilesRun.assign(threads, 0);
+        stats.tilesStolen.assign(threads, 0);
+
+        // No tiles are added once started, so a thread that finds every
+        // deque empty is done
+        const uint limit = parallelThreadLimit;
+        auto worker = [&](uint self) {
+            parallelThreadLimit = limit;
+            while (true) {
+                size_t tile = 0;
+                bool found = false, stolen = false;
+                {
+                    std::lock_guard<std::mutex> guard(queues[self].lock);
+                    if (!queues[self].tiles.empty()) {
+                        tile = queues[self].tiles.front();
+                        queues[self].tiles.pop_front();
+                        found = true;
+                    }
+                }
+                for (uint k = 1; !found && k < threads; k++) {
+                    Queue& victim = queues[(self + k) % threads];
+                    std::lock_guard<std::mutex> guard(victim.lock);
+                    if (!victim.tiles.empty()) {
+                        tile = victim.tiles.back();
+                        victim.tiles.pop_back();
+                        found = stolen = true;
+                    }
+                }
+                if (!found) break;
+
+                const Clock::time_point start = Clock::now();
+                fn(tileAt(tile));
+                stats.busySeconds[self] += std::chrono::duration<double>(Clock::now() - start).count();
+                stats.tilesRun[self]++;
+                if (stolen) stats.tilesStolen[self]++;
+            }
+        };
+
+        const Clock::time_point start = Clock::now();
+        std::vector<std::thread> pool;
+        for (uint t = 1; t < threads; t++) pool.emplace_back(worker, t);
+        worker(0);
+        for (std::thread& t : pool) t.join();
+        stats.wallSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        return stats;
+    }
+}
+
+#endif
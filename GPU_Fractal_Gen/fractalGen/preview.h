@@ -0,0 +1,228 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+
+#include "SETTINGS.h"
+#include "field.h"
+#include "parallel.h"
+
+using namespace std;
+
+// Renders a field directly, without meshing, by sphere tracing its zero
+// level set from a pinhole camera. Steps come from the first-order distance
+// estimate f / |grad f|, with the gradient carried through the Julia
+// iterations by getValueAndGradient, so empty space is crossed in a few large
+// steps and only rays grazing the surface take many. Rows of pixels are
+// traced tile by tile on all cores.
+namespace Preview
+{
+    static const int PV_DEFAULT_SIZE = 512;
+
+    // Bisection steps that pin a hit down once a step crosses the surface
+    static const int PV_REFINE_ITERATIONS = 8;
+
+    struct Camera {
+        VEC3F eye;
+        VEC3F target;
+        VEC3F up = VEC3F(0, 1, 0);
+        Real  fov = 35;   // vertical, in degrees
+
+        // Looks at the center of the box from a diagonal, far enough back
+        // that the whole box is in view
+        static Camera framing(const AABB& box, Real fov = 35) {
+            Camera c;
+            c.fov = fov;
+            c.target = box.center();
+            const Real radius = box.span().norm() / 2;
+            c.eye = c.target + VEC3F(1, 0.7, 1.3).normalized() * (radius / sin(fov * M_PI / 360));
+            return c;
+        }
+    };
+
+    struct RenderSettings {
+        int  width = PV_DEFAULT_SIZE, height = PV_DEFAULT_SIZE;
+        int  maxSteps = 160;
+        Real stepScale = 0.6;      // fraction of the distance estimate taken per step; the field isn't a true distance
+        Real maxStepFraction = 1.0 / 64;   // of the bounds diagonal, so portal edges aren't stepped over
+        Real minStepPixels = 0.5;  // steps are at least this many pixel footprints long
+    };
+
+    struct RenderStats {
+        size_t rays = 0, hits = 0, steps = 0;
+
+        void print() const {
+            printf("Preview: %zu rays, %zu hit (%.1f%%), %.1f field evaluations per ray\n", rays, hits,
+                   rays ? 100.0 * hits / rays : 0.0, rays ? (double) steps / rays : 0.0);
+        }
+    };
+
+    struct Image {
+        int width = 0, height = 0;
+        std::vector<uint8_t> rgb;
+
+        Image(int width = 0, int height = 0): width(width), height(height), rgb(size_t(width) * height * 3, 0) {}
+
+        // Binary PPM (P6), 8 bits per channel
+        bool writePPM(string filename) const {
+            FILE* file = fopen(filename.c_str(), "wb");
+            if (file == NULL) {
+                printf("Could not open %s for writing.\n", filename.c_str());
+                return false;
+            }
+            fprintf(file, "P6\n%d %d\n255\n", width, height);
+            fwrite(rgb.data(), 1, rgb.size(), file);
+
+            PROFILE_COUNT("io/bytes written", ftell(file));
+            fclose(file);
+
+            printf("Wrote %dx%d preview to %s\n", width, height, filename.c_str());
+            return true;
+        }
+    };
+
+    // Parameter interval [tNear, tFar] of the ray inside the box; false if it misses
+    static inline bool pv_internalClip(const AABB& box, const VEC3F& origin, const VEC3F& dir, Real& tNear, Real& tFar) {
+        tNear = 0;
+        tFar = numeric_limits<Real>::max();
+        for (int k = 0; k < 3; k++) {
+            const Real inv = 1 / dir[k];
+            Real t0 = (box.min()[k] - origin[k]) * inv, t1 = (box.max()[k] - origin[k]) * inv;
+            if (t0 > t1) std::swap(t0, t1);
+            tNear = std::max(tNear, t0);
+            tFar = std::min(tFar, t1);
+        }
+        return tNear <= tFar;
+    }
+
+    static inline uint8_t pv_internalByte(Real v) {
+        return uint8_t(std::min(Real(255), std::max(Real(0), v * 255 + Real(0.5))));
+    }
+
+    /*!
+      \brief Sphere traces the zero level set of the field (negative inside)
+      within the box and shades hits by their gradient normal. Pixels are
+      traced in parallel tiles if the field supports concurrent reads.
+      \param field the field; its getValueAndGradient drives the steps
+      \param box the region the field is defined in; rays start and stop at it
+      \param camera the camera
+      \param settings image size and tracing controls
+      \param stats filled in if not null
+      \return the image, rows top to bottom
+      */
+    inline Image render(const FieldFunction3D& field, const AABB& box, const Camera& camera,
+                        const RenderSettings& settings = RenderSettings(), RenderStats* stats = nullptr) {
+        PROFILE_SCOPE("render preview");
+        Image image(settings.width, settings.height);
+
+        const VEC3F forward = (camera.target - camera.eye).normalized();
+        VEC3F right = forward.cross(camera.up);
+        if (right.norm() < 1e-6) right = forward.cross(VEC3F(0, 0, 1));
+        right.normalize();
+        const VEC3F up = right.cross(forward);
+
+        const Real halfHeight = tan(camera.fov * M_PI / 360);
+        const Real halfWidth = halfHeight * settings.width / settings.height;
+        const Real pixelAngle = 2 * halfHeight / settings.height;
+        const Real maxStep = box.span().norm() * settings.maxStepFraction;
+
+        // Lit from over the camera's shoulder, with a dim fill from the opposite side
+        const VEC3F key = (up * 0.8 + right * 0.5 - forward * 0.6).normalized();
+        const VEC3F base(0.95, 0.55, 0.45);
+
+        std::atomic<size_t> hits(0), steps(0);
+
+        auto traceTile = [&](const Parallel::Tile& tile) {
+            size_t tileHits = 0, tileSteps = 0;
+            for (uint y = tile.y0; y < tile.y1; y++) {
+                for (uint x = tile.x0; x < tile.x1; x++) {
+                    const Real u = ((x + Real(0.5)) / settings.width * 2 - 1) * halfWidth;
+                    const Real v = (1 - (y + Real(0.5)) / settings.height * 2) * halfHeight;
+                    const VEC3F dir = (forward + right * u + up * v).normalized();
+
+                    // Sky fades from top to bottom
+                    const Real sky = 0.25 + 0.15 * (1 - Real(y) / settings.height);
+                    VEC3F color(sky, sky, sky * 1.1);
+
+                    Real t, tFar;
+                    if (pv_internalClip(box, camera.eye, dir, t, tFar)) {
+                        Real tPrev = t;
+                        bool hit = false, crossed = false;
+                        VEC3F gradient;
+                        for (int i = 0; i < settings.maxSteps && t <= tFar; i++) {
+                            const Real value = field.getValueAndGradient(camera.eye + dir * t, gradient);
+                            tileSteps++;
+                            if (value <= 0) {
+                                hit = true;
+                                crossed = i > 0;
+                                break;
+                            }
+
+                            // Near debris the estimate collapses without the ray
+                            // ever entering, so it only sets the step; a hit
+                            // needs the field to change sign
+                            const Real slope = gradient.norm();
+                            const Real distance = (slope > 0 && std::isfinite(slope)) ? value / slope : maxStep;
+                            tPrev = t;
+                            t += std::min(maxStep, std::max(settings.minStepPixels * pixelAngle * t, settings.stepScale * distance));
+                        }
+
+                        if (hit) {
+                            // A step that overshot into the inside is pulled back onto the surface
+                            if (crossed) {
+                                Real lo = tPrev, hi = t;
+                                for (int i = 0; i < PV_REFINE_ITERATIONS; i++) {
+                                    const Real mid = (lo + hi) / 2;
+                                    if (field.getFieldValue(camera.eye + dir * mid) > 0) lo = mid;
+                                    else hi = mid;
+                                }
+                                tileSteps += PV_REFINE_ITERATIONS;
+                                t = hi;
+                                field.getValueAndGradient(camera.eye + dir * t, gradient);
+                                tileSteps++;
+                            }
+
+                            VEC3F normal = gradient.norm() > 0 && std::isfinite(gradient.norm()) ? VEC3F(gradient.normalized()) : VEC3F(-dir);
+                            if (normal.dot(dir) > 0) normal = -normal;
+                            const Real diffuse = std::max(Real(0), normal.dot(key));
+                            const Real fill = std::max(Real(0), -normal.dot(key)) * 0.2;
+                            const Real facing = std::max(Real(0), -normal.dot(dir));
+                            color = base * (0.12 + 0.7 * diffuse + fill + 0.18 * facing);
+                            tileHits++;
+                        }
+                    }
+
+                    uint8_t* pixel = &image.rgb[(size_t(y) * settings.width + x) * 3];
+                    for (int k = 0; k < 3; k++) pixel[k] = pv_internalByte(std::pow(color[k], Real(1 / 2.2)));
+                }
+            }
+            hits += tileHits;
+            steps += tileSteps;
+        };
+
+        if (field.supportsConcurrentReads()) {
+            Parallel::SchedulerStats schedule = Parallel::parallelTiles(settings.width, settings.height, 1, traceTile);
+            schedule.print("Preview tiles");
+        } else {
+            const uint tileSize = Parallel::PARALLEL_TILE_SIZE;
+            for (uint y = 0; y < uint(settings.height); y += tileSize)
+                traceTile(Parallel::Tile{ 0, y, 0, uint(settings.width), std::min(uint(settings.height), y + tileSize), 1 });
+        }
+
+        PROFILE_COUNT("preview/field evaluations", steps.load());
+        if (stats) {
+            stats->rays = size_t(settings.width) * settings.height;
+            stats->hits = hits;
+            stats->steps = steps;
+        }
+        return image;
+    }
+}
+
+#endif
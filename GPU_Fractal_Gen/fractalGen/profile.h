@@ -0,0 +1,443 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+
+#include "SETTINGS.h"
+
+// Hot-path instrumentation: scoped stage timers, named counters and small
+// histograms, kept per thread and merged on output into a Chrome trace-event
+// JSON file (chrome://tracing, Perfetto) and a summary table.
+//
+// Everything is off until Profile::start(). While off, each probe is one
+// relaxed load and a branch; build with -DPROFILE_COMPILED=0 to remove the
+// probes altogether. Counter and histogram names are registered the first
+// time their probe fires, so probes only need a string literal.
+//
+//   PROFILE_SCOPE("march_cubes");                    // timed until end of scope
+//   PROFILE_COUNT("field/R3JuliaSet", 1);
+//   PROFILE_HISTOGRAM("julia/iterations", iterations);
+#ifndef PROFILE_COMPILED
+#define PROFILE_COMPILED 1
+#endif
+
+namespace Profile
+{
+    static const int PROFILE_MAX_COUNTERS   = 64;
+    static const int PROFILE_MAX_HISTOGRAMS = 16;
+    static const int PROFILE_HISTOGRAM_BINS = 64;   // the last bin also holds all larger values
+
+    // Counters with fixed ids, so the allocation hooks never have to register
+    enum BuiltinCounter { ALLOCATIONS = 0, ALLOCATED_BYTES, BYTES_WRITTEN, NUM_BUILTIN_COUNTERS };
+
+    struct Event {
+        const char* name;
+        int64_t start, duration;    // microseconds since the trace origin
+    };
+
+    // Counts of one thread. Only the owning thread writes them, so a relaxed
+    // load and store increments them; they are atomic so totals() can read
+    // them while the thread runs.
+    struct ThreadState {
+        uint32_t id = 0;
+        std::atomic<uint64_t> counters[PROFILE_MAX_COUNTERS] = {};
+        std::atomic<uint64_t> histograms[PROFILE_MAX_HISTOGRAMS][PROFILE_HISTOGRAM_BINS] = {};
+        std::vector<Event> events;
+    };
+
+    // Stages recorded by a thread that has exited
+    struct RetiredTrack {
+        uint32_t id;
+        std::vector<Event> events;
+    };
+
+    struct Registry {
+        std::mutex lock;
+        std::vector<ThreadState*> threads;      // live threads, each owned by its ThreadOwner
+        uint32_t nextThreadId = 0;
+
+        // Counts and stages of exited threads, merged in when they exit
+        uint64_t retiredCounters[PROFILE_MAX_COUNTERS] = {};
+        uint64_t retiredHistograms[PROFILE_MAX_HISTOGRAMS][PROFILE_HISTOGRAM_BINS] = {};
+        std::vector<RetiredTrack> retired;
+
+        std::vector<std::string> counterNames = { "alloc/count", "alloc/bytes", "io/bytes written" };
+        std::vector<std::string> histogramNames;
+        std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+        int sessions = 0;
+    };
+
+    // Owns the profile state of its thread and retires it when the thread
+    // exits, so short-lived parallelFor workers don't each leave a state behind
+    struct ThreadOwner {
+        std::unique_ptr<ThreadState> state;
+        ~ThreadOwner();
+    };
+
+    inline std::atomic<bool> profileEnabled(false);
+    inline thread_local ThreadState* profileThread = nullptr;
+    inline thread_local ThreadOwner profileOwner;
+
+    inline Registry& registry() {
+        static Registry r;
+        return r;
+    }
+
+    // Blocks of the allocation hooks: a header holding the requested size,
+    // padded to keep the block maximally aligned, then the memory handed out
+    static const size_t PROFILE_ALLOCATION_HEADER = alignof(std::max_align_t);
+
+    inline void* profile_internalAllocate(size_t size) {
+        char* block = static_cast<char*>(std::malloc(PROFILE_ALLOCATION_HEADER + size));
+        if (!block) return nullptr;
+        *reinterpret_cast<size_t*>(block) = size;
+        return block + PROFILE_ALLOCATION_HEADER;
+    }
+
+    inline void profile_internalRelease(void* p) {
+        if (p) std::free(static_cast<char*>(p) - PROFILE_ALLOCATION_HEADER);
+    }
+
+    inline bool enabled() {
+        return profileEnabled.load(std::memory_order_relaxed);
+    }
+
+    static inline void profile_internalIncrement(std::atomic<uint64_t>& value, uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    /*!
+      \brief Starts recording. Sessions nest (e.g. concurrent jobs under
+      SERVE); recording stops when the last one ends. The first session
+      clears what earlier sessions recorded. No probe fires between
+      sessions, so the owning threads aren't writing while it does.
+      */
+    inline void start() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        if (r.sessions++ == 0) {
+            for (ThreadState* thread : r.threads) {
+                for (auto& c : thread->counters) c.store(0, std::memory_order_relaxed);
+                for (auto& h : thread->histograms)
+                    for (auto& b : h) b.store(0, std::memory_order_relaxed);
+                thread->events.clear();
+            }
+            std::fill(&r.retiredCounters[0], &r.retiredCounters[0] + PROFILE_MAX_COUNTERS, 0);
+            std::fill(&r.retiredHistograms[0][0], &r.retiredHistograms[0][0] + PROFILE_MAX_HISTOGRAMS * PROFILE_HISTOGRAM_BINS, 0);
+            r.retired.clear();
+        }
+        profileEnabled.store(true);
+    }
+
+    inline void stop() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        if (r.sessions > 0 && --r.sessions == 0) profileEnabled.store(false);
+    }
+
+    // State of the calling thread, created on first use and retired by its
+    // ThreadOwner when the thread exits
+    inline ThreadState* threadState() {
+        if (profileThread) return profileThread;
+
+        Registry& r = registry();
+        std::unique_ptr<ThreadState> state(new ThreadState());
+        std::lock_guard<std::mutex> guard(r.lock);
+        state->id = r.nextThreadId++;
+        r.threads.push_back(state.get());
+        profileThread = state.get();
+        profileOwner.state = std::move(state);
+        return profileThread;
+    }
+
+    // Folds the exiting thread's counts into the registry's retired totals,
+    // keeps its stages for the trace and frees its state
+    inline ThreadOwner::~ThreadOwner() {
+        if (!state) return;
+        ThreadState* thread = state.get();
+        profileThread = nullptr;    // the allocation hooks stop counting into it
+
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        for (int c = 0; c < PROFILE_MAX_COUNTERS; c++) r.retiredCounters[c] += thread->counters[c].load(std::memory_order_relaxed);
+        for (int h = 0; h < PROFILE_MAX_HISTOGRAMS; h++)
+            for (int b = 0; b < PROFILE_HISTOGRAM_BINS; b++)
+                r.retiredHistograms[h][b] += thread->histograms[h][b].load(std::memory_order_relaxed);
+        if (!thread->events.empty()) r.retired.push_back({ thread->id, std::move(thread->events) });
+        r.threads.erase(std::find(r.threads.begin(), r.threads.end(), thread));
+        state.reset();
+    }
+
+    inline int profile_internalRegister(std::vector<std::string>& names, const char* name, int capacity) {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        for (size_t i = 0; i < names.size(); i++)
+            if (names[i] == name) return int(i);
+        if (int(names.size()) >= capacity) {
+            printf("Profile: too many probes, ignoring %s\n", name);
+            return -1;
+        }
+        names.push_back(name);
+        return int(names.size()) - 1;
+    }
+
+    inline int counterId(const char* name) {
+        return profile_internalRegister(registry().counterNames, name, PROFILE_MAX_COUNTERS);
+    }
+
+    inline int histogramId(const char* name) {
+        return profile_internalRegister(registry().histogramNames, name, PROFILE_MAX_HISTOGRAMS);
+    }
+
+    inline void count(int id, uint64_t n) {
+        if (id >= 0) profile_internalIncrement(threadState()->counters[id], n);
+    }
+
+    inline void sample(int id, int64_t value) {
+        if (id < 0) return;
+        const int bin = int(std::min<int64_t>(std::max<int64_t>(value, 0), PROFILE_HISTOGRAM_BINS - 1));
+        profile_internalIncrement(threadState()->histograms[id][bin], 1);
+    }
+
+    inline int64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - registry().origin).count();
+    }
+
+    // Times its own lifetime as one trace event, if recording when created
+    class ScopedTimer {
+    private:
+        const char* name;
+        int64_t startTime = -1;
+
+    public:
+        explicit ScopedTimer(const char* name): name(name) {
+            if (enabled()) startTime = now();
+        }
+
+        ~ScopedTimer() {
+            if (startTime >= 0) threadState()->events.push_back({ name, startTime, now() - startTime });
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+    };
+
+    // Sums of every thread's counters and histograms, exited threads included
+    struct Totals {
+        std::vector<uint64_t> counters;
+        std::vector<std::vector<uint64_t>> histograms;
+    };
+
+    inline Totals totals() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        Totals t;
+        t.counters.assign(r.counterNames.size(), 0);
+        t.histograms.assign(r.histogramNames.size(), std::vector<uint64_t>(PROFILE_HISTOGRAM_BINS, 0));
+        for (size_t c = 0; c < t.counters.size(); c++) t.counters[c] = r.retiredCounters[c];
+        for (size_t h = 0; h < t.histograms.size(); h++)
+            for (int b = 0; b < PROFILE_HISTOGRAM_BINS; b++) t.histograms[h][b] = r.retiredHistograms[h][b];
+        for (const ThreadState* thread : r.threads) {
+            for (size_t c = 0; c < t.counters.size(); c++) t.counters[c] += thread->counters[c].load(std::memory_order_relaxed);
+            for (size_t h = 0; h < t.histograms.size(); h++)
+                for (int b = 0; b < PROFILE_HISTOGRAM_BINS; b++) t.histograms[h][b] += thread->histograms[h][b].load(std::memory_order_relaxed);
+        }
+        return t;
+    }
+
+    static inline void profile_internalWriteString(FILE* file, const std::string& s) {
+        fputc('"', file);
+        for (char c : s) {
+            if (c == '"' || c == '\\') fputc('\\', file);
+            fputc(c, file);
+        }
+        fputc('"', file);
+    }
+
+    /*!
+      \brief Writes every recorded stage as a complete ("X") trace event, one
+      track per thread, followed by the counter totals as a counter ("C")
+      event and the histograms under "otherData".
+      \return false if the file couldn't be written
+      */
+    inline bool writeChromeTrace(const std::string& path) {
+        const Totals t = totals();
+        const int64_t end = now();
+
+        FILE* file = fopen(path.c_str(), "w");
+        if (file == NULL) return false;
+
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+
+        std::vector<RetiredTrack> tracks;
+        for (const ThreadState* thread : r.threads) tracks.push_back({ thread->id, thread->events });
+        tracks.insert(tracks.end(), r.retired.begin(), r.retired.end());
+        std::sort(tracks.begin(), tracks.end(), [](const RetiredTrack& a, const RetiredTrack& b) { return a.id < b.id; });
+
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool first = true;
+        for (const RetiredTrack& track : tracks) {
+            if (track.events.empty()) continue;
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                first ? "" : ",\n", track.id, track.id);
+            first = false;
+            for (const Event& e : track.events) {
+                fprintf(file, ",\n{\"name\":");
+                profile_internalWriteString(file, e.name);
+                fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lld,\"dur\":%lld}",
+                    track.id, (long long) e.start, (long long) e.duration);
+            }
+        }
+
+        fprintf(file, "%s{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":%lld,\"args\":{", first ? "" : ",\n", (long long) end);
+        for (size_t c = 0; c < t.counters.size(); c++) {
+            fprintf(file, "%s", c ? "," : "");
+            profile_internalWriteString(file, r.counterNames[c]);
+            fprintf(file, ":%llu", (unsigned long long) t.counters[c]);
+        }
+        fprintf(file, "}}\n],\"otherData\":{");
+        for (size_t h = 0; h < t.histograms.size(); h++) {
+            fprintf(file, "%s", h ? "," : "");
+            profile_internalWriteString(file, r.histogramNames[h]);
+            fprintf(file, ":[");
+            for (int b = 0; b < PROFILE_HISTOGRAM_BINS; b++)
+                fprintf(file, "%s%llu", b ? "," : "", (unsigned long long) t.histograms[h][b]);
+            fprintf(file, "]");
+        }
+        fprintf(file, "}}\n");
+
+        return fclose(file) == 0;
+    }
+
+    // Total of one counter over all threads, 0 if it was never counted
+    inline uint64_t counterTotal(const char* name) {
+        const Totals t = totals();
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        for (size_t c = 0; c < t.counters.size(); c++)
+            if (r.counterNames[c] == name) return t.counters[c];
+        return 0;
+    }
+
+    /*!
+      \brief Prints per-stage call counts and times (summed over threads, so
+      nested and parallel stages overlap), the counter totals and, per
+      histogram, its mean and non-empty bins.
+      */
+    inline void printSummary() {
+        const Totals t = totals();
+
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+
+        struct Stage { size_t calls = 0; int64_t total = 0, longest = 0; };
+        std::map<std::string, Stage> stages;
+        auto addStages = [&stages](const std::vector<Event>& events) {
+            for (const Event& e : events) {
+                Stage& s = stages[e.name];
+                s.calls++;
+                s.total += e.duration;
+                s.longest = std::max(s.longest, e.duration);
+            }
+        };
+        for (const ThreadState* thread : r.threads) addStages(thread->events);
+        for (const RetiredTrack& track : r.retired) addStages(track.events);
+
+        std::vector<std::pair<std::string, Stage>> sorted(stages.begin(), stages.end());
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, Stage>& a, const std::pair<std::string, Stage>& b) {
+            return a.second.total > b.second.total;
+        });
+
+        printf("%-32s %10s %12s %12s %12s\n", "stage", "calls", "total ms", "mean ms", "max ms");
+        for (const auto& s : sorted) {
+            printf("%-32s %10zu %12.3f %12.3f %12.3f\n", s.first.c_str(), s.second.calls,
+                s.second.total / 1e3, s.second.total / 1e3 / s.second.calls, s.second.longest / 1e3);
+        }
+
+        printf("\n%-32s %16s\n", "counter", "total");
+        for (size_t c = 0; c < t.counters.size(); c++) {
+            if (t.counters[c] == 0) continue;
+            printf("%-32s %16llu\n", r.counterNames[c].c_str(), (unsigned long long) t.counters[c]);
+        }
+
+        for (size_t h = 0; h < t.histograms.size(); h++) {
+            uint64_t samples = 0, sum = 0;
+            for (int b = 0; b < PROFILE_HISTOGRAM_BINS; b++) {
+                samples += t.histograms[h][b];
+                sum += t.histograms[h][b] * b;
+            }
+            if (samples == 0) continue;
+
+            printf("\n%s: %llu samples, mean %.3f\n", r.histogramNames[h].c_str(),
+                (unsigned long long) samples, double(sum) / samples);
+            for (int b = 0; b < PROFILE_HISTOGRAM_BINS; b++) {
+                if (t.histograms[h][b] == 0) continue;
+                printf("  %s%-4d %12llu\n", b == PROFILE_HISTOGRAM_BINS - 1 ? ">=" : "  ", b,
+                    (unsigned long long) t.histograms[h][b]);
+            }
+        }
+    }
+}
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+#if PROFILE_COMPILED
+
+#define PROFILE_SCOPE(name) Profile::ScopedTimer PROFILE_CONCAT(PROFILE_SCOPE_, __LINE__)(name)
+#define PROFILE_COUNT(name, n) do { if (Profile::enabled()) { static const int PROFILE_ID = Profile::counterId(name); Profile::count(PROFILE_ID, (n)); } } while (0)
+#define PROFILE_HISTOGRAM(name, value) do { if (Profile::enabled()) { static const int PROFILE_ID = Profile::histogramId(name); Profile::sample(PROFILE_ID, (value)); } } while (0)
+
+// Counts heap allocations into the alloc/ counters. Replaces the global
+// operator new and delete, so it must appear once, at file scope, in one
+// translation unit of the program. Allocations of threads that have no
+// profile state yet are not counted, which keeps the hook from recursing
+// into threadState(). Every block carries a header with its size, so new and
+// delete are a matched pair over malloc and free. They are kept out of line:
+// inlined into their callers, the compiler would see free() called on the
+// result of operator new.
+#if defined(_MSC_VER)
+#define PROFILE_NOINLINE __declspec(noinline)
+#else
+#define PROFILE_NOINLINE __attribute__((noinline))
+#endif
+
+#define PROFILE_ALLOCATION_HOOKS() \
+    PROFILE_NOINLINE void* operator new(size_t size) { \
+        if (Profile::enabled() && Profile::profileThread) { \
+            Profile::profile_internalIncrement(Profile::profileThread->counters[Profile::ALLOCATIONS], 1); \
+            Profile::profile_internalIncrement(Profile::profileThread->counters[Profile::ALLOCATED_BYTES], size); \
+        } \
+        void* p = Profile::profile_internalAllocate(size); \
+        if (!p) throw std::bad_alloc(); \
+        return p; \
+    } \
+    PROFILE_NOINLINE void* operator new[](size_t size) { return operator new(size); } \
+    PROFILE_NOINLINE void operator delete(void* p) noexcept { Profile::profile_internalRelease(p); } \
+    PROFILE_NOINLINE void operator delete[](void* p) noexcept { Profile::profile_internalRelease(p); } \
+    PROFILE_NOINLINE void operator delete(void* p, size_t) noexcept { Profile::profile_internalRelease(p); } \
+    PROFILE_NOINLINE void operator delete[](void* p, size_t) noexcept { Profile::profile_internalRelease(p); }
+
+#else
+
+#define PROFILE_SCOPE(name) do {} while (0)
+#define PROFILE_COUNT(name, n) do {} while (0)
+#define PROFILE_HISTOGRAM(name, value) do {} while (0)
+#define PROFILE_ALLOCATION_HOOKS()
+
+#endif
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef SAMPLECACHE_H
+#define SAMPLECACHE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "SETTINGS.h"
+#include "field.h"
+#include "mesh.h"
+#include "parallel.h"
+
+// Persistent caches for a field graph that is expensive to evaluate, keyed by
+// a hash of everything that determines its values (see fieldCacheKey in
+// generator.h). A sample file holds the lattice samples of one grid, filled
+// in one z-slab at a time, so an interrupted run picks up after the last
+// slab it finished. A mesh file holds the raw extracted mesh, so a run that
+// only changes post-processing skips the field altogether.
+//
+// Sample file layout:
+//   SampleHeader | uint8 slabDone[zRes], padded to 8 bytes | double samples[zRes][yRes][xRes]
+// Mesh file layout:
+//   MeshHeader | double vertices[3 * numVertices] | double normals[3 * numNormals] | uint32 indices[numIndices]
+namespace SampleCache
+{
+    static const char SC_SAMPLE_MAGIC[8] = {'F', 'S', 'C', 'S', 'M', 'P', 'L', '1'};
+    static const char SC_MESH_MAGIC[8]   = {'F', 'S', 'C', 'M', 'E', 'S', 'H', '1'};
+
+    struct SampleHeader {
+        char     magic[8];
+        uint64_t key;
+        uint32_t xRes, yRes, zRes;
+        uint32_t reserved;
+    };
+
+    struct MeshHeader {
+        char     magic[8];
+        uint64_t key;
+        uint64_t numVertices, numNormals, numIndices;
+    };
+
+    static inline size_t sc_internalFlagsSize(uint zRes) {
+        return (zRes + 7) & ~size_t(7);
+    }
+
+    // Writes the pages of a shared mapping that hold [p, p + size) through
+    // to the file and waits for them
+    static inline void sc_internalFlush(const void* p, size_t size) {
+#ifdef _WIN32
+        (void) p; (void) size;
+#else
+        const uintptr_t page = uintptr_t(sysconf(_SC_PAGESIZE));
+        const uintptr_t begin = uintptr_t(p) & ~(page - 1);
+        msync((void*) begin, uintptr_t(p) + size - begin, MS_SYNC);
+#endif
+    }
+
+    // Writes to a temporary file next to `path` and renames it into place, so
+    // a reader never sees a half-written file
+    inline bool writeFileAtomically(const std::string& path, const std::function<bool(FILE*)>& write) {
+        std::string tmp = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+#ifndef _WIN32
+        tmp += "." + std::to_string(getpid());
+#endif
+        FILE* file = fopen(tmp.c_str(), "wb");
+        if (file == NULL) return false;
+        const bool ok = write(file);
+        PROFILE_COUNT("io/bytes written", ftell(file));
+        if (fclose(file) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /*!
+      \brief Writes the raw mesh (full precision, normals if it has any) under `key`.
+      \return false if the file couldn't be written
+      */
+    inline bool writeMesh(const std::string& path, uint64_t key, const Mesh& mesh) {
+        return writeFileAtomically(path, [&](FILE* file) {
+            MeshHeader header;
+            memcpy(header.magic, SC_MESH_MAGIC, 8);
+            header.key = key;
+            header.numVertices = mesh.vertices.size();
+            header.numNormals = mesh.normals.size();
+            header.numIndices = mesh.indices.size();
+
+            std::vector<double> values;
+            values.reserve(3 * (mesh.vertices.size() + mesh.normals.size()));
+            for (const VEC3F& v : mesh.vertices) values.insert(values.end(), { v[0], v[1], v[2] });
+            for (const VEC3F& n : mesh.normals) values.insert(values.end(), { n[0], n[1], n[2] });
+            std::vector<uint32_t> indices(mesh.indices.begin(), mesh.indices.end());
+
+            return fwrite(&header, sizeof(header), 1, file) == 1
+                && fwrite(values.data(), sizeof(double), values.size(), file) == values.size()
+                && fwrite(indices.data(), sizeof(uint32_t), indices.size(), file) == indices.size();
+        });
+    }
+
+    /*!
+      \brief Reads a mesh written by writeMesh.
+      \return false if there is no complete mesh for `key` at `path`
+      */
+    inline bool readMesh(const std::string& path, uint64_t key, Mesh& mesh) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == NULL) return false;
+
+        MeshHeader header;
+        bool ok = fread(&header, sizeof(header), 1, file) == 1
+            && memcmp(header.magic, SC_MESH_MAGIC, 8) == 0 && header.key == key;
+
+        std::vector<double> values;
+        std::vector<uint32_t> indices;
+        if (ok) {
+            values.resize(3 * (header.numVertices + header.numNormals));
+            indices.resize(header.numIndices);
+            ok = fread(values.data(), sizeof(double), values.size(), file) == values.size()
+              && fread(indices.data(), sizeof(uint32_t), indices.size(), file) == indices.size();
+        }
+        fclose(file);
+        if (!ok) return false;
+
+        mesh = Mesh();
+        mesh.vertices.resize(header.numVertices);
+        mesh.normals.resize(header.numNormals);
+        const double* p = values.data();
+        for (VEC3F& v : mesh.vertices) { v = VEC3F(p[0], p[1], p[2]); p += 3; }
+        for (VEC3F& n : mesh.normals)  { n = VEC3F(p[0], p[1], p[2]); p += 3; }
+        mesh.indices.assign(indices.begin(), indices.end());
+        return true;
+    }
+}
+
+// A VirtualGrid3D whose lattice samples live in a memory-mapped sample file.
+// The first read from a z-slab evaluates the whole slab in parallel, stores
+// it and marks it done in the file; slabs already done by an earlier run with
+// the same key are read straight from the mapping. Off-lattice reads (root
+// finding, gradients) go to the field. If the file can't be opened or mapped
+// the grid warns and behaves like a plain VirtualGrid3D.
+class VirtualGrid3DDiskCached: public VirtualGrid3D {
+private:
+    uint8_t* mapped = nullptr;
+    size_t mappedSize = 0;
+    uint8_t* slabDone = nullptr;
+    double* samples = nullptr;
+    std::unique_ptr<std::atomic<bool>[]> ready;
+    std::mutex fillLock;
+#ifndef _WIN32
+    int fd = -1;
+#endif
+
+    bool open(const std::string& path, uint64_t key) {
+#ifdef _WIN32
+        (void) path; (void) key;
+        return false;
+#else
+        const size_t flagsSize = SampleCache::sc_internalFlagsSize(zRes);
+        const size_t total = sizeof(SampleCache::SampleHeader) + flagsSize + sizeof(double) * size_t(xRes) * yRes * zRes;
+
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+
+        // One writer per sample file; a second job on the same field (e.g.
+        // under SERVE) samples without the cache rather than wait
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+
+        // A file of the wrong size or for another key is started over
+        SampleCache::SampleHeader header;
+        bool valid = size_t(st.st_size) == total
+            && pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header)
+            && memcmp(header.magic, SampleCache::SC_SAMPLE_MAGIC, 8) == 0
+            && header.key == key && header.xRes == xRes && header.yRes == yRes && header.zRes == zRes;
+        if (!valid) {
+            if (ftruncate(fd, 0) != 0 || ftruncate(fd, total) != 0) return false;
+            memcpy(header.magic, SampleCache::SC_SAMPLE_MAGIC, 8);
+            header.key = key;
+            header.xRes = xRes;
+            header.yRes = yRes;
+            header.zRes = zRes;
+            header.reserved = 0;
+            if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) return false;
+        }
+
+        void* m = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED) return false;
+        mapped = (uint8_t*) m;
+        mappedSize = total;
+        slabDone = mapped + sizeof(SampleCache::SampleHeader);
+        samples = (double*) (slabDone + flagsSize);
+        return true;
+#endif
+    }
+
+    void fillSlab(uint z) {
+        std::lock_guard<std::mutex> guard(fillLock);
+        if (ready[z].load(std::memory_order_acquire)) return;
+        PROFILE_SCOPE("sample cache slab");
+
+        double* slab = samples + size_t(z) * xRes * yRes;
+        auto fillRow = [&](size_t y) {
+            for (uint x = 0; x < xRes; x++)
+                slab[y * xRes + x] = VirtualGrid3D::getf(x, y, z);
+        };
+        if (VirtualGrid3D::supportsConcurrentReads()) {
+            Parallel::parallelFor(0, yRes, fillRow);
+        } else {
+            for (uint y = 0; y < yRes; y++) fillRow(y);
+        }
+
+        // The flag goes in only once the samples are on disk, so even a crash
+        // or power loss never leaves a slab marked done with its samples
+        // missing. The flag itself may still be lost, which only costs
+        // evaluating the slab again.
+        SampleCache::sc_internalFlush(slab, sizeof(double) * xRes * yRes);
+        slabDone[z] = 1;
+        slabsEvaluated++;
+        PROFILE_COUNT("sample cache/slabs evaluated", 1);
+        ready[z].store(true, std::memory_order_release);
+    }
+
+public:
+    size_t slabsResumed = 0;    // done by an earlier run
+    std::atomic<size_t> slabsEvaluated{0};
+
+    VirtualGrid3DDiskCached(uint xRes, uint yRes, uint zRes, VEC3F functionMin, VEC3F functionMax, FieldFunction3D* fieldFunction,
+                            const std::string& path, uint64_t key):
+        VirtualGrid3D(xRes, yRes, zRes, functionMin, functionMax, fieldFunction),
+        ready(new std::atomic<bool>[zRes])
+    {
+        if (!open(path, key)) {
+            printf("Warning: could not map sample cache %s, evaluating without it\n", path.c_str());
+        }
+        for (uint z = 0; z < zRes; z++) {
+            const bool done = mapped && slabDone[z];
+            ready[z].store(done);
+            if (done) slabsResumed++;
+        }
+    }
+
+    ~VirtualGrid3DDiskCached() {
+#ifndef _WIN32
+        if (mapped) {
+            msync(mapped, mappedSize, MS_ASYNC);
+            munmap(mapped, mappedSize);
+        }
+        if (fd >= 0) ::close(fd);  // releases the lock
+#endif
+    }
+
+    VirtualGrid3DDiskCached(const VirtualGrid3DDiskCached&) = delete;
+    VirtualGrid3DDiskCached& operator=(const VirtualGrid3DDiskCached&) = delete;
+
+    bool isMapped() const { return mapped != nullptr; }
+
+    virtual Real get(uint x, uint y, uint z) const override {
+        if (!mapped) return VirtualGrid3D::getf(x, y, z);
+        if (!ready[z].load(std::memory_order_acquire))
+            const_cast<VirtualGrid3DDiskCached*>(this)->fillSlab(z);
+        return samples[(size_t(z) * yRes + y) * xRes + x];
+    }
+
+    virtual Real getf(Real x, Real y, Real z) const override {
+        if (x == floor(x) && y == floor(y) && z == floor(z) && x >= 0 && y >= 0 && z >= 0 && x < xRes && y < yRes && z < zRes) {
+            return get((uint) x, (uint) y, (uint) z);
+        }
+        return VirtualGrid3D::getf(x, y, z);
+    }
+};
+
+#endif
@@ -0,0 +1,629 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <array>
+
+#include "SETTINGS.h"
+#include "mesh.h"
+#include "parallel.h"
+
+using namespace std;
+
+// Quadric error metric edge-collapse decimation (Garland & Heckbert 1997).
+// Triangles are binned into a grid of spatial partitions that are simplified
+// independently in parallel; vertices shared between partitions are locked
+// for the round, and the grid is shifted by half a cell on the next round so
+// the seams get simplified too.
+namespace Simplify
+{
+    // Weight of the plane quadrics that keep open mesh boundaries in place
+    static const Real SIMP_BOUNDARY_WEIGHT = 1000.0;
+
+    // Partitions per thread, so uneven partitions still balance out
+    static const int SIMP_PARTITIONS_PER_THREAD = 8;
+
+    static const int SIMP_MAX_ROUNDS = 6;
+
+    struct Quadric {
+        // Upper triangle of the symmetric 4x4 matrix
+        Real a[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+        static Quadric fromPlane(const VEC3F& n, Real d, Real weight = 1) {
+            Quadric q;
+            q.a[0] = n.x() * n.x(); q.a[1] = n.x() * n.y(); q.a[2] = n.x() * n.z(); q.a[3] = n.x() * d;
+            q.a[4] = n.y() * n.y(); q.a[5] = n.y() * n.z(); q.a[6] = n.y() * d;
+            q.a[7] = n.z() * n.z(); q.a[8] = n.z() * d;
+            q.a[9] = d * d;
+            for (Real& v : q.a) v *= weight;
+            return q;
+        }
+
+        Quadric& operator+=(const Quadric& o) {
+            for (int i = 0; i < 10; i++) a[i] += o.a[i];
+            return *this;
+        }
+
+        Quadric operator+(const Quadric& o) const {
+            Quadric q = *this;
+            q += o;
+            return q;
+        }
+
+        Real evaluate(const VEC3F& p) const {
+            const Real x = p.x(), y = p.y(), z = p.z();
+            return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+                 + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+                 + a[7] * z * z + 2 * a[8] * z
+                 + a[9];
+        }
+
+        // Position minimizing the error, if the system is well conditioned
+        bool optimum(VEC3F& out) const {
+            Matrix<Real, 3, 3> A;
+            A << a[0], a[1], a[2],
+                 a[1], a[4], a[5],
+                 a[2], a[5], a[7];
+            const Real det = A.determinant();
+            if (fabs(det) < 1e-12) return false;
+            out = A.inverse() * VEC3F(-a[3], -a[6], -a[8]);
+            return true;
+        }
+    };
+
+    struct LOD {
+        Mesh mesh;
+        Real targetRatio = 1;
+        // sqrt of the surface quadric cost of the accepted collapses, in mesh
+        // units: distance to the merged face planes, without the boundary
+        // penalty that only steers which collapses are taken
+        Real maxError = 0;
+        Real meanError = 0;
+    };
+
+    struct Settings {
+        bool preserveBoundaries = true;
+        int partitionsPerThread = SIMP_PARTITIONS_PER_THREAD;
+    };
+
+    // Working state shared across partitions. Partitions only write to the
+    // triangles they own and to vertices that no other partition touches.
+    struct simp_internalState {
+        std::vector<VEC3F> vertices;
+        std::vector<VEC3F> normals;
+        std::vector<uint8_t> moved;    // normals of moved vertices are recomputed on compaction
+        std::vector<uint> indices;
+        std::vector<uint8_t> triAlive; // Not vector<bool>: partitions write it concurrently
+        std::vector<Quadric> quadrics;         // face planes plus boundary penalties, drive the collapses
+        std::vector<Quadric> surfaceQuadrics;  // face planes only, measure the error
+        size_t aliveTris = 0;
+    };
+
+    struct simp_internalCollapse {
+        Real cost;
+        uint u, v;          // local vertex ids, v collapses into u
+        uint versionU, versionV;
+        VEC3F position;
+
+        bool operator<(const simp_internalCollapse& o) const { return cost > o.cost; }
+    };
+
+    // Quadrics a partition merged into a locked vertex, added to it once all
+    // partitions are done since other partitions read it concurrently
+    struct simp_internalLockedMerge {
+        uint vertex;
+        Quadric quadric, surface;
+    };
+
+    struct simp_internalPartitionResult {
+        size_t collapses = 0;
+        Real maxCost = 0;
+        Real sumCost = 0;
+        std::vector<simp_internalLockedMerge> lockedMerges;
+    };
+
+    static inline VEC3F simp_internalFaceNormal(const VEC3F& a, const VEC3F& b, const VEC3F& c) {
+        return (b - a).cross(c - a);
+    }
+
+    static inline uint64_t simp_internalEdgeKey(uint a, uint b) {
+        if (a > b) std::swap(a, b);
+        return ((uint64_t) a << 32) | b;
+    }
+
+    static void simp_internalComputeQuadrics(simp_internalState& state, bool preserveBoundaries) {
+        const size_t nTris = state.indices.size() / 3;
+        state.quadrics.assign(state.vertices.size(), Quadric());
+        state.surfaceQuadrics.assign(state.vertices.size(), Quadric());
+
+        std::unordered_map<uint64_t, int> edgeUse;
+        if (preserveBoundaries) {
+            edgeUse.reserve(state.indices.size());
+            for (size_t t = 0; t < nTris; t++) {
+                if (!state.triAlive[t]) continue;
+                for (int k = 0; k < 3; k++)
+                    edgeUse[simp_internalEdgeKey(state.indices[3 * t + k], state.indices[3 * t + (k + 1) % 3])]++;
+            }
+        }
+
+        for (size_t t = 0; t < nTris; t++) {
+            if (!state.triAlive[t]) continue;
+            const uint* tri = &state.indices[3 * t];
+            const VEC3F& a = state.vertices[tri[0]];
+            const VEC3F& b = state.vertices[tri[1]];
+            const VEC3F& c = state.vertices[tri[2]];
+
+            VEC3F n = simp_internalFaceNormal(a, b, c);
+            const Real len = n.norm();
+            if (len <= 0) continue;
+            n /= len;
+
+            const Quadric q = Quadric::fromPlane(n, -n.dot(a));
+            for (int k = 0; k < 3; k++) {
+                state.quadrics[tri[k]] += q;
+                state.surfaceQuadrics[tri[k]] += q;
+            }
+
+            if (!preserveBoundaries) continue;
+
+            for (int k = 0; k < 3; k++) {
+                const uint e0 = tri[k], e1 = tri[(k + 1) % 3];
+                if (edgeUse[simp_internalEdgeKey(e0, e1)] != 1) continue;
+
+                // Plane through the boundary edge, perpendicular to the face
+                const VEC3F edge = state.vertices[e1] - state.vertices[e0];
+                VEC3F bn = edge.cross(n);
+                const Real bl = bn.norm();
+                if (bl <= 0) continue;
+                bn /= bl;
+
+                const Quadric bq = Quadric::fromPlane(bn, -bn.dot(state.vertices[e0]), SIMP_BOUNDARY_WEIGHT * edge.squaredNorm());
+                state.quadrics[e0] += bq;
+                state.quadrics[e1] += bq;
+            }
+        }
+    }
+
+    // Simplifies the triangles of one partition down to targetTris.
+    static simp_internalPartitionResult simp_internalSimplifyPartition(simp_internalState& state,
+                                                                        const std::vector<uint>& tris,
+                                                                        const std::vector<int>& vertexOwner,
+                                                                        int partition,
+                                                                        size_t targetTris)
+    {
+        simp_internalPartitionResult result;
+        if (tris.size() <= targetTris) return result;
+
+        // Local vertex numbering
+        std::unordered_map<uint, uint> toLocal;
+        std::vector<uint> globalId;
+        std::vector<std::vector<uint>> adjacency; // local vertex -> indices into tris
+        for (size_t i = 0; i < tris.size(); i++) {
+            for (int k = 0; k < 3; k++) {
+                const uint g = state.indices[3 * tris[i] + k];
+                auto it = toLocal.find(g);
+                uint l;
+                if (it == toLocal.end()) {
+                    l = globalId.size();
+                    toLocal[g] = l;
+                    globalId.push_back(g);
+                    adjacency.emplace_back();
+                } else {
+                    l = it->second;
+                }
+                adjacency[l].push_back(i);
+            }
+        }
+
+        const size_t nLocal = globalId.size();
+        std::vector<VEC3F> position(nLocal);
+        std::vector<Quadric> quadric(nLocal), surface(nLocal);
+        std::vector<bool> locked(nLocal), removed(nLocal, false), moved(nLocal, false);
+        std::vector<uint> version(nLocal, 0);
+        for (size_t l = 0; l < nLocal; l++) {
+            position[l] = state.vertices[globalId[l]];
+            quadric[l] = state.quadrics[globalId[l]];
+            surface[l] = state.surfaceQuadrics[globalId[l]];
+            locked[l] = vertexOwner[globalId[l]] != partition;
+        }
+        std::vector<Quadric> lockedGain, lockedSurfaceGain;
+        std::vector<bool> gained;
+
+        std::vector<std::array<uint, 3>> local(tris.size());
+        std::vector<bool> alive(tris.size(), true);
+        for (size_t i = 0; i < tris.size(); i++)
+            for (int k = 0; k < 3; k++) local[i][k] = toLocal[state.indices[3 * tris[i] + k]];
+
+        auto evaluate = [&](uint a, uint b, simp_internalCollapse& out) -> bool {
+            if (locked[a] && locked[b]) return false;
+
+            // Collapse the free vertex into the locked one, if any
+            if (locked[b]) std::swap(a, b);
+
+            const Quadric q = quadric[a] + quadric[b];
+            VEC3F p;
+            if (locked[a]) {
+                p = position[a];
+            } else if (!q.optimum(p)) {
+                const VEC3F mid = 0.5 * (position[a] + position[b]);
+                p = position[a];
+                if (q.evaluate(position[b]) < q.evaluate(p)) p = position[b];
+                if (q.evaluate(mid) < q.evaluate(p)) p = mid;
+            }
+
+            out.u = a;
+            out.v = b;
+            out.versionU = version[a];
+            out.versionV = version[b];
+            out.position = p;
+            out.cost = std::max((Real) 0, q.evaluate(p));
+            return true;
+        };
+
+        // One candidate per edge, whether one or two triangles share it
+        std::priority_queue<simp_internalCollapse> heap;
+        std::unordered_set<uint64_t> seeded;
+        seeded.reserve(local.size() * 2);
+        for (size_t i = 0; i < local.size(); i++) {
+            for (int k = 0; k < 3; k++) {
+                const uint a = local[i][k], b = local[i][(k + 1) % 3];
+                if (!seeded.insert(simp_internalEdgeKey(a, b)).second) continue;
+                simp_internalCollapse c;
+                if (evaluate(a, b, c)) heap.push(c);
+            }
+        }
+
+        size_t aliveCount = tris.size();
+        std::vector<uint> neighborsU, neighborsV, opposite;
+
+        auto gatherNeighbors = [&](uint x, std::vector<uint>& out) {
+            out.clear();
+            for (uint t : adjacency[x]) {
+                if (!alive[t]) continue;
+                for (int k = 0; k < 3; k++)
+                    if (local[t][k] != x) out.push_back(local[t][k]);
+            }
+            std::sort(out.begin(), out.end());
+            out.erase(std::unique(out.begin(), out.end()), out.end());
+        };
+
+        while (aliveCount > targetTris && !heap.empty()) {
+            simp_internalCollapse c = heap.top();
+            heap.pop();
+
+            const uint u = c.u, v = c.v;
+            if (removed[u] || removed[v] || version[u] != c.versionU || version[v] != c.versionV) continue;
+
+            // Link condition: the only shared neighbors of u and v are the
+            // opposite corners of the triangles on edge (u, v)
+            gatherNeighbors(u, neighborsU);
+            gatherNeighbors(v, neighborsV);
+            if (!std::binary_search(neighborsU.begin(), neighborsU.end(), v)) continue;
+
+            opposite.clear();
+            for (uint t : adjacency[v]) {
+                if (!alive[t]) continue;
+                const auto& tri = local[t];
+                if (tri[0] != u && tri[1] != u && tri[2] != u) continue;
+                for (int k = 0; k < 3; k++)
+                    if (tri[k] != u && tri[k] != v) opposite.push_back(tri[k]);
+            }
+            std::sort(opposite.begin(), opposite.end());
+
+            size_t shared = 0;
+            bool linkOk = true;
+            for (uint n : neighborsU) {
+                if (std::binary_search(neighborsV.begin(), neighborsV.end(), n)) {
+                    shared++;
+                    if (!std::binary_search(opposite.begin(), opposite.end(), n)) linkOk = false;
+                }
+            }
+            if (!linkOk || shared > 2) continue;
+
+            // Reject collapses that flip or degenerate any remaining triangle
+            bool flips = false;
+            for (uint x : {u, v}) {
+                for (uint t : adjacency[x]) {
+                    if (!alive[t] || flips) continue;
+                    const auto& tri = local[t];
+                    bool hasU = tri[0] == u || tri[1] == u || tri[2] == u;
+                    bool hasV = tri[0] == v || tri[1] == v || tri[2] == v;
+                    if (hasU && hasV) continue;
+
+                    VEC3F before[3], after[3];
+                    for (int k = 0; k < 3; k++) {
+                        before[k] = position[tri[k]];
+                        after[k] = (tri[k] == u || tri[k] == v) ? c.position : before[k];
+                    }
+                    const VEC3F n0 = simp_internalFaceNormal(before[0], before[1], before[2]);
+                    const VEC3F n1 = simp_internalFaceNormal(after[0], after[1], after[2]);
+                    if (n1.squaredNorm() <= 1e-12 * n0.squaredNorm() || n0.dot(n1) <= 0) flips = true;
+                }
+            }
+            if (flips) continue;
+
+            // Apply: triangles on the edge die, the rest of v's fan moves to u
+            for (uint t : adjacency[v]) {
+                if (!alive[t]) continue;
+                auto& tri = local[t];
+                if (tri[0] == u || tri[1] == u || tri[2] == u) {
+                    alive[t] = false;
+                    aliveCount--;
+                } else {
+                    for (int k = 0; k < 3; k++) if (tri[k] == v) tri[k] = u;
+                    adjacency[u].push_back(t);
+                }
+            }
+            adjacency[v].clear();
+
+            const Real error = std::max((Real) 0, (surface[u] + surface[v]).evaluate(c.position));
+
+            removed[v] = true;
+            if (locked[u]) {
+                if (gained.empty()) {
+                    lockedGain.resize(nLocal);
+                    lockedSurfaceGain.resize(nLocal);
+                    gained.assign(nLocal, false);
+                }
+                lockedGain[u] += quadric[v];
+                lockedSurfaceGain[u] += surface[v];
+                gained[u] = true;
+            } else {
+                moved[u] = moved[u] || c.position != position[u];
+                position[u] = c.position;
+            }
+            quadric[u] += quadric[v];
+            surface[u] += surface[v];
+            version[u]++;
+
+            result.collapses++;
+            result.maxCost = std::max(result.maxCost, error);
+            result.sumCost += error;
+
+            // Drop dead entries from u's fan and requeue its edges
+            auto& fan = adjacency[u];
+            fan.erase(std::remove_if(fan.begin(), fan.end(), [&](uint t) { return !alive[t]; }), fan.end());
+
+            gatherNeighbors(u, neighborsU);
+            for (uint n : neighborsU) {
+                simp_internalCollapse nc;
+                if (evaluate(u, n, nc)) heap.push(nc);
+            }
+        }
+
+        // Write back. Unlocked vertices belong to this partition alone; what
+        // locked vertices absorbed is handed back to the caller.
+        for (size_t l = 0; l < nLocal; l++) {
+            if (removed[l]) continue;
+            if (locked[l]) {
+                if (!gained.empty() && gained[l]) result.lockedMerges.push_back({ globalId[l], lockedGain[l], lockedSurfaceGain[l] });
+                continue;
+            }
+            state.vertices[globalId[l]] = position[l];
+            state.quadrics[globalId[l]] = quadric[l];
+            state.surfaceQuadrics[globalId[l]] = surface[l];
+            if (moved[l]) state.moved[globalId[l]] = 1;
+        }
+        for (size_t i = 0; i < tris.size(); i++) {
+            if (!alive[i]) {
+                state.triAlive[tris[i]] = 0;
+                continue;
+            }
+            for (int k = 0; k < 3; k++) state.indices[3 * tris[i] + k] = globalId[local[i][k]];
+        }
+
+        return result;
+    }
+
+    static Mesh simp_internalCompact(const simp_internalState& state) {
+        Mesh out;
+        const bool hasNormals = state.normals.size() == state.vertices.size();
+        const uint unassigned = (uint) -1;
+        std::vector<uint> remap(state.vertices.size(), unassigned);
+
+        // Vertices that moved get area-weighted face normals of their new fan
+        std::vector<VEC3F> movedNormals;
+        if (hasNormals) {
+            movedNormals.assign(state.vertices.size(), VEC3F(0, 0, 0));
+            for (size_t t = 0; t < state.triAlive.size(); t++) {
+                if (!state.triAlive[t]) continue;
+                const uint* tri = &state.indices[3 * t];
+                const VEC3F n = simp_internalFaceNormal(state.vertices[tri[0]], state.vertices[tri[1]], state.vertices[tri[2]]);
+                for (int k = 0; k < 3; k++)
+                    if (state.moved[tri[k]]) movedNormals[tri[k]] += n;
+            }
+        }
+
+        for (size_t t = 0; t < state.triAlive.size(); t++) {
+            if (!state.triAlive[t]) continue;
+            for (int k = 0; k < 3; k++) {
+                const uint g = state.indices[3 * t + k];
+                if (remap[g] == unassigned) {
+                    remap[g] = out.vertices.size();
+                    out.vertices.push_back(state.vertices[g]);
+                    if (hasNormals) {
+                        const Real length = movedNormals[g].norm();
+                        out.normals.push_back(state.moved[g] && length > 0 ? VEC3F(movedNormals[g] / length) : state.normals[g]);
+                    }
+                }
+                out.indices.push_back(remap[g]);
+            }
+        }
+        return out;
+    }
+
+    /*!
+      \brief Simplifies the mesh in place to roughly targetRatio of its triangles.
+      \param state working state, continued from the previous LOD
+      \param targetTris triangle budget
+      \param settings partitioning settings
+      \param lod receives the error metrics
+      */
+    static void simp_internalSimplify(simp_internalState& state, size_t targetTris, const Settings& settings, LOD& lod) {
+        AABB bounds(state.vertices[0], state.vertices[0]);
+        for (const VEC3F& v : state.vertices) bounds.include(v);
+
+        const int cellsPerAxis = std::max(1, (int) std::round(std::cbrt((double) Parallel::numThreads() * settings.partitionsPerThread)));
+        const VEC3F cellSize = bounds.span() / cellsPerAxis + VEC3F(1e-9, 1e-9, 1e-9);
+
+        size_t totalCollapses = 0;
+        Real sumCost = 0, maxCost = 0;
+
+        for (int round = 0; round < SIMP_MAX_ROUNDS && state.aliveTris > targetTris; round++) {
+            // Shift the partition grid every other round so the locked seams move
+            const VEC3F shift = (round % 2) ? VEC3F(0.5 * cellSize) : VEC3F(0, 0, 0);
+            const int cells = (round % 2) ? cellsPerAxis + 1 : cellsPerAxis;
+            const size_t nPartitions = (size_t) cells * cells * cells;
+
+            std::vector<std::vector<uint>> partitionTris(nPartitions);
+            std::vector<int> vertexOwner(state.vertices.size(), -1);
+
+            for (size_t t = 0; t < state.triAlive.size(); t++) {
+                if (!state.triAlive[t]) continue;
+                const uint* tri = &state.indices[3 * t];
+                const VEC3F centroid = (state.vertices[tri[0]] + state.vertices[tri[1]] + state.vertices[tri[2]]) / 3.0;
+                VEC3I cell = ((centroid - bounds.min() + shift).cwiseQuotient(cellSize)).array().floor().cast<int>();
+                cell = cell.cwiseMax(VEC3I(0, 0, 0)).cwiseMin(VEC3I(cells - 1, cells - 1, cells - 1));
+                const int p = (cell.z() * cells + cell.y()) * cells + cell.x();
+                partitionTris[p].push_back(t);
+
+                for (int k = 0; k < 3; k++) {
+                    int& owner = vertexOwner[tri[k]];
+                    owner = (owner == -1 || owner == p) ? p : -2;
+                }
+            }
+
+            const double keep = (double) targetTris / state.aliveTris;
+            std::vector<simp_internalPartitionResult> results(nPartitions);
+
+            Parallel::parallelFor(0, nPartitions, [&](size_t p) {
+                const size_t target = (size_t) std::ceil(partitionTris[p].size() * keep);
+                results[p] = simp_internalSimplifyPartition(state, partitionTris[p], vertexOwner, (int) p, target);
+            });
+
+            size_t roundCollapses = 0;
+            for (const auto& r : results) {
+                roundCollapses += r.collapses;
+                sumCost += r.sumCost;
+                maxCost = std::max(maxCost, r.maxCost);
+                for (const simp_internalLockedMerge& m : r.lockedMerges) {
+                    state.quadrics[m.vertex] += m.quadric;
+                    state.surfaceQuadrics[m.vertex] += m.surface;
+                }
+            }
+            totalCollapses += roundCollapses;
+
+            state.aliveTris = std::count(state.triAlive.begin(), state.triAlive.end(), (uint8_t) 1);
+            if (roundCollapses == 0) break;
+        }
+
+        lod.maxError = std::sqrt(maxCost);
+        lod.meanError = totalCollapses ? std::sqrt(sumCost / totalCollapses) : 0;
+    }
+
+    /*!
+      \brief Builds a chain of LODs from the mesh. Each LOD is simplified from
+      the previous one, so the whole chain costs about as much as the first level.
+      \param mesh full resolution mesh
+      \param ratios target triangle ratios relative to the input, decreasing
+      \param settings partitioning settings
+      \return one LOD per ratio
+      */
+    inline std::vector<LOD> buildLODChain(const Mesh& mesh, std::vector<Real> ratios, const Settings& settings = Settings()) {
+        std::vector<LOD> chain;
+        if (mesh.indices.empty()) return chain;
+
+        std::sort(ratios.begin(), ratios.end(), std::greater<Real>());
+
+        simp_internalState state;
+        state.vertices = mesh.vertices;
+        state.normals = mesh.normals;
+        state.moved.assign(mesh.vertices.size(), 0);
+        state.indices = mesh.indices;
+        state.triAlive.assign(mesh.indices.size() / 3, 1);
+        state.aliveTris = mesh.indices.size() / 3;
+        simp_internalComputeQuadrics(state, settings.preserveBoundaries);
+
+        const size_t fullTris = state.aliveTris;
+
+        PB_START("Building %zu LODs from %zu triangles", ratios.size(), fullTris);
+        for (size_t i = 0; i < ratios.size(); i++) {
+            LOD lod;
+            lod.targetRatio = ratios[i];
+            simp_internalSimplify(state, (size_t) (fullTris * ratios[i]), settings, lod);
+            lod.mesh = simp_internalCompact(state);
+            chain.push_back(lod);
+            PB_PROGRESS((float) (i + 1) / ratios.size());
+        }
+        PB_END();
+
+        for (const LOD& lod : chain) {
+            printf("  LOD ratio %.3f: %d triangles, max error %.3e, mean error %.3e\n",
+                   lod.targetRatio, (int) (lod.mesh.indices.size() / 3), lod.maxError, lod.meanError);
+        }
+
+        return chain;
+    }
+
+    /*!
+      \brief Writes all LODs into one binary package: "CLOD", version, LOD
+      count, then per LOD {vertex offset, vertex count, index offset, index
+      count, target ratio, max error, mean error}, followed by the float32
+      interleaved position/normal data of all LODs and their uint32 indices
+      (relative to each LOD's first vertex).
+      \param filename output path
+      \param chain LODs to pack
+      */
+    inline void writeLODPackage(string filename, const std::vector<LOD>& chain) {
+        FILE* file = fopen(filename.c_str(), "wb");
+        if (file == NULL) {
+            printf("Could not open %s for writing.\n", filename.c_str());
+            return;
+        }
+
+        const char magic[4] = {'C', 'L', 'O', 'D'};
+        const uint32_t header[2] = {1, (uint32_t) chain.size()};
+        fwrite(magic, 1, 4, file);
+        fwrite(header, sizeof(uint32_t), 2, file);
+
+        uint32_t vertexOffset = 0, indexOffset = 0;
+        for (const LOD& lod : chain) {
+            const uint32_t counts[4] = {vertexOffset, (uint32_t) lod.mesh.vertices.size(), indexOffset, (uint32_t) lod.mesh.indices.size()};
+            const float metrics[3] = {(float) lod.targetRatio, (float) lod.maxError, (float) lod.meanError};
+            fwrite(counts, sizeof(uint32_t), 4, file);
+            fwrite(metrics, sizeof(float), 3, file);
+            vertexOffset += counts[1];
+            indexOffset += counts[3];
+        }
+
+        for (const LOD& lod : chain) {
+            const bool hasNormals = lod.mesh.normals.size() == lod.mesh.vertices.size();
+            std::vector<float> interleaved(6 * lod.mesh.vertices.size(), 0.0f);
+            for (size_t i = 0; i < lod.mesh.vertices.size(); i++) {
+                for (int k = 0; k < 3; k++) {
+                    interleaved[6 * i + k] = lod.mesh.vertices[i][k];
+                    if (hasNormals) interleaved[6 * i + 3 + k] = lod.mesh.normals[i][k];
+                }
+            }
+            fwrite(interleaved.data(), sizeof(float), interleaved.size(), file);
+        }
+
+        for (const LOD& lod : chain) {
+            fwrite(lod.mesh.indices.data(), sizeof(uint32_t), lod.mesh.indices.size(), file);
+        }
+
+        PROFILE_COUNT("io/bytes written", ftell(file));
+        fclose(file);
+
+        printf("Wrote %zu LODs to %s\n", chain.size(), filename.c_str());
+    }
+}
+
+#endif
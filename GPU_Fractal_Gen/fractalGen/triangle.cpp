@@ -35,9 +35,7 @@ static Real norm(VEC3F v) {
 //////////////////////////////////////////////////////////////////////
 Triangle::Triangle(VEC3F* v0, VEC3F* v1, VEC3F* v2)
 {
-  _vertices.push_back(v0);
-  _vertices.push_back(v1);
-  _vertices.push_back(v2);
+  _vertices = { v0, v1, v2 };
 
   _normal = cross(*v1 - *v0, *v2 - *v0);
   _area   = 0.5f * norm(_normal);
@@ -50,9 +48,7 @@ Triangle::Triangle(VEC3F* v0, VEC3F* v1, VEC3F* v2)
 //////////////////////////////////////////////////////////////////////
 Triangle::Triangle(Triangle* triangle)
 {
-  _vertices.push_back(triangle->_vertices[0]);
-  _vertices.push_back(triangle->_vertices[1]);
-  _vertices.push_back(triangle->_vertices[2]);
+  _vertices = triangle->_vertices;
 
   _normal = cross(*(_vertices[1]) - *(_vertices[0]),
                   *(_vertices[2]) - *(_vertices[0]));
@@ -75,9 +71,7 @@ void Triangle::recomputeNormal()
 //////////////////////////////////////////////////////////////////////
 Triangle::Triangle()
 {
-  _vertices.resize(3);
-  for (int x = 0; x < 3; x++)
-    _vertices[x] = NULL;
+  _vertices = { NULL, NULL, NULL };
   _color = VEC3F(1, 1, 1);
 }
 
@@ -86,8 +80,8 @@ Triangle::Triangle()
 // if they are all the same
 //////////////////////////////////////////////////////////////////////
 bool Triangle::operator==(const Triangle& RHS) const {
-  vector<VEC3F*> copyLHS = _vertices;
-  vector<VEC3F*> copyRHS = RHS._vertices;
+  std::array<VEC3F*, 3> copyLHS = _vertices;
+  std::array<VEC3F*, 3> copyRHS = RHS._vertices;
   sort(copyLHS.begin(), copyLHS.end());
   sort(copyRHS.begin(), copyRHS.end());
 
@@ -103,12 +97,7 @@ bool Triangle::operator==(const Triangle& RHS) const {
 // set the current triangle equal to the RHS
 //////////////////////////////////////////////////////////////////////
 Triangle& Triangle::operator=(const Triangle& RHS) {
-  _vertices.clear();
-  _vertices.resize(0);
-
-  _vertices.push_back(RHS._vertices[0]);
-  _vertices.push_back(RHS._vertices[1]);
-  _vertices.push_back(RHS._vertices[2]);
+  _vertices = RHS._vertices;
 
   _normal = RHS._normal;
   _area = RHS._area;
@@ -121,7 +110,7 @@ Triangle& Triangle::operator=(const Triangle& RHS) {
 //////////////////////////////////////////////////////////////////////
 VEC3F Triangle::centroid()
 {
-  VEC3F final;
+  VEC3F final(0, 0, 0);
   final += *(_vertices[0]);
   final += *(_vertices[1]);
   final += *(_vertices[2]);
@@ -214,3 +203,16 @@ void Triangle::boundingBox(VEC3F& mins, VEC3F& maxs)
         maxs[y] = (*_vertices[x])[y];
     }
 }
+
+//////////////////////////////////////////////////////////////////////
+// triangle-triangle and segment intersection, see TriangleView
+//////////////////////////////////////////////////////////////////////
+bool Triangle::intersects(Triangle& RHS)
+{
+  return view().intersects(RHS.view());
+}
+
+bool Triangle::intersects(VEC3F& start, VEC3F& end)
+{
+  return view().intersects(start, end);
+}
@@ -1,9 +1,68 @@
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
+#include <array>
+#include <algorithm>
+#include <cmath>
+
 #include "SETTINGS.h"
 
 using namespace std;
+
+// Non-owning view of three vertices of a mesh. Nothing is computed or
+// allocated up front, so it is free to make one per face; use it instead of
+// Triangle for per-face geometry queries over large meshes.
+struct TriangleView {
+    const VEC3F& v0;
+    const VEC3F& v1;
+    const VEC3F& v2;
+
+    TriangleView(const VEC3F& v0, const VEC3F& v1, const VEC3F& v2): v0(v0), v1(v1), v2(v2) {}
+
+    // Cross product of the edges, twice the area long
+    VEC3F areaNormal() const { return (v1 - v0).cross(v2 - v0); }
+    VEC3F normal() const { return areaNormal().normalized(); }
+    Real area() const { return 0.5 * areaNormal().norm(); }
+    VEC3F centroid() const { return (v0 + v1 + v2) / 3.0; }
+
+    Real maxEdgeLength() const {
+        return std::sqrt(std::max({ (v0 - v1).squaredNorm(), (v0 - v2).squaredNorm(), (v1 - v2).squaredNorm() }));
+    }
+
+    void boundingBox(VEC3F& mins, VEC3F& maxs) const {
+        mins = v0.cwiseMin(v1).cwiseMin(v2);
+        maxs = v0.cwiseMax(v1).cwiseMax(v2);
+    }
+
+    // Segment test (Moller-Trumbore). A segment lying in the plane of the
+    // triangle doesn't count.
+    bool intersects(const VEC3F& start, const VEC3F& end) const {
+        const VEC3F e1 = v1 - v0, e2 = v2 - v0, dir = end - start;
+        const VEC3F p = dir.cross(e2);
+        const Real det = e1.dot(p);
+        if (std::fabs(det) < 1e-20) return false;
+
+        const Real inv = 1.0 / det;
+        const VEC3F s = start - v0;
+        const Real u = s.dot(p) * inv;
+        if (u < 0 || u > 1) return false;
+
+        const VEC3F q = s.cross(e1);
+        const Real v = dir.dot(q) * inv;
+        if (v < 0 || u + v > 1) return false;
+
+        const Real t = e2.dot(q) * inv;
+        return t >= 0 && t <= 1;
+    }
+
+    // Two triangles intersect when an edge of either crosses the other, so
+    // faces sharing a vertex or edge count. Coplanar overlaps aren't reported.
+    bool intersects(const TriangleView& o) const {
+        return o.intersects(v0, v1) || o.intersects(v1, v2) || o.intersects(v2, v0) ||
+               intersects(o.v0, o.v1) || intersects(o.v1, o.v2) || intersects(o.v2, o.v0);
+    }
+};
+
 class Triangle {
 public:
     Triangle(VEC3F* v0, VEC3F* v1, VEC3F* v2);
@@ -26,8 +85,9 @@ public:
     const VEC3F* vertex(int x) const { return _vertices[x]; };
     void setVertex(int x, VEC3F* vertex) { _vertices[x] = vertex; };
     VEC3F centroid();
-    vector<VEC3F*>& vertices() { return _vertices; };
-    const vector<VEC3F*>& vertices() const { return _vertices; };
+    std::array<VEC3F*, 3>& vertices() { return _vertices; };
+    const std::array<VEC3F*, 3>& vertices() const { return _vertices; };
+    TriangleView view() const { return TriangleView(*_vertices[0], *_vertices[1], *_vertices[2]); }
 
     bool positionsEqual(Triangle& RHS);
 
@@ -42,7 +102,7 @@ public:
 private:
     VEC3F _color;
 
-    vector<VEC3F*> _vertices;
+    std::array<VEC3F*, 3> _vertices;
 
     VEC3F _normal;
     Real _area;
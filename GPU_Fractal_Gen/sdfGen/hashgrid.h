@@ -4,13 +4,35 @@
 #include "hashtable.h"
 #include "vec.h"
 
+// hash of an integer grid cell, fully mixed so both the low bits (HashTable)
+// and the high bits (FlatHashTable) are usable
+struct CellHashFunction
+{
+   template<unsigned int N>
+   unsigned int operator() (const Vec<N,int> &c) const
+   {
+      // combine with multiply-add: xor would map (a,b) and (-a,-b) together
+      // whenever a and b are both odd
+      unsigned int h=(unsigned int)c[0];
+      for(unsigned int i=1; i<N; ++i)
+         h=::hash(h)+(unsigned int)c[i];
+      // murmur3 finalizer
+      h^=h>>16; h*=0x85ebca6bu;
+      h^=h>>13; h*=0xc2b2ae35u;
+      return h^(h>>16);
+   }
+};
+
+// Grids default to the open-addressing table; pass
+// HashTable<VecNi,DataType,CellHashFunction> as Table for the chained one.
+
 //========================================================= first do 2D ============================
 
-template<class DataType>
+template<class DataType, class Table=FlatHashTable<Vec2i,DataType,CellHashFunction> >
 struct HashGrid2
 {
    double dx, overdx; // side-length of a grid cell and its reciprocal
-   HashTable<Vec2i,DataType> grid;
+   Table grid;
 
    explicit HashGrid2(double dx_=1, int expected_size=512)
       : dx(dx_), overdx(1/dx_), grid(expected_size)
@@ -33,6 +55,26 @@ struct HashGrid2
          grid.add(Vec2i(i,j), datum);
    }
 
+   // adds every box in one bulk build (FlatHashTable only)
+   void add_boxes(const std::vector<Vec2d> &xmin, const std::vector<Vec2d> &xmax, const std::vector<DataType> &data)
+   {
+      std::vector<Vec2i> imins(data.size()), imaxs(data.size());
+      size_t cells=0;
+      for(unsigned int b=0; b<data.size(); ++b){
+         imins[b]=round(xmin[b]*overdx); imaxs[b]=round(xmax[b]*overdx);
+         const Vec2i &imin=imins[b], &imax=imaxs[b];
+         cells+=(imax[0]-imin[0]+1)*(imax[1]-imin[1]+1);
+      }
+      std::vector<std::pair<Vec2i,DataType> > entries;
+      entries.reserve(cells);
+      for(unsigned int b=0; b<data.size(); ++b){
+         const Vec2i &imin=imins[b], &imax=imaxs[b];
+         for(int j=imin[1]; j<=imax[1]; ++j) for(int i=imin[0]; i<=imax[0]; ++i)
+            entries.push_back(std::make_pair(Vec2i(i,j), data[b]));
+      }
+      grid.add_all(entries);
+   }
+
    void delete_box(const Vec2d &xmin, const Vec2d &xmax, const DataType &datum)
    {
       Vec2i imin=round(xmin*overdx), imax=round(xmax*overdx);
@@ -71,11 +113,11 @@ struct HashGrid2
 
 //==================================== and now in 3D =================================================
 
-template<class DataType>
+template<class DataType, class Table=FlatHashTable<Vec3i,DataType,CellHashFunction> >
 struct HashGrid3
 {
    double dx, overdx; // side-length of a grid cell and its reciprocal
-   HashTable<Vec3i,DataType> grid;
+   Table grid;
 
    explicit HashGrid3(double dx_=1, int expected_size=512)
       : dx(dx_), overdx(1/dx_), grid(expected_size)
@@ -98,6 +140,26 @@ struct HashGrid3
          grid.add(Vec3i(i,j,k), datum);
    }
 
+   // adds every box in one bulk build (FlatHashTable only)
+   void add_boxes(const std::vector<Vec3d> &xmin, const std::vector<Vec3d> &xmax, const std::vector<DataType> &data)
+   {
+      std::vector<Vec3i> imins(data.size()), imaxs(data.size());
+      size_t cells=0;
+      for(unsigned int b=0; b<data.size(); ++b){
+         imins[b]=round(xmin[b]*overdx); imaxs[b]=round(xmax[b]*overdx);
+         const Vec3i &imin=imins[b], &imax=imaxs[b];
+         cells+=(imax[0]-imin[0]+1)*(imax[1]-imin[1]+1)*(imax[2]-imin[2]+1);
+      }
+      std::vector<std::pair<Vec3i,DataType> > entries;
+      entries.reserve(cells);
+      for(unsigned int b=0; b<data.size(); ++b){
+         const Vec3i &imin=imins[b], &imax=imaxs[b];
+         for(int k=imin[2]; k<=imax[2]; ++k) for(int j=imin[1]; j<=imax[1]; ++j) for(int i=imin[0]; i<=imax[0]; ++i)
+            entries.push_back(std::make_pair(Vec3i(i,j,k), data[b]));
+      }
+      grid.add_all(entries);
+   }
+
    void delete_box(const Vec3d &xmin, const Vec3d &xmax, const DataType &datum)
    {
       Vec3i imin=round(xmin*overdx), imax=round(xmax*overdx);
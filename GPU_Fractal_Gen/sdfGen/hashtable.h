@@ -3,6 +3,7 @@
 
 #include <functional>
 #include <iostream>
+#include <utility>
 #include <vector>
 
 template<class Key, class Data>
@@ -21,7 +22,7 @@ inline unsigned int hash(unsigned int k)
 struct DefaultHashFunction
 {
    template<typename Key>
-   unsigned int operator() (const Key &k) const { return hash(k); }
+   unsigned int operator() (const Key &k) const { return ::hash(k); }
 };
 
 struct equal
@@ -30,7 +31,7 @@ struct equal
    bool operator() (const T &a, const T &b) const { return a==b; }
 };
 
-template<typename Key, typename Data, class HashFunction=DefaultHashFunction, class KeyEqual=equal>
+template<typename Key, typename Data, class HashFunction=DefaultHashFunction, class KeyEqual=::equal>
 struct HashTable
 {
    unsigned int table_rank;
@@ -245,4 +246,312 @@ struct HashTable
    }
 };
 
+// Open-addressing alternative to HashTable with the same interface. Distinct
+// keys live in one flat array with linear probing and Robin Hood ordering:
+// each slot records its distance from the key's home slot (taken from the
+// high bits of the hash), and an insert displaces any key closer to its own
+// home. Probing runs off the end of the array into a tail that grows as
+// needed rather than wrapping around. Each key heads a list of its entries
+// in a shared pool; add_all() rebuilds the pool sorted by key, so after a
+// bulk build every key's entries are contiguous.
+template<typename Key>
+struct FlatHashSlot
+{
+   Key key;
+   int head; // first entry of this key in the pool
+};
+
+template<typename Key, typename Data, class HashFunction=DefaultHashFunction, class KeyEqual=::equal>
+struct FlatHashTable
+{
+   unsigned int table_rank; // 2^table_rank home slots
+   unsigned int num_keys;
+   unsigned int num_entries;
+   std::vector<FlatHashSlot<Key> > slots;
+   std::vector<unsigned int> probe; // 0 for an empty slot, else 1 + distance from home
+   std::vector<HashEntry<Key, Data> > pool;
+   int free_list;
+   const HashFunction hash_function;
+   const KeyEqual key_equal;
+
+   explicit FlatHashTable(unsigned int expected_size=64)
+      : hash_function(HashFunction()), key_equal(KeyEqual())
+   { init(expected_size); }
+
+   explicit FlatHashTable(const HashFunction &hf, unsigned int expected_size=64)
+      : hash_function(hf), key_equal(KeyEqual())
+   { init(expected_size); }
+
+   void init(unsigned int expected_size)
+   {
+      num_keys=0;
+      num_entries=0;
+      free_list=-1;
+      pool.clear();
+      pool.reserve(expected_size);
+      table_rank=rank_for(expected_size);
+      slots.assign(1u<<table_rank, FlatHashSlot<Key>());
+      probe.assign(1u<<table_rank, 0);
+   }
+
+   // smallest rank keeping the load factor at or below one half
+   static unsigned int rank_for(unsigned int expected_keys)
+   {
+      unsigned int rank=4;
+      while(rank<31 && (1u<<(rank-1)) < expected_keys)
+         ++rank;
+      return rank;
+   }
+
+   unsigned int home_of(unsigned int h) const
+   { return h>>(32-table_rank); }
+
+   // slot holding key k, or -1
+   int find(const Key &k) const
+   {
+      unsigned int i=home_of(hash_function(k)), dist=1;
+      for(; i<slots.size() && probe[i]>=dist; ++i, ++dist)
+         if(key_equal(k, slots[i].key))
+            return (int)i;
+      return -1;
+   }
+
+   // Robin Hood insert of a key that isn't in the table yet
+   void insert_key(FlatHashSlot<Key> slot)
+   {
+      unsigned int i=home_of(hash_function(slot.key)), dist=1;
+      for(;; ++i, ++dist){
+         if(i==slots.size()){
+            slots.push_back(FlatHashSlot<Key>());
+            probe.push_back(0);
+         }
+         if(probe[i]==0){
+            slots[i]=slot;
+            probe[i]=dist;
+            return;
+         }
+         if(probe[i]<dist){ // richer than us: take its slot and carry it on
+            std::swap(slots[i], slot);
+            std::swap(probe[i], dist);
+         }
+      }
+   }
+
+   void rehash(unsigned int rank)
+   {
+      std::vector<FlatHashSlot<Key> > old;
+      old.reserve(num_keys);
+      for(unsigned int i=0; i<slots.size(); ++i)
+         if(probe[i]) old.push_back(slots[i]);
+      table_rank=rank;
+      slots.assign(1u<<table_rank, FlatHashSlot<Key>());
+      probe.assign(1u<<table_rank, 0);
+      for(unsigned int i=0; i<old.size(); ++i)
+         insert_key(old[i]);
+   }
+
+   void add(const Key &k, const Data &d)
+   {
+      int s=find(k);
+      if(s==-1){
+         if(num_keys+1 > (1u<<(table_rank-1)))
+            rehash(table_rank+1);
+         FlatHashSlot<Key> slot={k, -1};
+         insert_key(slot);
+         ++num_keys;
+         s=find(k);
+      }
+      int i;
+      if(free_list!=-1){
+         i=free_list;
+         free_list=pool[i].next;
+      }else{
+         i=(int)pool.size();
+         pool.push_back(HashEntry<Key, Data>());
+      }
+      pool[i].key=k;
+      pool[i].data=d;
+      pool[i].next=slots[s].head; // put the new entry at the start of the key's list
+      slots[s].head=i;
+      ++num_entries;
+   }
+
+   // Adds many entries at once with a counting sort by key: one pass
+   // numbers the keys in order of first appearance (kept in the heads for
+   // now) and counts their entries, a prefix sum gives each key a contiguous
+   // range of the pool, and a second pass scatters the entries (old ones
+   // included) into their ranges with no further lookups.
+   void add_all(const std::vector<std::pair<Key, Data> > &entries)
+   {
+      std::vector<HashEntry<Key, Data> > old;
+      std::vector<int> ids, counts;
+      old.reserve(num_entries);
+      ids.reserve(num_entries+entries.size());
+      for(unsigned int i=0; i<slots.size(); ++i){
+         if(!probe[i]) continue;
+         const int id=(int)counts.size();
+         counts.push_back(0);
+         for(int j=slots[i].head; j!=-1; j=pool[j].next){
+            old.push_back(pool[j]);
+            ids.push_back(id);
+            ++counts[id];
+         }
+         slots[i].head=id;
+      }
+      for(unsigned int i=0; i<entries.size(); ++i){
+         int s=find(entries[i].first), id;
+         if(s!=-1)
+            id=slots[s].head;
+         else{
+            if(num_keys+1 > (1u<<(table_rank-1)))
+               rehash(table_rank+1);
+            id=(int)counts.size();
+            counts.push_back(0);
+            FlatHashSlot<Key> slot={entries[i].first, id};
+            insert_key(slot);
+            ++num_keys;
+         }
+         ids.push_back(id);
+         ++counts[id];
+      }
+
+      std::vector<int> starts(counts.size());
+      int offset=0;
+      for(unsigned int id=0; id<counts.size(); ++id){
+         starts[id]=offset;
+         offset+=counts[id];
+         counts[id]=starts[id]; // from here on, the write cursor
+      }
+      num_entries=(unsigned int)offset;
+      free_list=-1;
+      pool.resize(num_entries);
+      for(unsigned int i=0; i<ids.size(); ++i){
+         const int e=counts[ids[i]]++;
+         if(i<old.size())
+            pool[e]=old[i];
+         else{
+            pool[e].key=entries[i-old.size()].first;
+            pool[e].data=entries[i-old.size()].second;
+         }
+         pool[e].next=e+1;
+      }
+      for(unsigned int i=0; i<slots.size(); ++i){
+         if(!probe[i]) continue;
+         const int id=slots[i].head;
+         pool[counts[id]-1].next=-1;
+         slots[i].head=starts[id];
+      }
+   }
+
+   void delete_entry(const Key &k, const Data &d) // delete first entry that matches both key and data
+   {
+      int s=find(k);
+      if(s==-1)
+         return;
+      int i=slots[s].head, *p_i=&slots[s].head;
+      while(i!=-1){
+         if(d==pool[i].data){
+            *p_i=pool[i].next; // make list skip over this entry
+            pool[i].next=free_list; // and put it on the front of the free list
+            free_list=i;
+            --num_entries;
+            break;
+         }
+         p_i=&pool[i].next;
+         i=*p_i;
+      }
+      if(slots[s].head!=-1)
+         return;
+      // last entry of the key is gone: shift the rest of the cluster back
+      unsigned int j=(unsigned int)s;
+      for(; j+1<slots.size() && probe[j+1]>1; ++j){
+         slots[j]=slots[j+1];
+         probe[j]=probe[j+1]-1;
+      }
+      probe[j]=0;
+      --num_keys;
+   }
+
+   unsigned int size() const
+   { return num_entries; }
+
+   void clear()
+   {
+      num_keys=0;
+      num_entries=0;
+      free_list=-1;
+      pool.clear();
+      slots.resize(1u<<table_rank);
+      probe.assign(1u<<table_rank, 0);
+   }
+
+   void reserve(unsigned int expected_size)
+   {
+      pool.reserve(expected_size);
+      unsigned int rank=rank_for(expected_size);
+      if(rank>table_rank)
+         rehash(rank);
+   }
+
+   bool has_entry(const Key &k) const
+   { return find(k)!=-1; }
+
+   bool get_entry(const Key &k, Data &data_return) const
+   {
+      int s=find(k);
+      if(s==-1)
+         return false;
+      data_return=pool[slots[s].head].data;
+      return true;
+   }
+
+   void append_all_entries(const Key& k, std::vector<Data>& data_return) const
+   {
+      int s=find(k);
+      if(s==-1)
+         return;
+      for(int i=slots[s].head; i!=-1; i=pool[i].next)
+         data_return.push_back(pool[i].data);
+   }
+
+   Data &operator() (const Key &k, const Data &missing_data)
+   {
+      int s=find(k);
+      if(s==-1){
+         add(k, missing_data); // a new key's only entry is its list head
+         s=find(k);
+      }
+      return pool[slots[s].head].data;
+   }
+
+   const Data &operator() (const Key &k, const Data &missing_data) const
+   {
+      int s=find(k);
+      return s==-1 ? missing_data : pool[slots[s].head].data;
+   }
+
+   void output_statistics() const
+   {
+      std::vector<int> distcount;
+      unsigned int i;
+      int total=0;
+      for(i=0; i<slots.size(); ++i){
+         if(!probe[i]) continue;
+         if(probe[i]>distcount.size()) distcount.resize(probe[i]);
+         ++distcount[probe[i]-1];
+         ++total;
+      }
+      int subtotal=0;
+      for(i=0; i<distcount.size() && i<10; ++i){
+         subtotal+=distcount[i];
+         if(distcount[i]>0)
+            std::cout<<"distance "<<i<<": "<<distcount[i]<<"   ("<<distcount[i]/(float)total*100.0<<"%)"<<std::endl;
+      }
+      std::cout<<"rest: "<<total-subtotal<<"   ("<<100.0*(1.0-subtotal/(float)(total ? total : 1))<<"%)"<<std::endl;
+      std::cout<<"longest probe: "<<(distcount.empty() ? 0 : distcount.size()-1)<<std::endl;
+      std::cout<<"keys: "<<num_keys<<" in "<<(1u<<table_rank)<<" home slots + "<<slots.size()-(1u<<table_rank)<<" tail, "
+               <<num_entries/(float)(num_keys ? num_keys : 1)<<" entries per key"<<std::endl;
+   }
+};
+
 #endif
@@ -6,26 +6,118 @@
 #include "SETTINGS.h"
 #include "makelevelset3.h"
 #include "field.h"
+#include "objreader.h"
 #include "projects/sdfGen/vec.h"
+#include "hashgrid.h"
 
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <limits>
 
 using namespace std;
 
+// Box-query throughput of a hash grid: each triangle's own box is looked up
+// again, as a nearest-triangle search would
+template<class Grid>
+static double query_triangles(const Grid& grid, const vector<Vec3d>& boxMin, const vector<Vec3d>& boxMax, size_t& found)
+{
+    TIMER_INIT();
+    vector<int> hits;
+    found = 0;
+    TIMER_START();
+    for (size_t t = 0; t < boxMin.size(); ++t) {
+        grid.find_box(boxMin[t], boxMax[t], hits);
+        found += hits.size();
+    }
+    TIMER_END();
+    return TIMER_DURATION;
+}
+
+// Bins every triangle's bounding box into a HashGrid3 with the chained table,
+// the open-addressing table one box at a time, and the open-addressing table
+// in one bulk build, and reports insert and box-query throughput of each.
+// Cells are `cellScale` mean edge lengths across.
+static void benchmark_hashgrid(const vector<Vec3ui>& faceList, const vector<Vec3f>& vertList, double cellScale)
+{
+    vector<Vec3d> boxMin(faceList.size()), boxMax(faceList.size());
+    vector<int> ids(faceList.size());
+    double edgeSum = 0;
+    for (size_t t = 0; t < faceList.size(); ++t) {
+        Vec3d a(vertList[faceList[t][0]]), b(vertList[faceList[t][1]]), c(vertList[faceList[t][2]]);
+        boxMin[t] = min_union(a, min_union(b, c));
+        boxMax[t] = max_union(a, max_union(b, c));
+        edgeSum += dist(a, b) + dist(b, c) + dist(c, a);
+        ids[t] = (int)t;
+    }
+    const double dx = cellScale * edgeSum / (3.0 * max<size_t>(faceList.size(), 1));
+    const double n = (double)faceList.size();
+    cout << "Binning " << faceList.size() << " triangles, cell size " << dx << endl;
+
+    TIMER_INIT();
+    size_t chainedFound, flatFound, bulkFound;
+
+    TIMER_START();
+    HashGrid3<int, HashTable<Vec3i, int, CellHashFunction> > chained(dx, (int)faceList.size());
+    for (size_t t = 0; t < faceList.size(); ++t)
+        chained.add_box(boxMin[t], boxMax[t], ids[t]);
+    TIMER_END();
+    const double chainedInsert = TIMER_DURATION;
+    const double chainedQuery = query_triangles(chained, boxMin, boxMax, chainedFound);
+
+    TIMER_START();
+    HashGrid3<int> flat(dx, (int)faceList.size());
+    for (size_t t = 0; t < faceList.size(); ++t)
+        flat.add_box(boxMin[t], boxMax[t], ids[t]);
+    TIMER_END();
+    const double flatInsert = TIMER_DURATION;
+    const double flatQuery = query_triangles(flat, boxMin, boxMax, flatFound);
+
+    TIMER_START();
+    HashGrid3<int> bulk(dx, (int)faceList.size());
+    bulk.add_boxes(boxMin, boxMax, ids);
+    TIMER_END();
+    const double bulkInsert = TIMER_DURATION;
+    const double bulkQuery = query_triangles(bulk, boxMin, boxMax, bulkFound);
+
+    cout << " " << chained.size() << " entries" << endl;
+    cout << " chained insert: " << n / chainedInsert / 1e6 << " M boxes/s, query: " << n / chainedQuery / 1e6 << " M boxes/s" << endl;
+    cout << " flat    insert: " << n / flatInsert / 1e6 << " M boxes/s, query: " << n / flatQuery / 1e6 << " M boxes/s" << endl;
+    cout << " bulk    insert: " << n / bulkInsert / 1e6 << " M boxes/s, query: " << n / bulkQuery / 1e6 << " M boxes/s" << endl;
+    if (chainedFound != flatFound || chainedFound != bulkFound)
+        cout << "WARNING: query results differ (" << chainedFound << ", " << flatFound << ", " << bulkFound << ")" << endl;
+    cout << "Flat table:" << endl;
+    bulk.grid.output_statistics();
+}
 
 int main(int argc, char* argv[]) {
 
+    // Pull the F3D output options out of the argument list so the positional
+    // arguments below keep their meaning
+    F3D::WriteOptions f3dOptions;
+    {
+        int kept = 1;
+        for (int i = 1; i < argc; ++i) {
+            string arg(argv[i]);
+            if (arg == "--float32") f3dOptions.float32 = true;
+            else if (arg == "--compress") f3dOptions.compress = true;
+            else argv[kept++] = argv[i];
+        }
+        argc = kept;
+    }
+
     if(argc < 2) {
         cout << "USAGE: " << endl;
         cout << "To generate an SDF from a mesh with automatically generated bounds:" << endl;
         cout << " " << argv[0] << " <*.obj input> <resolution> <*.f3d output> <padding cells>\n";
         cout << "To get the bounds for a mesh sequence:" << endl;
         cout << " " << argv[0] << " BOUNDS <obj 1> <obj 2> ... <obj N>\n";
+        cout << "To benchmark triangle binning in the hash grids:" << endl;
+        cout << " " << argv[0] << " HASHGRID <*.obj input> [cell size in mean edge lengths]\n";
         cout << "To generate an SDF from a mesh with specified bounds:" << endl;
         cout << " " << argv[0] << " <*.obj input> <resolution> <*.f3d output> <min X> <min Y> <min Z> <max X> <max Y> <max Z>\n";
+        cout << "Options (SDF generation):" << endl;
+        cout << " --float32   store the field as 32-bit floats" << endl;
+        cout << " --compress  compress the field slab by slab" << endl;
         exit(-1);
     }
 
@@ -44,40 +136,20 @@ int main(int argc, char* argv[]) {
 
             cout << "Reading data.\n";
 
-            ifstream infile(argv[i]);
-            if(!infile) {
+            // Only the vertices matter for the bounds, skip faces and normals
+            ObjReader::ObjData obj;
+            if(!ObjReader::read(filename, obj, true)) {
                 cerr << "Failed to open " << argv[i] << " Terminating.\n";
                 exit(-1);
             }
 
-            int ignored_lines = 0;
-            int total_lines = 0;
-            string line;
-            while(!infile.eof()) {
-                getline(infile, line);
-
-                //.obj files sometimes contain vertex normals indicated by "vn"
-                if(line.substr(0,1) == string("v") && line.substr(0,2) != string("vn")){
-                    stringstream data(line);
-                    char c;
-                    Vec3f point;
-                    data >> c >> point[0] >> point[1] >> point[2];
-                    update_minmax(point, min_box, max_box);
-                }
-                else if( line.substr(0,2) == string("vn") ){
-                    cerr << "Obj-loader is not able to parse vertex normals, please strip them from the input file. \n";
-                    exit(-2);
-                }
-                else if(line.substr(0,1) == string("f")) { }
-                else {
-                    ++ignored_lines;
-                }
-                ++total_lines;
+            for (size_t v = 0; v < obj.numVertices(); ++v) {
+                Vec3f point(obj.positions[3*v], obj.positions[3*v+1], obj.positions[3*v+2]);
+                update_minmax(point, min_box, max_box);
             }
-            infile.close();
 
-            if(ignored_lines > 0)
-                cout << "Warning: " << ignored_lines << " of " << total_lines << " lines were ignored since they did not contain faces or vertices.\n";
+            if(obj.ignoredLines > 0)
+                cout << "Warning: " << obj.ignoredLines << " of " << obj.totalLines << " lines were ignored since they did not contain faces, vertices or normals.\n";
 
         }
 
@@ -87,6 +159,23 @@ int main(int argc, char* argv[]) {
         exit(0);
     }
 
+    if (string(argv[1]) == "HASHGRID" && argc >= 3) {
+        ObjReader::ObjData obj;
+        if(!ObjReader::read(argv[2], obj)) {
+            cerr << "Failed to open " << argv[2] << " Terminating.\n";
+            exit(-1);
+        }
+        vector<Vec3f> vertList(obj.numVertices());
+        vector<Vec3ui> faceList(obj.numFaces());
+        for (size_t v = 0; v < vertList.size(); ++v)
+            vertList[v] = Vec3f(obj.positions[3*v], obj.positions[3*v+1], obj.positions[3*v+2]);
+        for (size_t f = 0; f < faceList.size(); ++f)
+            faceList[f] = Vec3ui(obj.indices[3*f], obj.indices[3*f+1], obj.indices[3*f+2]);
+
+        benchmark_hashgrid(faceList, vertList, argc >= 4 ? atof(argv[3]) : 1.0);
+        exit(0);
+    }
+
     string filename(argv[1]);
     if(filename.size() < 5 || filename.substr(filename.size()-4) != string(".obj")) {
         cerr << "Error: Expected OBJ file with filename of the form <name>.obj.\n";
@@ -107,47 +196,23 @@ int main(int argc, char* argv[]) {
 
     cout << "Reading data.\n";
 
-    ifstream infile(argv[1]);
-    if(!infile) {
+    ObjReader::ObjData obj;
+    if(!ObjReader::read(filename, obj)) {
         cerr << "Failed to open. Terminating.\n";
         exit(-1);
     }
 
-    int ignored_lines = 0;
-    string line;
-    vector<Vec3f> vertList;
-    vector<Vec3ui> faceList;
-    while(!infile.eof()) {
-        getline(infile, line);
-
-        //.obj files sometimes contain vertex normals indicated by "vn"
-        if(line.substr(0,1) == string("v") && line.substr(0,2) != string("vn")){
-            stringstream data(line);
-            char c;
-            Vec3f point;
-            data >> c >> point[0] >> point[1] >> point[2];
-            vertList.push_back(point);
-            update_minmax(point, min_box, max_box);
-        }
-        else if(line.substr(0,1) == string("f")) {
-            stringstream data(line);
-            char c;
-            int v0,v1,v2;
-            data >> c >> v0 >> v1 >> v2;
-            faceList.push_back(Vec3ui(v0-1,v1-1,v2-1));
-        }
-        else if( line.substr(0,2) == string("vn") ){
-            cerr << "Obj-loader is not able to parse vertex normals, please strip them from the input file. \n";
-            exit(-2);
-        }
-        else {
-            ++ignored_lines;
-        }
+    vector<Vec3f> vertList(obj.numVertices());
+    vector<Vec3ui> faceList(obj.numFaces());
+    for (size_t v = 0; v < vertList.size(); ++v) {
+        vertList[v] = Vec3f(obj.positions[3*v], obj.positions[3*v+1], obj.positions[3*v+2]);
+        update_minmax(vertList[v], min_box, max_box);
     }
-    infile.close();
+    for (size_t f = 0; f < faceList.size(); ++f)
+        faceList[f] = Vec3ui(obj.indices[3*f], obj.indices[3*f+1], obj.indices[3*f+2]);
 
-    if(ignored_lines > 0)
-        cout << "Warning: " << ignored_lines << " lines were ignored since they did not contain faces or vertices.\n";
+    if(obj.ignoredLines > 0)
+        cout << "Warning: " << obj.ignoredLines << " lines were ignored since they did not contain faces, vertices or normals.\n";
 
     cout << "Read in " << vertList.size() << " vertices and " << faceList.size() << " faces." << endl;
 
@@ -234,7 +299,7 @@ int main(int argc, char* argv[]) {
             for (int x = 0; x < xRes; x++)
                 field.at(x,y,z) = phi_grid(x,y,z);
 
-    field.writeF3D(outname, true);
+    field.writeF3D(outname, field.mapBox, f3dOptions, true);
 
     cout << "Processing complete.\n";
 
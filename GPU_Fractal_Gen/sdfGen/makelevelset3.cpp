@@ -1,5 +1,8 @@
 #include "makelevelset3.h"
 #include "SETTINGS.h"
+#include "parallel.h"
+
+#include <mutex>
 
 // find distance x0 is from segment x1-x2
 static float point_segment_distance(const Vec3f &x0, const Vec3f &x1, const Vec3f &x2)
@@ -129,30 +132,74 @@ void make_level_set3(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x
     // we begin by initializing distances near the mesh, and figuring out intersection counts
     Vec3f ijkmin, ijkmax;
 
-    PB_START("Initializing distances near mesh");
+    // coordinates of triangle t's corners in grid to high precision, and the
+    // cells within exact_band of its bounds
+    auto grid_coords = [&](unsigned int t, double f[3][3]) {
+        unsigned int v[3]; assign(tri[t], v[0], v[1], v[2]);
+        for(int c=0; c<3; ++c) for(int a=0; a<3; ++a) f[c][a]=((double)x[v[c]][a]-origin[a])/dx;
+    };
+    auto band_bounds = [&](const double f[3][3], int lo[3], int hi[3]) {
+        const int n[3]={ni, nj, nk};
+        for(int a=0; a<3; ++a){
+            lo[a]=clamp(int(min(f[0][a],f[1][a],f[2][a]))-exact_band, 0, n[a]-1);
+            hi[a]=clamp(int(max(f[0][a],f[1][a],f[2][a]))+exact_band+1, 0, n[a]-1);
+        }
+    };
+
+    // do distances nearby: bin the triangles into the tiles their bands
+    // overlap, then fill the tiles in parallel. Each tile is only written by
+    // the thread running it, and visits its triangles in index order, so
+    // ties resolve exactly as in a serial pass over the triangles.
+    const int ts=Parallel::PARALLEL_TILE_SIZE;
+    const int ti=(ni+ts-1)/ts, tj=(nj+ts-1)/ts, tk=(nk+ts-1)/ts;
+    std::vector<std::vector<unsigned int> > tile_tris((size_t)ti*tj*tk);
     for(unsigned int t=0; t<tri.size(); ++t){
-        unsigned int p, q, r; assign(tri[t], p, q, r);
-        // coordinates in grid to high precision
-        double fip=((double)x[p][0]-origin[0])/dx, fjp=((double)x[p][1]-origin[1])/dx, fkp=((double)x[p][2]-origin[2])/dx;
-        double fiq=((double)x[q][0]-origin[0])/dx, fjq=((double)x[q][1]-origin[1])/dx, fkq=((double)x[q][2]-origin[2])/dx;
-        double fir=((double)x[r][0]-origin[0])/dx, fjr=((double)x[r][1]-origin[1])/dx, fkr=((double)x[r][2]-origin[2])/dx;
-        // do distances nearby
-        int i0=clamp(int(min(fip,fiq,fir))-exact_band, 0, ni-1), i1=clamp(int(max(fip,fiq,fir))+exact_band+1, 0, ni-1);
-        int j0=clamp(int(min(fjp,fjq,fjr))-exact_band, 0, nj-1), j1=clamp(int(max(fjp,fjq,fjr))+exact_band+1, 0, nj-1);
-        int k0=clamp(int(min(fkp,fkq,fkr))-exact_band, 0, nk-1), k1=clamp(int(max(fkp,fkq,fkr))+exact_band+1, 0, nk-1);
-        for(int k=k0; k<=k1; ++k) for(int j=j0; j<=j1; ++j) for(int i=i0; i<=i1; ++i){
-            Vec3f gx(i*dx+origin[0], j*dx+origin[1], k*dx+origin[2]);
-            float d=point_triangle_distance(gx, x[p], x[q], x[r]);
-            if(d<phi(i,j,k)){
-                phi(i,j,k)=d;
-                closest_tri(i,j,k)=t;
+        double f[3][3]; int lo[3], hi[3];
+        grid_coords(t, f);
+        band_bounds(f, lo, hi);
+        for(int k=lo[2]/ts; k<=hi[2]/ts; ++k) for(int j=lo[1]/ts; j<=hi[1]/ts; ++j) for(int i=lo[0]/ts; i<=hi[0]/ts; ++i)
+            tile_tris[((size_t)k*tj+j)*ti+i].push_back(t);
+    }
+
+    PB_START("Initializing distances near mesh");
+    std::mutex progress_lock;
+    size_t tiles_done=0;
+    Parallel::SchedulerStats stats=Parallel::parallelTiles(ni, nj, nk, [&](const Parallel::Tile& tile){
+        for(unsigned int t : tile_tris[((size_t)(tile.z0/ts)*tj+tile.y0/ts)*ti+tile.x0/ts]){
+            unsigned int p, q, r; assign(tri[t], p, q, r);
+            double f[3][3]; int lo[3], hi[3];
+            grid_coords(t, f);
+            band_bounds(f, lo, hi);
+            int i0=max(lo[0], (int)tile.x0), i1=min(hi[0], (int)tile.x1-1);
+            int j0=max(lo[1], (int)tile.y0), j1=min(hi[1], (int)tile.y1-1);
+            int k0=max(lo[2], (int)tile.z0), k1=min(hi[2], (int)tile.z1-1);
+            for(int k=k0; k<=k1; ++k) for(int j=j0; j<=j1; ++j) for(int i=i0; i<=i1; ++i){
+                Vec3f gx(i*dx+origin[0], j*dx+origin[1], k*dx+origin[2]);
+                float d=point_triangle_distance(gx, x[p], x[q], x[r]);
+                if(d<phi(i,j,k)){
+                    phi(i,j,k)=d;
+                    closest_tri(i,j,k)=t;
+                }
             }
         }
-        // and do intersection counts
-        j0=clamp((int)std::ceil(min(fjp,fjq,fjr)), 0, nj-1);
-        j1=clamp((int)std::floor(max(fjp,fjq,fjr)), 0, nj-1);
-        k0=clamp((int)std::ceil(min(fkp,fkq,fkr)), 0, nk-1);
-        k1=clamp((int)std::floor(max(fkp,fkq,fkr)), 0, nk-1);
+        std::lock_guard<std::mutex> guard(progress_lock);
+        ++tiles_done;
+        PB_PROGRESS((float) tiles_done / tile_tris.size());
+    }, ts);
+    PB_END();
+    stats.print("Distances near mesh");
+
+    // and do intersection counts
+    for(unsigned int t=0; t<tri.size(); ++t){
+        double f[3][3];
+        grid_coords(t, f);
+        double fip=f[0][0], fjp=f[0][1], fkp=f[0][2];
+        double fiq=f[1][0], fjq=f[1][1], fkq=f[1][2];
+        double fir=f[2][0], fjr=f[2][1], fkr=f[2][2];
+        int j0=clamp((int)std::ceil(min(fjp,fjq,fjr)), 0, nj-1);
+        int j1=clamp((int)std::floor(max(fjp,fjq,fjr)), 0, nj-1);
+        int k0=clamp((int)std::ceil(min(fkp,fkq,fkr)), 0, nk-1);
+        int k1=clamp((int)std::floor(max(fkp,fkq,fkr)), 0, nk-1);
         for(int k=k0; k<=k1; ++k) for(int j=j0; j<=j1; ++j){
             double a, b, c;
             if(point_in_triangle_2d(j, k, fjp, fkp, fjq, fkq, fjr, fkr, a, b, c)){
@@ -163,9 +210,7 @@ void make_level_set3(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x
                 // we ignore intersections that are beyond the +x side of the grid
             }
         }
-        PB_PROGRESS((float) t / tri.size());
     }
-    PB_END();
 
 
     PB_STARTD("Filling in distances not near mesh using fast sweeping");
@@ -0,0 +1,112 @@
+// Checks FlatHashTable against the chained HashTable it replaces in SDFGen:
+// the same adds, bulk adds and deletes go to both, and every key must then
+// hold the same entries in each. Keys come from a small range so most have
+// several entries, and a clustering hash drives the probes into the tail.
+
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+
+#include "sdfGen/hashtable.h"
+
+// Only the top bits pick the home slot, so this piles keys into a few clusters
+struct ClusteringHash
+{
+   unsigned int operator() (unsigned int k) const { return (k % 5) << 29; }
+};
+
+// Deterministic so a failure reproduces
+static unsigned int nextRandom(unsigned int& state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+static const unsigned int KEY_RANGE = 300;
+
+static int failures = 0;
+
+template <class Flat, class Chained>
+static bool sameEntries(const Flat& flat, const Chained& chained) {
+    size_t flatTotal = 0;
+    for (unsigned int k = 0; k < KEY_RANGE + 20; k++) {
+        std::vector<int> a, b;
+        flat.append_all_entries(k, a);
+        chained.append_all_entries(k, b);
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        if (a != b || flat.has_entry(k) != chained.has_entry(k)) return false;
+
+        int data = -1;
+        if (flat.get_entry(k, data) != !b.empty()) return false;
+        if (!b.empty() && !std::binary_search(b.begin(), b.end(), data)) return false;
+        if (b.empty() && flat(k, -7) != -7) return false;
+        flatTotal += a.size();
+    }
+    return flatTotal == flat.size();
+}
+
+template <class Hash>
+static void check(const std::string& name, unsigned int seed) {
+    FlatHashTable<unsigned int, int, Hash> flat(8);
+    HashTable<unsigned int, int, Hash> chained(8);
+    unsigned int state = seed;
+    int nextData = 0;
+    bool same = true;
+
+    for (int round = 0; round < 20 && same; round++) {
+        // One at a time
+        for (int i = 0; i < 150; i++) {
+            const unsigned int k = nextRandom(state) % KEY_RANGE;
+            flat.add(k, nextData);
+            chained.add(k, nextData);
+            nextData++;
+        }
+
+        // In bulk, on top of what is there
+        std::vector<std::pair<unsigned int, int> > batch;
+        for (int i = 0; i < 200; i++) {
+            batch.push_back(std::make_pair(nextRandom(state) % KEY_RANGE, nextData));
+            chained.add(batch.back().first, nextData);
+            nextData++;
+        }
+        flat.add_all(batch);
+
+        // Deletes, a few of them for entries that were never added; some
+        // rounds empty a whole band of keys
+        for (int i = 0; i < 250; i++) {
+            const unsigned int k = nextRandom(state) % KEY_RANGE;
+            const int d = int(nextRandom(state) % (nextData + 10));
+            flat.delete_entry(k, d);
+            chained.delete_entry(k, d);
+        }
+        if (round % 4 == 3) {
+            for (unsigned int k = 0; k < KEY_RANGE / 3; k++) {
+                std::vector<int> entries;
+                chained.append_all_entries(k, entries);
+                for (int d : entries) {
+                    flat.delete_entry(k, d);
+                    chained.delete_entry(k, d);
+                }
+            }
+        }
+
+        same = sameEntries(flat, chained);
+    }
+
+    printf("%-40s %s: %u entries in %u keys\n", name.c_str(), same ? "ok  " : "FAIL", flat.size(), flat.num_keys);
+    if (!same) failures++;
+}
+
+int main() {
+    check<DefaultHashFunction>("default hash", 1);
+    check<DefaultHashFunction>("default hash, other seed", 77);
+    check<ClusteringHash>("clustering hash", 1);
+
+    if (failures) {
+        printf("%d hash table checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
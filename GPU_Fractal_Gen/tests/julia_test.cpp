@@ -0,0 +1,81 @@
+// Checks the interior early-out of the Julia sets (cycleTolerance): orbits
+// caught in a cycle must end on the same point of it, and so get the same
+// value and inside / outside classification, as when every iteration runs.
+// The map below has an attracting 2-cycle whose two points lie on either side
+// of the zero level, so skipping a wrong number of steps flips the sign.
+
+#include <cstdio>
+#include <cmath>
+#include <string>
+
+#include "fractalGen/SETTINGS.h"
+#include "fractalGen/julia.h"
+
+using namespace std;
+
+// Outside radius 3 orbits blow up. Inside, points right of x = -0.75 are pulled
+// towards v and the others towards u, so orbits settle into u -> v -> u.
+class TwoCycleMap: public R3Map {
+public:
+    const VEC3F u = VEC3F(0.5, 0, 0), v = VEC3F(-2, 0, 0);
+    mutable size_t evaluations = 0;
+
+    VEC3F getFieldValue(const VEC3F& p) const override {
+        evaluations++;
+        if (p.norm() > 3) return p * p.norm();
+        return p[0] >= -0.75 ? VEC3F(v + 0.5 * (p - u)) : VEC3F(u + 0.5 * (p - v));
+    }
+};
+
+static int failures = 0;
+
+static void check(int maxIterations) {
+    TwoCycleMap map;
+    R3JuliaSet full(&map, maxIterations, 20), early(&map, maxIterations, 20);
+    early.cycleTolerance = 1e-9;
+
+    size_t samples = 0, inside = 0, cycling = 0, mismatches = 0;
+    size_t fullEvaluations = 0, earlyEvaluations = 0;
+    const int n = 11;
+    for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+    for (int k = 0; k < n; k++) {
+        const VEC3F p = VEC3F(-3, -3, -3) + VEC3F(i, j, k) * (6.0 / (n - 1));
+
+        map.evaluations = 0;
+        const Real reference = full.getFieldValue(p);
+        fullEvaluations += map.evaluations;
+
+        map.evaluations = 0;
+        const Real value = early.getFieldValue(p);
+        earlyEvaluations += map.evaluations;
+        if (map.evaluations < size_t(maxIterations) && reference < log(20.0)) cycling++;
+
+        VEC3F gradient;
+        const Real gradientValue = early.getValueAndGradient(p, gradient);
+
+        samples++;
+        if (reference < 0) inside++;
+        if ((value < 0) != (reference < 0) || fabs(value - reference) > 1e-6 || gradientValue != value)
+            mismatches++;
+    }
+
+    // Bounded orbits must have taken the early-out, or nothing was tested
+    const bool ok = mismatches == 0 && inside > 0 && inside < samples && cycling > 0 && earlyEvaluations < fullEvaluations;
+    printf("%-40s %s: %zu points, %zu inside, %zu cut short, %zu mismatches, %zu -> %zu map evaluations\n",
+        ("two-cycle, " + to_string(maxIterations) + " iterations").c_str(), ok ? "ok  " : "FAIL",
+        samples, inside, cycling, mismatches, fullEvaluations, earlyEvaluations);
+    if (!ok) failures++;
+}
+
+int main() {
+    // Both parities, so the orbit ends on either point of the cycle
+    check(100);
+    check(101);
+
+    if (failures) {
+        printf("%d Julia cycle checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,351 @@
+// Checks the host marching cubes paths against the original serial march on
+// analytic fields, so it runs on any machine without data files or a GPU.
+// The reference below is the cube-at-a-time march the generator started
+// from, with its own triangle table and edge bookkeeping, so it shares no
+// code with MC.h beyond the grid interface.
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <vector>
+#include <string>
+
+#include "fractalGen/SETTINGS.h"
+#include "fractalGen/field.h"
+#include "fractalGen/mesh.h"
+#include "fractalGen/MC.h"
+
+using namespace std;
+
+namespace Baseline
+{
+    static const unsigned long long MARCHING_CUBE_TRIS[256] =
+    {
+        0ULL, 33793ULL, 36945ULL, 159668546ULL,
+        18961ULL, 144771090ULL, 5851666ULL, 595283255635ULL,
+        20913ULL, 67640146ULL, 193993474ULL, 655980856339ULL,
+        88782242ULL, 736732689667ULL, 797430812739ULL, 194554754ULL,
+        26657ULL, 104867330ULL, 136709522ULL, 298069416227ULL,
+        109224258ULL, 8877909667ULL, 318136408323ULL, 1567994331701604ULL,
+        189884450ULL, 350847647843ULL, 559958167731ULL, 3256298596865604ULL,
+        447393122899ULL, 651646838401572ULL, 2538311371089956ULL, 737032694307ULL,
+        29329ULL, 43484162ULL, 91358498ULL, 374810899075ULL,
+        158485010ULL, 178117478419ULL, 88675058979ULL, 433581536604804ULL,
+        158486962ULL, 649105605635ULL, 4866906995ULL, 3220959471609924ULL,
+        649165714851ULL, 3184943915608436ULL, 570691368417972ULL, 595804498035ULL,
+        124295042ULL, 431498018963ULL, 508238522371ULL, 91518530ULL,
+        318240155763ULL, 291789778348404ULL, 1830001131721892ULL, 375363605923ULL,
+        777781811075ULL, 1136111028516116ULL, 3097834205243396ULL, 508001629971ULL,
+        2663607373704004ULL, 680242583802939237ULL, 333380770766129845ULL, 179746658ULL,
+        42545ULL, 138437538ULL, 93365810ULL, 713842853011ULL,
+        73602098ULL, 69575510115ULL, 23964357683ULL, 868078761575828ULL,
+        28681778ULL, 713778574611ULL, 250912709379ULL, 2323825233181284ULL,
+        302080811955ULL, 3184439127991172ULL, 1694042660682596ULL, 796909779811ULL,
+        176306722ULL, 150327278147ULL, 619854856867ULL, 1005252473234484ULL,
+        211025400963ULL, 36712706ULL, 360743481544788ULL, 150627258963ULL,
+        117482600995ULL, 1024968212107700ULL, 2535169275963444ULL, 4734473194086550421ULL,
+        628107696687956ULL, 9399128243ULL, 5198438490361643573ULL, 194220594ULL,
+        104474994ULL, 566996932387ULL, 427920028243ULL, 2014821863433780ULL,
+        492093858627ULL, 147361150235284ULL, 2005882975110676ULL, 9671606099636618005ULL,
+        777701008947ULL, 3185463219618820ULL, 482784926917540ULL, 2900953068249785909ULL,
+        1754182023747364ULL, 4274848857537943333ULL, 13198752741767688709ULL, 2015093490989156ULL,
+        591272318771ULL, 2659758091419812ULL, 1531044293118596ULL, 298306479155ULL,
+        408509245114388ULL, 210504348563ULL, 9248164405801223541ULL, 91321106ULL,
+        2660352816454484ULL, 680170263324308757ULL, 8333659837799955077ULL, 482966828984116ULL,
+        4274926723105633605ULL, 3184439197724820ULL, 192104450ULL, 15217ULL,
+        45937ULL, 129205250ULL, 129208402ULL, 529245952323ULL,
+        169097138ULL, 770695537027ULL, 382310500883ULL, 2838550742137652ULL,
+        122763026ULL, 277045793139ULL, 81608128403ULL, 1991870397907988ULL,
+        362778151475ULL, 2059003085103236ULL, 2132572377842852ULL, 655681091891ULL,
+        58419234ULL, 239280858627ULL, 529092143139ULL, 1568257451898804ULL,
+        447235128115ULL, 679678845236084ULL, 2167161349491220ULL, 1554184567314086709ULL,
+        165479003923ULL, 1428768988226596ULL, 977710670185060ULL, 10550024711307499077ULL,
+        1305410032576132ULL, 11779770265620358997ULL, 333446212255967269ULL, 978168444447012ULL,
+        162736434ULL, 35596216627ULL, 138295313843ULL, 891861543990356ULL,
+        692616541075ULL, 3151866750863876ULL, 100103641866564ULL, 6572336607016932133ULL,
+        215036012883ULL, 726936420696196ULL, 52433666ULL, 82160664963ULL,
+        2588613720361524ULL, 5802089162353039525ULL, 214799000387ULL, 144876322ULL,
+        668013605731ULL, 110616894681956ULL, 1601657732871812ULL, 430945547955ULL,
+        3156382366321172ULL, 7644494644932993285ULL, 3928124806469601813ULL, 3155990846772900ULL,
+        339991010498708ULL, 10743689387941597493ULL, 5103845475ULL, 105070898ULL,
+        3928064910068824213ULL, 156265010ULL, 1305138421793636ULL, 27185ULL,
+        195459938ULL, 567044449971ULL, 382447549283ULL, 2175279159592324ULL,
+        443529919251ULL, 195059004769796ULL, 2165424908404116ULL, 1554158691063110021ULL,
+        504228368803ULL, 1436350466655236ULL, 27584723588724ULL, 1900945754488837749ULL,
+        122971970ULL, 443829749251ULL, 302601798803ULL, 108558722ULL,
+        724700725875ULL, 43570095105972ULL, 2295263717447940ULL, 2860446751369014181ULL,
+        2165106202149444ULL, 69275726195ULL, 2860543885641537797ULL, 2165106320445780ULL,
+        2280890014640004ULL, 11820349930268368933ULL, 8721082628082003989ULL, 127050770ULL,
+        503707084675ULL, 122834978ULL, 2538193642857604ULL, 10129ULL,
+        801441490467ULL, 2923200302876740ULL, 1443359556281892ULL, 2901063790822564949ULL,
+        2728339631923524ULL, 7103874718248233397ULL, 12775311047932294245ULL, 95520290ULL,
+        2623783208098404ULL, 1900908618382410757ULL, 137742672547ULL, 2323440239468964ULL,
+        362478212387ULL, 727199575803140ULL, 73425410ULL, 34337ULL,
+        163101314ULL, 668566030659ULL, 801204361987ULL, 73030562ULL,
+        591509145619ULL, 162574594ULL, 100608342969108ULL, 5553ULL,
+        724147968595ULL, 1436604830452292ULL, 176259090ULL, 42001ULL,
+        143955266ULL, 2385ULL, 18433ULL, 0ULL,
+    };
+
+    static uint slabIndex(uint i, uint j, uint k, const VEC3I& size)
+    {
+        return size.x() * size.y() * (k % 2) + j * size.x() + i;
+    }
+
+    static void computeEdge(VEC3I* slab_inds, Mesh& mesh, Grid3D* grid, float va, float vb, int axis, uint x, uint y, uint z, const VEC3I& size)
+    {
+        if ((va < 0.0) == (vb < 0.0))
+            return;
+
+        VEC3F offset(0, 0, 0);
+        if (grid->supportsNonIntegerIndices) {
+            double l_bound = (va > 0) ? 0 : 1;
+            double r_bound = (va > 0) ? 1 : 0;
+
+            for (int i = 0; i < MC_MAX_ROOTFINDING_ITERATIONS; ++i) {
+                offset[axis] = 0.5 * (l_bound + r_bound);
+                VEC3F samplePoint = VEC3F(x, y, z) + offset;
+                const Real val = grid->getf(samplePoint);
+
+                if (fabs(val) < MC_ROOTFINDING_THRESH) break;
+
+                if (val < 0) {
+                    r_bound = offset[axis];
+                } else {
+                    l_bound = offset[axis];
+                }
+            }
+        }
+
+        slab_inds[slabIndex(x, y, z, size)][axis] = int(mesh.vertices.size());
+        mesh.vertices.push_back(VEC3F(x, y, z) + offset);
+        mesh.normals.push_back(VEC3F(0, 0, 0));
+    }
+
+    static void accumulateNormal(Mesh& mesh, uint a, uint b, uint c)
+    {
+        const VEC3F ab = mesh.vertices[a] - mesh.vertices[b];
+        const VEC3F cb = mesh.vertices[c] - mesh.vertices[b];
+        const VEC3F n(cb.y() * ab.z() - cb.z() * ab.y(), cb.z() * ab.x() - cb.x() * ab.z(), cb.x() * ab.y() - cb.y() * ab.x());
+        mesh.normals[a] += n;
+        mesh.normals[b] += n;
+        mesh.normals[c] += n;
+    }
+
+    static void march(Grid3D* grid, Mesh& mesh)
+    {
+        const uint nx = grid->xRes, ny = grid->yRes, nz = grid->zRes;
+        const VEC3I size(nx, ny, nz);
+        vector<VEC3I> slab_inds(size_t(nx) * ny * 2, VEC3I(0, 0, 0));
+
+        for (uint z = 0; z < nz - 1; z++)
+        for (uint y = 0; y < ny - 1; y++)
+        for (uint x = 0; x < nx - 1; x++) {
+            Real vs[8];
+            vs[0] = grid->get(x, y, z);
+            vs[1] = grid->get(x + 1, y, z);
+            vs[2] = grid->get(x, y + 1, z);
+            vs[3] = grid->get(x + 1, y + 1, z);
+            vs[4] = grid->get(x, y, z + 1);
+            vs[5] = grid->get(x + 1, y, z + 1);
+            vs[6] = grid->get(x, y + 1, z + 1);
+            vs[7] = grid->get(x + 1, y + 1, z + 1);
+
+            int config_n = 0;
+            for (int c = 0; c < 8; c++) config_n |= (vs[c] < 0) << c;
+            if (config_n == 0 || config_n == 255)
+                continue;
+
+            VEC3I* s = slab_inds.data();
+            if (y == 0 && z == 0)
+                computeEdge(s, mesh, grid, vs[0], vs[1], 0, x, y, z, size);
+            if (z == 0)
+                computeEdge(s, mesh, grid, vs[2], vs[3], 0, x, y + 1, z, size);
+            if (y == 0)
+                computeEdge(s, mesh, grid, vs[4], vs[5], 0, x, y, z + 1, size);
+            computeEdge(s, mesh, grid, vs[6], vs[7], 0, x, y + 1, z + 1, size);
+            if (x == 0 && z == 0)
+                computeEdge(s, mesh, grid, vs[0], vs[2], 1, x, y, z, size);
+            if (z == 0)
+                computeEdge(s, mesh, grid, vs[1], vs[3], 1, x + 1, y, z, size);
+            if (x == 0)
+                computeEdge(s, mesh, grid, vs[4], vs[6], 1, x, y, z + 1, size);
+            computeEdge(s, mesh, grid, vs[5], vs[7], 1, x + 1, y, z + 1, size);
+            if (x == 0 && y == 0)
+                computeEdge(s, mesh, grid, vs[0], vs[4], 2, x, y, z, size);
+            if (y == 0)
+                computeEdge(s, mesh, grid, vs[1], vs[5], 2, x + 1, y, z, size);
+            if (x == 0)
+                computeEdge(s, mesh, grid, vs[2], vs[6], 2, x, y + 1, z, size);
+            computeEdge(s, mesh, grid, vs[3], vs[7], 2, x + 1, y + 1, z, size);
+
+            uint edge_indices[12];
+            edge_indices[0]  = s[slabIndex(x, y, z, size)].x();
+            edge_indices[1]  = s[slabIndex(x, y + 1, z, size)].x();
+            edge_indices[2]  = s[slabIndex(x, y, z + 1, size)].x();
+            edge_indices[3]  = s[slabIndex(x, y + 1, z + 1, size)].x();
+            edge_indices[4]  = s[slabIndex(x, y, z, size)].y();
+            edge_indices[5]  = s[slabIndex(x + 1, y, z, size)].y();
+            edge_indices[6]  = s[slabIndex(x, y, z + 1, size)].y();
+            edge_indices[7]  = s[slabIndex(x + 1, y, z + 1, size)].y();
+            edge_indices[8]  = s[slabIndex(x, y, z, size)].z();
+            edge_indices[9]  = s[slabIndex(x + 1, y, z, size)].z();
+            edge_indices[10] = s[slabIndex(x, y + 1, z, size)].z();
+            edge_indices[11] = s[slabIndex(x + 1, y + 1, z, size)].z();
+
+            const unsigned long long config = MARCHING_CUBE_TRIS[config_n];
+            const size_t n_triangles = config & 0xF;
+            const size_t indexBase = mesh.indices.size();
+            for (size_t i = 0; i < n_triangles * 3; i++)
+                mesh.indices.push_back(edge_indices[(config >> (4 + 4 * i)) & 0xF]);
+            for (size_t i = 0; i < n_triangles; i++)
+                accumulateNormal(mesh, mesh.indices[indexBase + 3 * i], mesh.indices[indexBase + 3 * i + 1], mesh.indices[indexBase + 3 * i + 2]);
+        }
+
+        for (size_t i = 0; i < mesh.normals.size(); i++)
+            mesh.normals[i] = mesh.normals[i].normalized();
+    }
+}
+
+// Analytic fields, negative inside
+static Real sphereField(VEC3F p) {
+    return (p - VEC3F(0.1, -0.05, 0.02)).norm() - 0.62;
+}
+
+static Real planeField(VEC3F p) {
+    return VEC3F(0.3, -0.5, 0.8).normalized().dot(p) - 0.07;
+}
+
+// A function field that may be sampled from several threads
+class ConcurrentField: public FieldFunction3D {
+public:
+    using FieldFunction3D::FieldFunction3D;
+    bool supportsConcurrentReads() const override { return true; }
+};
+
+// Forces march_cubes onto its serial, gathering path
+class SerialGrid: public VirtualGrid3D {
+public:
+    using VirtualGrid3D::VirtualGrid3D;
+    bool supportsConcurrentReads() const override { return false; }
+};
+
+// Stops the march once it samples layer stopZ, as if the run were killed there
+class InterruptedGrid: public SerialGrid {
+public:
+    using SerialGrid::SerialGrid;
+    uint stopZ = UINT_MAX;
+
+    Real get(uint x, uint y, uint z) const override {
+        if (z >= stopZ) throw z;
+        return SerialGrid::get(x, y, z);
+    }
+};
+
+template <class T>
+static bool sameBits(const vector<T>& a, const vector<T>& b) {
+    return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+static int failures = 0;
+
+static void check(const string& name, Grid3D* grid, const MC::CellMask* mask = nullptr) {
+    Mesh m, reference;
+    MC::march_cubes(grid, m, false, mask);
+    Baseline::march(grid, reference);
+
+    const bool same = !reference.indices.empty()
+        && sameBits(m.vertices, reference.vertices)
+        && sameBits(m.normals, reference.normals)
+        && sameBits(m.indices, reference.indices);
+    printf("%-40s %s: %zu vertices, %zu triangles (baseline %zu, %zu)\n", name.c_str(), same ? "ok  " : "FAIL",
+        m.vertices.size(), m.indices.size() / 3, reference.vertices.size(), reference.indices.size() / 3);
+    if (!same) failures++;
+}
+
+static bool fileExists(const string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file) fclose(file);
+    return file != NULL;
+}
+
+// Interrupts a checkpointed march twice and resumes it each time; the mesh
+// must come out the same as an uninterrupted march, and the checkpoint must
+// be gone afterwards
+static void checkResume(const string& name, InterruptedGrid* grid) {
+    Mesh reference;
+    MC::march_cubes(grid, reference);
+
+    MC::Checkpoint checkpoint;
+    checkpoint.path = "mc_test.checkpoint";
+    checkpoint.key = 42;
+    checkpoint.everySlabs = 2;
+    remove(checkpoint.path.c_str());
+    remove((checkpoint.path + ".mesh").c_str());
+
+    bool interrupted = true;
+    Mesh m;
+    for (uint stopZ : {grid->zRes / 3, 2 * grid->zRes / 3}) {
+        grid->stopZ = stopZ;
+        m = Mesh();
+        try {
+            MC::march_cubes(grid, m, false, nullptr, nullptr, &checkpoint);
+            interrupted = false;
+        } catch (uint) {
+        }
+        interrupted = interrupted && fileExists(checkpoint.path);
+        checkpoint.resume = true;
+    }
+    grid->stopZ = UINT_MAX;
+    m = Mesh();
+    MC::march_cubes(grid, m, false, nullptr, nullptr, &checkpoint);
+
+    const bool same = interrupted && !reference.indices.empty()
+        && sameBits(m.vertices, reference.vertices)
+        && sameBits(m.normals, reference.normals)
+        && sameBits(m.indices, reference.indices)
+        && !fileExists(checkpoint.path) && !fileExists(checkpoint.path + ".mesh");
+    printf("%-40s %s: %zu vertices, %zu triangles (uninterrupted %zu, %zu)\n", name.c_str(), same ? "ok  " : "FAIL",
+        m.vertices.size(), m.indices.size() / 3, reference.vertices.size(), reference.indices.size() / 3);
+    if (!same) failures++;
+}
+
+int main() {
+    const VEC3F lo(-1, -1, -1), hi(1, 1, 1);
+    ConcurrentField sphere(sphereField), plane(planeField);
+
+    // Odd resolutions leave a shorter last block of sampled layers
+    for (uint res : {9u, 41u}) {
+        const string r = " res " + to_string(res);
+        ArrayGrid3D sphereArray(res, res, res, lo, hi, &sphere);
+        ArrayGrid3D planeArray(res, res, res, lo, hi, &plane);
+        VirtualGrid3D sphereVirtual(res, res, res, lo, hi, &sphere);
+        VirtualGrid3D planeVirtual(res, res, res, lo, hi, &plane);
+        SerialGrid sphereSerial(res, res, res, lo, hi, &sphere);
+        SerialGrid planeSerial(res, res, res, lo, hi, &plane);
+
+        MC::CellMask all(res, res, res);
+        for (uint z = 0; z < res; z++)
+        for (uint y = 0; y < res; y++)
+        for (uint x = 0; x < res; x++)
+            all.set(x, y, z);
+
+        check("sphere, sampled grid, blocked" + r, &sphereArray);
+        check("plane, sampled grid, blocked" + r, &planeArray);
+        check("sphere, root finding, blocked" + r, &sphereVirtual);
+        check("plane, root finding, blocked" + r, &planeVirtual);
+        check("sphere, root finding, serial" + r, &sphereSerial);
+        check("plane, root finding, serial" + r, &planeSerial);
+        check("sphere, root finding, masked" + r, &sphereVirtual, &all);
+
+        InterruptedGrid sphereInterrupted(res, res, res, lo, hi, &sphere);
+        checkResume("sphere, checkpointed and resumed" + r, &sphereInterrupted);
+    }
+
+    if (failures) {
+        printf("%d marching cubes checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
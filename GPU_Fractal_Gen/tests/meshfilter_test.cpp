@@ -0,0 +1,175 @@
+// Checks component labelling and filtering on a hand-built mesh: a few
+// closed boxes and flat strips of known triangle counts and sizes, their
+// vertices interleaved so no component is contiguous in the arrays, plus a
+// vertex no triangle uses.
+
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "fractalGen/SETTINGS.h"
+#include "fractalGen/mesh.h"
+#include "fractalGen/meshfilter.h"
+
+using namespace std;
+
+struct Part {
+    vector<VEC3F> vertices;
+    vector<uint> indices;     // local to the part
+};
+
+// Axis-aligned box of the given size at `origin`: 8 vertices, 12 triangles
+static Part box(const VEC3F& origin, Real size) {
+    Part p;
+    for (int c = 0; c < 8; c++)
+        p.vertices.push_back(origin + size * VEC3F(c & 1, (c >> 1) & 1, (c >> 2) & 1));
+    const uint faces[6][4] = { {0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5} };
+    for (const auto& f : faces)
+        p.indices.insert(p.indices.end(), { f[0], f[1], f[2], f[0], f[2], f[3] });
+    return p;
+}
+
+// Flat strip of n (even) triangles along x
+static Part strip(const VEC3F& origin, int n, Real width) {
+    Part p;
+    for (int i = 0; i < n / 2 + 1; i++) {
+        p.vertices.push_back(origin + VEC3F(i * width, 0, 0));
+        p.vertices.push_back(origin + VEC3F(i * width, width, 0));
+    }
+    for (int t = 0; t < n; t++) {
+        const uint a = uint(t / 2) * 2;
+        if (t % 2 == 0) p.indices.insert(p.indices.end(), { a, a + 2, a + 1 });
+        else            p.indices.insert(p.indices.end(), { a + 1, a + 2, a + 3 });
+    }
+    return p;
+}
+
+// Deals the parts' vertices out round-robin, so every component is spread
+// over the whole vertex array, then appends a vertex no triangle uses
+static Mesh interleave(const vector<Part>& parts, vector<uint>& partOfVertex) {
+    Mesh m;
+    vector<vector<uint>> global(parts.size());
+    for (size_t round = 0, placed = 1; placed > 0; round++) {
+        placed = 0;
+        for (size_t k = 0; k < parts.size(); k++) {
+            if (round >= parts[k].vertices.size()) continue;
+            global[k].push_back(uint(m.vertices.size()));
+            m.vertices.push_back(parts[k].vertices[round]);
+            m.normals.push_back(VEC3F(0, 0, 1));
+            partOfVertex.push_back(uint(k));
+            placed++;
+        }
+    }
+    for (size_t k = 0; k < parts.size(); k++)
+        for (uint i : parts[k].indices) m.indices.push_back(global[k][i]);
+
+    m.vertices.push_back(VEC3F(9, 9, 9));
+    m.normals.push_back(VEC3F(0, 0, 1));
+    partOfVertex.push_back(uint(parts.size()));
+    return m;
+}
+
+// The triangles of the mesh as corner positions, to compare meshes whose
+// vertices were renumbered
+static vector<vector<Real>> triangleCorners(const Mesh& m) {
+    vector<vector<Real>> out;
+    for (size_t t = 0; t + 2 < m.indices.size(); t += 3) {
+        vector<Real> corners;
+        for (int j = 0; j < 3; j++)
+            for (int k = 0; k < 3; k++) corners.push_back(m.vertices[m.indices[t + j]][k]);
+        out.push_back(corners);
+    }
+    return out;
+}
+
+static int failures = 0;
+
+static void report(const string& name, bool ok, const string& detail = "") {
+    printf("%-40s %s%s\n", name.c_str(), ok ? "ok  " : "FAIL", detail.c_str());
+    if (!ok) failures++;
+}
+
+// Filters a copy of `m` and checks exactly the parts in `kept` survive, in order
+static void checkFilter(const string& name, const Mesh& m, const vector<Part>& parts,
+                        const MeshFilter::FilterSettings& settings, const vector<size_t>& kept) {
+    Mesh filtered = m;
+    const MeshFilter::FilterStats stats = MeshFilter::filterComponents(filtered, settings);
+
+    vector<uint> unused;
+    vector<Part> keptParts;
+    for (size_t k : kept) keptParts.push_back(parts[k]);
+    const Mesh expected = interleave(keptParts, unused);
+
+    size_t vertices = 0, triangles = 0;
+    for (const Part& p : keptParts) {
+        vertices += p.vertices.size();
+        triangles += p.indices.size() / 3;
+    }
+
+    // Kept triangles stay in their order; their vertices stay in theirs
+    vector<vector<Real>> before = triangleCorners(m), after = triangleCorners(filtered), want;
+    for (const auto& corners : before)
+        for (const Part& p : keptParts)
+            if (find(p.vertices.begin(), p.vertices.end(), VEC3F(corners[0], corners[1], corners[2])) != p.vertices.end())
+                want.push_back(corners);
+    const bool verticesInOrder = filtered.vertices.size() == vertices
+        && vector<VEC3F>(filtered.vertices.begin(), filtered.vertices.end())
+            == vector<VEC3F>(expected.vertices.begin(), expected.vertices.end() - 1);
+
+    const bool ok = after == want && verticesInOrder && filtered.normals.size() == vertices
+        && stats.componentsAfter == kept.size() && stats.trianglesAfter == triangles && stats.verticesAfter == vertices;
+    report(name, ok, ": " + to_string(stats.componentsBefore) + " -> " + to_string(stats.componentsAfter) + " components, "
+        + to_string(stats.trianglesBefore) + " -> " + to_string(stats.trianglesAfter) + " triangles");
+}
+
+int main() {
+    // 0: big box, 12 triangles, diagonal 3.46; 1: small box, 12, 0.17;
+    // 2: long strip, 30, 7.52; 3: short strip, 4, 0.56; 4: strip, 12, 3.04
+    const vector<Part> parts = {
+        box(VEC3F(0, 0, 0), 2), box(VEC3F(5, 0, 0), 0.1), strip(VEC3F(0, 5, 0), 30, 0.5),
+        strip(VEC3F(0, 8, 0), 4, 0.25), strip(VEC3F(0, 10, 0), 12, 0.5) };
+    vector<uint> partOfVertex;
+    const Mesh m = interleave(parts, partOfVertex);
+
+    // Labels: one per part plus the lone vertex, numbered by first vertex,
+    // shared exactly by the vertices of one part
+    {
+        vector<uint> labels;
+        const size_t n = MeshFilter::labelComponents(m, labels);
+        bool ok = n == parts.size() + 1 && labels.size() == m.vertices.size();
+        uint next = 0;
+        for (size_t i = 0; ok && i < labels.size(); i++) {
+            if (labels[i] == next) next++;
+            ok = labels[i] < next;
+            for (size_t j = 0; ok && j < i; j++)
+                ok = (labels[i] == labels[j]) == (partOfVertex[i] == partOfVertex[j]);
+        }
+        report("component labels", ok, ": " + to_string(n) + " components");
+    }
+
+    MeshFilter::FilterSettings settings;
+    checkFilter("no thresholds drops the lone vertex", m, parts, settings, {0, 1, 2, 3, 4});
+
+    settings.minTriangles = 12;
+    checkFilter("min triangles", m, parts, settings, {0, 1, 2, 4});
+
+    settings = MeshFilter::FilterSettings();
+    settings.minSize = 1;
+    checkFilter("min size", m, parts, settings, {0, 2, 4});
+
+    // Parts 0, 1 and 4 tie at 12 triangles: the earlier ones win
+    settings = MeshFilter::FilterSettings();
+    settings.keepLargest = 3;
+    checkFilter("keep largest, ties by order", m, parts, settings, {0, 1, 2});
+
+    settings.minSize = 1;
+    settings.keepLargest = 2;
+    checkFilter("min size and keep largest", m, parts, settings, {0, 2});
+
+    if (failures) {
+        printf("%d mesh filter checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Checks meshlet building on a marched sphere and a flat grid: every triangle
+// lands in exactly one meshlet with its winding, the limits hold, every
+// vertex is inside its meshlet's sphere, and the normal cone only culls a
+// meshlet for cameras that see all of its triangles from behind.
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <array>
+#include <algorithm>
+
+#include "fractalGen/SETTINGS.h"
+#include "fractalGen/field.h"
+#include "fractalGen/mesh.h"
+#include "fractalGen/MC.h"
+#include "fractalGen/meshlets.h"
+
+using namespace std;
+
+static Real sphereField(VEC3F p) {
+    return (p - VEC3F(0.1, -0.05, 0.02)).norm() - 0.62;
+}
+
+// n x n quads in the z = 0 plane, counter-clockwise seen from +z
+static Mesh flatGrid(int n) {
+    Mesh m;
+    for (int y = 0; y <= n; y++)
+    for (int x = 0; x <= n; x++) {
+        m.vertices.push_back(VEC3F(x, y, 0) / n);
+        m.normals.push_back(VEC3F(0, 0, 1));
+    }
+    for (int y = 0; y < n; y++)
+    for (int x = 0; x < n; x++) {
+        const uint a = y * (n + 1) + x, b = a + 1, c = a + n + 1, d = c + 1;
+        m.indices.insert(m.indices.end(), { a, b, d, a, d, c });
+    }
+    return m;
+}
+
+// The mesh's triangles as index triplets rotated to start at the smallest,
+// which keeps the winding
+static vector<std::array<uint, 3>> rotatedTriangles(const vector<uint>& indices) {
+    vector<std::array<uint, 3>> out;
+    for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+        std::array<uint, 3> tri = { indices[t], indices[t + 1], indices[t + 2] };
+        rotate(tri.begin(), min_element(tri.begin(), tri.end()), tri.end());
+        out.push_back(tri);
+    }
+    sort(out.begin(), out.end());
+    return out;
+}
+
+// Deterministic camera positions around the origin at a few distances
+static vector<VEC3F> cameras() {
+    vector<VEC3F> out;
+    const int n = 24;
+    for (Real distance : {0.9, 1.5, 4.0, 50.0})
+        for (int i = 0; i < n; i++) {
+            const Real z = 1 - (2 * i + 1.0) / n, r = sqrt(1 - z * z), phi = i * 2.39996;
+            out.push_back(distance * VEC3F(r * cos(phi), r * sin(phi), z) + VEC3F(0.5, 0.5, 0));
+        }
+    return out;
+}
+
+static int failures = 0;
+
+static void report(const string& name, bool ok, const string& detail = "") {
+    printf("%-40s %s%s\n", name.c_str(), ok ? "ok  " : "FAIL", detail.c_str());
+    if (!ok) failures++;
+}
+
+static void check(const string& name, const Mesh& mesh, uint maxVertices, uint maxTriangles) {
+    const Meshlets::MeshletSet set = Meshlets::build(mesh, maxVertices, maxTriangles);
+
+    // Layout: contiguous, within the limits, local indices in range, and
+    // the triangles put back together are the mesh's
+    bool layout = !set.meshlets.empty() && set.bounds.size() == set.meshlets.size();
+    uint vertexEnd = 0, triangleEnd = 0;
+    vector<uint> rebuilt;
+    for (const Meshlets::Meshlet& m : set.meshlets) {
+        layout = layout && m.vertexOffset == vertexEnd && m.triangleOffset == triangleEnd
+            && m.vertexCount <= maxVertices && m.triangleCount <= maxTriangles && m.triangleCount > 0;
+        for (uint t = 0; layout && t < 3 * m.triangleCount; t++) {
+            const uint8_t local = set.triangles[m.triangleOffset + t];
+            layout = local < m.vertexCount;
+            if (layout) rebuilt.push_back(set.vertices[m.vertexOffset + local]);
+        }
+        vertexEnd += m.vertexCount;
+        triangleEnd += 3 * m.triangleCount;
+    }
+    layout = layout && vertexEnd == set.vertices.size() && triangleEnd == set.triangles.size()
+        && rotatedTriangles(rebuilt) == rotatedTriangles(mesh.indices);
+    report(name + ", layout", layout, ": " + to_string(set.meshlets.size()) + " meshlets");
+    if (!layout) return;
+
+    // Spheres hold their vertices; the cone only culls back-facing meshlets
+    size_t outside = 0, wrongCulls = 0, culls = 0, tests = 0;
+    const vector<VEC3F> eyes = cameras();
+    for (size_t i = 0; i < set.meshlets.size(); i++) {
+        const Meshlets::Meshlet& m = set.meshlets[i];
+        const Meshlets::Bounds& b = set.bounds[i];
+        for (uint v = 0; v < m.vertexCount; v++)
+            if ((mesh.vertices[set.vertices[m.vertexOffset + v]] - b.center).norm() > b.radius * (1 + 1e-9)) outside++;
+
+        for (const VEC3F& eye : eyes) {
+            tests++;
+            if ((b.coneApex - eye).normalized().dot(b.coneAxis) < b.coneCutoff) continue;
+            culls++;
+            for (uint t = 0; t < m.triangleCount; t++) {
+                const uint8_t* local = &set.triangles[m.triangleOffset + 3 * t];
+                const VEC3F& p0 = mesh.vertices[set.vertices[m.vertexOffset + local[0]]];
+                const VEC3F& p1 = mesh.vertices[set.vertices[m.vertexOffset + local[1]]];
+                const VEC3F& p2 = mesh.vertices[set.vertices[m.vertexOffset + local[2]]];
+                if ((p1 - p0).cross(p2 - p0).dot(eye - p0) > 1e-12) {
+                    wrongCulls++;
+                    break;
+                }
+            }
+        }
+    }
+    report(name + ", bounds and cones", outside == 0 && wrongCulls == 0 && culls > 0,
+        ": " + to_string(culls) + " of " + to_string(tests) + " culled, " + to_string(wrongCulls) + " wrongly, "
+        + to_string(outside) + " vertices outside");
+}
+
+int main() {
+    const uint res = 41;
+    FieldFunction3D sphereFunction(sphereField);
+    VirtualGrid3D grid(res, res, res, VEC3F(-1, -1, -1), VEC3F(1, 1, 1), &sphereFunction);
+    Mesh sphere;
+    MC::march_cubes(&grid, sphere, false);
+
+    check("sphere, default limits", sphere, Meshlets::ML_MAX_VERTICES, Meshlets::ML_MAX_TRIANGLES);
+    check("sphere, small limits", sphere, 16, 20);
+    check("flat grid, vertex bound", flatGrid(20), 32, 124);
+    check("flat grid, triangle bound", flatGrid(20), 255, 7);
+
+    // A flat meshlet faces straight up, culls from anywhere below its plane
+    // and from nowhere above it
+    {
+        const Mesh flat = flatGrid(4);
+        const Meshlets::MeshletSet set = Meshlets::build(flat);
+        const Meshlets::Bounds& b = set.bounds[0];
+        const bool ok = set.meshlets.size() == 1 && b.coneAxis.isApprox(VEC3F(0, 0, 1)) && fabs(b.coneCutoff) < 1e-6
+            && (b.coneApex - VEC3F(0.3, 0.8, -0.01)).normalized().dot(b.coneAxis) >= b.coneCutoff
+            && (b.coneApex - VEC3F(0.3, 0.8, 0.01)).normalized().dot(b.coneAxis) < b.coneCutoff;
+        report("flat meshlet cone", ok);
+    }
+
+    if (failures) {
+        printf("%d meshlet checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+// Round-trips a mesh library through the CPAK file: the file is parsed back
+// here, independently of MeshPack, and every range has to decode to the mesh
+// it was packed from, positions within one quantization step, normals within
+// the octahedral encoding's error and indices exactly.
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <string>
+
+#include "fractalGen/SETTINGS.h"
+#include "fractalGen/field.h"
+#include "fractalGen/mesh.h"
+#include "fractalGen/MC.h"
+#include "fractalGen/meshpack.h"
+
+using namespace std;
+
+static Real sphereField(VEC3F p) {
+    return (p - VEC3F(0.1, -0.05, 0.02)).norm() - 0.62;
+}
+
+// n x n quads on a bumpy sheet, as a triangle soup so welding has work to do,
+// with normals pointing every way, below the equator too
+static Mesh sheet(int n, bool soup) {
+    Mesh m;
+    auto vertex = [&](int x, int y) {
+        const Real u = Real(x) / n, v = Real(y) / n;
+        m.vertices.push_back(VEC3F(2 * u - 1, 3 * v, 0.2 * sin(7 * u) * cos(5 * v)));
+        m.normals.push_back(VEC3F(sin(13 * u + 2 * v), cos(11 * v - u), cos(17 * u * v + 1)).normalized());
+        return uint(m.vertices.size() - 1);
+    };
+    if (!soup)
+        for (int y = 0; y <= n; y++)
+            for (int x = 0; x <= n; x++) vertex(x, y);
+    for (int y = 0; y < n; y++)
+    for (int x = 0; x < n; x++) {
+        const int corners[6][2] = { {x, y}, {x + 1, y}, {x + 1, y + 1}, {x, y}, {x + 1, y + 1}, {x, y + 1} };
+        for (const auto& c : corners)
+            m.indices.push_back(soup ? vertex(c[0], c[1]) : uint(c[1] * (n + 1) + c[0]));
+    }
+    return m;
+}
+
+static Real area(const vector<VEC3F>& corners) {
+    Real sum = 0;
+    for (size_t t = 0; t + 2 < corners.size(); t += 3)
+        sum += (corners[t + 1] - corners[t]).cross(corners[t + 2] - corners[t]).norm() / 2;
+    return sum;
+}
+
+static Real meshArea(const Mesh& m) {
+    vector<VEC3F> corners;
+    for (uint i : m.indices) corners.push_back(m.vertices[i]);
+    return area(corners);
+}
+
+// Reads a T at `offset` and moves past it; false once the file runs out
+template <class T>
+static bool take(const vector<char>& bytes, size_t& offset, T& value) {
+    if (offset + sizeof(T) > bytes.size()) return false;
+    memcpy(&value, &bytes[offset], sizeof(T));
+    offset += sizeof(T);
+    return true;
+}
+
+static int failures = 0;
+
+static void report(const string& name, bool ok, const string& detail = "") {
+    printf("%-40s %s%s\n", name.c_str(), ok ? "ok  " : "FAIL", detail.c_str());
+    if (!ok) failures++;
+}
+
+static void check(const string& name, vector<Mesh> meshes, const vector<string>& names,
+                  const MeshOpt::OptimizeSettings& settings = MeshOpt::OptimizeSettings()) {
+    vector<Real> areas;
+    for (const Mesh& m : meshes) areas.push_back(meshArea(m));
+
+    const MeshPack::PackedLibrary library = MeshPack::pack(meshes, names, settings);
+    const string path = "meshpack_test.cpak";
+    library.writeBinary(path);
+
+    vector<char> bytes;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        bytes.resize(ftell(file));
+        fseek(file, 0, SEEK_SET);
+        if (fread(bytes.data(), 1, bytes.size(), file) != bytes.size()) bytes.clear();
+        fclose(file);
+    }
+    remove(path.c_str());
+
+    // Header and draw table: ranges follow each other in pack order
+    size_t offset = 4;
+    uint32_t header[5] = {0};
+    for (uint32_t& h : header) take(bytes, offset, h);
+    const bool shortIndices = header[4] == 2;
+    bool table = bytes.size() >= 4 && memcmp(bytes.data(), "CPAK", 4) == 0 && header[0] == 1
+        && header[1] == meshes.size() && (header[4] == 2 || header[4] == 4) && shortIndices == library.shortIndices;
+
+    struct Range { uint32_t firstIndex, indexCount, baseVertex, vertexCount; float box[6]; };
+    vector<Range> ranges(table ? header[1] : 0);
+    uint32_t indexEnd = 0, vertexEnd = 0;
+    for (size_t i = 0; table && i < ranges.size(); i++) {
+        char label[MeshPack::MP_NAME_BYTES];
+        Range& r = ranges[i];
+        table = offset + sizeof(label) <= bytes.size();
+        if (!table) break;
+        memcpy(label, &bytes[offset], sizeof(label));
+        offset += sizeof(label);
+        table = take(bytes, offset, r.firstIndex) && take(bytes, offset, r.indexCount)
+            && take(bytes, offset, r.baseVertex) && take(bytes, offset, r.vertexCount);
+        for (float& f : r.box) table = table && take(bytes, offset, f);
+
+        table = table && label[sizeof(label) - 1] == 0 && string(label) == names[i].substr(0, sizeof(label) - 1)
+            && r.firstIndex == indexEnd && r.baseVertex == vertexEnd
+            && r.indexCount == meshes[i].indices.size() && r.vertexCount == meshes[i].vertices.size();
+        indexEnd += r.indexCount;
+        vertexEnd += r.vertexCount;
+    }
+    const size_t positionsAt = offset, normalsAt = positionsAt + 8 * size_t(vertexEnd), indicesAt = normalsAt + 4 * size_t(vertexEnd);
+    const size_t indexBytes = shortIndices ? 2 * ((indexEnd + 1) & ~1u) : 4 * size_t(indexEnd);
+    table = table && header[2] == vertexEnd && header[3] == indexEnd && bytes.size() == indicesAt + indexBytes;
+    report(name + ", header and draw table", table, ": " + to_string(bytes.size()) + " bytes, "
+        + to_string(header[4]) + "-byte indices");
+    if (!table) return;
+
+    // Each range decodes to its optimized mesh and covers the original's area
+    for (size_t i = 0; i < ranges.size(); i++) {
+        const Range& r = ranges[i];
+        const Mesh& m = meshes[i];
+        const VEC3F lo(r.box[0], r.box[1], r.box[2]), hi(r.box[3], r.box[4], r.box[5]);
+        VEC3F span = hi - lo;
+        for (int k = 0; k < 3; k++) if (span[k] <= 0) span[k] = 1;
+
+        Real positionError = 0, normalError = 0;
+        vector<VEC3F> decoded(r.vertexCount);
+        for (uint32_t v = 0; v < r.vertexCount; v++) {
+            uint16_t q[4];
+            int16_t e[2];
+            memcpy(q, &bytes[positionsAt + 8 * size_t(r.baseVertex + v)], sizeof(q));
+            memcpy(e, &bytes[normalsAt + 4 * size_t(r.baseVertex + v)], sizeof(e));
+
+            decoded[v] = lo + VEC3F(q[0], q[1], q[2]).cwiseProduct(span) / 65535.0;
+            for (int k = 0; k < 3; k++)
+                positionError = max(positionError, fabs(decoded[v][k] - m.vertices[v][k]) / span[k]);
+
+            Real x = e[0] / 32767.0, y = e[1] / 32767.0;
+            const Real z = 1 - fabs(x) - fabs(y);
+            if (z < 0) {
+                const Real fx = (1 - fabs(y)) * (x >= 0 ? 1 : -1), fy = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+                x = fx;
+                y = fy;
+            }
+            normalError = max(normalError, (VEC3F(x, y, z).normalized() - m.normals[v].normalized()).norm());
+        }
+
+        bool sameIndices = true;
+        vector<VEC3F> corners;
+        for (uint32_t j = 0; j < r.indexCount; j++) {
+            const size_t at = r.firstIndex + j;
+            uint32_t index = 0;
+            if (shortIndices) {
+                uint16_t s;
+                memcpy(&s, &bytes[indicesAt + 2 * at], sizeof(s));
+                index = s;
+            } else {
+                memcpy(&index, &bytes[indicesAt + 4 * at], sizeof(index));
+            }
+            sameIndices = sameIndices && index == m.indices[j] && index < r.vertexCount;
+            if (sameIndices) corners.push_back(decoded[index]);
+        }
+
+        // Half a step of rounding plus the float bounds; the oct encoding is
+        // good to about 1e-4
+        const Real areaError = sameIndices ? fabs(area(corners) - areas[i]) / areas[i] : 1;
+        const bool ok = sameIndices && positionError < 1.0 / 65535 && normalError < 1e-3 && areaError < 1e-3;
+        char detail[160];
+        snprintf(detail, sizeof(detail), ": %u vertices, position error %.2g, normal error %.2g, area error %.2g",
+            r.vertexCount, positionError, normalError, areaError);
+        report(name + ", " + names[i], ok, detail);
+    }
+}
+
+int main() {
+    const uint res = 25;
+    FieldFunction3D sphereFunction(sphereField);
+    VirtualGrid3D grid(res, res, res, VEC3F(-1, -1, -1), VEC3F(1, 1, 1), &sphereFunction);
+    Mesh sphere;
+    MC::march_cubes(&grid, sphere, false);
+
+    check("short indices", { sphere, sheet(12, true), sheet(5, false) },
+        { "sphere", MeshPack::meshName("out/reef.variant2.obj"), "a name longer than the thirty one bytes of the table" });
+
+    // More than 65536 vertices in one mesh widens every index
+    MeshOpt::OptimizeSettings unwelded;
+    unwelded.weld = false;
+    check("long indices", { sheet(4, false), sheet(110, true) }, { "small", "large soup" }, unwelded);
+
+    if (failures) {
+        printf("%d mesh pack checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
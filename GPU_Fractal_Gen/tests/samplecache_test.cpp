@@ -0,0 +1,119 @@
+// Checks the persistent sample and mesh caches: slabs a run finished are
+// read back from the file by the next run with the same key instead of being
+// evaluated again, and a file for another key or grid is started over.
+
+#include <cstdio>
+#include <vector>
+#include <string>
+
+#include "fractalGen/SETTINGS.h"
+#include "fractalGen/field.h"
+#include "fractalGen/samplecache.h"
+
+using namespace std;
+
+static size_t evaluations = 0;
+
+// Two fields that differ everywhere, so a value shows which one it came from
+static Real firstField(VEC3F p) {
+    evaluations++;
+    return p[0] + 2 * p[1] + 3 * p[2];
+}
+
+static Real secondField(VEC3F p) {
+    evaluations++;
+    return firstField(p) + 100;
+}
+
+static int failures = 0;
+
+static void report(const string& name, bool ok, const string& detail = "") {
+    printf("%-40s %s%s\n", name.c_str(), ok ? "ok  " : "FAIL", detail.c_str());
+    if (!ok) failures++;
+}
+
+// Whether every sample of slabs [z0, z1) has the value `field` gives it
+static bool slabsFrom(const VirtualGrid3DDiskCached& grid, FieldFunction3D& field, uint z0, uint z1) {
+    VirtualGrid3D plain(grid.xRes, grid.yRes, grid.zRes, grid.mapBox.min(), grid.mapBox.max(), &field);
+    for (uint z = z0; z < z1; z++)
+    for (uint y = 0; y < grid.yRes; y++)
+    for (uint x = 0; x < grid.xRes; x++)
+        if (grid.get(x, y, z) != plain.get(x, y, z)) return false;
+    return true;
+}
+
+int main() {
+#ifdef _WIN32
+    printf("Sample caches aren't supported on Windows, skipping\n");
+    return 0;
+#endif
+    const uint res = 12, done = 5;
+    const VEC3F lo(-1, -1, -1), hi(1, 1, 1);
+    const string path = "samplecache_test.samples";
+    FieldFunction3D first(firstField), second(secondField);
+    remove(path.c_str());
+
+    // A first run that only gets through some slabs
+    {
+        VirtualGrid3DDiskCached grid(res, res, res, lo, hi, &first, path, 1);
+        const bool ok = grid.isMapped() && grid.slabsResumed == 0 && slabsFrom(grid, first, 0, done)
+            && grid.slabsEvaluated == done;
+        report("fresh file", ok, ": " + to_string(grid.slabsEvaluated.load()) + " slabs evaluated");
+    }
+
+    // The next run with the same key reads those slabs from the file without
+    // evaluating anything, and evaluates the rest with its own field
+    {
+        VirtualGrid3DDiskCached grid(res, res, res, lo, hi, &second, path, 1);
+        evaluations = 0;
+        bool ok = grid.isMapped() && grid.slabsResumed == done;
+        for (uint z = 0; z < done; z++) grid.get(0, 0, z);
+        ok = ok && evaluations == 0 && grid.slabsEvaluated == 0;
+        ok = ok && slabsFrom(grid, first, 0, done) && slabsFrom(grid, second, done, res)
+            && grid.slabsEvaluated == res - done;
+        report("resumed from done slabs", ok, ": " + to_string(grid.slabsResumed) + " slabs resumed");
+    }
+
+    // Another key: the file is started over
+    {
+        VirtualGrid3DDiskCached grid(res, res, res, lo, hi, &second, path, 2);
+        const bool ok = grid.isMapped() && grid.slabsResumed == 0 && slabsFrom(grid, second, 0, res)
+            && grid.slabsEvaluated == res;
+        report("key mismatch resets the file", ok);
+    }
+    {
+        VirtualGrid3DDiskCached grid(res, res, res, lo, hi, &first, path, 2);
+        const bool ok = grid.slabsResumed == res && slabsFrom(grid, second, 0, res);
+        report("reset file resumed under the new key", ok);
+    }
+
+    // Same key, another grid: started over as well
+    {
+        VirtualGrid3DDiskCached grid(res, res, res + 1, lo, hi, &first, path, 2);
+        const bool ok = grid.isMapped() && grid.slabsResumed == 0 && slabsFrom(grid, first, 0, res + 1);
+        report("resolution mismatch resets the file", ok);
+    }
+    remove(path.c_str());
+
+    // Mesh files round-trip exactly and only under their own key
+    {
+        const string meshPath = "samplecache_test.mesh";
+        Mesh mesh;
+        mesh.vertices = { VEC3F(0, 0, 0), VEC3F(1, 0.1, 0), VEC3F(0, 1, 1.0 / 3) };
+        mesh.normals = { VEC3F(0, 0, 1), VEC3F(0, 0.6, 0.8), VEC3F(1, 0, 0) };
+        mesh.indices = { 0, 1, 2 };
+
+        Mesh same, other;
+        const bool ok = SampleCache::writeMesh(meshPath, 7, mesh) && SampleCache::readMesh(meshPath, 7, same)
+            && same.vertices == mesh.vertices && same.normals == mesh.normals && same.indices == mesh.indices
+            && !SampleCache::readMesh(meshPath, 8, other);
+        report("mesh file round trip", ok);
+        remove(meshPath.c_str());
+    }
+
+    if (failures) {
+        printf("%d sample cache checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}